@@ -66,6 +66,10 @@ std::string OldInfoLogFileName(const std::string& dbname) {
   return dbname + "/LOG.old";
 }
 
+std::string InvalidRunsFileName(const std::string& dbname) {
+  return dbname + "/INVALIDRUNS";
+}
+
 // Owned filenames have the form:
 //    dbname/CURRENT
 //    dbname/LOCK
@@ -139,9 +143,9 @@ Status SetCurrentFile(Env* env, const std::string& dbname,
 Status SetCurrentFileWithLogNumber(Env* env, const std::string& dbname,
                                    uint64_t log_seq_num) {
   // Remove leading "dbname/" and add newline to manifest file name
-  Slice contents = std::to_string(log_seq_num);
+  std::string contents = std::to_string(log_seq_num);
   std::string tmp = TempFileName(dbname, log_seq_num);
-  Status s = WriteStringToFileSync(env, contents.ToString() + "\n", tmp);
+  Status s = WriteStringToFileSync(env, contents + "\n", tmp);
   if (s.ok()) {
     s = env->RenameFile(tmp, CurrentFileName(dbname));
   }
@@ -156,6 +160,8 @@ Status SetCurrentFileWithLogNumber(Env* env, const std::string& dbname,
 //    dbname/LOCK
 //    dbname/LOG
 //    dbname/LOG.old
+//    dbname/INVALIDRUNS[.tmp]
+//    dbname/[tmp]seg.[0-9]+
 //    dbname/MANIFEST-[0-9]+
 //    dbname/[0-9]+.(log|sst|ldb)
 bool ParseSilkstoreFileName(const std::string& filename, uint64_t* number,
@@ -170,6 +176,12 @@ bool ParseSilkstoreFileName(const std::string& filename, uint64_t* number,
   } else if (rest == "LOG" || rest == "LOG.old") {
     *number = 0;
     *type = kInfoLogFile;
+  } else if (rest == "INVALIDRUNS") {
+    *number = 0;
+    *type = kInvalidRunsFile;
+  } else if (rest == "INVALIDRUNS.tmp") {
+    *number = 0;
+    *type = kTempFile;
   } else if (rest.starts_with("seg.")) {
     rest.remove_prefix(strlen("seg."));
     uint64_t num;
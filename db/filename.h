@@ -25,7 +25,8 @@ enum FileType {
   kCurrentFile,
   kTempFile,
   kInfoLogFile,  // Either the current one, or an old one
-  kSegementFile  // segment storage file
+  kSegementFile,  // segment storage file
+  kInvalidRunsFile  // invalidated miniruns of the segments
 };
 
 // Return the name of the log file with the specified number
@@ -67,6 +68,10 @@ std::string InfoLogFileName(const std::string& dbname);
 // Return the name of the old info log file for "dbname".
 std::string OldInfoLogFileName(const std::string& dbname);
 
+// Return the name of the file recording which miniruns of the segments
+// of silkstore "dbname" are invalid.
+std::string InvalidRunsFileName(const std::string& dbname);
+
 // If filename is a leveldb file, store the type of the file in *type.
 // The number encoded in the filename is stored in *number.  If the
 // filename was successfully parsed, returns true.  Else return false.
@@ -5,6 +5,8 @@
 #ifndef STORAGE_LEVELDB_DB_SNAPSHOT_H_
 #define STORAGE_LEVELDB_DB_SNAPSHOT_H_
 
+#include <vector>
+
 #include "db/dbformat.h"
 #include "leveldb/db.h"
 
@@ -85,6 +87,14 @@ class SnapshotList {
     delete snapshot;
   }
 
+  // Appends the sequence numbers of all live snapshots to *seqs, oldest
+  // first.
+  void GetAll(std::vector<SequenceNumber>* seqs) const {
+    for (const SnapshotImpl* s = head_.next_; s != &head_; s = s->next_) {
+      seqs->push_back(s->sequence_number_);
+    }
+  }
+
  private:
   // Dummy head of doubly-linked list of snapshots
   SnapshotImpl head_;
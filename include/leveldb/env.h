@@ -121,6 +121,14 @@ class LEVELDB_EXPORT Env {
   virtual Status RenameFile(const std::string& src,
                             const std::string& target) = 0;
 
+  // Deallocate the storage of "len" bytes of fname starting at "offset"
+  // without changing the file size.  The range reads back as zeros.
+  //
+  // May return an IsNotSupportedError error if this Env or the file
+  // system does not support punching holes.
+  virtual Status PunchHole(const std::string& fname, uint64_t offset,
+                           uint64_t len);
+
   // Lock the specified file.  Used to prevent concurrent access to
   // the same db by multiple processes.  On failure, stores nullptr in
   // *lock and returns non-OK.
@@ -243,6 +251,15 @@ class LEVELDB_EXPORT WritableFile {
   virtual Status Close() = 0;
   virtual Status Flush() = 0;
   virtual Status Sync() = 0;
+
+  // Append "n" bytes of the file "src_fname" starting at "offset", letting
+  // the file system copy them without passing them through user space.
+  //
+  // The default implementation returns NotSupported, and so does an
+  // implementation that cannot copy between the two files; the caller
+  // then reads the bytes and Append()s them itself.
+  virtual Status AppendFileRange(const std::string& src_fname, uint64_t offset,
+                                 uint64_t n);
 };
 
 // An interface for writing log messages.
@@ -333,6 +350,9 @@ class LEVELDB_EXPORT EnvWrapper : public Env {
   Status RenameFile(const std::string& s, const std::string& t) override {
     return target_->RenameFile(s, t);
   }
+  Status PunchHole(const std::string& f, uint64_t o, uint64_t l) override {
+    return target_->PunchHole(f, o, l);
+  }
   Status LockFile(const std::string& f, FileLock** l) override {
     return target_->LockFile(f, l);
   }
@@ -15,6 +15,7 @@ class Comparator;
 class Env;
 class FilterPolicy;
 class Logger;
+class Slice;
 class Snapshot;
 
 // DB contents are stored in a set of blocks, each of which holds a
@@ -28,6 +29,29 @@ enum CompressionType {
   kSnappyCompression = 0x1
 };
 
+// SilkStore keeps the map from each leaf's max key to its index entry in
+// a leaf index.  The following enum selects the structure that holds it.
+enum LeafIndexType {
+  // A log-structured map in the NVM region of nvmleafindex_file.
+  kNvmLeafIndex = 0x0,
+  // A LevelDB instance in <dbname>/leaf_index.  Suits datasets whose leaf
+  // index does not fit in memory.
+  kLevelDBLeafIndex = 0x1,
+  // A B+-tree in DRAM, made durable by a log in <dbname>/leaf_index.
+  // Suits machines without NVM.
+  kMemLeafIndex = 0x2
+};
+
+// Order in which garbage collection picks segments to reclaim.
+enum GCPolicyType {
+  // Segments with the largest fraction of invalid data first.
+  kGreedyGCPolicy = 0x0,
+  // LFS cost-benefit: free space gained times the age of the segment,
+  // over the cost of reading it and writing its live data back.  Leaves
+  // recently written segments alone while their data is still dying.
+  kCostBenefitGCPolicy = 0x1
+};
+
 // Options to control the behavior of a database (passed to DB::Open)
 struct LEVELDB_EXPORT Options {
   // -------------------
@@ -104,6 +128,46 @@ struct LEVELDB_EXPORT Options {
 
   size_t leaf_max_num_miniruns;
 
+  // Adjacent leaves each holding less than this fraction of
+  // leaf_datasize_thresh bytes are merged into a single leaf, as long as
+  // the merged leaf stays below half of leaf_datasize_thresh.
+  // 0 disables merging; leaves left empty are dropped either way.
+  //
+  // Default: 0.125
+  double leaf_merge_ratio;
+
+  // Number of segment streams miniruns are placed into by the write
+  // hotness of their leaf.  Leaves are regrouped periodically, and
+  // flushes, splits and GC append each minirun to the segment of its
+  // leaf's group, so segments fill with data that dies at a similar rate
+  // and GC finds them mostly invalid.  1 disables grouping.
+  //
+  // Default: 1
+  int num_segment_groups;
+
+  // Number of threads SilkStore runs its background work on.  Flushes,
+  // leaf splits, garbage collection and leaf optimization share them,
+  // in that order of priority, and a flush or split spreads its leaves
+  // over all of them.
+  //
+  // Default: 4
+  int background_threads;
+
+  // Bytes per second the background work may read from and write to
+  // segments, shared out between flushes, leaf splits, garbage collection
+  // and leaf optimization.  0 means unlimited.
+  //
+  // Default: 0
+  size_t background_io_bytes_per_sec;
+
+  // Foreground Get() p99 latency, in microseconds, to tune the background
+  // I/O rate toward.  Every second the rate is lowered while the p99 is
+  // above this and raised back toward background_io_bytes_per_sec while
+  // it is well below.  0 keeps the rate fixed.
+  //
+  // Default: 0
+  size_t background_io_target_p99_micros;
+
   size_t storage_block_size;
   // Number of open files that can be used by the DB.  You may need to
   // increase this if your database has a large working set (budget
@@ -120,6 +184,14 @@ struct LEVELDB_EXPORT Options {
   // Default: nullptr
   Cache* block_cache;
 
+  // If non-null, SilkStore caches the result of point lookups that reach
+  // the leaf layer in this cache, keyed by user key.  Entries are
+  // invalidated by writes to the same key, so hot keys are served
+  // without touching the leaf index or any minirun.  The cache may be
+  // shared between databases.
+  // Default: nullptr
+  Cache* row_cache;
+
   // Approximate size of user data packed per block.  Note that the
   // block size specified here corresponds to uncompressed data.  The
   // actual size of the unit read from disk may be smaller if
@@ -135,6 +207,13 @@ struct LEVELDB_EXPORT Options {
   // Default: 16
   int block_restart_interval;
 
+  // Number of keys between restart points in the block index of a
+  // minirun.  The index is embedded in every leaf index entry, so values
+  // above 1 prefix-compress it at the cost of a short linear scan per seek.
+  //
+  // Default: 16
+  int index_block_restart_interval;
+
   // Leveldb will write up to this amount of bytes to a file before
   // switching to a new one.
   // Most clients should leave this parameter alone.  However if your
@@ -190,6 +269,17 @@ struct LEVELDB_EXPORT Options {
   // 0.9
   double segments_storage_size_gc_threshold;
 
+  // How garbage collection picks the segments it reclaims.
+  // Default: kCostBenefitGCPolicy
+  GCPolicyType gc_policy;
+
+  // If true, the disk space of runs made garbage by leaf compactions is
+  // freed right away by punching holes into their segments, for the whole
+  // file system blocks a run covers.  GC then only has to collect the
+  // slivers between them.  Ignored where the file system cannot punch holes.
+  // Default: false
+  bool punch_invalid_runs;
+
   // Whether to deploy filter for memtable
   // Default: false
   bool use_memtable_dynamic_filter;
@@ -198,6 +288,11 @@ struct LEVELDB_EXPORT Options {
   // Only used when use_memtable_dynamic_filter is set.
   // Default: 0.1
   double memtable_dynamic_filter_fp_rate;
+
+  // Structure used for the leaf index.  A DB must be reopened with the
+  // type it was created with; other types do not see its leaf index.
+  // Default: kNvmLeafIndex
+  LeafIndexType leaf_index_type;
   // Create an Options object with default values for all fields.
 
   // Nvm map file
@@ -228,8 +323,29 @@ struct LEVELDB_EXPORT ReadOptions {
   // Default: nullptr
   const Snapshot* snapshot;
 
+  // If "iterate_upper_bound" is non-null, forward iteration stops before
+  // the first user key that is at or past *iterate_upper_bound, and no
+  // leaf lying entirely beyond the bound is opened.  The pointed-to slice
+  // must remain valid until the iterator is deleted; its contents may be
+  // changed between Seek() calls.
+  // Only honored by SilkStore iterators.
+  // Default: nullptr
+  const Slice* iterate_upper_bound;
+
+  // If "iterate_prefix_length" is non-zero, Seek(target) additionally
+  // bounds forward iteration to keys sharing the first
+  // iterate_prefix_length bytes of target.  Requires a bytewise ordered
+  // user comparator.  SeekToFirst() and SeekToLast() ignore the prefix.
+  // Only honored by SilkStore iterators.
+  // Default: 0
+  size_t iterate_prefix_length;
+
   ReadOptions()
-      : verify_checksums(false), fill_cache(true), snapshot(nullptr) {}
+      : verify_checksums(false),
+        fill_cache(true),
+        snapshot(nullptr),
+        iterate_upper_bound(nullptr),
+        iterate_prefix_length(0) {}
 };
 
 // Options that control write operations
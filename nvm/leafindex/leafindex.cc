@@ -9,7 +9,9 @@
 #include "leveldb/write_batch.h"
 #include "util/coding.h"
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
 
 namespace leveldb {
 
@@ -21,16 +23,26 @@ static Slice GetLengthPrefixedSlice(const char* data) {
 }
 
 LeafIndex::LeafIndex(const InternalKeyComparator& cmp,
-                     DynamicFilter* dynamic_filter, silkstore::Nvmem* nvmem)
+                     DynamicFilter* dynamic_filter, silkstore::Nvmem* nvmem,
+                     const LeafIndexValueMerger* merger,
+                     Cache* merged_cache)
     : comparator_(cmp),
       refs_(0),
+      index_(NodeComparator(), &arena_),
       num_entries_(0),
-      searches_(0),
+      num_keys_(0),
+      live_bytes_(0),
+      key_bytes_(0),
+      stored_key_bytes_(0),
+      newest_snapshot_(0),
       dynamic_filter(dynamic_filter),
       nvmem(nvmem),
       counters_(0),
       memory_usage_(0),
-      dram_usage_(0) {}
+      dram_usage_(0),
+      merger_(merger),
+      merged_cache_(merged_cache),
+      merged_cache_id_(merged_cache != nullptr ? merged_cache->NewId() : 0) {}
 
 LeafIndex::~LeafIndex() {
   assert(refs_ == 0);
@@ -44,9 +56,9 @@ LeafIndex::~LeafIndex() {
   }
 }
 
-size_t LeafIndex::Searches() const { return searches_; }
 size_t LeafIndex::NumEntries() const { return num_entries_; }
 size_t LeafIndex::ApproximateMemoryUsage() { return memory_usage_; }
+size_t LeafIndex::LiveBytes() const { return live_bytes_; }
 
 int LeafIndex::KeyComparator::operator()(const char* aptr,
                                          const char* bptr) const {
@@ -65,45 +77,205 @@ static const char* EncodeKey(std::string* scratch, const Slice& target) {
   scratch->append(target.data(), target.size());
   return scratch->data();
 }
+
+// Returns the (sequence << 8 | type) tag of the log record at "address".
+static uint64_t RecordTag(uint64_t address) {
+  uint32_t key_length;
+  const char* key_ptr = GetVarint32Ptr((const char*)address,
+                                       (const char*)(address + 5), &key_length);
+  return DecodeFixed64(key_ptr + key_length - 8);
+}
+
+// Type of a record holding a delta for the key's previous record.  Its
+// value is: fixed64 offset of the previous record in nvmem, fixed32 number
+// of deltas in the chain including this one, delta.  Offsets rather than
+// addresses survive the region being mapped elsewhere after a restart.
+static const ValueType kTypeDelta = static_cast<ValueType>(0x7f);
+static const size_t kDeltaHeaderSize = 12;
+
+// Returns the value of the log record at "address".
+static Slice RecordValue(uint64_t address) {
+  Slice key = GetLengthPrefixedSlice((const char*)address);
+  return GetLengthPrefixedSlice(key.data() + key.size());
+}
+
+static bool IsDeltaRecord(uint64_t address) {
+  return static_cast<ValueType>(RecordTag(address) & 0xff) == kTypeDelta;
+}
+
+// Returns true iff the log record at "address" is a deletion.
+static bool IsDeletionRecord(uint64_t address) {
+  return static_cast<ValueType>(RecordTag(address) & 0xff) == kTypeDeletion;
+}
+
+// Returns the encoded length of the log record at "address".
+static size_t RecordSize(uint64_t address) {
+  Slice key = GetLengthPrefixedSlice((const char*)address);
+  Slice value = GetLengthPrefixedSlice(key.data() + key.size());
+  return value.data() + value.size() - (const char*)address;
+}
+
+// Compares the concatenations a0+a1 and b0+b1 bytewise.
+static int ComparePieces(Slice a0, Slice a1, Slice b0, Slice b1) {
+  while (true) {
+    if (a0.empty()) {
+      a0 = a1;
+      a1 = Slice();
+    }
+    if (b0.empty()) {
+      b0 = b1;
+      b1 = Slice();
+    }
+    if (a0.empty() || b0.empty()) {
+      return a0.empty() ? (b0.empty() ? 0 : -1) : +1;
+    }
+    const size_t n = std::min(a0.size(), b0.size());
+    int r = memcmp(a0.data(), b0.data(), n);
+    if (r != 0) return r;
+    a0.remove_prefix(n);
+    b0.remove_prefix(n);
+  }
+}
+
+int LeafIndex::NodeComparator::operator()(const IndexNode* a,
+                                          const IndexNode* b) const {
+  Slice a0 = a->prefix(), b0 = b->prefix();
+  if (a->shared_data == b->shared_data) {
+    // Both share bytes of the same key: skip what they have in common
+    const size_t n = std::min(a0.size(), b0.size());
+    a0.remove_prefix(n);
+    b0.remove_prefix(n);
+  }
+  return ComparePieces(a0, a->suffix(), b0, b->suffix());
+}
+
+// Walks the skiplist without locks, skipping leaves that are deleted or
+// not yet written as of "snapshot".  The record address is loaded once per
+// position so key() and value() always come from the same committed record.
 class LeafIndexIterator : public Iterator {
  public:
-  explicit LeafIndexIterator(LeafIndex::Index* index) : index(index) {
-    iter_ = index->begin();
-  }
-  virtual bool Valid() const { return iter_ != index->end() && iter_->second; }
+  LeafIndexIterator(const LeafIndex* leaf_index, SequenceNumber snapshot)
+      : leaf_index_(leaf_index),
+        iter_(&leaf_index->index_),
+        snapshot_(snapshot),
+        address_(0),
+        merged_handle_(nullptr),
+        merged_valid_(false) {}
+
+  virtual ~LeafIndexIterator() { ReleaseMerged(); }
+
+  virtual bool Valid() const { return iter_.Valid(); }
+
   virtual void Seek(const Slice& k) {
-    iter_ = index->lower_bound(k.ToString());
+    std::unique_ptr<char[]> target = NewLookupNode(k);
+    iter_.Seek(reinterpret_cast<const LeafIndex::IndexNode*>(target.get()));
+    SkipDeletedForward();
+  }
+
+  virtual void SeekToFirst() {
+    iter_.SeekToFirst();
+    SkipDeletedForward();
   }
-  virtual void SeekToFirst() { iter_ = index->begin(); }
+
   virtual void SeekToLast() {
-    fprintf(stderr, "MemTableIterator's SeekToLast() is not implemented !");
-    assert(true);
+    iter_.SeekToLast();
+    SkipDeletedBackward();
   }
-  virtual void Next() { ++iter_; }
-  virtual void Prev() {
-    --iter_;
-    fprintf(stderr, "MemTableIterator's Prev() is not implemented ! \n");
-    sleep(111);
-    assert(true);
+
+  virtual void Next() {
+    assert(Valid());
+    iter_.Next();
+    SkipDeletedForward();
   }
-  virtual Slice key() const {
-    return iter_->first;  // GetLengthPrefixedSlice((char *)(iter_->second));
+
+  virtual void Prev() {
+    assert(Valid());
+    iter_.Prev();
+    SkipDeletedBackward();
   }
+
+  virtual Slice key() const { return key_; }
+
   virtual Slice value() const {
-    Slice key_slice = GetLengthPrefixedSlice((char*)(iter_->second));
-    return GetLengthPrefixedSlice(key_slice.data() + key_slice.size());
+    if (!IsDeltaRecord(address_)) return RecordValue(address_);
+    // Deltas are merged once per position, on first use
+    Cache* cache = leaf_index_->merged_cache_;
+    if (cache != nullptr) {
+      if (merged_handle_ == nullptr) {
+        merged_handle_ = leaf_index_->LookupMergedValue(address_);
+      }
+      return *reinterpret_cast<std::string*>(cache->Value(merged_handle_));
+    }
+    if (!merged_valid_) {
+      leaf_index_->ReadValue(address_, &merged_);
+      merged_valid_ = true;
+    }
+    return merged_;
   }
+
   virtual Status status() const { return Status::OK(); }
 
+  // Builds a node that compares equal to "key" for skiplist seeks.
+  static std::unique_ptr<char[]> NewLookupNode(const Slice& key) {
+    std::unique_ptr<char[]> buf(
+        new char[sizeof(LeafIndex::IndexNode) + key.size()]);
+    auto node = reinterpret_cast<LeafIndex::IndexNode*>(buf.get());
+    node->shared_data = nullptr;
+    node->key_size = static_cast<uint32_t>(key.size());
+    node->shared_size = 0;
+    memcpy(node->key_data, key.data(), key.size());
+    return buf;
+  }
+
  private:
-  LeafIndex::Index* index;
-  LeafIndex::Index::iterator iter_;
+  // Returns true iff the current node holds a live leaf.
+  bool LoadLive() {
+    const LeafIndex::Version* v =
+        LeafIndex::VisibleVersion(iter_.key(), snapshot_);
+    if (v == nullptr) return false;
+    address_ = v->address.load(std::memory_order_acquire);
+    ReleaseMerged();
+    if (IsDeletionRecord(address_)) return false;
+    // Keys are front coded in the index, so they are rebuilt per position
+    key_.clear();
+    iter_.key()->AppendKeyTo(&key_);
+    return true;
+  }
+
+  void ReleaseMerged() {
+    if (merged_handle_ != nullptr) {
+      leaf_index_->merged_cache_->Release(merged_handle_);
+      merged_handle_ = nullptr;
+    }
+    merged_valid_ = false;
+  }
+
+  void SkipDeletedForward() {
+    while (iter_.Valid() && !LoadLive()) iter_.Next();
+  }
+
+  void SkipDeletedBackward() {
+    while (iter_.Valid() && !LoadLive()) iter_.Prev();
+  }
+
+  const LeafIndex* leaf_index_;
+  LeafIndex::Index::Iterator iter_;
+  const SequenceNumber snapshot_;
+  uint64_t address_;
+  std::string key_;
+  // The merged value of a delta record, pinned in the cache if there is one
+  mutable Cache::Handle* merged_handle_;
+  mutable std::string merged_;
+  mutable bool merged_valid_;
+
   // No copying allowed
   LeafIndexIterator(const LeafIndexIterator&);
   void operator=(const LeafIndexIterator&);
 };
 
-Iterator* LeafIndex::NewIterator() { return new LeafIndexIterator(&index_); }
+Iterator* LeafIndex::NewIterator(SequenceNumber snapshot) {
+  return new LeafIndexIterator(this, snapshot);
+}
 Status LeafIndex::AddCounter(size_t added) {
   counters_ += added;
   nvmem->UpdateCounter(counters_);
@@ -119,11 +291,189 @@ size_t LeafIndex::GetCounter() { return nvmem->GetCounter(); }
 
 Status LeafIndex::AddBatch(const WriteBatch* batch) { return Status::OK(); }
 
+const LeafIndex::IndexNode* LeafIndex::FindNode(const Slice& key) const {
+  std::unique_ptr<char[]> target = LeafIndexIterator::NewLookupNode(key);
+  Index::Iterator iter(&index_);
+  iter.Seek(reinterpret_cast<const IndexNode*>(target.get()));
+  if (iter.Valid() &&
+      NodeComparator()(iter.key(),
+                       reinterpret_cast<const IndexNode*>(target.get())) == 0) {
+    return iter.key();
+  }
+  return nullptr;
+}
+
+const LeafIndex::Version* LeafIndex::VisibleVersion(const IndexNode* node,
+                                                    SequenceNumber snapshot) {
+  const Version* v = node->head.load(std::memory_order_acquire);
+  while (v != nullptr &&
+         v->sequence.load(std::memory_order_relaxed) > snapshot) {
+    v = v->older;
+  }
+  return v;
+}
+
+void LeafIndex::Publish(const Slice& key, uint64_t address, SequenceNumber seq,
+                        bool is_deletion) {
+  const IndexNode* node = FindNode(key);
+  if (node != nullptr) {
+    Version* head = node->head.load(std::memory_order_relaxed);
+    uint64_t old_address = head->address.load(std::memory_order_relaxed);
+    bool was_deletion = IsDeletionRecord(old_address);
+    if (newest_snapshot_ < head->sequence.load(std::memory_order_relaxed)) {
+      // No snapshot can read the old version: reuse it.  A reader holding
+      // an older snapshot skips it whichever sequence it observes.
+      head->sequence.store(seq, std::memory_order_relaxed);
+      // The record is fully written to NVM before readers can reach it
+      head->address.store(address, std::memory_order_release);
+    } else {
+      Version* v = reinterpret_cast<Version*>(
+          arena_.AllocateAligned(sizeof(Version)));
+      new (&v->address) std::atomic<uint64_t>(address);
+      new (&v->sequence) std::atomic<SequenceNumber>(seq);
+      v->older = head;
+      node->head.store(v, std::memory_order_release);
+    }
+    if (!was_deletion) live_bytes_ -= RecordSize(old_address);
+    if (!is_deletion) live_bytes_ += RecordSize(address);
+    if (was_deletion && !is_deletion) {
+      num_keys_.fetch_add(1, std::memory_order_relaxed);
+    } else if (!was_deletion && is_deletion) {
+      num_keys_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  Version* v =
+      reinterpret_cast<Version*>(arena_.AllocateAligned(sizeof(Version)));
+  new (&v->address) std::atomic<uint64_t>(address);
+  new (&v->sequence) std::atomic<SequenceNumber>(seq);
+  v->older = nullptr;
+  IndexNode* new_node = NewIndexNode(key);
+  new (&new_node->head) std::atomic<Version*>(v);
+  // SkipList::Insert publishes the node with a release store
+  index_.Insert(new_node);
+  if (!is_deletion) {
+    num_keys_.fetch_add(1, std::memory_order_relaxed);
+    live_bytes_ += RecordSize(address);
+  }
+}
+
+LeafIndex::IndexNode* LeafIndex::NewIndexNode(const Slice& key) {
+  // The neighbours "key" will be linked between
+  std::unique_ptr<char[]> target = LeafIndexIterator::NewLookupNode(key);
+  Index::Iterator iter(&index_);
+  iter.Seek(reinterpret_cast<const IndexNode*>(target.get()));
+  const IndexNode* next = iter.Valid() ? iter.key() : nullptr;
+  if (iter.Valid()) {
+    iter.Prev();
+  } else {
+    iter.SeekToLast();
+  }
+  const IndexNode* prev = iter.Valid() ? iter.key() : nullptr;
+
+  const char* shared_data = nullptr;
+  size_t shared = 0;
+  for (const IndexNode* n : {prev, next}) {
+    if (n == nullptr) continue;
+    Slice p = n->SharablePrefix();
+    const size_t limit = std::min(p.size(), key.size());
+    size_t len = 0;
+    while (len < limit && p[len] == key[len]) len++;
+    if (len > shared) {
+      shared = len;
+      shared_data = p.data();
+    }
+  }
+  if (shared < kMinSharedPrefix) {
+    shared = 0;
+    shared_data = nullptr;
+  }
+
+  char* mem = arena_.AllocateAligned(sizeof(IndexNode) + key.size() - shared);
+  IndexNode* node = reinterpret_cast<IndexNode*>(mem);
+  node->shared_data = shared_data;
+  node->key_size = static_cast<uint32_t>(key.size());
+  node->shared_size = static_cast<uint32_t>(shared);
+  memcpy(node->key_data, key.data() + shared, key.size() - shared);
+  key_bytes_ += key.size();
+  stored_key_bytes_ += key.size() - shared;
+  return node;
+}
+
 bool LeafIndex::AddIndex(Slice key, uint64_t val) {
-  index_[key.ToString()] = val;
+  Publish(key, val, RecordTag(val) >> 8, IsDeletionRecord(val));
   return true;
 }
 
+size_t LeafIndex::GetEpoch() { return nvmem->GetEpoch(); }
+
+void LeafIndex::SetEpoch(size_t epoch) { nvmem->UpdateEpoch(epoch); }
+
+void LeafIndex::CopyVersions(LeafIndex* target, const IndexNode* node,
+                             const std::vector<SequenceNumber>& sequences,
+                             SequenceNumber after, bool keep_deletions) {
+  // Versions read by each view, newest first
+  std::vector<const Version*> keep;
+  for (SequenceNumber seq : sequences) {
+    const Version* v = VisibleVersion(node, seq);
+    if (v == nullptr || v->sequence.load(std::memory_order_relaxed) <= after) {
+      break;
+    }
+    if (keep.empty() || v != keep.back()) keep.push_back(v);
+  }
+  // A deletion with nothing older is the same as no entry at all
+  while (!keep_deletions && !keep.empty() &&
+         IsDeletionRecord(
+             keep.back()->address.load(std::memory_order_acquire))) {
+    keep.pop_back();
+  }
+  if (keep.empty()) return;
+  std::string key;
+  node->AppendKeyTo(&key);
+  for (auto it = keep.rbegin(); it != keep.rend(); ++it) {
+    uint64_t address = (*it)->address.load(std::memory_order_acquire);
+    const uint64_t tag = RecordTag(address);
+    if (IsDeletionRecord(address)) {
+      target->Add(tag >> 8, kTypeDeletion, key, Slice());
+      continue;
+    }
+    // Delta chains point into this region, so they are merged on copy
+    std::string value;
+    ReadValue(address, &value);
+    target->Add(tag >> 8, kTypeValue, key, value);
+  }
+}
+
+void LeafIndex::CopyLiveEntriesTo(
+    LeafIndex* target, SequenceNumber as_of,
+    const std::vector<SequenceNumber>& snapshots) {
+  std::vector<SequenceNumber> sequences(1, as_of);
+  for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+    if (*it <= as_of) sequences.push_back(*it);
+  }
+  // Keys inserted meanwhile may or may not be seen; they are newer than
+  // "as_of" either way
+  Index::Iterator iter(&index_);
+  for (iter.SeekToFirst(); iter.Valid(); iter.Next()) {
+    CopyVersions(target, iter.key(), sequences, 0, false);
+  }
+}
+
+void LeafIndex::CopyNewerEntriesTo(
+    LeafIndex* target, const std::set<std::string>& keys,
+    SequenceNumber after, const std::vector<SequenceNumber>& snapshots) {
+  std::vector<SequenceNumber> sequences(1, kMaxSequenceNumber);
+  for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+    if (*it > after) sequences.push_back(*it);
+  }
+  for (const std::string& key : keys) {
+    const IndexNode* node = FindNode(key);
+    if (node == nullptr) continue;
+    // Deletions drop what the copy wrote for the key
+    CopyVersions(target, node, sequences, after, true);
+  }
+}
+
 Status LeafIndex::Recovery(SequenceNumber& max_sequence) {
   // ToDo Get the right counters
   // Because updatecounter is not called in testcase, counters is set to 20
@@ -134,19 +484,16 @@ Status LeafIndex::Recovery(SequenceNumber& max_sequence) {
   uint32_t value_length;
   counters_ = counters;
   std::cout << "Recovery counts: " << counters << "\n";
-  if (counters > 0) {
-    const char* key_ptr = GetVarint32Ptr(
-        (char*)(address + offset), (char*)(address + offset + 5), &key_length);
-    std::string key =  // Slice(key_ptr, key_length - 8).ToString();
-        std::string(key_ptr, key_length - 8);
-    max_sequence = SequenceNumber(DecodeFixed64(key_ptr + key_length - 8));
-    max_sequence = (max_sequence >> 8) + counters;
-  }
-
+  // A compacted image keeps the original sequence numbers, so they are
+  // not contiguous and the maximum has to be taken over every record.
+  max_sequence = 0;
   while (counters--) {
     const char* key_ptr = GetVarint32Ptr(
         (char*)(address + offset), (char*)(address + offset + 5), &key_length);
     std::string key = std::string(key_ptr, key_length - 8);
+    max_sequence = std::max(
+        max_sequence,
+        SequenceNumber(DecodeFixed64(key_ptr + key_length - 8) >> 8));
     AddIndex(key, address + offset);
     offset += key_length + VarintLength(key_length);
     const char* value_ptr =
@@ -159,15 +506,16 @@ Status LeafIndex::Recovery(SequenceNumber& max_sequence) {
   return Status::OK();
 }
 
-void LeafIndex::Add(SequenceNumber s, ValueType type, const Slice& key,
-                    const Slice& value) {
+uint64_t LeafIndex::AppendRecord(SequenceNumber s, ValueType type,
+                                 const Slice& key, const Slice& value) {
   size_t key_size = key.size();
   size_t val_size = value.size();
   size_t internal_key_size = key_size + 8;
   const size_t encoded_len = VarintLength(internal_key_size) +
                              internal_key_size + VarintLength(val_size) +
                              val_size;
-  // buf = arena_.Allocate(encoded_len);
+  record_buf_.resize(encoded_len);
+  char* buf = &record_buf_[0];
   char* p = EncodeVarint32(buf, internal_key_size);
   memcpy(p, key.data(), key_size);
   p += key_size;
@@ -177,24 +525,101 @@ void LeafIndex::Add(SequenceNumber s, ValueType type, const Slice& key,
   memcpy(p, value.data(), val_size);
   assert(p + val_size == buf + encoded_len);
   uint64_t address = nvmem->Insert(buf, encoded_len);
-  index_[key.ToString()] = address;
-  if (dynamic_filter) {
-    dynamic_filter->Add(key);
-  }
   ++num_entries_;
   // update memory_usage_ to recode nvm's usage size
   memory_usage_ += encoded_len;
   AddCounter(1);
+  return address;
+}
+
+bool LeafIndex::ReadValue(uint64_t address, std::string* value) const {
+  std::vector<Slice> deltas;
+  while (IsDeltaRecord(address)) {
+    Slice v = RecordValue(address);
+    deltas.push_back(
+        Slice(v.data() + kDeltaHeaderSize, v.size() - kDeltaHeaderSize));
+    address = nvmem->GetBeginAddress() + DecodeFixed64(v.data());
+  }
+  bool deleted = IsDeletionRecord(address);
+  Slice base = deleted ? Slice() : RecordValue(address);
+  if (deltas.empty()) {
+    value->assign(base.data(), base.size());
+    return !deleted;
+  }
+  std::reverse(deltas.begin(), deltas.end());
+  merger_->Merge(base, deltas, value);
+  return true;
+}
+
+static void DeleteMergedValue(const Slice& key, void* value) {
+  delete reinterpret_cast<std::string*>(value);
+}
+
+Cache::Handle* LeafIndex::LookupMergedValue(uint64_t address) const {
+  char buf[16];
+  EncodeFixed64(buf, merged_cache_id_);
+  EncodeFixed64(buf + 8, address);
+  Slice key(buf, sizeof(buf));
+  Cache::Handle* handle = merged_cache_->Lookup(key);
+  if (handle == nullptr) {
+    // Records never change, so concurrent misses insert equal values
+    std::string* value = new std::string;
+    ReadValue(address, value);
+    handle = merged_cache_->Insert(key, value, value->size(),
+                                   &DeleteMergedValue);
+  }
+  return handle;
+}
+
+void LeafIndex::Add(SequenceNumber s, ValueType type, const Slice& key,
+                    const Slice& value) {
+  uint64_t address;
+  if (type == kTypeValue && merger_ != nullptr && merger_->IsDelta(value)) {
+    const IndexNode* node = FindNode(key);
+    uint64_t prev = 0;
+    uint32_t depth = 0;
+    if (node != nullptr) {
+      prev = VisibleVersion(node, kMaxSequenceNumber)
+                 ->address.load(std::memory_order_relaxed);
+      if (IsDeletionRecord(prev)) {
+        prev = 0;
+      } else if (IsDeltaRecord(prev)) {
+        depth = DecodeFixed32(RecordValue(prev).data() + 8);
+      }
+    }
+    if (prev == 0 || depth >= kMaxDeltaChain) {
+      // Start a new chain with the full value
+      std::string base, full;
+      if (prev != 0) ReadValue(prev, &base);
+      merger_->Merge(base, {value}, &full);
+      address = AppendRecord(s, kTypeValue, key, full);
+    } else {
+      std::string delta;
+      PutFixed64(&delta, prev - nvmem->GetBeginAddress());
+      PutFixed32(&delta, depth + 1);
+      delta.append(value.data(), value.size());
+      address = AppendRecord(s, kTypeDelta, key, delta);
+    }
+  } else {
+    address = AppendRecord(s, type, key, value);
+  }
+  Publish(key, address, s, type == kTypeDeletion);
+  if (dynamic_filter) {
+    dynamic_filter->Add(key);
+  }
 }
 
 bool LeafIndex::Get(const LookupKey& key, std::string* value, Status* s) {
   if (dynamic_filter != nullptr && !dynamic_filter->KeyMayMatch(key.user_key()))
     return false;
-  ++searches_;
-  Slice memkey = key.user_key();
-  uint64_t address = 0;
-  bool suc = index_.count(memkey.ToString());
-  if (suc == true) {
+  const IndexNode* node = FindNode(key.user_key());
+  const Version* version = nullptr;
+  if (node != nullptr) {
+    version = VisibleVersion(
+        node, DecodeFixed64(key.internal_key().data() +
+                            key.internal_key().size() - 8) >> 8);
+  }
+  if (version != nullptr) {
     // entry format is:
     //    magicNum
     //    klength  varint32
@@ -205,7 +630,7 @@ bool LeafIndex::Get(const LookupKey& key, std::string* value, Status* s) {
     // Check that it belongs to same user key.  We do not check the
     // sequence number since the Seek() call above should have skipped
     // all entries with overly large sequence numbers.
-    address = index_[memkey.ToString()];
+    uint64_t address = version->address.load(std::memory_order_acquire);
     uint32_t key_length;
     const char* key_ptr =
         GetVarint32Ptr((char*)(address), (char*)(address + 5),
@@ -222,6 +647,16 @@ bool LeafIndex::Get(const LookupKey& key, std::string* value, Status* s) {
           value->assign(v.data(), v.size());
           return true;
         }
+        case kTypeDelta:
+          if (merged_cache_ != nullptr) {
+            Cache::Handle* handle = LookupMergedValue(address);
+            value->assign(
+                *reinterpret_cast<std::string*>(merged_cache_->Value(handle)));
+            merged_cache_->Release(handle);
+          } else {
+            ReadValue(address, value);
+          }
+          return true;
         case kTypeDeletion:
           *s = Status::NotFound(Slice());
           return true;
@@ -11,12 +11,17 @@
 #ifndef STORAGE_LEVELDB_DB_LeafIndex_STL_H_
 #define STORAGE_LEVELDB_DB_LeafIndex_STL_H_
 
-#include <map>
+#include <atomic>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "db/dbformat.h"
+#include "db/skiplist.h"
+#include "leveldb/cache.h"
 #include "leveldb/db.h"
 #include "leveldb/filter_policy.h"
+#include "util/arena.h"
 
 #include "nvm/nvmem.h"
 
@@ -25,6 +30,21 @@ namespace leveldb {
 class InternalKeyComparator;
 class MemTableIterator;
 
+// Lets the leaf index log a value as a small delta against the key's
+// previous value instead of rewriting the whole value.
+class LeafIndexValueMerger {
+ public:
+  virtual ~LeafIndexValueMerger() = default;
+
+  // Returns true iff "value" is a delta to apply to the key's current value.
+  virtual bool IsDelta(const Slice& value) const = 0;
+
+  // Stores in *result the value obtained by applying "deltas", oldest
+  // first, to "base".  "base" is empty if the key has no value.
+  virtual void Merge(const Slice& base, const std::vector<Slice>& deltas,
+                     std::string* result) const = 0;
+};
+
 class LeafIndex {
  public:
   // MemTables are reference counted.  The initial reference count
@@ -32,40 +52,62 @@ class LeafIndex {
   // explicit LeafIndex(const InternalKeyComparator& comparator,
   //    DynamicFilter * dynamic_filter, silkstore::Nvmem *nvmem,
   //    silkstore::NvmLog *nvmlog);
+  //
+  // With a "merger", values it reports as deltas are logged as a record
+  // that points at the key's previous record; readers rebuild the full
+  // value.  Every kMaxDeltaChain deltas the full value is logged again.
+  // Rebuilt values are kept in "merged_cache" if it is not null.
   explicit LeafIndex(const InternalKeyComparator& comparator,
-                     DynamicFilter* dynamic_filter, silkstore::Nvmem* nvmem);
+                     DynamicFilter* dynamic_filter, silkstore::Nvmem* nvmem,
+                     const LeafIndexValueMerger* merger = nullptr,
+                     Cache* merged_cache = nullptr);
+
+  static const int kMaxDeltaChain = 4;
 
-  // Increase reference count.
+  // Increase reference count.  Ref() and Unref() are thread-safe.
   void Ref() {
-    ++refs_;
+    refs_.fetch_add(1, std::memory_order_relaxed);
     return;
   }
 
   void print() { nvmem->print(); }
 
-  // Drop reference count.  Delete if no more references exist.
-  void Unref() {
-    --refs_;
-    assert(refs_ >= 0);
-    if (refs_ <= 0) {
+  // Drop reference count.  Delete if no more references exist.  Returns
+  // true iff this call deleted the index.
+  bool Unref() {
+    int refs = refs_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    assert(refs >= 0);
+    if (refs <= 0) {
       // printf("release LeafIndex\n");
       delete this;
+      return true;
     }
-    return;
+    return false;
   }
-  size_t Size() { return index_.size(); }
+  size_t Size() { return num_keys_.load(std::memory_order_relaxed); }
   // Returns an estimate of the number of bytes of data in use by this
   // data structure. It is safe to call when MemTable is being modified.
   size_t ApproximateMemoryUsage();
-  // Return an iterator that yields the contents of the memtable.
-  // The caller must ensure that the underlying MemTable remains live
-  // while the returned iterator is live.  The keys returned by this
-  // iterator are internal keys encoded by AppendInternalKey in the
-  // db/format.{h,cc} module.
-  Iterator* NewIterator();
+  // Bytes of NVM log held by the newest live record of each key.  The
+  // rest of ApproximateMemoryUsage() is garbage a log compaction reclaims.
+  size_t LiveBytes() const;
+  // Bytes of DRAM held by the skiplist, its keys and versions.
+  size_t DramUsage() const { return arena_.MemoryUsage(); }
+  // Total size of the keys indexed, and the part of it actually stored
+  // after sharing prefixes between neighbouring keys.
+  size_t KeyBytes() const { return key_bytes_; }
+  size_t StoredKeyBytes() const { return stored_key_bytes_; }
+  // Return an iterator over the leaves live as of sequence "snapshot",
+  // keyed by user key.  The caller must ensure that the LeafIndex remains
+  // live while the returned iterator is live.  Iterators need no locking
+  // and may run concurrently with Add(); each position reflects one
+  // committed record.
+  Iterator* NewIterator(SequenceNumber snapshot = kMaxSequenceNumber);
   // Add an entry into memtable that maps key to value at the
   // specified sequence number and with the specified type.
   // Typically value will be empty if type==kTypeDeletion.
+  // REQUIRES: external synchronization between writers.  Readers
+  // (Get and iterators) need none.
   void Add(SequenceNumber seq, ValueType type, const Slice& key,
            const Slice& value);
   Status AddBatch(const WriteBatch* b);
@@ -74,14 +116,41 @@ class LeafIndex {
   Status AddCounter(size_t added);
   size_t GetCounter();
   bool AddIndex(Slice, uint64_t);
+  // Epoch of the NVM region backing this index; the region with the
+  // highest epoch is the current image after a restart.
+  size_t GetEpoch();
+  void SetEpoch(size_t epoch);
+  // Append the record of every live key as of sequence "as_of" to
+  // "target", keeping its sequence number.  Deletions and overwritten
+  // records are dropped.  Records still visible to a snapshot in
+  // "snapshots" are copied too.  Add() may run on this index meanwhile,
+  // provided it does not overwrite the versions visible at "as_of", see
+  // SetNewestSnapshot().
+  // REQUIRES: no concurrent Add() on "target".
+  void CopyLiveEntriesTo(LeafIndex* target, SequenceNumber as_of,
+                         const std::vector<SequenceNumber>& snapshots);
+  // Append to "target" the records of "keys" newer than "after" that the
+  // latest view or a snapshot in "snapshots" reads, deletions included.
+  // Completes a CopyLiveEntriesTo(target, after, ...) with the writes
+  // made during the copy.
+  // REQUIRES: no concurrent Add() on this index or on "target".
+  void CopyNewerEntriesTo(LeafIndex* target, const std::set<std::string>& keys,
+                          SequenceNumber after,
+                          const std::vector<SequenceNumber>& snapshots);
+  // Sequence of the newest live snapshot, 0 if there is none.  Add()
+  // overwrites a key's newest version in place unless this snapshot may
+  // still read it, so superseded versions only cost memory while pinned.
+  // REQUIRES: external synchronization with Add().
+  void SetNewestSnapshot(SequenceNumber seq) { newest_snapshot_ = seq; }
 
+  // Reads as of the sequence number in "key".
   // If memtable contains a value for key, store it in *value and return true.
   // If memtable contains a deletion for key, store a NotFound() error
   // in *status and return true.
   // Else, return false.
+  // Lock-free: safe to call concurrently with Add().
   bool Get(const LookupKey& key, std::string* value, Status* s);
   size_t NumEntries() const;
-  size_t Searches() const;
 
  private:
   // Private since only Unref() should be used to delete it.
@@ -94,19 +163,112 @@ class LeafIndex {
   friend class LeafIndexIterator;
   friend class LeafIndexBackwardIterator;
 
-  typedef std::map<std::string, uint64_t> Index;
+  // One NVM record of a key, linked to the version it superseded.
+  // Versions live in arena_ and are reclaimed with the whole LeafIndex
+  // when a log compaction retires it.
+  struct Version {
+    std::atomic<uint64_t> address;
+    std::atomic<SequenceNumber> sequence;
+    const Version* older;
+  };
+
+  // One node per user key ever written.  The node itself is immutable
+  // once linked into the skiplist; only "head" moves to the newest
+  // version of the key, which may be a deletion.
+  //
+  // Keys are front coded: the first shared_size bytes are not copied but
+  // point into the key of a neighbouring node, which leaf keys with a
+  // common prefix make worthwhile.  Nodes are never freed before the
+  // LeafIndex, so the shared bytes stay valid.
+  struct IndexNode {
+    mutable std::atomic<Version*> head;
+    const char* shared_data;
+    uint32_t key_size;
+    uint32_t shared_size;
+    char key_data[1];  // Key bytes after the shared prefix
+
+    Slice prefix() const { return Slice(shared_data, shared_size); }
+    Slice suffix() const { return Slice(key_data, key_size - shared_size); }
+    // Longest prefix of the key held in contiguous memory
+    Slice SharablePrefix() const {
+      return shared_size == 0 ? suffix() : prefix();
+    }
+    void AppendKeyTo(std::string* dst) const {
+      dst->append(shared_data, shared_size);
+      dst->append(key_data, key_size - shared_size);
+    }
+  };
+
+  // Prefixes shorter than this are copied; sharing them would not pay
+  // for the pointer.
+  static const size_t kMinSharedPrefix = 16;
+
+  struct NodeComparator {
+    int operator()(const IndexNode* a, const IndexNode* b) const;
+  };
+
+  typedef SkipList<const IndexNode*, NodeComparator> Index;
+
+  // Returns the node for "key", or nullptr if it was never written.
+  const IndexNode* FindNode(const Slice& key) const;
+
+  // Newest version of "node" with sequence <= "snapshot", or nullptr.
+  static const Version* VisibleVersion(const IndexNode* node,
+                                       SequenceNumber snapshot);
+
+  // Appends to "target" the versions of "node" that the views at
+  // "sequences", in descending order, read and that are newer than
+  // "after", oldest first.  Without "keep_deletions", deletions older
+  // than every copied value are left out.
+  void CopyVersions(LeafIndex* target, const IndexNode* node,
+                    const std::vector<SequenceNumber>& sequences,
+                    SequenceNumber after, bool keep_deletions);
+
+  // Appends one record to the NVM log and returns its address.
+  uint64_t AppendRecord(SequenceNumber seq, ValueType type, const Slice& key,
+                        const Slice& value);
+
+  // Stores in *value the full value of the record at "address", following
+  // and merging delta records.  Returns false for a deletion.
+  bool ReadValue(uint64_t address, std::string* value) const;
+
+  // Returns a handle on the full value of the delta record at "address"
+  // in merged_cache_, merging the chain on a miss.  The caller must
+  // release the handle.
+  // REQUIRES: merged_cache_ != nullptr
+  Cache::Handle* LookupMergedValue(uint64_t address) const;
+
+  // Allocates the node for "key", sharing the longest prefix it has with
+  // its neighbours in the index.
+  IndexNode* NewIndexNode(const Slice& key);
+
+  // Points "key" at the record at "address", creating its node on first use.
+  // REQUIRES: external synchronization between writers.
+  void Publish(const Slice& key, uint64_t address, SequenceNumber seq,
+               bool is_deletion);
+
   KeyComparator comparator_;
-  int refs_;
+  std::atomic<int> refs_;
+  Arena arena_;
   Index index_;
   silkstore::Nvmem* nvmem;
-  char buf[1024ul * 1024ul * 16ul];
-  size_t num_entries_;
-  size_t searches_;
+  // Staging buffer for the record being appended to nvmem
+  std::string record_buf_;
+  std::atomic<size_t> num_entries_;
+  std::atomic<size_t> num_keys_;
+  std::atomic<size_t> live_bytes_;
+  std::atomic<size_t> key_bytes_;
+  std::atomic<size_t> stored_key_bytes_;
+  SequenceNumber newest_snapshot_;
   size_t counters_;
-  size_t memory_usage_;
+  std::atomic<size_t> memory_usage_;
   // Using for debug
   size_t dram_usage_;
   DynamicFilter* dynamic_filter;
+  const LeafIndexValueMerger* const merger_;
+  Cache* const merged_cache_;
+  // Distinguishes this image's records in merged_cache_
+  const uint64_t merged_cache_id_;
   // No copying allowed
   LeafIndex(const LeafIndex&);
   void operator=(const LeafIndex&);
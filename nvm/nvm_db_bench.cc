@@ -2,6 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <algorithm>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +19,7 @@
 #include "util/mutexlock.h"
 #include "util/random.h"
 #include "util/testutil.h"
+#include "silkstore/perf_context.h"
 #include "silkstore/silkstore_impl.h"
 
 // Comma-separated list of operations to run in the specified order
@@ -27,6 +29,8 @@
 //      overwrite     -- overwrite N values in random key order in async mode
 //      fillsync      -- write N/100 values in random key order in sync mode
 //      fill100K      -- write N/1000 100K values in random order in async mode
+//      gchotcold     -- write all --table_size keys, then N values with 90%
+//                       going to a hot 10% of the keys; exercises GC policy
 //      deleteseq     -- delete N keys in sequential order
 //      deleterandom  -- delete N keys in random order
 //      readseq       -- read N times sequentially
@@ -34,6 +38,7 @@
 //      readrandom    -- read N times in random order
 //      readmissing   -- read N missing keys in random order
 //      readhot       -- read N times in random order from 1% section of DB
+//      readscaling   -- readrandom with 1, 2, 4, ... --max_read_threads threads
 //      seekrandom    -- N random seeks
 //      open          -- cost of opening a DB
 //      crc32c        -- repeated crc32c of 4K of data
@@ -41,6 +46,7 @@
 //   Meta operations:
 //      compact     -- Compact the entire DB
 //      stats       -- Print DB stats
+//      silkstats   -- Print SilkStore read path tickers and histograms
 //      sstables    -- Print sstable info
 //      heapprofile -- Dump a heap profile (if supported by this port)
 static const char* FLAGS_benchmarks =
@@ -105,6 +111,9 @@ static int FLAGS_table_size = -1;
 // Number of concurrent threads to run.
 static int FLAGS_threads = 1;
 
+// Largest thread count tried by the readscaling benchmark.
+static int FLAGS_max_read_threads = 64;
+
 // Size of each value
 static int FLAGS_value_size = 128;
 
@@ -115,6 +124,10 @@ static double FLAGS_compression_ratio = 1;
 // Print histogram of operation timings
 static bool FLAGS_histogram = false;
 
+// Print each thread's SilkStore PerfContext (with stage timings) after
+// every benchmark
+static bool FLAGS_perf_context = false;
+
 // Number of bytes to buffer in memtable before compacting
 // (initialized to default value by "main")
 static int FLAGS_write_buffer_size = 0;
@@ -131,6 +144,10 @@ static int FLAGS_block_size = 0;
 // Negative means use default settings.
 static int FLAGS_cache_size = -1;
 
+// Number of bytes to use as a SilkStore row cache for point lookups.
+// Zero disables the row cache.
+static int FLAGS_row_cache_size = 0;
+
 // Maximum number of files to keep open at the same time (use default if == 0)
 static int FLAGS_open_files = 0;
 
@@ -162,9 +179,21 @@ static bool FLAGS_enable_leaf_read_opt = true;
 
 static bool FLAGS_enable_memtable_bloom = false;
 
+// Segment streams miniruns are placed into by leaf write hotness
+static int FLAGS_num_segment_groups = 1;
+
 // Ratio of the capacity of the log and the dataset
 static double FLAGS_log_dataset_ratio = 2.0;
 
+// Structure of the SilkStore leaf index: "nvm", "leveldb" or "mem"
+static const char* FLAGS_leaf_index = "nvm";
+
+// How SilkStore picks segments to collect: "cost_benefit" or "greedy"
+static const char* FLAGS_gc_policy = "cost_benefit";
+
+// If true, SilkStore punches holes into segments for invalidated runs
+static bool FLAGS_punch_invalid_runs = false;
+
 namespace leveldb {
 
 namespace {
@@ -601,6 +630,7 @@ class WorkloadMixture {
 class Benchmark {
  private:
   Cache* cache_;
+  Cache* row_cache_;
   const FilterPolicy* filter_policy_;
   DB* db_;
   int num_;
@@ -699,6 +729,8 @@ class Benchmark {
  public:
   Benchmark()
       : cache_(FLAGS_cache_size >= 0 ? NewLRUCache(FLAGS_cache_size) : nullptr),
+        row_cache_(FLAGS_row_cache_size > 0 ? NewLRUCache(FLAGS_row_cache_size)
+                                            : nullptr),
         filter_policy_(FLAGS_bloom_bits >= 0
                            ? NewBloomFilterPolicy(FLAGS_bloom_bits)
                            : nullptr),
@@ -730,6 +762,7 @@ class Benchmark {
   ~Benchmark() {
     delete db_;
     delete cache_;
+    delete row_cache_;
     delete filter_policy_;
   }
 
@@ -777,6 +810,9 @@ class Benchmark {
       } else if (name == Slice("writeskewed")) {
         fresh_db = true;
         method = &Benchmark::WriteSkewed;
+      } else if (name == Slice("gchotcold")) {
+        fresh_db = true;
+        method = &Benchmark::WriteHotCold;
       } else if (name == Slice("overwrite")) {
         fresh_db = false;
         method = &Benchmark::WriteRandom;
@@ -804,6 +840,17 @@ class Benchmark {
         method = &Benchmark::SeekRandom;
       } else if (name == Slice("readhot")) {
         method = &Benchmark::ReadHot;
+      } else if (name == Slice("readscaling")) {
+        // readrandom at 1, 2, 4, ... FLAGS_max_read_threads threads with the
+        // same total number of reads
+        const int total_reads = reads_;
+        for (int n = 1; n <= FLAGS_max_read_threads; n *= 2) {
+          reads_ = std::max(1, total_reads / n);
+          char run_name[100];
+          snprintf(run_name, sizeof(run_name), "readrandom/%dT", n);
+          RunBenchmark(n, run_name, &Benchmark::ReadRandom);
+        }
+        reads_ = total_reads;
       } else if (name == Slice("readrandomsmall")) {
         reads_ /= 1000;
         method = &Benchmark::ReadRandom;
@@ -830,6 +877,8 @@ class Benchmark {
         PrintStats("leveldb.stats");
       } else if (name == Slice("sstables")) {
         PrintStats("leveldb.sstables");
+      } else if (name == Slice("silkstats")) {
+        PrintStats("silkstore.statistics");
       } else if (name == Slice("mixed_workload")) {
         fresh_db = false;
         method = &Benchmark::MixedWorkload;
@@ -888,12 +937,20 @@ class Benchmark {
       }
     }
 
+    if (FLAGS_perf_context) {
+      silkstore::SetPerfLevel(silkstore::kPerfEnableTime);
+      silkstore::GetPerfContext()->Reset();
+    }
     thread->stats.Start();
     (arg->bm->*(arg->method))(thread);
     thread->stats.Stop();
 
     {
       MutexLock l(&shared->mu);
+      if (FLAGS_perf_context) {
+        fprintf(stdout, "thread %d perf context: %s\n", thread->tid,
+                silkstore::GetPerfContext()->ToString().c_str());
+      }
       shared->num_done++;
       if (shared->num_done >= shared->total) {
         shared->cv.SignalAll();
@@ -1027,6 +1084,7 @@ class Benchmark {
     options.env = g_env;
     options.create_if_missing = !FLAGS_use_existing_db;
     options.block_cache = cache_;
+    options.row_cache = row_cache_;
     options.nvmemtable_file = "/mnt/NVMSilkstore/nvmemtable";
     options.leaf_max_num_miniruns = FLAGS_leaf_max_num_miniruns;
     options.memtbl_to_L0_ratio = FLAGS_memtbl_to_L0_ratio;
@@ -1039,6 +1097,18 @@ class Benchmark {
     options.compression = kNoCompression;
     options.enable_leaf_read_opt = FLAGS_enable_leaf_read_opt;
     options.use_memtable_dynamic_filter = FLAGS_enable_memtable_bloom;
+    options.num_segment_groups = FLAGS_num_segment_groups;
+    if (FLAGS_leaf_index == std::string("leveldb")) {
+      options.leaf_index_type = kLevelDBLeafIndex;
+    } else if (FLAGS_leaf_index == std::string("mem")) {
+      options.leaf_index_type = kMemLeafIndex;
+    } else {
+      options.leaf_index_type = kNvmLeafIndex;
+    }
+    options.gc_policy = FLAGS_gc_policy == std::string("greedy")
+                            ? kGreedyGCPolicy
+                            : kCostBenefitGCPolicy;
+    options.punch_invalid_runs = FLAGS_punch_invalid_runs;
     // options.leaf_index_path = "/mnt/myPMem";
     options.maximum_segments_storage_size =
         (static_cast<int64_t>(kKeySize + FLAGS_value_size) * FLAGS_table_size) *
@@ -1157,10 +1227,70 @@ class Benchmark {
     std::string segment_util;
     db_->GetProperty("silkstore.segment_util", &segment_util);
     thread->stats.AddMessage(segment_util);
+    std::string gc_group_stats;
+    db_->GetProperty("silkstore.gc_group_stats", &gc_group_stats);
+    thread->stats.AddMessage(gc_group_stats);
+  }
+
+  void WriteHotCold(ThreadState* thread) {
+    RandomGenerator gen;
+    WriteBatch batch;
+    Status s;
+    std::string msg;
+    int64_t bytes = 0;
+    const int hot_keys = std::max(1, FLAGS_table_size / 10);
+    // The load writes every key once so cold data fills most segments
+    for (int i = 0; i < FLAGS_table_size + num_; i += entries_per_batch_) {
+      batch.Clear();
+      for (int j = 0; j < entries_per_batch_; j++) {
+        int k;
+        if (i + j < FLAGS_table_size) {
+          k = i + j;
+        } else if (thread->rand.OneIn(10)) {
+          k = thread->rand.Uniform(FLAGS_table_size);
+        } else {
+          k = thread->rand.Uniform(hot_keys);
+        }
+        char key[100];
+        snprintf(key, sizeof(key), "%016d", k);
+        batch.Put(key, gen.Generate(value_size_));
+        bytes += value_size_ + strlen(key);
+        if (i + j >= FLAGS_table_size) thread->stats.FinishedSingleOp();
+      }
+      s = db_->Write(write_options_, &batch);
+      if (!s.ok()) {
+        fprintf(stderr, "put error: %s\n", s.ToString().c_str());
+        exit(1);
+      }
+    }
+
+    thread->stats.AddBytes(bytes);
+    db_->GetProperty(std::string(FLAGS_db_type) + ".stats", &msg);
+    thread->stats.AddMessage(msg);
+    std::string gc_stat;
+    db_->GetProperty("silkstore.gcstat", &gc_stat);
+    thread->stats.AddMessage(gc_stat);
+    std::string segment_cache;
+    db_->GetProperty("silkstore.segment_cache", &segment_cache);
+    thread->stats.AddMessage(segment_cache);
+    std::string gc_group_stats;
+    db_->GetProperty("silkstore.gc_group_stats", &gc_group_stats);
+    thread->stats.AddMessage(gc_group_stats);
+    std::string write_volume;
+    db_->GetProperty(std::string(FLAGS_db_type) + ".write_volume",
+                     &write_volume);
+    std::string wm = "Write Amplification Factor: " +
+                     std::to_string(std::stol(write_volume) / (bytes + 1.0));
+    thread->stats.AddMessage(wm);
   }
 
   void ShortRangeQuery(ThreadState* thread) {
-    Iterator* iter = db_->NewIterator(ReadOptions());
+    // Bound every scan so the store never opens a leaf past its range
+    char limit[100];
+    Slice upper_bound;
+    ReadOptions options;
+    options.iterate_upper_bound = &upper_bound;
+    Iterator* iter = db_->NewIterator(options);
     int64_t bytes = 0;
     int query_nums = 10000;
     int query_lens = 10000;
@@ -1169,6 +1299,8 @@ class Benchmark {
       char key[100];
       const int k = thread->rand.Next() % FLAGS_table_size;
       snprintf(key, sizeof(key), "%016d", k);
+      snprintf(limit, sizeof(limit), "%016d", k + query_lens);
+      upper_bound = Slice(limit);
       int i = 0;
       for (iter->Seek(key); i < query_lens && iter->Valid(); iter->Next()) {
         bytes += iter->key().size() + iter->value().size();
@@ -1473,6 +1605,9 @@ int main(int argc, char** argv) {
     } else if (sscanf(argv[i], "--histogram=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       FLAGS_histogram = n;
+    } else if (sscanf(argv[i], "--perf_context=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_perf_context = n;
     } else if (sscanf(argv[i], "--use_existing_db=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       FLAGS_use_existing_db = n;
@@ -1485,6 +1620,8 @@ int main(int argc, char** argv) {
       FLAGS_reads = n;
     } else if (sscanf(argv[i], "--threads=%d%c", &n, &junk) == 1) {
       FLAGS_threads = n;
+    } else if (sscanf(argv[i], "--max_read_threads=%d%c", &n, &junk) == 1) {
+      FLAGS_max_read_threads = n;
     } else if (sscanf(argv[i], "--value_size=%d%c", &n, &junk) == 1) {
       FLAGS_value_size = n;
     } else if (sscanf(argv[i], "--write_buffer_size=%d%c", &n, &junk) == 1) {
@@ -1495,6 +1632,8 @@ int main(int argc, char** argv) {
       FLAGS_block_size = n;
     } else if (sscanf(argv[i], "--cache_size=%d%c", &n, &junk) == 1) {
       FLAGS_cache_size = n;
+    } else if (sscanf(argv[i], "--row_cache_size=%d%c", &n, &junk) == 1) {
+      FLAGS_row_cache_size = n;
     } else if (sscanf(argv[i], "--bloom_bits=%d%c", &n, &junk) == 1) {
       FLAGS_bloom_bits = n;
     } else if (sscanf(argv[i], "--open_files=%d%c", &n, &junk) == 1) {
@@ -1511,10 +1650,19 @@ int main(int argc, char** argv) {
       FLAGS_enable_leaf_read_opt = std::stoi(argv[i] + 23);
     } else if (strncmp(argv[i], "--enable_memtable_bloom=", 24) == 0) {
       FLAGS_enable_memtable_bloom = std::stoi(argv[i] + 24);
+    } else if (sscanf(argv[i], "--num_segment_groups=%d%c", &n, &junk) == 1) {
+      FLAGS_num_segment_groups = n;
     } else if (strncmp(argv[i], "--table_size=", 13) == 0) {
       FLAGS_table_size = std::stoi(argv[i] + 13);
     } else if (strncmp(argv[i], "--log_dataset_ratio=", 20) == 0) {
       FLAGS_log_dataset_ratio = std::stof(argv[i] + 20);
+    } else if (strncmp(argv[i], "--leaf_index=", 13) == 0) {
+      FLAGS_leaf_index = argv[i] + 13;
+    } else if (strncmp(argv[i], "--gc_policy=", 12) == 0) {
+      FLAGS_gc_policy = argv[i] + 12;
+    } else if (sscanf(argv[i], "--punch_invalid_runs=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_punch_invalid_runs = n;
     } else {
       fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
       exit(1);
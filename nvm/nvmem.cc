@@ -44,6 +44,18 @@ size_t Nvmem::GetCounter() {
   return counter;
 }
 
+bool Nvmem::UpdateEpoch(size_t epoch) {
+  memcpy(data_ + 8, &epoch, 8);
+  clwb(data_ + 8);
+  sfence();
+  return true;
+}
+size_t Nvmem::GetEpoch() {
+  size_t epoch = 0;
+  memcpy(&epoch, data_ + 8, 8);
+  return epoch;
+}
+
 uint64_t Nvmem::GetBeginAddress() { return (uint64_t)data_; }
 
 void Nvmem::print() {
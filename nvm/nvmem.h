@@ -47,6 +47,10 @@ class Nvmem {
   bool UpdateCounter(size_t counters);
   bool UpdateIndex(size_t index);
   size_t GetCounter();
+  // The second header word is an epoch owned by the user of the region,
+  // e.g. to tell which of several images is the newest after a crash.
+  bool UpdateEpoch(size_t epoch);
+  size_t GetEpoch();
   uint64_t GetBeginAddress();
   uint64_t Insert(const char*, int);
 
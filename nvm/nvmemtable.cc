@@ -7,6 +7,7 @@
 #include "leveldb/env.h"
 #include "leveldb/iterator.h"
 #include "leveldb/write_batch.h"
+#include "silkstore/silkstore_iter.h"
 #include "util/coding.h"
 
 #include <iostream>
@@ -67,23 +68,35 @@ static const char* EncodeKey(std::string* scratch, const Slice& target) {
 }
 class NvmemTableIterator : public Iterator {
  public:
-  explicit NvmemTableIterator(NvmemTable::Index* index) : index(index) {
+  NvmemTableIterator(NvmemTable::Index* index, const Comparator* ucmp,
+                     const ReadOptions& options)
+      : index(index), bound_(ucmp, options) {
     iter_ = index->begin();
   }
   virtual bool Valid() const { return iter_ != index->end() && iter_->second; }
   // Seek 中的key 带有 8bits的序列号和标记位
   virtual void Seek(const Slice& k) {
     int k_len = k.size();
+    bound_.Reset(Slice(k.data(), k_len - 8));
     iter_ = index->lower_bound(k.ToString().substr(0, k_len - 8));
+    StopAtBound();
+  }
+  virtual void SeekToFirst() {
+    bound_.Reset();
+    iter_ = index->begin();
+    StopAtBound();
   }
-  virtual void SeekToFirst() { iter_ = index->begin(); }
   virtual void SeekToLast() {
+    bound_.Reset();
     iter_ = index->end();
     iter_--;
     fprintf(stderr, "MemTableIterator's SeekToLast() is not implemented !");
     // assert(true);
   }
-  virtual void Next() { ++iter_; }
+  virtual void Next() {
+    ++iter_;
+    StopAtBound();
+  }
   virtual void Prev() {
     --iter_;
     fprintf(stderr, "MemTableIterator's Prev() is not implemented ! \n");
@@ -103,13 +116,28 @@ class NvmemTableIterator : public Iterator {
  private:
   NvmemTable::Index* index;
   NvmemTable::Index::iterator iter_;
+  silkstore::IterateBound bound_;
+
+  // Forward iteration ends at the first user key past the bound.  The
+  // index is keyed by user key, so no decoding is needed.
+  void StopAtBound() {
+    if (bound_.Active() && iter_ != index->end() &&
+        bound_.Exceeds(iter_->first)) {
+      iter_ = index->end();
+    }
+  }
 
   // No copying allowed
   NvmemTableIterator(const NvmemTableIterator&);
   void operator=(const NvmemTableIterator&);
 };
 
-Iterator* NvmemTable::NewIterator() { return new NvmemTableIterator(&index_); }
+Iterator* NvmemTable::NewIterator() { return NewIterator(ReadOptions()); }
+
+Iterator* NvmemTable::NewIterator(const ReadOptions& options) {
+  return new NvmemTableIterator(
+      &index_, comparator_.comparator.user_comparator(), options);
+}
 
 Status NvmemTable::AddCounter(size_t added) {
   counters_ += added;
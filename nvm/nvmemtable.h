@@ -61,6 +61,8 @@ class NvmemTable {
   // iterator are internal keys encoded by AppendInternalKey in the
   // db/format.{h,cc} module.
   Iterator* NewIterator();
+  // Same as above, but stops at the iteration bounds in "options".
+  Iterator* NewIterator(const ReadOptions& options);
   // Add an entry into memtable that maps key to value at the
   // specified sequence number and with the specified type.
   // Typically value will be empty if type==kTypeDeletion.
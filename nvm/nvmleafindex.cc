@@ -1,16 +1,79 @@
 #include "nvm/nvmleafindex.h"
+#include <algorithm>
 #include <stdexcept>
+#include "db/dbformat.h"
+#include "leveldb/env.h"
 #include "util/coding.h"
+#include "util/mutexlock.h"
 
 namespace leveldb {
 namespace silkstore {
 
+// Compact the index log once it is at least this full and mostly garbage.
+static const double kCompactionUsageRatio = 0.5;
+static const double kCompactionGarbageRatio = 0.5;
+
+// Bytes of DRAM for leaf index values merged from delta chains.  Entries
+// of hot leaves are then merged once per delta instead of once per read.
+static const size_t kMergedCacheSize = 32 << 20;
+
+static SequenceNumber SnapshotSequence(const ReadOptions& options) {
+  return options.snapshot != nullptr
+             ? static_cast<const SnapshotImpl*>(options.snapshot)
+                   ->sequence_number()
+             : kMaxSequenceNumber;
+}
+
+namespace {
+
+// Collects the keys a batch writes
+class KeyCollector : public WriteBatch::Handler {
+ public:
+  explicit KeyCollector(std::set<std::string>* keys) : keys_(keys) {}
+
+  void Put(const Slice& key, const Slice& value) override {
+    keys_->insert(key.ToString());
+  }
+
+  void Delete(const Slice& key) override { keys_->insert(key.ToString()); }
+
+ private:
+  std::set<std::string>* keys_;
+};
+
+}  // namespace
+
+LeafIndex* NvmLeafIndex::CurrentIndex() {
+  MutexLock l(&index_mutex_);
+  leaf_index_->Ref();
+  return leaf_index_;
+}
+
+void NvmLeafIndex::ReleaseIndex(LeafIndex* index) {
+  // Only a retired image loses its last reference here; the current one is
+  // held by leaf_index_
+  if (index->Unref()) {
+    MutexLock l(&mutex_);
+    --retired_images_;
+    bg_cv_.SignalAll();
+    MaybeScheduleCompaction();
+  }
+}
+
+void NvmLeafIndex::ReleaseIndexCleanup(void* index, void* db) {
+  reinterpret_cast<NvmLeafIndex*>(db)->ReleaseIndex(
+      reinterpret_cast<LeafIndex*>(index));
+}
+
 Iterator* NvmLeafIndex::NewIterator(const ReadOptions& options) {
   // std::__throw_runtime_error(" NvmLeafIndex::NewIterator(const ReadOptions&
   // options) not support\n");
-  mutex_.Lock();
-  auto it = leaf_index_->NewIterator();
-  mutex_.Unlock();
+  // Readers never block on writers: the index publishes entries with
+  // release stores and only writers serialize on mutex_.  The reference
+  // keeps the image alive across a concurrent log compaction.
+  LeafIndex* index = CurrentIndex();
+  auto it = index->NewIterator(SnapshotSequence(options));
+  it->RegisterCleanup(&NvmLeafIndex::ReleaseIndexCleanup, index, this);
 
   if (it == nullptr) {
     // std::cout<< "return NewEmptyIterator \n";
@@ -39,21 +102,49 @@ class EmptyKVIterator : public Iterator {
   virtual std::string Value() { return nullptr; };
 };
 
-NvmLeafIndex::NvmLeafIndex(const Options& options, const std::string& dbname) {
+NvmLeafIndex::NvmLeafIndex(const Options& options, const std::string& dbname,
+                           const LeafIndexValueMerger* merger)
+    : env_(options.env),
+      merger_(merger),
+      merged_cache_(merger != nullptr ? NewLRUCache(kMergedCacheSize)
+                                      : nullptr),
+      bg_cv_(&mutex_),
+      bg_compaction_scheduled_(false),
+      shutting_down_(false),
+      compaction_running_(false),
+      log_compactions_(0),
+      retired_images_(0),
+      last_sequence_(0) {
   cap_ = options.nvmleafindex_size;  // 10ul*1204ul*1024ul*1024ul;
+  // Two images share the space the single log used to own, so a
+  // compaction always has a spare region to write into.
+  region_size_ = (cap_ - 50 * MB) / 2;
   const char* filename = options.nvmleafindex_file;
   std::string recovery_file = dbname + "/leafindex_recovery";
   bool file_exist = access(recovery_file.c_str(), 0) == 0;
-  NvmManager* nvm_manager_ = new NvmManager(filename, cap_);
+  nvm_manager_ = new NvmManager(filename, cap_);
+  Nvmem* first = nvm_manager_->allocate(region_size_);
+  Nvmem* second = nvm_manager_->allocate(region_size_);
+  if (!file_exist) {
+    first->UpdateCounter(0);
+    first->UpdateEpoch(1);
+    second->UpdateCounter(0);
+    second->UpdateEpoch(0);
+  }
+  // The image with the newer epoch is current; a compaction that crashed
+  // before bumping its epoch left the other one unchanged.
+  if (first->GetEpoch() < second->GetEpoch()) std::swap(first, second);
+  delete second;
   const InternalKeyComparator internal_comparator_(
       leveldb::BytewiseComparator());
-  leaf_index_ = new LeafIndex(internal_comparator_, nullptr,
-                              nvm_manager_->allocate(cap_ - 50 * MB));
+  leaf_index_ = new LeafIndex(internal_comparator_, nullptr, first, merger_,
+                              merged_cache_);
   leaf_index_->Ref();
   if (file_exist) {
     //   printf("leaf_index_->Recovery May exists bug \n");
-    size_t seq;
+    SequenceNumber seq;
     leaf_index_->Recovery(seq);
+    last_sequence_ = seq;
     std::cout << "recovery_file: " << recovery_file << "\n";
     printf("#### NvmLeafIndex  Recovery  Size: %ld #####\n",
            leaf_index_->Size());
@@ -62,6 +153,8 @@ NvmLeafIndex::NvmLeafIndex(const Options& options, const std::string& dbname) {
     FILE* fd = fopen(recovery_file.c_str(), "w+");
     if (fd == NULL) {
       printf(" recovery_file err \n");
+    } else {
+      fclose(fd);
     }
     leaf_index_->ResetCounter();
     printf("#### Create NvmLeafIndex  #####\n");
@@ -69,37 +162,146 @@ NvmLeafIndex::NvmLeafIndex(const Options& options, const std::string& dbname) {
 }
 
 Status NvmLeafIndex::OpenNvmLeafIndex(const Options& options,
-                                      const std::string& name, DB** dbptr) {
-  *dbptr = new NvmLeafIndex(options, name);
+                                      const std::string& name, DB** dbptr,
+                                      const LeafIndexValueMerger* merger) {
+  *dbptr = new NvmLeafIndex(options, name, merger);
   return Status::OK();
 }
 
 const Snapshot* NvmLeafIndex::GetSnapshot() {
-  // printf("NvmLeafIndex::GetSnapshot not supported\n");
-  //  throw std::runtime_error("NvmLeafIndex::GetSnapshot not supported");
-  return nullptr;
+  // Taken under the writer lock so the index sees the new snapshot before
+  // the next Add() decides whether it may overwrite a version in place.
+  MutexLock l(&mutex_);
+  leaf_index_->SetNewestSnapshot(last_sequence_);
+  return snapshots_.New(last_sequence_);
 }
 
 void NvmLeafIndex::ReleaseSnapshot(const Snapshot* snapshot) {
-  // printf("NvmLeafIndex::ReleaseSnapshot not supported\n");
-
-  //  throw std::runtime_error("NvmLeafIndex::ReleaseSnapshot not supported");
+  MutexLock l(&mutex_);
+  snapshots_.Delete(static_cast<const SnapshotImpl*>(snapshot));
+  leaf_index_->SetNewestSnapshot(
+      snapshots_.empty() ? 0 : snapshots_.newest()->sequence_number());
 }
 
 NvmLeafIndex::~NvmLeafIndex() {
+  mutex_.Lock();
+  shutting_down_ = true;
+  while (bg_compaction_scheduled_) {
+    bg_cv_.Wait();
+  }
+  mutex_.Unlock();
   if (leaf_index_ != nullptr) {
     leaf_index_->Unref();
   }
+  delete merged_cache_;
+  delete nvm_manager_;
+}
+
+bool NvmLeafIndex::NeedsCompaction() {
+  size_t usage = leaf_index_->ApproximateMemoryUsage();
+  return usage > region_size_ * kCompactionUsageRatio &&
+         usage - leaf_index_->LiveBytes() > usage * kCompactionGarbageRatio;
+}
+
+void NvmLeafIndex::MaybeScheduleCompaction() {
+  mutex_.AssertHeld();
+  if (bg_compaction_scheduled_ || shutting_down_ || !NeedsCompaction()) {
+    return;
+  }
+  bg_compaction_scheduled_ = true;
+  env_->Schedule(&NvmLeafIndex::BGWork, this);
+}
+
+void NvmLeafIndex::BGWork(void* arg) {
+  NvmLeafIndex* index = reinterpret_cast<NvmLeafIndex*>(arg);
+  MutexLock l(&index->mutex_);
+  if (!index->shutting_down_ && index->NeedsCompaction()) {
+    index->CompactLog();
+  }
+  index->bg_compaction_scheduled_ = false;
+  index->bg_cv_.SignalAll();
+}
+
+bool NvmLeafIndex::CompactLog() {
+  mutex_.AssertHeld();
+  while (compaction_running_) {
+    bg_cv_.Wait();
+  }
+  // The previous image is only freed once its last reader is gone
+  Nvmem* region = nvm_manager_->TryAllocate(region_size_);
+  if (region == nullptr) {
+    return false;
+  }
+  compaction_running_ = true;
+  LeafIndex* old_index = leaf_index_;
+  const InternalKeyComparator internal_comparator_(
+      leveldb::BytewiseComparator());
+  LeafIndex* new_index =
+      new LeafIndex(internal_comparator_, nullptr, region, merger_,
+                    merged_cache_);
+  new_index->Ref();
+  new_index->ResetCounter();
+
+  // Writers go on appending to the old image during the copy.  The
+  // snapshot keeps them from overwriting the versions being copied.
+  const SequenceNumber copied = last_sequence_;
+  const SnapshotImpl* copy_snapshot = snapshots_.New(copied);
+  old_index->SetNewestSnapshot(copied);
+  new_index->SetNewestSnapshot(copied);
+  std::vector<SequenceNumber> snapshots;
+  snapshots_.GetAll(&snapshots);
+  mutex_.Unlock();
+  old_index->CopyLiveEntriesTo(new_index, copied, snapshots);
+  mutex_.Lock();
+
+  snapshots.clear();
+  snapshots_.GetAll(&snapshots);
+  new_index->SetNewestSnapshot(snapshots_.newest()->sequence_number());
+  old_index->CopyNewerEntriesTo(new_index, written_during_compaction_, copied,
+                                snapshots);
+  written_during_compaction_.clear();
+  snapshots_.Delete(copy_snapshot);
+  new_index->SetNewestSnapshot(
+      snapshots_.empty() ? 0 : snapshots_.newest()->sequence_number());
+  // Commit point: recovery now prefers the compacted image
+  new_index->SetEpoch(old_index->GetEpoch() + 1);
+  {
+    MutexLock l(&index_mutex_);
+    leaf_index_ = new_index;
+  }
+  if (!old_index->Unref()) {
+    ++retired_images_;
+  }
+  ++log_compactions_;
+  compaction_running_ = false;
+  bg_cv_.SignalAll();
+  return true;
 }
 
 Status NvmLeafIndex::Write(const WriteOptions& options, WriteBatch* my_batch) {
   // throw std::runtime_error("NvmLeafIndex::Write not supported");
-  if (leaf_index_->ApproximateMemoryUsage() > (cap_ - 100 * MB)) {
-    throw std::runtime_error("NvmLeafIndex out of memory\n");
+  MutexLock l(&mutex_);
+  const size_t limit =
+      region_size_ - std::min<size_t>(50 * MB, region_size_ / 4);
+  while (leaf_index_->ApproximateMemoryUsage() > limit) {
+    if (compaction_running_ || retired_images_ > 0) {
+      // The compaction in flight may make enough room, or the readers of
+      // the image before it are about to free the spare region
+      bg_cv_.Wait();
+      continue;
+    }
+    if (!CompactLog() || leaf_index_->ApproximateMemoryUsage() > limit) {
+      return Status::IOError("NvmLeafIndex out of space");
+    }
   }
-  mutex_.Lock();
+  WriteBatchInternal::SetSequence(my_batch, last_sequence_ + 1);
+  last_sequence_ += WriteBatchInternal::Count(my_batch);
   Status status = WriteBatchInternal::InsertInto(my_batch, leaf_index_);
-  mutex_.Unlock();
+  if (compaction_running_) {
+    KeyCollector collector(&written_during_compaction_);
+    my_batch->Iterate(&collector);
+  }
+  MaybeScheduleCompaction();
   return status;
 }
 
@@ -118,8 +320,12 @@ Status NvmLeafIndex::Get(const ReadOptions& options, const Slice& key,
                          std::string* value) {
   Status s;
   // printf("NvmLeafIndex::Get May Exist bug \n");
-  LookupKey lkey(key, 100000000000ul);
-  leaf_index_->Get(lkey, value, &s);
+  LookupKey lkey(key, SnapshotSequence(options));
+  LeafIndex* index = CurrentIndex();
+  if (!index->Get(lkey, value, &s)) {
+    s = Status::NotFound(Slice());
+  }
+  ReleaseIndex(index);
   return s;
 }
 
@@ -127,7 +333,29 @@ bool NvmLeafIndex::GetProperty(const Slice& property, std::string* value) {
   // throw std::runtime_error("NvmLeafIndex::GetProperty not supported");
   // printf("NvmLeafIndex::GetProperty not supported\n");
   char buf[1000];
-  snprintf(buf, sizeof(buf), "\n leafnode nums  %lu\n", leaf_index_->Size());
+  LeafIndex* index = CurrentIndex();
+  if (property == Slice("silkstore.leaf_index_memory")) {
+    snprintf(buf, sizeof(buf),
+             "leaf index dram bytes %lu\n"
+             "leaf index key bytes %lu (%lu stored)\n",
+             (unsigned long)index->DramUsage(),
+             (unsigned long)index->KeyBytes(),
+             (unsigned long)index->StoredKeyBytes());
+    ReleaseIndex(index);
+    value->append(buf);
+    return true;
+  }
+  uint64_t log_compactions;
+  {
+    MutexLock l(&mutex_);
+    log_compactions = log_compactions_;
+  }
+  snprintf(buf, sizeof(buf),
+           "\n leafnode nums  %lu\n log bytes %lu live bytes %lu "
+           "log compactions %lu\n",
+           index->Size(), index->ApproximateMemoryUsage(), index->LiveBytes(),
+           (unsigned long)log_compactions);
+  ReleaseIndex(index);
   value->append(buf);
   return true;
 }
@@ -136,7 +364,8 @@ void NvmLeafIndex::GetApproximateSizes(const Range* range, int n,
   throw std::runtime_error("NvmLeafIndex::GetApproximateSizes not supported");
 }
 void NvmLeafIndex::CompactRange(const Slice* begin, const Slice* end) {
-  throw std::runtime_error("NvmLeafIndex::CompactRange not supported");
+  MutexLock l(&mutex_);
+  CompactLog();
 }
 
 }  // namespace silkstore
@@ -1,10 +1,12 @@
 #ifndef STORAGE_LEVELDB_INCLUDE_NVM_LEAF_INDEX_H_
 #define STORAGE_LEVELDB_INCLUDE_NVM_LEAF_INDEX_H_
 
+#include "db/snapshot.h"
 #include "db/write_batch_internal.h"
 #include <cstdint>
 #include <cstdio>
 #include <map>
+#include <set>
 #include <string>
 #include "leveldb/db.h"
 #include "leveldb/iterator.h"
@@ -29,10 +31,14 @@ class NvmLeafIndex : public DB {
   // OK on success.
   // Stores nullptr in *dbptr and returns a non-OK status on error.
   // Caller should delete *dbptr when it is no longer needed.
+  //
+  // If "merger" is not null, values it reports as deltas are logged as
+  // deltas against the key's previous value.  It must outlive the index.
   static Status OpenNvmLeafIndex(const Options& options,
-                                 const std::string& name, DB** dbptr);
-  NvmLeafIndex(const Options& options, const std::string& dbname);
-  NvmLeafIndex() = default;
+                                 const std::string& name, DB** dbptr,
+                                 const LeafIndexValueMerger* merger = nullptr);
+  NvmLeafIndex(const Options& options, const std::string& dbname,
+               const LeafIndexValueMerger* merger = nullptr);
   NvmLeafIndex(const NvmLeafIndex&) = delete;
   NvmLeafIndex& operator=(const NvmLeafIndex&) = delete;
 
@@ -53,6 +59,9 @@ class NvmLeafIndex : public DB {
   // Apply the specified updates to the database.
   // Returns OK on success, non-OK on failure.
   // Note: consider setting options.sync = true.
+  //
+  // When the log is full and the image before the last compaction is still
+  // pinned, e.g. by an open iterator, this waits until it is released.
   virtual Status Write(const WriteOptions& options, WriteBatch* updates);
 
   // If the database contains an entry for "key" store the
@@ -77,6 +86,9 @@ class NvmLeafIndex : public DB {
   // this handle will all observe a stable snapshot of the current DB
   // state.  The caller must call ReleaseSnapshot(result) when the
   // snapshot is no longer needed.
+  //
+  // Leaf index snapshots use the index's own sequence numbers, which
+  // Write() assigns; they are unrelated to SilkStore sequence numbers.
   virtual const Snapshot* GetSnapshot();
 
   // Release a previously acquired snapshot.  The caller must not
@@ -120,12 +132,60 @@ class NvmLeafIndex : public DB {
   // end==nullptr is treated as a key after all keys in the database.
   // Therefore the following call will compact the entire database:
   //    db->CompactRange(nullptr, nullptr);
+  //
+  // NvmLeafIndex ignores the range and rewrites the live entries of the
+  // whole index log into a fresh NVM region.
   virtual void CompactRange(const Slice* begin, const Slice* end);
 
  private:
+  // Returns the current index with a reference the caller must drop with
+  // ReleaseIndex().
+  LeafIndex* CurrentIndex();
+  // Drops a reference CurrentIndex() returned.  Wakes up writers waiting
+  // for the region of a retired image when it was the last one.
+  void ReleaseIndex(LeafIndex* index);
+  static void ReleaseIndexCleanup(void* index, void* db);
+
+  // True when enough of the log is garbage for a compaction to pay off.
+  bool NeedsCompaction();
+  void MaybeScheduleCompaction() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  static void BGWork(void* arg);
+  // Copies live entries into the spare region, bumps its epoch and swaps
+  // it in.  Returns false if the spare region is still pinned by readers
+  // of the image before the last compaction, see retired_images_.  mutex_
+  // is released while the entries are copied, so writers only wait for the
+  // records they appended meanwhile to be copied and for the swap.
+  bool CompactLog() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  Env* const env_;
+  const LeafIndexValueMerger* const merger_;
+  // Full values rebuilt from delta chains, shared by all images; null
+  // without a merger
+  Cache* const merged_cache_;
   size_t cap_;
-  LeafIndex* leaf_index_;
+  // Each of the two index images gets a region of this many bytes
+  size_t region_size_;
+  NvmManager* nvm_manager_;
+  // Serializes writers and log compactions; readers never take it
   port::Mutex mutex_;
+  port::CondVar bg_cv_ GUARDED_BY(mutex_);
+  bool bg_compaction_scheduled_ GUARDED_BY(mutex_);
+  bool shutting_down_ GUARDED_BY(mutex_);
+  // A CompactLog() is copying the index
+  bool compaction_running_ GUARDED_BY(mutex_);
+  // Keys written while compaction_running_, copied again before the swap
+  std::set<std::string> written_during_compaction_ GUARDED_BY(mutex_);
+  uint64_t log_compactions_ GUARDED_BY(mutex_);
+  // Images swapped out by a compaction that still have readers, e.g. an
+  // open iterator, so their regions cannot be compacted into yet.  Writers
+  // that run out of space wait on bg_cv_ until the last reader is gone.
+  int retired_images_ GUARDED_BY(mutex_);
+  // Sequence of the last entry written to the index
+  SequenceNumber last_sequence_ GUARDED_BY(mutex_);
+  SnapshotList snapshots_ GUARDED_BY(mutex_);
+  // Protects the leaf_index_ pointer so readers can Ref() it safely
+  port::Mutex index_mutex_;
+  LeafIndex* leaf_index_;
 };
 
 }  // namespace silkstore
@@ -1,5 +1,11 @@
 #include "nvm/nvmleafindex.h"
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "leveldb/env.h"
+
 class Random {
  private:
   uint32_t seed_;
@@ -625,10 +631,584 @@ void Recovey() {
   std::cout << "kNumOps: " << kNumOps << " count " << count << "\n";
 }
 
+// Readers run Get and full scans while a single writer keeps overwriting and
+// deleting keys.  Every value a reader sees must belong to the key it was
+// returned for, and scans must stay sorted in both directions.
+void ConcurrentReadWrite() {
+  leveldb::DB* db_ = nullptr;
+  leveldb::Status s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(
+      leveldb::Options(), "./nvm_leaf_concurrent_test", &db_);
+  assert(s.ok() == true);
+  std::cout << " ######### ConcurrentReadWrite Test ######## \n";
+  static const int kNumKVs = 200;
+  static const int kNumOps = 5000;
+  static const int kNumReaders = 4;
+
+  std::atomic<bool> done(false);
+  std::atomic<int> errors(0);
+  auto reader = [&]() {
+    while (!done.load(std::memory_order_acquire)) {
+      leveldb::Iterator* it = db_->NewIterator(leveldb::ReadOptions());
+      std::string prev;
+      for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        std::string k = it->key().ToString();
+        if (!prev.empty() && k <= prev) errors++;
+        if (!it->value().starts_with(k)) errors++;
+        prev = k;
+      }
+      prev.clear();
+      for (it->SeekToLast(); it->Valid(); it->Prev()) {
+        std::string k = it->key().ToString();
+        if (!prev.empty() && k >= prev) errors++;
+        prev = k;
+      }
+      delete it;
+      std::string key = std::to_string(1000 + rand() % kNumKVs);
+      std::string res;
+      s = db_->Get(leveldb::ReadOptions(), key, &res);
+      // Missing keys come back OK with an empty value
+      if (!res.empty() && res.compare(0, key.size(), key) != 0) errors++;
+    }
+  };
+  std::vector<std::thread> readers;
+  for (int i = 0; i < kNumReaders; i++) readers.emplace_back(reader);
+
+  std::map<std::string, std::string> m;
+  leveldb::WriteBatch batch;
+  for (int i = 0; i < kNumOps; i++) {
+    std::string key = std::to_string(1000 + i % kNumKVs);
+    if (i % 7 == 0) {
+      batch.Delete(key);
+      m.erase(key);
+    } else {
+      std::string value = key + "_" + std::to_string(i);
+      batch.Put(key, value);
+      m[key] = value;
+    }
+    db_->Write(leveldb::WriteOptions(), &batch);
+    batch.Clear();
+  }
+  done.store(true, std::memory_order_release);
+  for (auto& t : readers) t.join();
+
+  leveldb::Iterator* it = db_->NewIterator(leveldb::ReadOptions());
+  auto mit = m.begin();
+  for (it->SeekToFirst(); it->Valid(); it->Next(), ++mit) {
+    if (mit == m.end() || it->key() != mit->first ||
+        it->value() != mit->second) {
+      errors++;
+      break;
+    }
+  }
+  if (mit != m.end()) errors++;
+  delete it;
+  delete db_;
+  if (errors.load() != 0) {
+    fprintf(stderr, "ConcurrentReadWrite saw %d errors\n", errors.load());
+    return;
+  }
+  std::cout << " @@@@@@@@@ PASS #########\n";
+}
+
+// Overwrites a small key set until the index log is mostly garbage, then
+// compacts it, keeps writing and reopens.  Recovery must rebuild the index
+// from the compacted image plus the records appended after it.
+void LogCompaction() {
+  const std::string dbname = "./nvm_leaf_compaction_test";
+  leveldb::Env::Default()->CreateDir(dbname);
+  leveldb::Env::Default()->DeleteFile(dbname + "/leafindex_recovery");
+  leveldb::DB* db_ = nullptr;
+  leveldb::Status s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(
+      leveldb::Options(), dbname, &db_);
+  assert(s.ok() == true);
+  std::cout << " ######### LogCompaction Test ######## \n";
+  static const int kNumKVs = 100;
+  static const int kNumOps = 20000;
+
+  std::map<std::string, std::string> m;
+  leveldb::WriteBatch batch;
+  auto write = [&](int i) {
+    std::string key = std::to_string(1000 + i % kNumKVs);
+    if (i % 11 == 0) {
+      batch.Delete(key);
+      m.erase(key);
+    } else {
+      std::string value = key + "_" + std::to_string(i);
+      batch.Put(key, value);
+      m[key] = value;
+    }
+    db_->Write(leveldb::WriteOptions(), &batch);
+    batch.Clear();
+  };
+  auto verify = [&]() {
+    leveldb::Iterator* it = db_->NewIterator(leveldb::ReadOptions());
+    auto mit = m.begin();
+    bool ok = true;
+    for (it->SeekToFirst(); it->Valid(); it->Next(), ++mit) {
+      if (mit == m.end() || it->key() != mit->first ||
+          it->value() != mit->second) {
+        ok = false;
+        break;
+      }
+    }
+    delete it;
+    return ok && mit == m.end();
+  };
+
+  for (int i = 0; i < kNumOps; i++) write(i);
+  // An open iterator pins the old image across the compaction
+  leveldb::Iterator* pinned = db_->NewIterator(leveldb::ReadOptions());
+  pinned->SeekToFirst();
+  db_->CompactRange(nullptr, nullptr);
+  std::string before = pinned->key().ToString();
+  delete pinned;
+  if (!verify() || before != m.begin()->first) {
+    fprintf(stderr, "LogCompaction lost entries after compaction\n");
+    return;
+  }
+  std::string stats;
+  db_->GetProperty("", &stats);
+  std::cout << stats;
+
+  for (int i = kNumOps; i < kNumOps + 500; i++) write(i);
+  delete db_;
+
+  s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(leveldb::Options(),
+                                                         dbname, &db_);
+  assert(s.ok() == true);
+  if (!verify()) {
+    fprintf(stderr, "LogCompaction lost entries after recovery\n");
+    delete db_;
+    return;
+  }
+  delete db_;
+  std::cout << " @@@@@@@@@ PASS #########\n";
+}
+
+// Holds an iterator across two log compactions.  The first one retires
+// the image the iterator reads; the second one needs its region, so the
+// writer that fills up the log must wait for the iterator instead of
+// failing.
+void PinnedLogCompaction() {
+  const std::string dbname = "./nvm_leaf_pinned_compaction_test";
+  leveldb::Env::Default()->CreateDir(dbname);
+  leveldb::Env::Default()->DeleteFile(dbname + "/leafindex_recovery");
+  leveldb::Options options;
+  options.nvmleafindex_file = "/mnt/NVMSilkstore/nvm_leaf_pinned_test";
+  options.nvmleafindex_size = 200 << 20;
+  leveldb::DB* db_ = nullptr;
+  leveldb::Status s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(
+      options, dbname, &db_);
+  assert(s.ok() == true);
+  std::cout << " ######### PinnedLogCompaction Test ######## \n";
+  static const int kNumKVs = 100;
+  // Several times the log, so it fills up while the iterator is open
+  static const int kNumOps = 40000;
+  static const int kValueSize = 4000;
+
+  std::map<std::string, std::string> m;
+  leveldb::WriteBatch batch;
+  for (int i = 0; i < kNumKVs; i++) {
+    std::string key = std::to_string(1000 + i);
+    batch.Put(key, key);
+    m[key] = key;
+  }
+  db_->Write(leveldb::WriteOptions(), &batch);
+  batch.Clear();
+  const std::map<std::string, std::string> pinned_contents = m;
+  leveldb::Iterator* pinned = db_->NewIterator(leveldb::ReadOptions());
+  pinned->SeekToFirst();
+  db_->CompactRange(nullptr, nullptr);
+
+  std::atomic<int> progress(0);
+  std::atomic<bool> done(false);
+  std::atomic<int> errors(0);
+  std::thread writer([&]() {
+    leveldb::WriteBatch batch;
+    Random rnd(301);
+    for (int i = 0; i < kNumOps; i++) {
+      std::string key = std::to_string(1000 + i % kNumKVs);
+      std::string value = key + "_" + RandomString(&rnd, kValueSize);
+      batch.Put(key, value);
+      m[key] = value;
+      if (!db_->Write(leveldb::WriteOptions(), &batch).ok()) errors++;
+      batch.Clear();
+      progress++;
+    }
+    done.store(true, std::memory_order_release);
+  });
+  // Keep the iterator until the writer stalls on the full log
+  int last = -1;
+  while (!done.load(std::memory_order_acquire) && progress.load() != last) {
+    last = progress.load();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+  bool pinned_ok = !done.load(std::memory_order_acquire);
+  auto mit = pinned_contents.begin();
+  for (; pinned->Valid(); pinned->Next(), ++mit) {
+    if (mit == pinned_contents.end() || pinned->key() != mit->first ||
+        pinned->value() != mit->second) {
+      pinned_ok = false;
+      break;
+    }
+  }
+  pinned_ok = pinned_ok && mit == pinned_contents.end();
+  delete pinned;
+  writer.join();
+
+  std::string stats;
+  db_->GetProperty("", &stats);
+  std::cout << stats;
+  leveldb::Iterator* it = db_->NewIterator(leveldb::ReadOptions());
+  mit = m.begin();
+  for (it->SeekToFirst(); it->Valid(); it->Next(), ++mit) {
+    if (mit == m.end() || it->key() != mit->first ||
+        it->value() != mit->second) {
+      errors++;
+      break;
+    }
+  }
+  if (mit != m.end()) errors++;
+  delete it;
+  delete db_;
+  if (!pinned_ok || errors.load() != 0 ||
+      stats.find("log compactions 1\n") != std::string::npos) {
+    fprintf(stderr, "PinnedLogCompaction saw %d errors, pinned %s\n%s",
+            errors.load(), pinned_ok ? "ok" : "broken", stats.c_str());
+    return;
+  }
+  std::cout << " @@@@@@@@@ PASS #########\n";
+}
+
+// Compacts the log repeatedly while a writer overwrites and deletes keys.
+// Writes made during a compaction must reach the compacted image, also
+// after a reopen.
+void CompactionDuringWrites() {
+  const std::string dbname = "./nvm_leaf_online_compaction_test";
+  leveldb::Env::Default()->CreateDir(dbname);
+  leveldb::Env::Default()->DeleteFile(dbname + "/leafindex_recovery");
+  leveldb::DB* db_ = nullptr;
+  leveldb::Status s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(
+      leveldb::Options(), dbname, &db_);
+  assert(s.ok() == true);
+  std::cout << " ######### CompactionDuringWrites Test ######## \n";
+  static const int kNumKVs = 2000;
+  static const int kNumOps = 40000;
+
+  std::map<std::string, std::string> m;
+  std::atomic<bool> done(false);
+  std::atomic<int> errors(0);
+  std::thread writer([&]() {
+    leveldb::WriteBatch batch;
+    for (int i = 0; i < kNumOps; i++) {
+      std::string key = std::to_string(10000 + i % kNumKVs);
+      if (i % 13 == 0) {
+        batch.Delete(key);
+        m.erase(key);
+      } else {
+        std::string value = key + "_" + std::to_string(i);
+        batch.Put(key, value);
+        m[key] = value;
+      }
+      if (!db_->Write(leveldb::WriteOptions(), &batch).ok()) errors++;
+      batch.Clear();
+    }
+    done.store(true, std::memory_order_release);
+  });
+  while (!done.load(std::memory_order_acquire)) {
+    db_->CompactRange(nullptr, nullptr);
+  }
+  writer.join();
+
+  auto verify = [&]() {
+    leveldb::Iterator* it = db_->NewIterator(leveldb::ReadOptions());
+    auto mit = m.begin();
+    bool ok = true;
+    for (it->SeekToFirst(); it->Valid(); it->Next(), ++mit) {
+      if (mit == m.end() || it->key() != mit->first ||
+          it->value() != mit->second) {
+        ok = false;
+        break;
+      }
+    }
+    delete it;
+    return ok && mit == m.end();
+  };
+  if (!verify()) errors++;
+  delete db_;
+  s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(leveldb::Options(),
+                                                         dbname, &db_);
+  assert(s.ok() == true);
+  if (!verify()) errors++;
+  delete db_;
+  if (errors.load() != 0) {
+    fprintf(stderr, "CompactionDuringWrites saw %d errors\n", errors.load());
+    return;
+  }
+  std::cout << " @@@@@@@@@ PASS #########\n";
+}
+
+// A snapshot keeps seeing the entries it was taken on while later writes
+// overwrite and delete them, also across a log compaction.
+void Snapshots() {
+  leveldb::DB* db_ = nullptr;
+  leveldb::Status s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(
+      leveldb::Options(), "./nvm_leaf_snapshot_test", &db_);
+  assert(s.ok() == true);
+  std::cout << " ######### Snapshots Test ######## \n";
+  static const int kNumKVs = 50;
+
+  leveldb::WriteBatch batch;
+  std::map<std::string, std::string> old_m, new_m;
+  for (int i = 0; i < kNumKVs; i++) {
+    std::string key = std::to_string(1000 + i);
+    batch.Put(key, key + "_old");
+    old_m[key] = key + "_old";
+  }
+  db_->Write(leveldb::WriteOptions(), &batch);
+  batch.Clear();
+
+  const leveldb::Snapshot* snap = db_->GetSnapshot();
+  for (int i = 0; i < kNumKVs; i++) {
+    std::string key = std::to_string(1000 + i);
+    if (i % 3 == 0) {
+      batch.Delete(key);
+    } else {
+      batch.Put(key, key + "_new");
+      new_m[key] = key + "_new";
+    }
+    db_->Write(leveldb::WriteOptions(), &batch);
+    batch.Clear();
+  }
+  batch.Put("0999", "added");
+  new_m["0999"] = "added";
+  db_->Write(leveldb::WriteOptions(), &batch);
+  batch.Clear();
+
+  leveldb::ReadOptions snap_options;
+  snap_options.snapshot = snap;
+  auto matches = [&](const leveldb::ReadOptions& options,
+                     const std::map<std::string, std::string>& m) {
+    leveldb::Iterator* it = db_->NewIterator(options);
+    auto mit = m.begin();
+    bool ok = true;
+    for (it->SeekToFirst(); it->Valid(); it->Next(), ++mit) {
+      if (mit == m.end() || it->key() != mit->first ||
+          it->value() != mit->second) {
+        ok = false;
+        break;
+      }
+    }
+    delete it;
+    for (auto& kv : m) {
+      std::string res;
+      db_->Get(options, kv.first, &res);
+      if (res != kv.second) ok = false;
+    }
+    return ok && mit == m.end();
+  };
+
+  int errors = 0;
+  if (!matches(snap_options, old_m)) errors++;
+  if (!matches(leveldb::ReadOptions(), new_m)) errors++;
+  db_->CompactRange(nullptr, nullptr);
+  if (!matches(snap_options, old_m)) errors++;
+  if (!matches(leveldb::ReadOptions(), new_m)) errors++;
+  db_->ReleaseSnapshot(snap);
+  db_->CompactRange(nullptr, nullptr);
+  if (!matches(leveldb::ReadOptions(), new_m)) errors++;
+  delete db_;
+  if (errors != 0) {
+    fprintf(stderr, "Snapshots saw %d errors\n", errors);
+    return;
+  }
+  std::cout << " @@@@@@@@@ PASS #########\n";
+}
+
+// Values starting with '+' are deltas that append the rest of the value.
+class AppendMerger : public leveldb::LeafIndexValueMerger {
+ public:
+  bool IsDelta(const leveldb::Slice& value) const override {
+    return !value.empty() && value[0] == '+';
+  }
+  void Merge(const leveldb::Slice& base,
+             const std::vector<leveldb::Slice>& deltas,
+             std::string* result) const override {
+    result->assign(base.data(), base.size());
+    for (const leveldb::Slice& d : deltas) {
+      result->append(d.data() + 1, d.size() - 1);
+    }
+  }
+};
+
+// Delta values are merged into the key's value on reads, across chain
+// consolidation, log compaction and recovery.
+void DeltaAppend() {
+  const std::string dbname = "./nvm_leaf_delta_test";
+  leveldb::Env::Default()->CreateDir(dbname);
+  leveldb::Env::Default()->DeleteFile(dbname + "/leafindex_recovery");
+  AppendMerger merger;
+  leveldb::DB* db_ = nullptr;
+  leveldb::Status s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(
+      leveldb::Options(), dbname, &db_, &merger);
+  assert(s.ok() == true);
+  std::cout << " ######### DeltaAppend Test ######## \n";
+  static const int kNumKVs = 20;
+  static const int kNumRounds = 3 * leveldb::LeafIndex::kMaxDeltaChain + 1;
+
+  std::map<std::string, std::string> m;
+  leveldb::WriteBatch batch;
+  for (int r = 0; r < kNumRounds; r++) {
+    for (int i = 0; i < kNumKVs; i++) {
+      std::string key = std::to_string(1000 + i);
+      std::string piece = std::to_string(r) + ",";
+      if (r == 0 && i % 2 == 0) {
+        // Half of the keys start without a base value
+        batch.Put(key, piece);
+      } else {
+        batch.Put(key, "+" + piece);
+      }
+      m[key] += piece;
+      if (i == 7 && r == kNumRounds / 2) {
+        batch.Delete(key);
+        m.erase(key);
+      }
+    }
+    db_->Write(leveldb::WriteOptions(), &batch);
+    batch.Clear();
+  }
+
+  auto matches = [&]() {
+    leveldb::Iterator* it = db_->NewIterator(leveldb::ReadOptions());
+    auto mit = m.begin();
+    bool ok = true;
+    for (it->SeekToFirst(); it->Valid(); it->Next(), ++mit) {
+      if (mit == m.end() || it->key() != mit->first ||
+          it->value() != mit->second) {
+        ok = false;
+        break;
+      }
+    }
+    delete it;
+    for (auto& kv : m) {
+      std::string res;
+      db_->Get(leveldb::ReadOptions(), kv.first, &res);
+      if (res != kv.second) ok = false;
+    }
+    return ok && mit == m.end();
+  };
+
+  int errors = 0;
+  if (!matches()) errors++;
+  db_->CompactRange(nullptr, nullptr);
+  if (!matches()) errors++;
+  delete db_;
+  s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(
+      leveldb::Options(), dbname, &db_, &merger);
+  assert(s.ok() == true);
+  if (!matches()) errors++;
+  delete db_;
+  if (errors != 0) {
+    fprintf(stderr, "DeltaAppend saw %d errors\n", errors);
+    return;
+  }
+  std::cout << " @@@@@@@@@ PASS #########\n";
+}
+
+// Keys with long common prefixes are front coded in the index; order,
+// seeks and lookups must be unaffected.
+void SharedPrefixKeys() {
+  const std::string dbname = "./nvm_leaf_prefix_test";
+  leveldb::Env::Default()->CreateDir(dbname);
+  leveldb::Env::Default()->DeleteFile(dbname + "/leafindex_recovery");
+  leveldb::DB* db_ = nullptr;
+  leveldb::Status s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(
+      leveldb::Options(), dbname, &db_);
+  assert(s.ok() == true);
+  std::cout << " ######### SharedPrefixKeys Test ######## \n";
+  static const int kNumKVs = 2000;
+
+  std::map<std::string, std::string> m;
+  leveldb::WriteBatch batch;
+  Random rnd(301);
+  for (int i = 0; i < kNumKVs; i++) {
+    // A few distinct prefixes, inserted in random order
+    char key[100];
+    snprintf(key, sizeof(key), "user_table_%d_row_%08u", i % 3,
+             rnd.Uniform(1000000));
+    batch.Put(key, std::to_string(i));
+    m[key] = std::to_string(i);
+    db_->Write(leveldb::WriteOptions(), &batch);
+    batch.Clear();
+  }
+  // Shorter and longer keys around the shared prefixes
+  for (const char* key : {"user", "user_table_1", "user_table_1_row_9",
+                          "user_table_2_row_00000000_x", "zz"}) {
+    batch.Put(key, key);
+    m[key] = key;
+  }
+  db_->Write(leveldb::WriteOptions(), &batch);
+  batch.Clear();
+
+  auto matches = [&]() {
+    leveldb::Iterator* it = db_->NewIterator(leveldb::ReadOptions());
+    auto mit = m.begin();
+    bool ok = true;
+    for (it->SeekToFirst(); it->Valid(); it->Next(), ++mit) {
+      if (mit == m.end() || it->key() != mit->first ||
+          it->value() != mit->second) {
+        ok = false;
+        break;
+      }
+    }
+    ok = ok && mit == m.end();
+    for (auto& kv : m) {
+      std::string res;
+      db_->Get(leveldb::ReadOptions(), kv.first, &res);
+      if (res != kv.second) ok = false;
+      // Seeking just past a key lands on its successor
+      it->Seek(kv.first + '\0');
+      auto next = m.upper_bound(kv.first);
+      if (next == m.end() ? it->Valid()
+                          : (!it->Valid() || it->key() != next->first)) {
+        ok = false;
+      }
+    }
+    delete it;
+    return ok;
+  };
+
+  int errors = 0;
+  if (!matches()) errors++;
+  std::string memory;
+  db_->GetProperty("silkstore.leaf_index_memory", &memory);
+  std::cout << memory;
+  db_->CompactRange(nullptr, nullptr);
+  if (!matches()) errors++;
+  delete db_;
+  s = leveldb::silkstore::NvmLeafIndex::OpenNvmLeafIndex(leveldb::Options(),
+                                                         dbname, &db_);
+  assert(s.ok() == true);
+  if (!matches()) errors++;
+  delete db_;
+  if (errors != 0) {
+    fprintf(stderr, "SharedPrefixKeys saw %d errors\n", errors);
+    return;
+  }
+  std::cout << " @@@@@@@@@ PASS #########\n";
+}
+
 int main(int argc, char const* argv[]) {
   // IterTest();
   // EmptyIter();
   Recovey();
+  ConcurrentReadWrite();
+  LogCompaction();
+  PinnedLogCompaction();
+  CompactionDuringWrites();
+  Snapshots();
+  DeltaAppend();
+  SharedPrefixKeys();
   // WriteBatchTest();
   // SequentialWrite();
 
@@ -1,6 +1,8 @@
 
 #include "nvm/nvmmanager.h"
 
+#include <algorithm>
+
 namespace leveldb {
 namespace silkstore {
 
@@ -38,7 +40,30 @@ Nvmem* NvmManager::reallocate(size_t offset, size_t cap) {
   return new Nvmem(data_ + offset, cap, this);
 }
 
-Nvmem* NvmManager::allocate(size_t size) {
+bool NvmManager::Overlaps(size_t offset, size_t size) const {
+  for (const auto& used : memUsage) {
+    if (offset < used.first + used.second && used.first < offset + size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool NvmManager::FindFreeRange(size_t size, size_t* offset) const {
+  std::vector<std::pair<size_t, size_t>> used(memUsage.begin(),
+                                              memUsage.end());
+  std::sort(used.begin(), used.end());
+  size_t start = logCap_;
+  for (const auto& range : used) {
+    if (range.first >= start + size) break;
+    start = std::max(start, range.first + range.second);
+  }
+  if (start + size > cap_) return false;
+  *offset = start;
+  return true;
+}
+
+Nvmem* NvmManager::TryAllocate(size_t size) {
   std::lock_guard<std::mutex> lk(mtx);
 
   if (index_ + size >= cap_) {
@@ -47,10 +72,10 @@ Nvmem* NvmManager::allocate(size_t size) {
     fprintf(stdout, "########## NvmManager Reset  ###########\n");
     fprintf(stdout, "########## $$$$$$$$$$$$$$$$  ###########\n");
   }
-  if (memUsage.size() != 0 && index_ < memUsage.front().first &&
-      index_ + size > memUsage.front().first) {
-    fprintf(stderr, "NvmManager is out can't allocate nvmem \n");
-    assert(false);
+  // Regions are not always freed in allocation order, so fall back to the
+  // first hole that fits when the ring position is still in use.
+  if (Overlaps(index_, size) && !FindFreeRange(size, &index_)) {
+    return nullptr;
   }
   Nvmem* nvm = new Nvmem(data_ + index_, size, this);
   memUsage.emplace_back(index_, size);
@@ -58,6 +83,15 @@ Nvmem* NvmManager::allocate(size_t size) {
   return nvm;
 }
 
+Nvmem* NvmManager::allocate(size_t size) {
+  Nvmem* nvm = TryAllocate(size);
+  if (nvm == nullptr) {
+    fprintf(stderr, "NvmManager is out can't allocate nvmem \n");
+    assert(false);
+  }
+  return nvm;
+}
+
 std::string NvmManager::getNvmInfo() {
   std::string info;
   info += std::to_string(index_) + ",";
@@ -22,6 +22,10 @@ class NvmManager {
   std::deque<std::pair<size_t, size_t>> memUsage;
   std::mutex mtx;
   void init();
+  // Returns true iff [offset, offset + size) intersects an allocated region.
+  bool Overlaps(size_t offset, size_t size) const;
+  // Lowest offset at or after logCap_ with "size" free bytes.
+  bool FindFreeRange(size_t size, size_t* offset) const;
 
  public:
   NvmManager();
@@ -29,6 +33,9 @@ class NvmManager {
   ~NvmManager();
   // allocate new nvmem
   Nvmem* allocate(size_t cap = 30 * MB);
+  // Same as allocate(), but returns nullptr instead of failing when no free
+  // range of "cap" bytes exists.
+  Nvmem* TryAllocate(size_t cap);
   // using to recovery nvm table
   Nvmem* reallocate(size_t offset, size_t cap);
   std::string getNvmInfo();
@@ -0,0 +1,175 @@
+#include "silkstore/background_scheduler.h"
+
+#include <memory>
+
+namespace leveldb {
+namespace silkstore {
+
+const char* BackgroundPriorityName(BackgroundPriority pri) {
+  switch (pri) {
+    case kFlushPriority:
+      return "flush";
+    case kSplitPriority:
+      return "split";
+    case kGCPriority:
+      return "gc";
+    case kReadOptPriority:
+      return "read_opt";
+    default:
+      return "unknown";
+  }
+}
+
+// State shared by RunParallel and the work items it queues.  Each call
+// of the user's work is claimed exactly once, by a worker or by the
+// thread that called RunParallel.
+struct BackgroundScheduler::ParallelRun {
+  std::mutex mutex;
+  std::condition_variable done_cv;
+  std::vector<bool> claimed;
+  int running = 0;  // calls claimed by workers and not finished yet
+  const std::function<void(int)>* work;
+
+  ParallelRun(int parallelism, const std::function<void(int)>* work)
+      : claimed(parallelism, false), work(work) {}
+
+  bool Claim(int i, bool by_worker) {
+    std::lock_guard<std::mutex> l(mutex);
+    if (claimed[i]) return false;
+    claimed[i] = true;
+    if (by_worker) ++running;
+    return true;
+  }
+
+  void Finish() {
+    std::lock_guard<std::mutex> l(mutex);
+    if (--running == 0) done_cv.notify_all();
+  }
+
+  void WaitForWorkers() {
+    std::unique_lock<std::mutex> l(mutex);
+    done_cv.wait(l, [this]() { return running == 0; });
+  }
+};
+
+BackgroundScheduler::BackgroundScheduler(int num_threads)
+    : shutting_down_(false) {
+  for (int pri = 0; pri < kNumBackgroundPriorities; ++pri) {
+    delayed_depth_[pri] = 0;
+  }
+  if (num_threads < 1) num_threads = 1;
+  threads_.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(&BackgroundScheduler::WorkerMain, this);
+  }
+}
+
+BackgroundScheduler::~BackgroundScheduler() {
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    shutting_down_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void BackgroundScheduler::Schedule(BackgroundPriority pri,
+                                   std::function<void()> work) {
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    queues_[pri].push_back(std::move(work));
+  }
+  work_cv_.notify_one();
+}
+
+void BackgroundScheduler::ScheduleDelayed(BackgroundPriority pri,
+                                          std::function<void()> work,
+                                          uint64_t delay_micros) {
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    delayed_.push(DelayedWork{
+        Clock::now() + std::chrono::microseconds(delay_micros), pri,
+        std::move(work)});
+    ++delayed_depth_[pri];
+  }
+  // A worker may be sleeping until a later deadline
+  work_cv_.notify_one();
+}
+
+void BackgroundScheduler::RunParallel(BackgroundPriority pri, int parallelism,
+                                      const std::function<void(int)>& work) {
+  if (parallelism <= 1) {
+    work(0);
+    return;
+  }
+  auto run = std::make_shared<ParallelRun>(parallelism, &work);
+  for (int i = 1; i < parallelism; ++i) {
+    Schedule(pri, [run, i]() {
+      if (run->Claim(i, true)) {
+        (*run->work)(i);
+        run->Finish();
+      }
+    });
+  }
+  work(0);
+  for (int i = 1; i < parallelism; ++i) {
+    if (run->Claim(i, false)) work(i);
+  }
+  run->WaitForWorkers();
+}
+
+size_t BackgroundScheduler::QueueDepth(BackgroundPriority pri) {
+  std::lock_guard<std::mutex> l(mutex_);
+  return queues_[pri].size() + delayed_depth_[pri];
+}
+
+std::string BackgroundScheduler::QueueDepthString() {
+  std::string result;
+  for (int pri = 0; pri < kNumBackgroundPriorities; ++pri) {
+    BackgroundPriority p = static_cast<BackgroundPriority>(pri);
+    result.append(BackgroundPriorityName(p));
+    result.append(" ");
+    result.append(std::to_string(QueueDepth(p)));
+    result.append("\n");
+  }
+  return result;
+}
+
+void BackgroundScheduler::WorkerMain() {
+  std::unique_lock<std::mutex> l(mutex_);
+  while (!shutting_down_) {
+    // Move delayed work that is due to its queue
+    const Clock::time_point now = Clock::now();
+    while (!delayed_.empty() && delayed_.top().due <= now) {
+      const DelayedWork& top = delayed_.top();
+      --delayed_depth_[top.pri];
+      queues_[top.pri].push_back(top.work);
+      delayed_.pop();
+    }
+
+    int pri = 0;
+    while (pri < kNumBackgroundPriorities && queues_[pri].empty()) ++pri;
+    if (pri == kNumBackgroundPriorities) {
+      if (delayed_.empty()) {
+        work_cv_.wait(l);
+      } else {
+        const Clock::time_point due = delayed_.top().due;
+        work_cv_.wait_until(l, due);
+      }
+      continue;
+    }
+
+    std::function<void()> work = std::move(queues_[pri].front());
+    queues_[pri].pop_front();
+    l.unlock();
+    work();
+    // Release what the work captured before taking the lock again
+    work = nullptr;
+    l.lock();
+  }
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
@@ -0,0 +1,97 @@
+#ifndef STORAGE_LEVELDB_SILKSTORE_BACKGROUND_SCHEDULER_H_
+#define STORAGE_LEVELDB_SILKSTORE_BACKGROUND_SCHEDULER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace leveldb {
+namespace silkstore {
+
+// Classes of background work, most urgent first.  A worker always takes
+// the oldest queued work of the most urgent class.
+enum BackgroundPriority {
+  kFlushPriority = 0,
+  kSplitPriority,
+  kGCPriority,
+  kReadOptPriority,
+  kNumBackgroundPriorities
+};
+
+const char* BackgroundPriorityName(BackgroundPriority pri);
+
+// A fixed pool of worker threads owned by one SilkStore.  Flushes, leaf
+// splits, garbage collection and leaf optimization all run on it, so no
+// thread is created per task and urgent work never queues behind less
+// urgent work.
+class BackgroundScheduler {
+ public:
+  explicit BackgroundScheduler(int num_threads);
+
+  BackgroundScheduler(const BackgroundScheduler&) = delete;
+  BackgroundScheduler& operator=(const BackgroundScheduler&) = delete;
+
+  // Drops the work that has not started and waits for the running work.
+  ~BackgroundScheduler();
+
+  void Schedule(BackgroundPriority pri, std::function<void()> work);
+
+  // Queues "work" once "delay_micros" have passed.
+  void ScheduleDelayed(BackgroundPriority pri, std::function<void()> work,
+                       uint64_t delay_micros);
+
+  // Calls work(0), ..., work(parallelism - 1) and returns when all of them
+  // are done.  work(0) runs in the calling thread and the others are
+  // queued at "pri".  Calls that no worker has picked up by the time
+  // work(0) returns are run by the calling thread as well, so this never
+  // waits on a busy pool.  Callers that hand out tasks from a shared
+  // counter get idle workers stealing from busy ones for free.
+  void RunParallel(BackgroundPriority pri, int parallelism,
+                   const std::function<void(int)>& work);
+
+  int NumThreads() const { return static_cast<int>(threads_.size()); }
+
+  // Number of queued (not yet running) work items of class "pri",
+  // including delayed ones.
+  size_t QueueDepth(BackgroundPriority pri);
+
+  // One "<class> <depth>" line per priority class.
+  std::string QueueDepthString();
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct DelayedWork {
+    Clock::time_point due;
+    BackgroundPriority pri;
+    std::function<void()> work;
+
+    bool operator>(const DelayedWork& rhs) const { return due > rhs.due; }
+  };
+
+  struct ParallelRun;
+
+  void WorkerMain();
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  bool shutting_down_;
+  std::deque<std::function<void()>> queues_[kNumBackgroundPriorities];
+  std::priority_queue<DelayedWork, std::vector<DelayedWork>,
+                      std::greater<DelayedWork>>
+      delayed_;
+  size_t delayed_depth_[kNumBackgroundPriorities];
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_SILKSTORE_BACKGROUND_SCHEDULER_H_
@@ -0,0 +1,137 @@
+#include "silkstore/background_scheduler.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "leveldb/env.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+namespace silkstore {
+
+class BackgroundSchedulerTest {};
+
+// Blocks the only worker until Release() is called
+class Gate {
+ public:
+  Gate() : open_(false), entered_(false) {}
+
+  void Wait() {
+    std::unique_lock<std::mutex> l(mutex_);
+    entered_ = true;
+    cv_.notify_all();
+    cv_.wait(l, [this]() { return open_; });
+  }
+
+  void WaitEntered() {
+    std::unique_lock<std::mutex> l(mutex_);
+    cv_.wait(l, [this]() { return entered_; });
+  }
+
+  void Release() {
+    std::lock_guard<std::mutex> l(mutex_);
+    open_ = true;
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool open_;
+  bool entered_;
+};
+
+static void WaitFor(const std::atomic<int>& counter, int value) {
+  while (counter.load() < value) {
+    Env::Default()->SleepForMicroseconds(1000);
+  }
+}
+
+TEST(BackgroundSchedulerTest, PriorityOrder) {
+  BackgroundScheduler scheduler(1);
+  Gate gate;
+  scheduler.Schedule(kFlushPriority, [&gate]() { gate.Wait(); });
+  gate.WaitEntered();
+
+  std::mutex mu;
+  std::vector<BackgroundPriority> order;
+  std::atomic<int> done(0);
+  const BackgroundPriority pris[] = {kReadOptPriority, kGCPriority,
+                                     kSplitPriority, kFlushPriority};
+  for (BackgroundPriority pri : pris) {
+    scheduler.Schedule(pri, [&, pri]() {
+      std::lock_guard<std::mutex> l(mu);
+      order.push_back(pri);
+      ++done;
+    });
+  }
+  ASSERT_EQ(1, scheduler.QueueDepth(kFlushPriority));
+  ASSERT_EQ(1, scheduler.QueueDepth(kReadOptPriority));
+  gate.Release();
+  WaitFor(done, 4);
+
+  ASSERT_EQ(4, order.size());
+  ASSERT_EQ(kFlushPriority, order[0]);
+  ASSERT_EQ(kSplitPriority, order[1]);
+  ASSERT_EQ(kGCPriority, order[2]);
+  ASSERT_EQ(kReadOptPriority, order[3]);
+  ASSERT_EQ(0, scheduler.QueueDepth(kFlushPriority));
+}
+
+TEST(BackgroundSchedulerTest, Delayed) {
+  BackgroundScheduler scheduler(2);
+  std::atomic<int> done(0);
+  const uint64_t start = Env::Default()->NowMicros();
+  std::atomic<uint64_t> ran_at(0);
+  scheduler.ScheduleDelayed(kReadOptPriority, [&]() {
+    ran_at = Env::Default()->NowMicros();
+    ++done;
+  }, 50000);
+  ASSERT_EQ(1, scheduler.QueueDepth(kReadOptPriority));
+  // Work queued later but due earlier runs first
+  scheduler.Schedule(kReadOptPriority, [&]() { ++done; });
+  WaitFor(done, 2);
+  ASSERT_GE(ran_at.load() - start, 50000);
+  ASSERT_EQ(0, scheduler.QueueDepth(kReadOptPriority));
+}
+
+TEST(BackgroundSchedulerTest, RunParallel) {
+  BackgroundScheduler scheduler(3);
+  std::vector<std::atomic<int>> calls(16);
+  for (auto& c : calls) c = 0;
+  scheduler.RunParallel(kSplitPriority, 16, [&](int i) { ++calls[i]; });
+  for (auto& c : calls) ASSERT_EQ(1, c.load());
+}
+
+TEST(BackgroundSchedulerTest, RunParallelOnBusyPool) {
+  // With every worker blocked the caller must run all calls itself
+  BackgroundScheduler scheduler(1);
+  Gate gate;
+  scheduler.Schedule(kReadOptPriority, [&gate]() { gate.Wait(); });
+  gate.WaitEntered();
+  std::atomic<int> calls(0);
+  scheduler.RunParallel(kFlushPriority, 4, [&](int) { ++calls; });
+  ASSERT_EQ(4, calls.load());
+  gate.Release();
+}
+
+TEST(BackgroundSchedulerTest, NestedRunParallel) {
+  // Work running on the pool may itself fan out without deadlocking
+  BackgroundScheduler scheduler(2);
+  std::atomic<int> calls(0);
+  std::atomic<int> done(0);
+  for (int i = 0; i < 4; i++) {
+    scheduler.Schedule(kFlushPriority, [&]() {
+      scheduler.RunParallel(kSplitPriority, 4, [&](int) { ++calls; });
+      ++done;
+    });
+  }
+  WaitFor(done, 4);
+  ASSERT_EQ(16, calls.load());
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+int main(int argc, char** argv) { return leveldb::test::RunAllTests(); }
@@ -0,0 +1,75 @@
+#include "silkstore/epoch.h"
+
+#include <limits>
+#include <thread>
+
+namespace leveldb {
+namespace silkstore {
+
+EpochManager::EpochManager() : epoch_(1) {
+  for (int i = 0; i < kNumSlots; ++i) slots_[i].store(0);
+}
+
+EpochManager::~EpochManager() {
+  for (auto& retired : retired_) retired.second();
+}
+
+EpochManager::Guard::Guard(EpochManager* manager)
+    : manager_(manager), slot_(manager->Enter()) {}
+
+EpochManager::Guard::~Guard() { manager_->Exit(slot_); }
+
+// The epoch is read before the slot is claimed.  A reclaimer that scans
+// the slot before it is claimed has retired, and so unlinked, everything
+// it frees before the reader's first shared load; one that scans it after
+// sees an epoch no newer than any retirement the reader may have missed.
+int EpochManager::Enter() {
+  const int start = static_cast<int>(
+      std::hash<std::thread::id>()(std::this_thread::get_id()) % kNumSlots);
+  for (int i = start;; i = (i + 1) % kNumSlots) {
+    uint64_t expected = 0;
+    if (slots_[i].compare_exchange_strong(expected, epoch_.load())) {
+      return i;
+    }
+    if ((i + 1) % kNumSlots == start) std::this_thread::yield();
+  }
+}
+
+void EpochManager::Exit(int slot) { slots_[slot].store(0); }
+
+void EpochManager::Retire(std::function<void()> deleter) {
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    // Readers entering from now on cannot reach the object
+    retired_.emplace_back(epoch_.fetch_add(1), std::move(deleter));
+  }
+  Reclaim();
+}
+
+void EpochManager::Reclaim() {
+  std::vector<std::function<void()>> ready;
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (int i = 0; i < kNumSlots; ++i) {
+      const uint64_t e = slots_[i].load();
+      if (e != 0 && e < oldest) oldest = e;
+    }
+    size_t n = 0;
+    while (n < retired_.size() && retired_[n].first < oldest) {
+      ready.push_back(std::move(retired_[n].second));
+      ++n;
+    }
+    retired_.erase(retired_.begin(), retired_.begin() + n);
+  }
+  // Outside the lock, deleters may retire more objects
+  for (auto& deleter : ready) deleter();
+}
+
+size_t EpochManager::NumPending() {
+  std::lock_guard<std::mutex> l(mutex_);
+  return retired_.size();
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
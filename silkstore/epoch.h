@@ -0,0 +1,77 @@
+#ifndef STORAGE_LEVELDB_SILKSTORE_EPOCH_H_
+#define STORAGE_LEVELDB_SILKSTORE_EPOCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace leveldb {
+namespace silkstore {
+
+// Epoch based reclamation of objects read without locks.
+//
+// Readers enter a short critical section with EpochManager::Guard while
+// they dereference shared pointers.  A writer first unlinks an object so
+// no new reader can reach it, then Retire()s it; the object is destroyed
+// once every reader that might have seen it has left its critical section.
+// Neither side waits for the other.
+//
+// Critical sections must be short and must not nest: a reader stuck in
+// one holds back every retirement.
+class EpochManager {
+ public:
+  EpochManager();
+
+  EpochManager(const EpochManager&) = delete;
+  EpochManager& operator=(const EpochManager&) = delete;
+
+  // Runs the deleters of all retired objects.
+  // REQUIRES: no thread is inside a critical section.
+  ~EpochManager();
+
+  class Guard {
+   public:
+    explicit Guard(EpochManager* manager);
+    ~Guard();
+
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+
+   private:
+    EpochManager* manager_;
+    int slot_;
+  };
+
+  // Calls "deleter" once no critical section entered before this call is
+  // still running, from this or a later Retire() or Reclaim() call.
+  void Retire(std::function<void()> deleter);
+
+  // Runs the deleters that have become safe.
+  void Reclaim();
+
+  // Number of retired objects not destroyed yet
+  size_t NumPending();
+
+ private:
+  // Concurrent readers beyond this many wait for a free slot
+  static const int kNumSlots = 64;
+
+  int Enter();
+  void Exit(int slot);
+
+  std::atomic<uint64_t> epoch_;
+  // Epoch each reader entered at, 0 for free slots
+  std::atomic<uint64_t> slots_[kNumSlots];
+
+  std::mutex mutex_;
+  // Deleters and the epoch they were retired in, oldest first
+  std::vector<std::pair<uint64_t, std::function<void()>>> retired_;
+};
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_SILKSTORE_EPOCH_H_
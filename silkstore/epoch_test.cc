@@ -0,0 +1,91 @@
+#include "silkstore/epoch.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "util/testharness.h"
+
+namespace leveldb {
+namespace silkstore {
+
+class EpochTest {};
+
+TEST(EpochTest, RetireWithoutReaders) {
+  EpochManager epoch;
+  int deleted = 0;
+  epoch.Retire([&deleted]() { deleted++; });
+  ASSERT_EQ(1, deleted);
+  ASSERT_EQ(0, epoch.NumPending());
+}
+
+TEST(EpochTest, GuardDefersRetirement) {
+  EpochManager epoch;
+  int deleted = 0;
+  std::unique_ptr<EpochManager::Guard> before(new EpochManager::Guard(&epoch));
+  epoch.Retire([&deleted]() { deleted++; });
+  ASSERT_EQ(0, deleted);
+  ASSERT_EQ(1, epoch.NumPending());
+
+  // Readers entering after the retirement cannot have seen the object
+  EpochManager::Guard after(&epoch);
+  before.reset();
+  epoch.Reclaim();
+  ASSERT_EQ(1, deleted);
+  ASSERT_EQ(0, epoch.NumPending());
+}
+
+TEST(EpochTest, PendingRunOnDestruction) {
+  int deleted = 0;
+  {
+    EpochManager epoch;
+    {
+      EpochManager::Guard guard(&epoch);
+      epoch.Retire([&deleted]() { deleted++; });
+    }
+    ASSERT_EQ(0, deleted);
+  }
+  ASSERT_EQ(1, deleted);
+}
+
+TEST(EpochTest, ConcurrentReaders) {
+  // Retired values are poisoned instead of freed so a reader still seeing
+  // one is caught
+  const int kLive = 42, kDead = -1;
+  EpochManager epoch;
+  std::atomic<int*> current(new int(kLive));
+  std::vector<int*> retired;
+  std::atomic<bool> done(false);
+  std::atomic<int> errors(0);
+
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&]() {
+      while (!done.load()) {
+        EpochManager::Guard guard(&epoch);
+        int* value = current.load();
+        for (int i = 0; i < 100; i++) {
+          if (*value != kLive) errors++;
+        }
+      }
+    });
+  }
+  for (int i = 0; i < 20000; i++) {
+    int* old = current.exchange(new int(kLive));
+    retired.push_back(old);
+    epoch.Retire([old, kDead]() { *old = kDead; });
+  }
+  done.store(true);
+  for (auto& reader : readers) reader.join();
+  epoch.Reclaim();
+  ASSERT_EQ(0, errors.load());
+  ASSERT_EQ(0, epoch.NumPending());
+  for (int* value : retired) delete value;
+  delete current.load();
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+int main(int argc, char** argv) { return leveldb::test::RunAllTests(); }
@@ -0,0 +1,165 @@
+#include "silkstore/gc_policy.h"
+
+#include <algorithm>
+#include <queue>
+
+namespace leveldb {
+namespace silkstore {
+
+namespace {
+
+class GreedyGCPolicy : public GCPolicy {
+ public:
+  const char* Name() const override { return "greedy"; }
+
+  double Score(const SegmentUsage& usage, uint64_t) const override {
+    return 1.0 - usage.Utilization();
+  }
+};
+
+// Rosenblum and Ousterhout's LFS cleaner: reading a segment costs 1, writing
+// its live data back costs u, and the space freed, 1 - u, is weighted by
+// age since cold data is unlikely to die on its own soon.
+class CostBenefitGCPolicy : public GCPolicy {
+ public:
+  const char* Name() const override { return "cost_benefit"; }
+
+  double Score(const SegmentUsage& usage, uint64_t age) const override {
+    const double u = usage.Utilization();
+    return (1.0 - u) * (age + 1) / (1.0 + u);
+  }
+};
+
+}  // namespace
+
+GCPolicy* NewGCPolicy(GCPolicyType type) {
+  switch (type) {
+    case kGreedyGCPolicy:
+      return new GreedyGCPolicy;
+    case kCostBenefitGCPolicy:
+    default:
+      return new CostBenefitGCPolicy;
+  }
+}
+
+SegmentUsageTracker::SegmentUsageTracker(const GCPolicy* policy)
+    : policy_(policy), newest_seg_id_(0), total_bytes_(0), invalid_bytes_(0) {}
+
+int SegmentUsageTracker::BucketOf(const SegmentUsage& usage) {
+  if (usage.invalid_bytes == 0) return 0;
+  const double invalid = 1.0 - usage.Utilization();
+  return 1 + std::min(kNumBuckets - 2,
+                      static_cast<int>(invalid * (kNumBuckets - 1)));
+}
+
+void SegmentUsageTracker::AddSegment(uint32_t seg_id, uint64_t size,
+                                     uint64_t invalid_bytes) {
+  uint32_t data_seg_id = seg_id;
+  auto inherited = inherited_.find(seg_id);
+  if (inherited != inherited_.end()) {
+    data_seg_id = inherited->second;
+    inherited_.erase(inherited);
+  }
+  RemoveSegment(seg_id);
+  SegmentUsage usage{seg_id, size, std::min(invalid_bytes, size),
+                     data_seg_id};
+  usage_[seg_id] = usage;
+  buckets_[BucketOf(usage)].insert(KeyOf(usage));
+  newest_seg_id_ = std::max(newest_seg_id_, seg_id);
+  total_bytes_ += usage.size;
+  invalid_bytes_ += usage.invalid_bytes;
+}
+
+void SegmentUsageTracker::InheritAge(uint32_t seg_id, uint32_t src_seg_id) {
+  auto src = usage_.find(src_seg_id);
+  const uint32_t src_data_seg_id =
+      src == usage_.end() ? src_seg_id : src->second.data_seg_id;
+  auto it = inherited_.emplace(seg_id, seg_id).first;
+  it->second = std::min(it->second, src_data_seg_id);
+}
+
+void SegmentUsageTracker::AddInvalidBytes(uint32_t seg_id, uint64_t bytes) {
+  auto it = usage_.find(seg_id);
+  if (it == usage_.end()) return;
+  SegmentUsage& usage = it->second;
+  bytes = std::min(bytes, usage.size - usage.invalid_bytes);
+  if (bytes == 0) return;
+  const int old_bucket = BucketOf(usage);
+  usage.invalid_bytes += bytes;
+  invalid_bytes_ += bytes;
+  const int new_bucket = BucketOf(usage);
+  if (new_bucket != old_bucket) {
+    buckets_[old_bucket].erase(KeyOf(usage));
+    buckets_[new_bucket].insert(KeyOf(usage));
+  }
+}
+
+void SegmentUsageTracker::ReclaimInvalidBytes(uint32_t seg_id,
+                                              uint64_t bytes) {
+  auto it = usage_.find(seg_id);
+  if (it == usage_.end()) return;
+  SegmentUsage& usage = it->second;
+  bytes = std::min(bytes, usage.invalid_bytes);
+  if (bytes == 0) return;
+  const int old_bucket = BucketOf(usage);
+  usage.size -= bytes;
+  usage.invalid_bytes -= bytes;
+  total_bytes_ -= bytes;
+  invalid_bytes_ -= bytes;
+  const int new_bucket = BucketOf(usage);
+  if (new_bucket != old_bucket) {
+    buckets_[old_bucket].erase(KeyOf(usage));
+    buckets_[new_bucket].insert(KeyOf(usage));
+  }
+}
+
+void SegmentUsageTracker::RemoveSegment(uint32_t seg_id) {
+  auto it = usage_.find(seg_id);
+  if (it == usage_.end()) return;
+  buckets_[BucketOf(it->second)].erase(KeyOf(it->second));
+  total_bytes_ -= it->second.size;
+  invalid_bytes_ -= it->second.invalid_bytes;
+  usage_.erase(it);
+}
+
+std::vector<uint32_t> SegmentUsageTracker::PickVictims(int k) const {
+  struct Candidate {
+    double score;
+    std::set<BucketKey>::const_iterator it;
+    int bucket;
+
+    bool operator<(const Candidate& rhs) const { return score < rhs.score; }
+  };
+  auto score = [this](const BucketKey& key) {
+    return policy_->Score(usage_.at(key.second), newest_seg_id_ - key.first);
+  };
+
+  std::priority_queue<Candidate> heads;
+  for (int b = 1; b < kNumBuckets; ++b) {
+    if (!buckets_[b].empty()) {
+      heads.push({score(*buckets_[b].begin()), buckets_[b].begin(), b});
+    }
+  }
+  std::vector<uint32_t> victims;
+  while (static_cast<int>(victims.size()) < k && !heads.empty()) {
+    Candidate best = heads.top();
+    heads.pop();
+    victims.push_back(best.it->second);
+    if (++best.it != buckets_[best.bucket].end()) {
+      best.score = score(*best.it);
+      heads.push(best);
+    }
+  }
+  return victims;
+}
+
+bool SegmentUsageTracker::GetUsage(uint32_t seg_id,
+                                   SegmentUsage* usage) const {
+  auto it = usage_.find(seg_id);
+  if (it == usage_.end()) return false;
+  *usage = it->second;
+  return true;
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
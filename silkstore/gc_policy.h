@@ -0,0 +1,122 @@
+#ifndef STORAGE_LEVELDB_SILKSTORE_GC_POLICY_H_
+#define STORAGE_LEVELDB_SILKSTORE_GC_POLICY_H_
+
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "leveldb/options.h"
+
+namespace leveldb {
+namespace silkstore {
+
+// Space accounting of one finished segment
+struct SegmentUsage {
+  uint32_t seg_id;
+  uint64_t size;
+  uint64_t invalid_bytes;
+  // Id of the segment the oldest data in this one was first written to:
+  // its own id, or an older one if GC copied older data into it.
+  uint32_t data_seg_id;
+
+  // Fraction of the segment still holding live data
+  double Utilization() const {
+    return size == 0 ? 0 : 1.0 - static_cast<double>(invalid_bytes) / size;
+  }
+};
+
+// Decides how worthwhile collecting a segment is.
+class GCPolicy {
+ public:
+  virtual ~GCPolicy() = default;
+
+  virtual const char* Name() const = 0;
+
+  // Higher scores are collected first.  "age" is the number of segments
+  // created since the oldest data of this one was first written, counted
+  // from SegmentUsage::data_seg_id.
+  virtual double Score(const SegmentUsage& usage, uint64_t age) const = 0;
+};
+
+// Returns a new policy of the given type.  Caller owns the result.
+GCPolicy* NewGCPolicy(GCPolicyType type);
+
+// Keeps the SegmentUsage of every finished segment up to date as runs are
+// invalidated, so GC picks victims without opening any segment.
+//
+// Segments are bucketed by invalid fraction and ordered by the age of
+// their data within a bucket.  Updates are O(log n); picking k victims
+// scores only the segment with the oldest data in each bucket.  That is the
+// best of its bucket for any policy that prefers older data at equal
+// utilization.  The utilization of the segments in a bucket differs by up
+// to 1/63, so the ranking is approximate within that band.
+//
+// The data age GC carries over to the segments it copies into is kept in
+// memory only.  After a restart every segment starts out as old as itself.
+//
+// Not thread safe; SegmentManager calls it under its mutex.
+class SegmentUsageTracker {
+ public:
+  // "policy" must outlive the tracker.
+  explicit SegmentUsageTracker(const GCPolicy* policy);
+
+  SegmentUsageTracker(const SegmentUsageTracker&) = delete;
+  SegmentUsageTracker& operator=(const SegmentUsageTracker&) = delete;
+
+  // Starts tracking a finished segment of "size" bytes.
+  void AddSegment(uint32_t seg_id, uint64_t size, uint64_t invalid_bytes = 0);
+
+  // Records that data of segment "src_seg_id" was copied into segment
+  // "seg_id", which is not finished yet.  Once added, it is as old as the
+  // oldest data it received.
+  void InheritAge(uint32_t seg_id, uint32_t src_seg_id);
+
+  // Records that "bytes" more of the segment became garbage.  Ignored for
+  // segments not tracked.
+  void AddInvalidBytes(uint32_t seg_id, uint64_t bytes);
+
+  // Records that "bytes" of the segment's garbage no longer take up space,
+  // shrinking both its size and its invalid bytes.  Ignored for segments
+  // not tracked.
+  void ReclaimInvalidBytes(uint32_t seg_id, uint64_t bytes);
+
+  void RemoveSegment(uint32_t seg_id);
+
+  // Up to "k" segments with some invalid data, best first up to the
+  // approximation described above.
+  std::vector<uint32_t> PickVictims(int k) const;
+
+  bool GetUsage(uint32_t seg_id, SegmentUsage* usage) const;
+
+  size_t NumSegments() const { return usage_.size(); }
+  uint64_t TotalBytes() const { return total_bytes_; }
+  uint64_t InvalidBytes() const { return invalid_bytes_; }
+
+ private:
+  // Bucket 0 holds segments without invalid data, which are never picked
+  static const int kNumBuckets = 64;
+
+  // Bucket entries are ordered by data_seg_id, then seg_id
+  typedef std::pair<uint32_t, uint32_t> BucketKey;
+
+  static int BucketOf(const SegmentUsage& usage);
+  static BucketKey KeyOf(const SegmentUsage& usage) {
+    return BucketKey(usage.data_seg_id, usage.seg_id);
+  }
+
+  const GCPolicy* policy_;
+  std::unordered_map<uint32_t, SegmentUsage> usage_;
+  std::set<BucketKey> buckets_[kNumBuckets];
+  // data_seg_id of segments GC is still copying into
+  std::unordered_map<uint32_t, uint32_t> inherited_;
+  uint32_t newest_seg_id_;
+  uint64_t total_bytes_;
+  uint64_t invalid_bytes_;
+};
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_SILKSTORE_GC_POLICY_H_
@@ -0,0 +1,140 @@
+#include "silkstore/gc_policy.h"
+
+#include <memory>
+
+#include "util/testharness.h"
+
+namespace leveldb {
+namespace silkstore {
+
+class GCPolicyTest {};
+
+TEST(GCPolicyTest, Scores) {
+  std::unique_ptr<GCPolicy> greedy(NewGCPolicy(kGreedyGCPolicy));
+  std::unique_ptr<GCPolicy> cost_benefit(NewGCPolicy(kCostBenefitGCPolicy));
+  SegmentUsage half{1, 1000, 500};
+  SegmentUsage quarter{2, 1000, 250};
+  SegmentUsage dead{3, 1000, 1000};
+  ASSERT_EQ(0.5, greedy->Score(half, 0));
+  ASSERT_EQ(greedy->Score(half, 0), greedy->Score(half, 100));
+  ASSERT_GT(greedy->Score(half, 0), greedy->Score(quarter, 100));
+
+  // Age makes up for a lower invalid fraction
+  ASSERT_GT(cost_benefit->Score(half, 0), cost_benefit->Score(quarter, 0));
+  ASSERT_GT(cost_benefit->Score(quarter, 100), cost_benefit->Score(half, 0));
+  ASSERT_GT(cost_benefit->Score(dead, 0), cost_benefit->Score(half, 0));
+}
+
+TEST(GCPolicyTest, TrackerAccounting) {
+  std::unique_ptr<GCPolicy> policy(NewGCPolicy(kGreedyGCPolicy));
+  SegmentUsageTracker tracker(policy.get());
+  tracker.AddSegment(1, 1000);
+  tracker.AddSegment(2, 2000);
+  ASSERT_EQ(2, tracker.NumSegments());
+  ASSERT_EQ(3000, tracker.TotalBytes());
+
+  tracker.AddInvalidBytes(1, 400);
+  tracker.AddInvalidBytes(1, 800);  // capped at the segment size
+  tracker.AddInvalidBytes(7, 100);  // not tracked
+  SegmentUsage usage;
+  ASSERT_TRUE(tracker.GetUsage(1, &usage));
+  ASSERT_EQ(1000, usage.invalid_bytes);
+  ASSERT_EQ(1000, tracker.InvalidBytes());
+
+  tracker.RemoveSegment(1);
+  ASSERT_TRUE(!tracker.GetUsage(1, &usage));
+  ASSERT_EQ(1, tracker.NumSegments());
+  ASSERT_EQ(2000, tracker.TotalBytes());
+  ASSERT_EQ(0, tracker.InvalidBytes());
+}
+
+TEST(GCPolicyTest, ReclaimInvalidBytes) {
+  std::unique_ptr<GCPolicy> policy(NewGCPolicy(kGreedyGCPolicy));
+  SegmentUsageTracker tracker(policy.get());
+  tracker.AddSegment(1, 1000, 600);
+  tracker.AddSegment(2, 1000, 100);
+  ASSERT_EQ(1, tracker.PickVictims(1)[0]);
+
+  tracker.ReclaimInvalidBytes(1, 580);
+  SegmentUsage usage;
+  ASSERT_TRUE(tracker.GetUsage(1, &usage));
+  ASSERT_EQ(420, usage.size);
+  ASSERT_EQ(20, usage.invalid_bytes);
+  ASSERT_EQ(1420, tracker.TotalBytes());
+  ASSERT_EQ(120, tracker.InvalidBytes());
+  // Now the other segment frees more per byte copied
+  ASSERT_EQ(2, tracker.PickVictims(1)[0]);
+
+  // Nothing left to reclaim makes it no victim at all
+  tracker.ReclaimInvalidBytes(1, 1000);
+  ASSERT_TRUE(tracker.GetUsage(1, &usage));
+  ASSERT_EQ(400, usage.size);
+  ASSERT_EQ(0, usage.invalid_bytes);
+  ASSERT_EQ(1, tracker.PickVictims(5).size());
+}
+
+TEST(GCPolicyTest, PickVictims) {
+  std::unique_ptr<GCPolicy> greedy(NewGCPolicy(kGreedyGCPolicy));
+  std::unique_ptr<GCPolicy> cost_benefit(NewGCPolicy(kCostBenefitGCPolicy));
+  SegmentUsageTracker by_greedy(greedy.get());
+  SegmentUsageTracker by_cost_benefit(cost_benefit.get());
+  // An old, mostly live segment, a young half dead one and a clean one
+  for (SegmentUsageTracker* t : {&by_greedy, &by_cost_benefit}) {
+    ASSERT_TRUE(t->PickVictims(5).empty());
+    t->AddSegment(1, 1000, 300);
+    for (uint32_t id = 2; id < 100; id++) t->AddSegment(id, 1000);
+    t->AddSegment(100, 1000, 500);
+  }
+
+  std::vector<uint32_t> victims = by_greedy.PickVictims(5);
+  ASSERT_EQ(2, victims.size());
+  ASSERT_EQ(100, victims[0]);
+  ASSERT_EQ(1, victims[1]);
+
+  victims = by_cost_benefit.PickVictims(1);
+  ASSERT_EQ(1, victims.size());
+  ASSERT_EQ(1, victims[0]);
+
+  // Within a bucket the older segment goes first
+  by_cost_benefit.AddInvalidBytes(50, 500);
+  victims = by_cost_benefit.PickVictims(3);
+  ASSERT_EQ(3, victims.size());
+  ASSERT_EQ(1, victims[0]);
+  ASSERT_EQ(50, victims[1]);
+  ASSERT_EQ(100, victims[2]);
+}
+
+TEST(GCPolicyTest, RelocatedDataKeepsItsAge) {
+  std::unique_ptr<GCPolicy> policy(NewGCPolicy(kCostBenefitGCPolicy));
+  SegmentUsageTracker tracker(policy.get());
+  for (uint32_t id = 1; id < 100; id++) tracker.AddSegment(id, 1000);
+  tracker.AddSegment(100, 1000, 300);
+
+  // GC copies the cold data of segment 1 into segment 101
+  tracker.InheritAge(101, 1);
+  tracker.InheritAge(101, 99);
+  tracker.AddSegment(101, 1000, 300);
+  tracker.RemoveSegment(1);
+  SegmentUsage usage;
+  ASSERT_TRUE(tracker.GetUsage(100, &usage));
+  ASSERT_EQ(100, usage.data_seg_id);
+  ASSERT_TRUE(tracker.GetUsage(101, &usage));
+  ASSERT_EQ(1, usage.data_seg_id);
+
+  // At equal utilization the newer segment holding older data goes first
+  std::vector<uint32_t> victims = tracker.PickVictims(2);
+  ASSERT_EQ(2, victims.size());
+  ASSERT_EQ(101, victims[0]);
+  ASSERT_EQ(100, victims[1]);
+
+  // Copying it once more keeps the age
+  tracker.InheritAge(102, 101);
+  tracker.AddSegment(102, 1000);
+  ASSERT_TRUE(tracker.GetUsage(102, &usage));
+  ASSERT_EQ(1, usage.data_seg_id);
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+int main(int argc, char** argv) { return leveldb::test::RunAllTests(); }
@@ -0,0 +1,168 @@
+#include "silkstore/leaf_index_backend.h"
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "leveldb/write_batch.h"
+#include "nvm/leafindex/leafindex.h"
+#include "nvm/nvmleafindex.h"
+#include "port/port.h"
+#include "silkstore/mem_leaf_index.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+namespace silkstore {
+
+namespace {
+
+// Adapts a LevelDB instance to serve as the leaf index.  LevelDB has no
+// merge operator, so deltas are merged with the key's current value
+// before the batch is written, and the index stores full values only.
+class LevelDBLeafIndex : public DB {
+ public:
+  LevelDBLeafIndex(DB* db, const LeafIndexValueMerger* merger)
+      : db_(db), merger_(merger) {}
+
+  ~LevelDBLeafIndex() override { delete db_; }
+
+  Status Put(const WriteOptions& options, const Slice& key,
+             const Slice& value) override {
+    WriteBatch batch;
+    batch.Put(key, value);
+    return Write(options, &batch);
+  }
+
+  Status Delete(const WriteOptions& options, const Slice& key) override {
+    return db_->Delete(options, key);
+  }
+
+  Status Write(const WriteOptions& options, WriteBatch* updates) override {
+    if (merger_ == nullptr) return db_->Write(options, updates);
+    // Merging reads the current value, so writers must not interleave
+    MutexLock l(&mutex_);
+    DeltaResolver resolver(db_, merger_);
+    Status s = updates->Iterate(&resolver);
+    if (!s.ok()) return s;
+    if (!resolver.status().ok()) return resolver.status();
+    return db_->Write(options, resolver.batch());
+  }
+
+  Status Get(const ReadOptions& options, const Slice& key,
+             std::string* value) override {
+    return db_->Get(options, key, value);
+  }
+
+  Iterator* NewIterator(const ReadOptions& options) override {
+    return db_->NewIterator(options);
+  }
+
+  const Snapshot* GetSnapshot() override { return db_->GetSnapshot(); }
+
+  void ReleaseSnapshot(const Snapshot* snapshot) override {
+    db_->ReleaseSnapshot(snapshot);
+  }
+
+  bool GetProperty(const Slice& property, std::string* value) override {
+    if (property == Slice("silkstore.leaf_index_memory")) {
+      // Memtables and cached blocks; the index itself lives on disk
+      std::string usage;
+      if (!db_->GetProperty("leveldb.approximate-memory-usage", &usage)) {
+        return false;
+      }
+      value->append("leaf index dram bytes " + usage + "\n");
+      return true;
+    }
+    return db_->GetProperty(property, value);
+  }
+
+  void GetApproximateSizes(const Range* range, int n,
+                           uint64_t* sizes) override {
+    db_->GetApproximateSizes(range, n, sizes);
+  }
+
+  void CompactRange(const Slice* begin, const Slice* end) override {
+    db_->CompactRange(begin, end);
+  }
+
+ private:
+  // Rewrites a batch with every delta replaced by the merged value.
+  // Values written earlier in the same batch take precedence over the DB.
+  class DeltaResolver : public WriteBatch::Handler {
+   public:
+    DeltaResolver(DB* db, const LeafIndexValueMerger* merger)
+        : db_(db), merger_(merger) {}
+
+    WriteBatch* batch() { return &batch_; }
+    const Status& status() const { return status_; }
+
+    void Put(const Slice& key, const Slice& value) override {
+      if (!merger_->IsDelta(value)) {
+        batch_.Put(key, value);
+        // The slice stays valid while the input batch is iterated
+        pending_[key.ToString()] = value;
+        return;
+      }
+      Slice base;
+      std::string stored;
+      auto it = pending_.find(key.ToString());
+      if (it != pending_.end()) {
+        base = it->second;
+      } else {
+        Status s = db_->Get(ReadOptions(), key, &stored);
+        if (s.ok()) {
+          base = stored;
+        } else if (!s.IsNotFound() && status_.ok()) {
+          status_ = s;
+        }
+      }
+      merged_.emplace_back(new std::string);
+      std::string* merged = merged_.back().get();
+      merger_->Merge(base, std::vector<Slice>(1, value), merged);
+      batch_.Put(key, *merged);
+      pending_[key.ToString()] = *merged;
+    }
+
+    void Delete(const Slice& key) override {
+      batch_.Delete(key);
+      // An empty base is what the merger expects for a missing key
+      pending_[key.ToString()] = Slice();
+    }
+
+   private:
+    DB* const db_;
+    const LeafIndexValueMerger* const merger_;
+    WriteBatch batch_;
+    std::map<std::string, Slice> pending_;
+    std::vector<std::unique_ptr<std::string>> merged_;
+    Status status_;
+  };
+
+  DB* const db_;
+  const LeafIndexValueMerger* const merger_;
+  port::Mutex mutex_;
+};
+
+}  // namespace
+
+Status OpenLeafIndex(const Options& options, const std::string& dbname,
+                     const LeafIndexValueMerger* merger, DB** dbptr) {
+  *dbptr = nullptr;
+  switch (options.leaf_index_type) {
+    case kNvmLeafIndex:
+      return NvmLeafIndex::OpenNvmLeafIndex(options, dbname, dbptr, merger);
+    case kLevelDBLeafIndex: {
+      DB* db;
+      Status s = DB::Open(options, dbname + "/leaf_index", &db);
+      if (s.ok()) *dbptr = new LevelDBLeafIndex(db, merger);
+      return s;
+    }
+    case kMemLeafIndex:
+      return MemLeafIndex::Open(options, dbname + "/leaf_index", merger,
+                                dbptr);
+  }
+  return Status::InvalidArgument("unknown leaf index type");
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
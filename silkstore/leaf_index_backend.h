@@ -0,0 +1,28 @@
+#ifndef STORAGE_LEVELDB_SILKSTORE_LEAF_INDEX_BACKEND_H_
+#define STORAGE_LEVELDB_SILKSTORE_LEAF_INDEX_BACKEND_H_
+
+#include <string>
+
+#include "leveldb/db.h"
+#include "leveldb/options.h"
+
+namespace leveldb {
+
+class LeafIndexValueMerger;
+
+namespace silkstore {
+
+// Opens the leaf index of the SilkStore at "dbname" in the structure
+// selected by options.leaf_index_type.  Stores a pointer to it in *dbptr
+// and returns OK on success; stores nullptr otherwise.
+//
+// If "merger" is not null, values it reports as deltas are applied to
+// the key's current value by every type of index.  It must outlive the
+// index.
+Status OpenLeafIndex(const Options& options, const std::string& dbname,
+                     const LeafIndexValueMerger* merger, DB** dbptr);
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_SILKSTORE_LEAF_INDEX_BACKEND_H_
@@ -0,0 +1,225 @@
+#include "silkstore/leaf_index_backend.h"
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "leveldb/env.h"
+#include "leveldb/write_batch.h"
+#include "nvm/leafindex/leafindex.h"
+#include "util/random.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+namespace silkstore {
+
+// Treats values starting with '+' as deltas that append the rest
+class AppendMerger : public LeafIndexValueMerger {
+ public:
+  bool IsDelta(const Slice& value) const override {
+    return !value.empty() && value[0] == '+';
+  }
+
+  void Merge(const Slice& base, const std::vector<Slice>& deltas,
+             std::string* result) const override {
+    result->assign(base.data(), base.size());
+    for (const Slice& d : deltas) result->append(d.data() + 1, d.size() - 1);
+  }
+};
+
+static const LeafIndexType kTypes[] = {kLevelDBLeafIndex, kMemLeafIndex};
+
+class LeafIndexBackendTest {
+ public:
+  LeafIndexBackendTest() : dbname_(test::TmpDir() + "/leaf_index_backend_test") {
+    Destroy();
+  }
+
+  ~LeafIndexBackendTest() { Destroy(); }
+
+  void Destroy() {
+    index_.reset();
+    leveldb::DestroyDB(dbname_ + "/leaf_index", Options());
+    Env::Default()->DeleteDir(dbname_);
+  }
+
+  void Open(LeafIndexType type) {
+    index_.reset();
+    Env::Default()->CreateDir(dbname_);
+    Options options;
+    options.create_if_missing = true;
+    options.leaf_index_type = type;
+    DB* db;
+    ASSERT_OK(OpenLeafIndex(options, dbname_, &merger_, &db));
+    index_.reset(db);
+  }
+
+  std::string Get(const std::string& key, const Snapshot* snapshot = nullptr) {
+    ReadOptions options;
+    options.snapshot = snapshot;
+    std::string value;
+    Status s = index_->Get(options, key, &value);
+    if (s.IsNotFound()) return "NOT_FOUND";
+    if (!s.ok()) return s.ToString();
+    return value;
+  }
+
+  void CheckContents(const std::map<std::string, std::string>& model) {
+    for (const auto& kv : model) {
+      ASSERT_EQ(kv.second, Get(kv.first));
+    }
+    std::unique_ptr<Iterator> it(index_->NewIterator(ReadOptions()));
+    auto m = model.begin();
+    for (it->SeekToFirst(); it->Valid(); it->Next(), ++m) {
+      ASSERT_TRUE(m != model.end());
+      ASSERT_EQ(m->first, it->key().ToString());
+      ASSERT_EQ(m->second, it->value().ToString());
+    }
+    ASSERT_TRUE(m == model.end());
+    auto r = model.rbegin();
+    for (it->SeekToLast(); it->Valid(); it->Prev(), ++r) {
+      ASSERT_TRUE(r != model.rend());
+      ASSERT_EQ(r->first, it->key().ToString());
+    }
+    ASSERT_TRUE(r == model.rend());
+  }
+
+  const std::string dbname_;
+  AppendMerger merger_;
+  std::unique_ptr<DB> index_;
+};
+
+TEST(LeafIndexBackendTest, PutDeleteIterate) {
+  for (LeafIndexType type : kTypes) {
+    Destroy();
+    Open(type);
+    Random rnd(301);
+    std::map<std::string, std::string> model;
+    WriteBatch batch;
+    // Enough keys for several levels of a B+-tree
+    for (int i = 0; i < 20000; i++) {
+      char key[20];
+      snprintf(key, sizeof(key), "key%08d", rnd.Uniform(50000));
+      std::string value = std::to_string(i);
+      if (i % 5 == 4) {
+        batch.Delete(key);
+        model.erase(key);
+      } else {
+        batch.Put(key, value);
+        model[key] = value;
+      }
+      if (i % 100 == 99) {
+        ASSERT_OK(index_->Write(WriteOptions(), &batch));
+        batch.Clear();
+      }
+    }
+    ASSERT_EQ("NOT_FOUND", Get("a"));
+    ASSERT_EQ("NOT_FOUND", Get("z"));
+    CheckContents(model);
+
+    std::unique_ptr<Iterator> it(index_->NewIterator(ReadOptions()));
+    for (int i = 0; i < 1000; i++) {
+      char target[20];
+      snprintf(target, sizeof(target), "key%08d", rnd.Uniform(60000));
+      it->Seek(target);
+      auto m = model.lower_bound(target);
+      if (m == model.end()) {
+        ASSERT_TRUE(!it->Valid());
+      } else {
+        ASSERT_TRUE(it->Valid());
+        ASSERT_EQ(m->first, it->key().ToString());
+      }
+    }
+
+    // Deleting everything leaves an empty index
+    for (const auto& kv : model) batch.Delete(kv.first);
+    ASSERT_OK(index_->Write(WriteOptions(), &batch));
+    it.reset(index_->NewIterator(ReadOptions()));
+    it->SeekToFirst();
+    ASSERT_TRUE(!it->Valid());
+  }
+}
+
+TEST(LeafIndexBackendTest, Snapshot) {
+  for (LeafIndexType type : kTypes) {
+    Destroy();
+    Open(type);
+    ASSERT_OK(index_->Put(WriteOptions(), "a", "1"));
+    ASSERT_OK(index_->Put(WriteOptions(), "b", "1"));
+    const Snapshot* snapshot = index_->GetSnapshot();
+    ASSERT_OK(index_->Put(WriteOptions(), "a", "2"));
+    ASSERT_OK(index_->Delete(WriteOptions(), "b"));
+    ASSERT_OK(index_->Put(WriteOptions(), "c", "2"));
+    ASSERT_EQ("2", Get("a"));
+    ASSERT_EQ("NOT_FOUND", Get("b"));
+    ASSERT_EQ("1", Get("a", snapshot));
+    ASSERT_EQ("1", Get("b", snapshot));
+    ASSERT_EQ("NOT_FOUND", Get("c", snapshot));
+
+    ReadOptions options;
+    options.snapshot = snapshot;
+    std::unique_ptr<Iterator> it(index_->NewIterator(options));
+    std::string contents;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      contents += it->key().ToString() + "=" + it->value().ToString() + ";";
+    }
+    ASSERT_EQ("a=1;b=1;", contents);
+    it.reset();
+    index_->ReleaseSnapshot(snapshot);
+  }
+}
+
+TEST(LeafIndexBackendTest, Deltas) {
+  for (LeafIndexType type : kTypes) {
+    Destroy();
+    Open(type);
+    ASSERT_OK(index_->Put(WriteOptions(), "k", "base"));
+    ASSERT_OK(index_->Put(WriteOptions(), "k", "+1"));
+    ASSERT_EQ("base1", Get("k"));
+
+    // Deltas see the writes before them in the same batch
+    WriteBatch batch;
+    batch.Put("k", "+2");
+    batch.Put("k", "+3");
+    batch.Delete("j");
+    batch.Put("j", "+x");
+    ASSERT_OK(index_->Write(WriteOptions(), &batch));
+    ASSERT_EQ("base123", Get("k"));
+    ASSERT_EQ("x", Get("j"));
+
+    // Only merged values are visible after a reopen
+    Open(type);
+    ASSERT_EQ("base123", Get("k"));
+    ASSERT_OK(index_->Put(WriteOptions(), "k", "+4"));
+    ASSERT_EQ("base1234", Get("k"));
+  }
+}
+
+TEST(LeafIndexBackendTest, Reopen) {
+  for (LeafIndexType type : kTypes) {
+    Destroy();
+    Open(type);
+    std::map<std::string, std::string> model;
+    // Overwrite a few large values until the log is rewritten
+    const std::string big(4096, 'v');
+    for (int i = 0; i < 3000; i++) {
+      std::string key = "key" + std::to_string(i % 100);
+      std::string value = std::to_string(i) + big;
+      ASSERT_OK(index_->Put(WriteOptions(), key, value));
+      model[key] = value;
+    }
+    ASSERT_OK(index_->Delete(WriteOptions(), "key7"));
+    model.erase("key7");
+    CheckContents(model);
+    Open(type);
+    CheckContents(model);
+    index_->CompactRange(nullptr, nullptr);
+    Open(type);
+    CheckContents(model);
+  }
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+int main(int argc, char** argv) { return leveldb::test::RunAllTests(); }
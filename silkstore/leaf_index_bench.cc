@@ -0,0 +1,304 @@
+// Microbenchmark of the leaf index structures selected by
+// Options::leaf_index_type.
+//
+// Each structure is loaded with --num leaves whose entries are shaped
+// like the ones SilkStore writes, then timed on:
+//      fill    -- write every leaf in random order, --batch per batch
+//      lookup  -- Get --reads random leaves
+//      seek    -- seek --reads random keys and read the entry found, as
+//                 LeafStore::Get does
+//      scan    -- iterate over every leaf in order
+//      update  -- rewrite --reads random entries, --batch per batch
+//      append  -- add a run to --reads random leaves as deltas, as
+//                 compaction does
+// Afterwards the memory the index reports and the process RSS are
+// printed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "db/write_batch_internal.h"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/write_batch.h"
+#include "util/random.h"
+#include "util/testutil.h"
+#include "silkstore/leaf_index_backend.h"
+#include "silkstore/leaf_store.h"
+#include "silkstore/silkstore_impl.h"
+
+// Comma-separated structures to compare: "nvm", "leveldb", "mem"
+static const char* FLAGS_backends = "nvm,leveldb,mem";
+
+// Comma-separated benchmarks to run after "fill"
+static const char* FLAGS_benchmarks = "lookup,seek,scan,update,append";
+
+// Number of leaves
+static int FLAGS_num = 100000;
+
+// Number of operations of each read and update benchmark; -1 means --num
+static int FLAGS_reads = -1;
+
+// Runs per leaf entry, and bytes of block index each run carries
+static int FLAGS_runs = 4;
+static int FLAGS_run_size = 256;
+
+// Writes per leaf index batch
+static int FLAGS_batch = 100;
+
+static const char* FLAGS_db = "/tmp/leaf_index_bench";
+
+// NVM file for the "nvm" structure
+static const char* FLAGS_nvm_file = nullptr;
+
+namespace leveldb {
+namespace silkstore {
+
+namespace {
+
+std::string LeafKey(uint64_t i) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "user%016llu", (unsigned long long)i * 2);
+  return buf;
+}
+
+size_t ResidentBytes() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == nullptr) return 0;
+  unsigned long size = 0, resident = 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+class Benchmark {
+ public:
+  Benchmark(LeafIndexType type, const char* name)
+      : type_(type), name_(name), index_(nullptr), rand_(301) {
+    reads_ = FLAGS_reads < 0 ? FLAGS_num : FLAGS_reads;
+    Random rnd(17);
+    std::vector<std::string> bufs(FLAGS_runs + 1);
+    std::vector<MiniRunIndexEntry> runs;
+    std::string index_data;
+    for (int i = 0; i <= FLAGS_runs; i++) {
+      test::RandomString(&rnd, FLAGS_run_size, &index_data);
+      runs.push_back(MiniRunIndexEntry::Build(i, 0, index_data, Slice(),
+                                              4 << 20, &bufs[i]));
+    }
+    LeafIndexEntryBuilder::EncodeAppendDelta(runs.back(), &delta_);
+    runs.pop_back();
+    LeafIndexEntry entry;
+    for (const MiniRunIndexEntry& run : runs) {
+      std::string buf;
+      LeafIndexEntryBuilder::AppendMiniRunIndexEntry(entry, run, &buf, &entry);
+      entry_.swap(buf);
+      entry = LeafIndexEntry(entry_);
+    }
+  }
+
+  ~Benchmark() { delete index_; }
+
+  void Run() {
+    silkstore::DestroyDB(FLAGS_db, Options());
+    Env::Default()->CreateDir(FLAGS_db);
+    Options options;
+    options.create_if_missing = true;
+    options.leaf_index_type = type_;
+    if (FLAGS_nvm_file != nullptr) options.nvmleafindex_file = FLAGS_nvm_file;
+    const size_t rss_before = ResidentBytes();
+    Status s = OpenLeafIndex(options, FLAGS_db, &merger_, &index_);
+    if (!s.ok()) {
+      fprintf(stderr, "%s: open error: %s\n", name_, s.ToString().c_str());
+      return;
+    }
+
+    Time("fill", FLAGS_num, [this](int) { Fill(); });
+    const char* benchmarks = FLAGS_benchmarks;
+    while (benchmarks != nullptr && *benchmarks != '\0') {
+      const char* sep = strchr(benchmarks, ',');
+      std::string name = sep == nullptr
+                             ? std::string(benchmarks)
+                             : std::string(benchmarks, sep - benchmarks);
+      benchmarks = sep == nullptr ? nullptr : sep + 1;
+      if (name == "lookup") {
+        Time("lookup", reads_, [this](int n) { Lookup(n); });
+      } else if (name == "seek") {
+        Time("seek", reads_, [this](int n) { Seek(n); });
+      } else if (name == "scan") {
+        Time("scan", FLAGS_num, [this](int) { Scan(); });
+      } else if (name == "update") {
+        Time("update", reads_, [this](int n) { Update(n, false); });
+      } else if (name == "append") {
+        Time("append", reads_, [this](int n) { Update(n, true); });
+      } else if (!name.empty()) {
+        fprintf(stderr, "unknown benchmark '%s'\n", name.c_str());
+      }
+    }
+
+    std::string memory;
+    index_->GetProperty("silkstore.leaf_index_memory", &memory);
+    fprintf(stdout, "%-8s memory   : rss grew %.1f MB\n%s", name_,
+            (ResidentBytes() - rss_before) / 1048576.0, memory.c_str());
+    delete index_;
+    index_ = nullptr;
+    silkstore::DestroyDB(FLAGS_db, Options());
+  }
+
+ private:
+  template <typename Op>
+  void Time(const char* bench, int ops, Op op) {
+    message_.clear();
+    const uint64_t start = Env::Default()->NowMicros();
+    op(ops);
+    const uint64_t micros = Env::Default()->NowMicros() - start;
+    fprintf(stdout, "%-8s %-8s : %11.3f micros/op;%s\n", name_, bench,
+            ops > 0 ? static_cast<double>(micros) / ops : 0.0,
+            message_.c_str());
+    fflush(stdout);
+  }
+
+  void Write(WriteBatch* batch, bool force) {
+    if (!force && WriteBatchInternal::Count(batch) < FLAGS_batch) return;
+    Status s = index_->Write(WriteOptions(), batch);
+    if (!s.ok()) {
+      fprintf(stderr, "%s: write error: %s\n", name_, s.ToString().c_str());
+      exit(1);
+    }
+    batch->Clear();
+  }
+
+  void Fill() {
+    std::vector<uint64_t> order(FLAGS_num);
+    for (int i = 0; i < FLAGS_num; i++) order[i] = i;
+    std::random_shuffle(order.begin(), order.end());
+    WriteBatch batch;
+    for (uint64_t i : order) {
+      batch.Put(LeafKey(i), entry_);
+      Write(&batch, false);
+    }
+    Write(&batch, true);
+  }
+
+  void Lookup(int n) {
+    std::string value;
+    int found = 0;
+    for (int i = 0; i < n; i++) {
+      if (index_->Get(ReadOptions(), LeafKey(rand_.Uniform(FLAGS_num)),
+                      &value).ok()) {
+        found++;
+      }
+    }
+    message_ = " (" + std::to_string(found) + " of " + std::to_string(n) +
+               " found)";
+  }
+
+  void Seek(int n) {
+    size_t runs = 0;
+    for (int i = 0; i < n; i++) {
+      // Odd keys fall between leaves and land on the next one
+      std::string key = LeafKey(rand_.Uniform(FLAGS_num));
+      key.back() += 1;
+      std::unique_ptr<Iterator> it(index_->NewIterator(ReadOptions()));
+      it->Seek(key);
+      if (it->Valid()) runs += LeafIndexEntry(it->value()).GetNumMiniRuns();
+    }
+    message_ = " (" + std::to_string(runs) + " runs seen)";
+  }
+
+  void Scan() {
+    std::unique_ptr<Iterator> it(index_->NewIterator(ReadOptions()));
+    int leaves = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) leaves++;
+    message_ = " (" + std::to_string(leaves) + " leaves)";
+  }
+
+  void Update(int n, bool append) {
+    WriteBatch batch;
+    for (int i = 0; i < n; i++) {
+      batch.Put(LeafKey(rand_.Uniform(FLAGS_num)), append ? delta_ : entry_);
+      Write(&batch, false);
+    }
+    Write(&batch, true);
+  }
+
+  const LeafIndexType type_;
+  const char* const name_;
+  DB* index_;
+  LeafIndexEntryMerger merger_;
+  Random rand_;
+  int reads_;
+  std::string entry_;
+  std::string delta_;
+  std::string message_;
+};
+
+}  // namespace
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    int n;
+    char junk;
+    if (strncmp(argv[i], "--backends=", 11) == 0) {
+      FLAGS_backends = argv[i] + 11;
+    } else if (strncmp(argv[i], "--benchmarks=", 13) == 0) {
+      FLAGS_benchmarks = argv[i] + 13;
+    } else if (sscanf(argv[i], "--num=%d%c", &n, &junk) == 1) {
+      FLAGS_num = n;
+    } else if (sscanf(argv[i], "--reads=%d%c", &n, &junk) == 1) {
+      FLAGS_reads = n;
+    } else if (sscanf(argv[i], "--runs=%d%c", &n, &junk) == 1) {
+      FLAGS_runs = n;
+    } else if (sscanf(argv[i], "--run_size=%d%c", &n, &junk) == 1) {
+      FLAGS_run_size = n;
+    } else if (sscanf(argv[i], "--batch=%d%c", &n, &junk) == 1) {
+      FLAGS_batch = n;
+    } else if (strncmp(argv[i], "--db=", 5) == 0) {
+      FLAGS_db = argv[i] + 5;
+    } else if (strncmp(argv[i], "--nvm_file=", 11) == 0) {
+      FLAGS_nvm_file = argv[i] + 11;
+    } else {
+      fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  fprintf(stdout, "Leaves:     %d\n", FLAGS_num);
+  fprintf(stdout, "Runs:       %d per leaf, %d bytes of index each\n",
+          FLAGS_runs, FLAGS_run_size);
+  fprintf(stdout, "Batch:      %d writes\n", FLAGS_batch);
+  fprintf(stdout, "------------------------------------------------\n");
+  std::string backends = FLAGS_backends;
+  size_t pos = 0;
+  while (pos <= backends.size()) {
+    size_t end = backends.find(',', pos);
+    if (end == std::string::npos) end = backends.size();
+    std::string name = backends.substr(pos, end - pos);
+    pos = end + 1;
+    leveldb::LeafIndexType type;
+    if (name == "nvm") {
+      type = leveldb::kNvmLeafIndex;
+    } else if (name == "leveldb") {
+      type = leveldb::kLevelDBLeafIndex;
+    } else if (name == "mem") {
+      type = leveldb::kMemLeafIndex;
+    } else {
+      if (!name.empty()) {
+        fprintf(stderr, "unknown backend '%s'\n", name.c_str());
+      }
+      continue;
+    }
+    leveldb::silkstore::Benchmark benchmark(type, name.c_str());
+    benchmark.Run();
+  }
+  return 0;
+}
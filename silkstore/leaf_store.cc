@@ -2,35 +2,42 @@
 // Created by zxjcarrot on 2019-07-15.
 //
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 #include "table/filter_block.h"
 #include "table/format.h"
 #include "table/merger.h"
 #include "util/coding.h"
+#include "util/hash.h"
 
 #include "silkstore/leaf_store.h"
+#include "silkstore/perf_context.h"
 #include "silkstore/segment.h"
 #include "silkstore/silkstore_iter.h"
+#include "silkstore/statistics.h"
 #include "silkstore/util.h"
 
-extern int runs_searched;
-extern int runs_hit_counts;
-extern int runs_miss_counts;
-extern int bloom_filter_counts;
 namespace leveldb {
 namespace silkstore {
 
 class LeafStore::LeafStoreIterator : public Iterator {
  public:
   LeafStoreIterator(const ReadOptions& options, LeafStore* store)
-      : ropts_(options), store_(store), leaf_it_(nullptr) {
+      : ropts_(options),
+        store_(store),
+        leaf_it_(nullptr),
+        bound_(store->user_cmp_, options) {
+    // Leaves are opened lazily, keep their runs readable until then
+    read_view_ = store_->seg_manager_->AcquireReadView();
     leaf_index_it_ = store_->leaf_index_->NewIterator(options);
   }
 
   ~LeafStoreIterator() override {
     delete leaf_index_it_;
     if (leaf_it_) delete leaf_it_;
+    store_->seg_manager_->ReleaseReadView(read_view_);
   }
 
   // An iterator is either positioned at a key/value pair, or
@@ -44,9 +51,10 @@ class LeafStore::LeafStoreIterator : public Iterator {
   // after this call iff the source is not empty.
   void SeekToFirst() override {
     if (!status_.ok()) status_ = Status::OK();
+    bound_.Reset();
     leaf_index_it_->SeekToFirst();
     OpenLeafIterator();
-    if (status_.ok()) {
+    if (leaf_it_ != nullptr) {
       leaf_it_->SeekToFirst();
     }
   }
@@ -55,9 +63,10 @@ class LeafStore::LeafStoreIterator : public Iterator {
   // Valid() after this call iff the source is not empty.
   void SeekToLast() override {
     if (!status_.ok()) status_ = Status::OK();
+    bound_.Reset();
     leaf_index_it_->SeekToLast();
     OpenLeafIterator();
-    if (status_.ok()) {
+    if (leaf_it_ != nullptr) {
       leaf_it_->SeekToLast();
     }
   }
@@ -67,9 +76,20 @@ class LeafStore::LeafStoreIterator : public Iterator {
   // an entry that comes at or past target.
   void Seek(const Slice& target) override {
     if (!status_.ok()) status_ = Status::OK();
-    leaf_index_it_->Seek(target);
+    Slice user_target = ExtractUserKey(target);
+    bound_.Reset(user_target);
+    if (bound_.Active() && bound_.Exceeds(user_target)) {
+      StopAtBound();
+      return;
+    }
+    // The leaf index is keyed by user key
+    {
+      SILKSTORE_PERF_TIMER_GUARD(leaf_index_seek_nanos);
+      leaf_index_it_->Seek(user_target);
+    }
+    SILKSTORE_PERF_COUNTER_ADD(leaf_index_seek_count, 1);
     OpenLeafIterator();
-    if (status_.ok()) {
+    if (leaf_it_ != nullptr) {
       leaf_it_->Seek(target);
     }
   }
@@ -81,9 +101,16 @@ class LeafStore::LeafStoreIterator : public Iterator {
     assert(Valid());
     leaf_it_->Next();
     if (!leaf_it_->Valid()) {
+      // Leaves are keyed by their max user key, so every key in the leaves
+      // that follow is past this one.  Don't open them if it is past the
+      // iteration bound.
+      if (bound_.Active() && bound_.Exceeds(leaf_index_it_->key())) {
+        StopAtBound();
+        return;
+      }
       leaf_index_it_->Next();
       OpenLeafIterator();
-      if (status_.ok()) {
+      if (leaf_it_ != nullptr) {
         leaf_it_->SeekToFirst();
       }
     }
@@ -98,7 +125,7 @@ class LeafStore::LeafStoreIterator : public Iterator {
     if (!leaf_it_->Valid()) {
       leaf_index_it_->Prev();
       OpenLeafIterator();
-      if (status_.ok()) {
+      if (leaf_it_ != nullptr) {
         leaf_it_->SeekToLast();
       }
     }
@@ -126,11 +153,8 @@ class LeafStore::LeafStoreIterator : public Iterator {
   Status status() const override {
     if (!status_.ok()) return status_;
     Status s = leaf_index_it_->status();
-    if (s.ok()) {
-      if (leaf_it_ == nullptr)
-        s = Status::Corruption("Empty Leaf Reference");
-      else
-        s = leaf_it_->status();
+    if (s.ok() && leaf_it_ != nullptr) {
+      s = leaf_it_->status();
     }
     return s;
   }
@@ -139,8 +163,17 @@ class LeafStore::LeafStoreIterator : public Iterator {
   ReadOptions ropts_;
   Status status_;  // only store non-iterator error here
   LeafStore* store_;
+  uint64_t read_view_;
   Iterator* leaf_index_it_;
   Iterator* leaf_it_ = nullptr;
+  IterateBound bound_;
+
+  // Forward iteration ended at the bound; leave the iterator invalid
+  // without opening any further leaf.
+  void StopAtBound() {
+    if (leaf_it_ != nullptr) delete leaf_it_;
+    leaf_it_ = nullptr;
+  }
 
   void OpenLeafIterator() {
     if (leaf_index_it_->Valid()) {
@@ -148,9 +181,9 @@ class LeafStore::LeafStoreIterator : public Iterator {
       if (leaf_it_ != nullptr) delete leaf_it_;
       leaf_it_ = store_->NewIteratorForLeaf(ropts_, index_entry, status_);
     } else {
+      // Ran off either end of the leaf index
       if (leaf_it_ != nullptr) delete leaf_it_;
       leaf_it_ = nullptr;
-      status_ = Status::Corruption("Empty Leaf Reference");
     }
   }
 };
@@ -195,15 +228,59 @@ Slice MiniRunIndexEntry::GetFilterData() const {
   return Slice(p, filter_data_len_);
 }
 
+static const uint32_t kLeafIndexEntryV2Magic = 0x1eaf0002;
+static const uint32_t kLeafIndexEntryDeltaMagic = 0x1eafde1a;
+// fixed32 num runs + fixed64 leaf data size
+static const size_t kLeafIndexEntryV2HeaderSize = 12;
+// fixed32 blob offset, run data size, segment number, run number
+static const size_t kLeafIndexEntryV2RunSize = 16;
+
 LeafIndexEntry::LeafIndexEntry(const Slice& data) : raw_data_(data) {}
 
+bool LeafIndexEntry::IsV2() const {
+  // A v1 entry ends with its run count, which never reaches the magic
+  return raw_data_.size() >= kLeafIndexEntryV2HeaderSize + 4 &&
+         DecodeFixed32(raw_data_.data() + raw_data_.size() - 4) ==
+             kLeafIndexEntryV2Magic;
+}
+
 uint32_t LeafIndexEntry::GetNumMiniRuns() const {
   if (raw_data_.empty()) return 0;
+  if (IsV2()) return DecodeFixed32(raw_data_.data());
   const char* p = raw_data_.data() + raw_data_.size() - 4;
   return DecodeFixed32(p);
 }
 
+std::vector<Slice> LeafIndexEntry::DecodeV1Runs() const {
+  auto num_entries = GetNumMiniRuns();
+  std::vector<Slice> runs(num_entries);
+  const char* p = raw_data_.data() + raw_data_.size() - 4;
+  for (int i = num_entries - 1; i >= 0; --i) {
+    p -= 4;
+    assert(p >= raw_data_.data());
+    uint32_t entry_size = DecodeFixed32(p);
+    assert(entry_size > 0);
+    p -= entry_size;
+    assert(p >= raw_data_.data());
+    runs[i] = Slice(p, entry_size);
+  }
+  return runs;
+}
+
+MiniRunIndexEntry LeafIndexEntry::GetMiniRunIndexEntry(uint32_t i) const {
+  assert(i < GetNumMiniRuns());
+  if (!IsV2()) return MiniRunIndexEntry(DecodeV1Runs()[i]);
+  const char* table = raw_data_.data() + kLeafIndexEntryV2HeaderSize;
+  const char* run = table + i * kLeafIndexEntryV2RunSize;
+  uint32_t offset = DecodeFixed32(run);
+  uint32_t limit = i + 1 < GetNumMiniRuns()
+                       ? DecodeFixed32(run + kLeafIndexEntryV2RunSize)
+                       : raw_data_.size() - 4;
+  return MiniRunIndexEntry(Slice(raw_data_.data() + offset, limit - offset));
+}
+
 size_t LeafIndexEntry::GetLeafDataSize() const {
+  if (IsV2()) return DecodeFixed64(raw_data_.data() + 4);
   size_t s = 0;
   auto processor = [&s](const MiniRunIndexEntry& entry, uint32_t) {
     s += entry.GetRunDataSize();
@@ -245,7 +322,12 @@ void LeafIndexEntry::ForEachMiniRunIndexEntry(
   auto num_entries = GetNumMiniRuns();
   if (num_entries == 0) return;
 
-  if (order == TraversalOrder::backward) {
+  if (IsV2()) {
+    for (uint32_t k = 0; k < num_entries; ++k) {
+      uint32_t i = order == TraversalOrder::forward ? k : num_entries - 1 - k;
+      if (processor(GetMiniRunIndexEntry(i), i)) return;
+    }
+  } else if (order == TraversalOrder::backward) {
     const char* p = raw_data_.data() + raw_data_.size() - 4;
     for (int i = num_entries - 1; i >= 0; --i) {
       p -= 4;
@@ -259,42 +341,81 @@ void LeafIndexEntry::ForEachMiniRunIndexEntry(
       if (early_return) return;
     }
   } else {
-    std::vector<MiniRunIndexEntry> entries;
-    const char* p = raw_data_.data() + raw_data_.size() - 4;
-    for (int i = num_entries - 1; i >= 0; --i) {
-      p -= 4;
-      assert(p >= raw_data_.data());
-      uint32_t entry_size = DecodeFixed32(p);
-      assert(entry_size > 0);
-      p -= entry_size;
-      assert(p >= raw_data_.data());
-      MiniRunIndexEntry index_entry = MiniRunIndexEntry(Slice(p, entry_size));
-      entries.push_back(index_entry);
-    }
-    std::reverse(entries.begin(), entries.end());
-    for (int i = 0; i < entries.size(); ++i) {
-      bool early_return = processor(entries[i], i);
+    std::vector<Slice> runs = DecodeV1Runs();
+    for (int i = 0; i < runs.size(); ++i) {
+      bool early_return = processor(MiniRunIndexEntry(runs[i]), i);
       if (early_return) return;
     }
   }
 }
 
+void LeafIndexEntryBuilder::Build(const std::vector<MiniRunIndexEntry>& runs,
+                                  std::string* buf) {
+  // The runs may point into *buf, so encode into a scratch string first
+  std::string scratch;
+  uint64_t leaf_data_size = 0;
+  size_t blobs_size = 0;
+  for (const auto& run : runs) {
+    leaf_data_size += run.GetRunDataSize();
+    blobs_size += run.GetRawData().size();
+  }
+  scratch.reserve(kLeafIndexEntryV2HeaderSize +
+                  runs.size() * kLeafIndexEntryV2RunSize + blobs_size + 4);
+  PutFixed32(&scratch, runs.size());
+  PutFixed64(&scratch, leaf_data_size);
+  uint32_t offset =
+      kLeafIndexEntryV2HeaderSize + runs.size() * kLeafIndexEntryV2RunSize;
+  for (const auto& run : runs) {
+    PutFixed32(&scratch, offset);
+    PutFixed32(&scratch, run.GetRunDataSize());
+    PutFixed32(&scratch, run.GetSegmentNumber());
+    PutFixed32(&scratch, run.GetRunNumberWithinSegment());
+    offset += run.GetRawData().size();
+  }
+  for (const auto& run : runs) {
+    assert(run.GetRawData().size() > 0);
+    scratch.append(run.GetRawData().data(), run.GetRawData().size());
+  }
+  PutFixed32(&scratch, kLeafIndexEntryV2Magic);
+  buf->swap(scratch);
+}
+
 void LeafIndexEntryBuilder::AppendMiniRunIndexEntry(
     const LeafIndexEntry& base, const MiniRunIndexEntry& minirun_index_entry,
     std::string* buf, LeafIndexEntry* new_entry) {
-  buf->clear();
-  buf->append(base.GetRawData().data(), base.GetRawData().size());
-  if (buf->size()) {
-    assert(buf->size() >= 4);
-    // Erase footer (# of minirun index entries).
-    buf->resize(buf->size() - 4);
-  }
-  size_t entry_size = minirun_index_entry.GetRawData().size();
-  assert(entry_size > 0);
-  buf->append(minirun_index_entry.GetRawData().data(), entry_size);
-  PutFixed32(buf, entry_size);
-  // Append new footer (# of minirun index entries).
-  PutFixed32(buf, base.GetNumMiniRuns() + 1);
+  std::vector<MiniRunIndexEntry> runs =
+      base.GetAllMiniRunIndexEntry(LeafIndexEntry::TraversalOrder::forward);
+  runs.push_back(minirun_index_entry);
+  Build(runs, buf);
+  *new_entry = LeafIndexEntry(Slice(*buf));
+}
+
+Slice LeafIndexEntryBuilder::EncodeAppendDelta(
+    const MiniRunIndexEntry& minirun_index_entry, std::string* buf) {
+  buf->assign(minirun_index_entry.GetRawData().data(),
+              minirun_index_entry.GetRawData().size());
+  PutFixed32(buf, kLeafIndexEntryDeltaMagic);
+  return Slice(*buf);
+}
+
+bool LeafIndexEntryBuilder::IsAppendDelta(const Slice& value) {
+  // A minirun index entry has a 20 byte header
+  return value.size() >= 24 &&
+         DecodeFixed32(value.data() + value.size() - 4) ==
+             kLeafIndexEntryDeltaMagic;
+}
+
+void LeafIndexEntryBuilder::ApplyAppendDeltas(const LeafIndexEntry& base,
+                                              const std::vector<Slice>& deltas,
+                                              std::string* buf,
+                                              LeafIndexEntry* new_entry) {
+  std::vector<MiniRunIndexEntry> runs =
+      base.GetAllMiniRunIndexEntry(LeafIndexEntry::TraversalOrder::forward);
+  for (const Slice& delta : deltas) {
+    assert(IsAppendDelta(delta));
+    runs.push_back(MiniRunIndexEntry(Slice(delta.data(), delta.size() - 4)));
+  }
+  Build(runs, buf);
   *new_entry = LeafIndexEntry(Slice(*buf));
 }
 
@@ -302,33 +423,20 @@ Status LeafIndexEntryBuilder::ReplaceMiniRunRange(
     const LeafIndexEntry& base, uint32_t start, uint32_t end,
     const MiniRunIndexEntry& replacement, std::string* buf,
     LeafIndexEntry* new_entry) {
-  if (start >= base.GetNumMiniRuns() || end >= base.GetNumMiniRuns())
+  uint32_t num_runs = base.GetNumMiniRuns();
+  if (start >= num_runs || end >= num_runs)
     return Status::InvalidArgument("[start, end] not within bound of [0, " +
-                                   std::to_string(base.GetNumMiniRuns()) + "]");
-  buf->clear();
-  uint32_t new_num_entries = 0;
-  auto processor = [&](const MiniRunIndexEntry& entry, uint32_t idx) {
-    if (start <= idx && idx <= end) {
-      if (idx == start) {
-        size_t entry_size = replacement.GetRawData().size();
-        assert(entry_size);
-        buf->append(replacement.GetRawData().data(), entry_size);
-        PutFixed32(buf, entry_size);
-        ++new_num_entries;
-      }
+                                   std::to_string(num_runs) + "]");
+  std::vector<MiniRunIndexEntry> runs;
+  runs.reserve(num_runs);
+  for (uint32_t i = 0; i < num_runs; ++i) {
+    if (start <= i && i <= end) {
+      if (i == start) runs.push_back(replacement);
     } else {
-      size_t entry_size = entry.GetRawData().size();
-      assert(entry_size);
-      buf->append(entry.GetRawData().data(), entry_size);
-      PutFixed32(buf, entry_size);
-      ++new_num_entries;
+      runs.push_back(base.GetMiniRunIndexEntry(i));
     }
-    return false;
-  };
-  base.ForEachMiniRunIndexEntry(processor,
-                                LeafIndexEntry::TraversalOrder::forward);
-  // Append footer (# of minirun index entries).
-  PutFixed32(buf, new_num_entries);
+  }
+  Build(runs, buf);
   *new_entry = LeafIndexEntry(Slice(*buf));
   return Status::OK();
 }
@@ -337,24 +445,16 @@ Status LeafIndexEntryBuilder::RemoveMiniRunRange(const LeafIndexEntry& base,
                                                  uint32_t start, uint32_t end,
                                                  std::string* buf,
                                                  LeafIndexEntry* new_entry) {
-  if (start >= base.GetNumMiniRuns() || end >= base.GetNumMiniRuns())
+  uint32_t num_runs = base.GetNumMiniRuns();
+  if (start >= num_runs || end >= num_runs)
     return Status::InvalidArgument("[start, end] not within bound of [0, " +
-                                   std::to_string(base.GetNumMiniRuns()) + "]");
-  buf->clear();
-  uint32_t new_num_entries = 0;
-  auto processor = [&](const MiniRunIndexEntry& entry, uint32_t idx) {
-    if (start <= idx && idx <= end) {
-    } else {
-      buf->append(entry.GetRawData().data(), entry.GetRawData().size());
-      PutFixed32(buf, entry.GetRawData().size());
-      ++new_num_entries;
-    }
-    return false;
-  };
-  base.ForEachMiniRunIndexEntry(processor,
-                                LeafIndexEntry::TraversalOrder::forward);
-  // Append footer (# of minirun index entries).
-  PutFixed32(buf, new_num_entries);
+                                   std::to_string(num_runs) + "]");
+  std::vector<MiniRunIndexEntry> runs;
+  runs.reserve(num_runs);
+  for (uint32_t i = 0; i < num_runs; ++i) {
+    if (i < start || i > end) runs.push_back(base.GetMiniRunIndexEntry(i));
+  }
+  Build(runs, buf);
   *new_entry = LeafIndexEntry(Slice(*buf));
   return Status::OK();
 }
@@ -363,30 +463,118 @@ Iterator* LeafStore::NewIterator(const ReadOptions& options) {
   return new LeafStoreIterator(options, this);
 }
 
+size_t LeafBoundaries::FindLeaf(const Comparator* user_cmp,
+                                const Slice& user_key) const {
+  size_t left = 0, right = size();
+  while (left < right) {
+    size_t mid = left + (right - left) / 2;
+    if (user_cmp->Compare(key(mid), user_key) < 0) {
+      left = mid + 1;
+    } else {
+      right = mid;
+    }
+  }
+  return left;
+}
+
+bool LeafStore::BoundariesCurrent(const LeafBoundaries* boundaries) {
+  return boundaries != nullptr &&
+         boundaries_generation_.load(std::memory_order_acquire) ==
+             boundaries->generation();
+}
+
+Status LeafStore::WriteLeafIndex(WriteBatch* batch) {
+  MutexLock l(&boundaries_mutex_);
+  boundaries_generation_.fetch_add(1, std::memory_order_seq_cst);
+  return leaf_index_->Write(WriteOptions(), batch);
+}
+
+Status LeafStore::RebuildLeafBoundaries() {
+  MutexLock l(&boundaries_mutex_);
+  std::shared_ptr<LeafBoundaries> boundaries(new LeafBoundaries(
+      boundaries_generation_.load(std::memory_order_relaxed)));
+  std::unique_ptr<Iterator> it(leaf_index_->NewIterator(ReadOptions()));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    boundaries->Append(it->key());
+  }
+  if (!it->status().ok()) return it->status();
+  boundaries_ = std::move(boundaries);
+  return Status::OK();
+}
+
+std::shared_ptr<const LeafBoundaries> LeafStore::CurrentLeafBoundaries() {
+  MutexLock l(&boundaries_mutex_);
+  return boundaries_;
+}
+
 Status LeafStore::Get(const ReadOptions& options, const LookupKey& key,
-                      std::string* value, LeafStatStore& stat_store) {
-  Iterator* it = leaf_index_->NewIterator(options);
-  DeferCode c([it]() { delete it; });
-  it->Seek(key.user_key());
-  if (it->Valid() == false) return Status::NotFound("");
+                      std::string* value, LeafStatStore& stat_store,
+                      SequenceNumber* found_seq,
+                      const LeafBoundaries* boundaries) {
+  if (found_seq != nullptr) *found_seq = 0;
+  uint64_t read_view = seg_manager_->AcquireReadView();
+  DeferCode v([this, read_view]() {
+    seg_manager_->ReleaseReadView(read_view);
+  });
+  Slice leaf_max_key, index_data;
+  std::string index_entry_data;
+  Iterator* it = nullptr;
+  DeferCode c([&it]() { delete it; });
+  bool found_leaf = false;
+  if (BoundariesCurrent(boundaries)) {
+    // The leaf is the first one whose max key is not before the key, so
+    // its entry can be read by that max key without an iterator
+    size_t leaf = boundaries->FindLeaf(user_cmp_, key.user_key());
+    if (leaf == boundaries->size()) return Status::NotFound("");
+    SILKSTORE_PERF_TIMER_GUARD(leaf_index_seek_nanos);
+    leaf_max_key = boundaries->key(leaf);
+    found_leaf =
+        leaf_index_->Get(options, leaf_max_key, &index_entry_data).ok();
+    // A leaf index write since FindLeaf() may have split or removed the
+    // leaf, moving the key elsewhere
+    found_leaf = found_leaf && BoundariesCurrent(boundaries);
+    index_data = index_entry_data;
+  }
+  if (!found_leaf) {
+    it = leaf_index_->NewIterator(options);
+    {
+      SILKSTORE_PERF_TIMER_GUARD(leaf_index_seek_nanos);
+      it->Seek(key.user_key());
+    }
+    if (it->Valid() == false) return Status::NotFound("");
+    leaf_max_key = it->key();
+    index_data = it->value();
+  }
+  SILKSTORE_PERF_COUNTER_ADD(leaf_index_seek_count, 1);
   // TODO(yunxiao): Can get old data that contains a segment which has been
   // deleted.
-  Slice index_data = it->value();
   Status s;
   Status key_status = Status::NotFound("");
   LeafIndexEntry index_entry(index_data);
   ParsedInternalKey parsed_lookup_key;
   ParseInternalKey(key.internal_key(), &parsed_lookup_key);
+  uint64_t runs_probed = 0, runs_hit = 0, runs_miss = 0;
+  uint64_t filter_false_positives = 0;
   auto processor = [&, this](const MiniRunIndexEntry& minirun_index_entry,
                              uint32_t) -> bool {
-    ++runs_searched;
+    ++runs_probed;
+    SILKSTORE_PERF_COUNTER_ADD(runs_searched_count, 1);
+    bool filter_checked = false;
     if (options_.filter_policy) {
       FilterBlockReader filter(options_.filter_policy,
                                minirun_index_entry.GetFilterData());
-      if (filter.KeyMayMatch(0, key.internal_key()) == false) {
-        bloom_filter_counts++;
+      bool may_match;
+      {
+        SILKSTORE_PERF_TIMER_GUARD(filter_check_nanos);
+        may_match = filter.KeyMayMatch(0, key.internal_key());
+      }
+      SILKSTORE_PERF_COUNTER_ADD(filter_check_count, 1);
+      if (may_match == false) {
+        SILKSTORE_PERF_COUNTER_ADD(filter_useful_count, 1);
+        if (statistics_) statistics_->RecordTick(kFilterUseful);
         return false;
       }
+      filter_checked = true;
     }
     uint32_t seg_no = minirun_index_entry.GetSegmentNumber();
     Segment* seg = nullptr;
@@ -406,7 +594,18 @@ Status LeafStore::Get(const ReadOptions& options, const LookupKey& key,
     });  // todo fix memory leak: new run but not delelte
 
     std::unique_ptr<Iterator> iter(run->NewIterator(options));
-    iter->Seek(key.internal_key());
+    {
+      // Block reads are timed on their own, so only the remainder of the
+      // seek is charged to decoding
+      PerfContext* perf = GetPerfContext();
+      uint64_t read_nanos = perf->block_read_nanos;
+      PerfTimer timer(&perf->block_decode_nanos);
+      iter->Seek(key.internal_key());
+      uint64_t elapsed = timer.Elapsed();
+      timer.Stop();
+      uint64_t read_delta = perf->block_read_nanos - read_nanos;
+      perf->block_decode_nanos -= std::min(elapsed, read_delta);
+    }
 
     if (iter->Valid()) {
       ParsedInternalKey parsed_key;
@@ -417,25 +616,34 @@ Status LeafStore::Get(const ReadOptions& options, const LookupKey& key,
         auto parsed_user_key = parsed_key.user_key;
         auto key_user_key = key.user_key();
         if (user_cmp_->Compare(parsed_user_key, key_user_key) == 0) {
+          if (found_seq != nullptr) *found_seq = parsed_key.sequence;
           if (parsed_key.type == kTypeValue) {  // kFound
             value->assign(iter->value().data(), iter->value().size());
             key_status = Status::OK();
           } else {  // kDeleted
             key_status = Status::NotFound("");
           }
-          runs_hit_counts++;
+          ++runs_hit;
           return true;
         }
       }
     }
 
-    runs_miss_counts++;
+    ++runs_miss;
+    if (filter_checked) ++filter_false_positives;
     return false;
   };
 
   index_entry.ForEachMiniRunIndexEntry(
       processor, LeafIndexEntry::TraversalOrder::backward);
-  stat_store.IncrementLeafReads(it->key().ToString());
+  stat_store.IncrementLeafReads(leaf_max_key);
+  if (statistics_) {
+    statistics_->RecordTick(kRunsSearched, runs_probed);
+    statistics_->RecordTick(kRunsHit, runs_hit);
+    statistics_->RecordTick(kRunsMiss, runs_miss);
+    statistics_->RecordTick(kFilterFalsePositive, filter_false_positives);
+    statistics_->RecordInHistogram(kRunsProbedPerGet, runs_probed);
+  }
   return !s.ok() ? s : key_status;
 }
 
@@ -483,8 +691,12 @@ Iterator* LeafStore::NewIteratorForLeaf(const ReadOptions& options,
   };
   // Traverse the minirun index entries in backward order so that
   // the latest version of the keys come first in the merged ordered sequence.
-  leaf_index_entry.ForEachMiniRunIndexEntry(
-      processor, LeafIndexEntry::TraversalOrder::backward);
+  // Only the requested runs are decoded.
+  int64_t last = std::min<int64_t>(
+      end_minirun_no, int64_t(leaf_index_entry.GetNumMiniRuns()) - 1);
+  for (int64_t i = last; i >= int64_t(start_minirun_no); --i) {
+    if (processor(leaf_index_entry.GetMiniRunIndexEntry(i), i)) break;
+  }
   if (!s.ok()) {
     return nullptr;
   }
@@ -506,10 +718,296 @@ Iterator* LeafStore::NewDBIterForLeaf(
   return leveldb::silkstore::NewDBIterator(user_comparator, internal_iter, seq);
 }
 
+LeafStatStore::LeafStatStore()
+    : read_counters_(new ReadCounter[kNumReadSlots * kReadCountersPerSlot]) {
+  for (int i = 0; i < kNumReadSlots * kReadCountersPerSlot; ++i) {
+    read_counters_[i].key_hash.store(0, std::memory_order_relaxed);
+    read_counters_[i].reads.store(0, std::memory_order_relaxed);
+  }
+}
+
+uint64_t LeafStatStore::KeyHash(const Slice& key) {
+  uint64_t h = (static_cast<uint64_t>(Hash(key.data(), key.size(), 0x9747b28c))
+                << 32) |
+               Hash(key.data(), key.size(), 0xbc9f1d34);
+  return h == 0 ? 1 : h;  // 0 marks an unused ReadCounter
+}
+
+LeafStatStore::LeafStat* LeafStatStore::FindLeaf(const std::string& key) {
+  lock.AssertHeld();
+  auto it = ids_.find(key);
+  if (it == ids_.end()) return nullptr;
+  return &leaves_[it->second].stat;
+}
+
+LeafStatStore::LeafStat* LeafStatStore::AddLeaf(const std::string& key) {
+  lock.AssertHeld();
+  auto it = ids_.find(key);
+  if (it != ids_.end()) return &leaves_[it->second].stat;
+  uint32_t id;
+  if (!free_ids_.empty()) {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  } else {
+    id = leaves_.size();
+    leaves_.emplace_back();
+  }
+  Leaf& leaf = leaves_[id];
+  leaf.key = key;
+  leaf.key_hash = KeyHash(key);
+  ids_[Slice(leaf.key)] = id;
+  ids_by_hash_[leaf.key_hash] = id;
+  return &leaf.stat;
+}
+
+void LeafStatStore::RemoveLeaf(const std::string& key) {
+  lock.AssertHeld();
+  auto it = ids_.find(key);
+  if (it == ids_.end()) return;
+  uint32_t id = it->second;
+  Leaf& leaf = leaves_[id];
+  auto hit = ids_by_hash_.find(leaf.key_hash);
+  if (hit != ids_by_hash_.end() && hit->second == id) ids_by_hash_.erase(hit);
+  ids_.erase(it);
+  leaf.key.clear();
+  free_ids_.push_back(id);
+}
+
+void LeafStatStore::AddReads(uint64_t key_hash, uint32_t reads) {
+  lock.AssertHeld();
+  auto it = ids_by_hash_.find(key_hash);
+  if (it == ids_by_hash_.end()) return;  // leaf was deleted or split
+  leaves_[it->second].stat.reads_in_last_interval += reads;
+}
+
+void LeafStatStore::FoldReadCounters(int slot) {
+  lock.AssertHeld();
+  ReadCounter* table = &read_counters_[slot * kReadCountersPerSlot];
+  for (int i = 0; i < kReadCountersPerSlot; ++i) {
+    uint64_t key_hash = table[i].key_hash.load(std::memory_order_acquire);
+    if (key_hash == 0) continue;
+    // A read racing with the reset below may be credited to whichever leaf
+    // claims this entry next.  Hotness is a heuristic; that is acceptable.
+    uint32_t reads = table[i].reads.exchange(0, std::memory_order_relaxed);
+    table[i].key_hash.store(0, std::memory_order_release);
+    AddReads(key_hash, reads);
+  }
+}
+
+void LeafStatStore::NewLeaf(const std::string& key, int num_runs) {
+  MutexLock g(&lock);
+  *AddLeaf(key) = {-1, 0, 0, (long long)Env::Default()->NowMicros() / 1000000,
+                   0,  num_runs};
+}
+
+void LeafStatStore::IncrementLeafReads(const Slice& leaf_key) {
+  const uint64_t key_hash = KeyHash(leaf_key);
+  const int slot = ThreadSlot(kNumReadSlots);
+  ReadCounter* table = &read_counters_[slot * kReadCountersPerSlot];
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    for (int probe = 0; probe < kMaxReadCounterProbes; ++probe) {
+      ReadCounter& c =
+          table[(key_hash + probe) & (kReadCountersPerSlot - 1)];
+      uint64_t cur = c.key_hash.load(std::memory_order_acquire);
+      if (cur == 0) {
+        if (c.key_hash.compare_exchange_strong(cur, key_hash,
+                                               std::memory_order_acq_rel)) {
+          cur = key_hash;
+        }
+      }
+      if (cur == key_hash) {
+        c.reads.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+    // This thread touched too many leaves since the last
+    // UpdateReadHotness(); drain its table and retry.
+    MutexLock g(&lock);
+    FoldReadCounters(slot);
+  }
+}
+
+double LeafStatStore::GetWriteHotness(const std::string& leaf_key) {
+  MutexLock g(&lock);
+  LeafStat* stat = FindLeaf(leaf_key);
+  if (stat == nullptr) return -1;
+  return stat->write_hotness;
+}
+
+int LeafStatStore::GetGroupId(const std::string& leaf_key) {
+  MutexLock g(&lock);
+  LeafStat* stat = FindLeaf(leaf_key);
+  if (stat == nullptr) return -1;
+  return stat->group_id;
+}
+
+void LeafStatStore::GroupLeaves(Segmenter* segmenter, int num_groups) {
+  std::vector<std::string> keys;
+  std::vector<double> hotness;
+  {
+    MutexLock g(&lock);
+    const long long cur_time_in_s = Env::Default()->NowMicros() / 1000000;
+    keys.reserve(ids_.size());
+    hotness.reserve(ids_.size());
+    for (auto& kv : ids_) {
+      const Leaf& leaf = leaves_[kv.second];
+      keys.push_back(leaf.key);
+      hotness.push_back(std::log1p(
+          leaf.stat.write_hotness /
+          std::max(1LL, cur_time_in_s - leaf.stat.last_write_time_in_s)));
+    }
+  }
+  if (keys.empty()) return;
+
+  // Clustering takes a while with many leaves, so it runs unlocked.
+  // Leaves split or merged meanwhile keep their group until the next run.
+  std::vector<int> groups = segmenter->classify(hotness, num_groups);
+  const int coldest = *std::max_element(groups.begin(), groups.end());
+  MutexLock g(&lock);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    LeafStat* stat = FindLeaf(keys[i]);
+    if (stat != nullptr) stat->group_id = coldest - groups[i];
+  }
+}
+
+double LeafStatStore::GetReadHotness(const std::string& leaf_key) {
+  MutexLock g(&lock);
+  LeafStat* stat = FindLeaf(leaf_key);
+  if (stat == nullptr) return -1;
+  return stat->read_hotness;
+}
+
+void LeafStatStore::DeleteLeaf(const std::string& leaf_key) {
+  MutexLock g(&lock);
+  RemoveLeaf(leaf_key);
+}
+
+void LeafStatStore::UpdateLeafNumRuns(const std::string& leaf_key,
+                                      int num_runs) {
+  MutexLock g(&lock);
+  LeafStat* stat = FindLeaf(leaf_key);
+  if (stat == nullptr) return;
+  stat->num_runs = num_runs;
+}
+
+void LeafStatStore::UpdateWriteHotness(const std::string& leaf_key,
+                                       int writes) {
+  MutexLock g(&lock);
+  long long cur_time_in_s = Env::Default()->NowMicros() / 1000000;
+  LeafStat* stat = FindLeaf(leaf_key);
+  if (stat == nullptr) {
+    stat = AddLeaf(leaf_key);
+    *stat = {-1, 0, 0, cur_time_in_s, 0, 0};
+  }
+  // We weight the writes by the inverse of the amount of time elapsed since
+  // last update. Therefore, the longer the elapsed time is, the less the
+  // writes contribute to the hotness. This reflects not only the amount of
+  // writes but also the frequency of writes.
+  double weighted_writes =
+      (double)writes /
+      std::max(1LL, cur_time_in_s - stat->last_write_time_in_s);
+  stat->write_hotness = ExpSmoothUpdate(stat->write_hotness, weighted_writes,
+                                        write_hotness_exp_smooth_factor);
+  stat->last_write_time_in_s = cur_time_in_s;
+}
+
+void LeafStatStore::SplitLeaf(const std::string& leaf_key,
+                              std::vector<std::string>& splitted_keys) {
+  // leaf_key is splitted into (first_half_key, leaf_key)
+  MutexLock g(&lock);
+  LeafStat* stat = FindLeaf(leaf_key);
+  if (stat == nullptr) return;
+  LeafStat original_leaf_stat = *stat;
+  RemoveLeaf(leaf_key);
+  for (auto& subkey : splitted_keys) {
+    LeafStat& new_leaf_stat = *AddLeaf(subkey);
+    new_leaf_stat = {
+        -1, 0, 0, (long long)Env::Default()->NowMicros() / 1000000, 0, 1};
+    new_leaf_stat.write_hotness =
+        original_leaf_stat.write_hotness / splitted_keys.size();
+    new_leaf_stat.read_hotness =
+        original_leaf_stat.read_hotness / splitted_keys.size();
+    new_leaf_stat.reads_in_last_interval =
+        original_leaf_stat.reads_in_last_interval / splitted_keys.size();
+    new_leaf_stat.group_id = original_leaf_stat.group_id;
+    new_leaf_stat.last_write_time_in_s =
+        original_leaf_stat.last_write_time_in_s;
+  }
+}
+
+void LeafStatStore::MergeLeaves(const std::vector<std::string>& leaf_keys) {
+  if (leaf_keys.empty()) return;
+  MutexLock g(&lock);
+  LeafStat merged_stat = {
+      -1, 0, 0, (long long)Env::Default()->NowMicros() / 1000000, 0, 1};
+  bool found = false;
+  double hottest = 0;
+  for (auto& key : leaf_keys) {
+    LeafStat* stat = FindLeaf(key);
+    if (stat == nullptr) continue;
+    if (!found || stat->write_hotness > hottest) {
+      // The merged leaf stays in the group of its hottest part
+      merged_stat.group_id = stat->group_id;
+      hottest = stat->write_hotness;
+    }
+    merged_stat.write_hotness += stat->write_hotness;
+    merged_stat.read_hotness += stat->read_hotness;
+    merged_stat.reads_in_last_interval += stat->reads_in_last_interval;
+    merged_stat.last_write_time_in_s =
+        found ? std::max(merged_stat.last_write_time_in_s,
+                         stat->last_write_time_in_s)
+              : stat->last_write_time_in_s;
+    found = true;
+    RemoveLeaf(key);
+  }
+  *AddLeaf(leaf_keys.back()) = merged_stat;
+}
+
+void LeafStatStore::UpdateReadHotness() {
+  MutexLock g(&lock);
+  for (int slot = 0; slot < kNumReadSlots; ++slot) {
+    FoldReadCounters(slot);
+  }
+  for (auto& kv : ids_) {
+    UpdateReadHotnessForOneLeaf(leaves_[kv.second].stat);
+  }
+}
+
+void LeafStatStore::ForEachLeaf(
+    std::function<void(const std::string&, const LeafStat&)> processor) {
+  MutexLock g(&lock);
+  for (auto& kv : ids_) {
+    const Leaf& leaf = leaves_[kv.second];
+    processor(leaf.key, leaf.stat);
+  }
+}
+
+size_t LeafStatStore::ApproximateMemoryUsage() {
+  MutexLock g(&lock);
+  // Hash table nodes carry a next pointer and the cached hash
+  const size_t node_overhead = 2 * sizeof(void*);
+  size_t usage = leaves_.size() * sizeof(Leaf) +
+                 free_ids_.capacity() * sizeof(uint32_t) +
+                 ids_.size() * (sizeof(Slice) + sizeof(uint32_t) +
+                                node_overhead) +
+                 ids_.bucket_count() * sizeof(void*) +
+                 ids_by_hash_.size() * (sizeof(uint64_t) + sizeof(uint32_t) +
+                                        node_overhead) +
+                 ids_by_hash_.bucket_count() * sizeof(void*);
+  for (const Leaf& leaf : leaves_) {
+    // Short keys live inside the std::string itself
+    if (leaf.key.capacity() > std::string().capacity()) {
+      usage += leaf.key.capacity() + 1;
+    }
+  }
+  return usage;
+}
+
 Status LeafStore::Open(SegmentManager* seg_manager, DB* leaf_index,
                        const Options& options, const Comparator* user_cmp,
-                       LeafStore** store) {
-  *store = new LeafStore(seg_manager, leaf_index, options, user_cmp);
+                       Statistics* statistics, LeafStore** store) {
+  *store =
+      new LeafStore(seg_manager, leaf_index, options, user_cmp, statistics);
   return Status::OK();
 }
 
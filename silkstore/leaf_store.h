@@ -5,9 +5,12 @@
 #ifndef SILKSTORE_LEAF_INDEX_H
 #define SILKSTORE_LEAF_INDEX_H
 
+#include <atomic>
 #include <climits>
 #include <cstdint>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -19,6 +22,7 @@
 #include "leveldb/iterator.h"
 #include "leveldb/options.h"
 #include "leveldb/slice.h"
+#include "nvm/leafindex/leafindex.h"
 #include "table/block.h"
 #include "util/mutexlock.h"
 
@@ -26,6 +30,7 @@ namespace leveldb {
 namespace silkstore {
 
 class SegmentManager;
+class Statistics;
 // format
 //
 class MiniRunIndexEntry {
@@ -57,6 +62,21 @@ class MiniRunIndexEntry {
   uint32_t run_datasize_;
 };
 
+// A LeafIndexEntry lists the miniruns of a leaf, oldest first.
+//
+// v1 format (still readable):
+//    [minirun index entry][fixed32 entry size] ... [fixed32 num runs]
+//
+// v2 format (written by LeafIndexEntryBuilder):
+//    fixed32 num runs
+//    fixed64 leaf data size
+//    num runs * {fixed32 blob offset, fixed32 run data size,
+//                fixed32 segment number, fixed32 run number}
+//    minirun index entries, one blob per run in run order
+//    fixed32 kLeafIndexEntryV2Magic
+//
+// The fixed-width run table gives O(1) access to run i and keeps the
+// metadata of all runs together ahead of the index and filter blobs.
 class LeafIndexEntry {
  public:
   LeafIndexEntry(const Slice& data = Slice());
@@ -65,6 +85,10 @@ class LeafIndexEntry {
 
   uint32_t GetNumMiniRuns() const;
 
+  // Index entry of run "i", 0 being the oldest.
+  // REQUIRES: i < GetNumMiniRuns().  O(1) for v2 entries.
+  MiniRunIndexEntry GetMiniRunIndexEntry(uint32_t i) const;
+
   bool Empty() const { return GetNumMiniRuns() == 0; }
 
   // Return all index entries of MiniRun sorted on insert time
@@ -80,9 +104,14 @@ class LeafIndexEntry {
 
   std::string ToString();
 
+  // O(1) for v2 entries.
   size_t GetLeafDataSize() const;
 
  private:
+  bool IsV2() const;
+  // Slice of each run's minirun index entry, oldest first (v1 only).
+  std::vector<Slice> DecodeV1Runs() const;
+
   Slice raw_data_;
 };
 
@@ -107,6 +136,74 @@ class LeafIndexEntryBuilder {
   static Status RemoveMiniRunRange(const LeafIndexEntry& base, uint32_t start,
                                    uint32_t end, std::string* buf,
                                    LeafIndexEntry* new_entry);
+
+  // Encodes a leaf index update that appends "minirun_index_entry" to
+  // whatever entry the leaf has when the update is applied.  It holds only
+  // the new run, so writing it costs O(1) runs instead of O(T).
+  //    [minirun index entry][fixed32 kLeafIndexEntryDeltaMagic]
+  static Slice EncodeAppendDelta(const MiniRunIndexEntry& minirun_index_entry,
+                                 std::string* buf);
+
+  // Returns true iff "value" was produced by EncodeAppendDelta().
+  static bool IsAppendDelta(const Slice& value);
+
+  // Appends the runs of "deltas", oldest first, to "base".
+  static void ApplyAppendDeltas(const LeafIndexEntry& base,
+                                const std::vector<Slice>& deltas,
+                                std::string* buf, LeafIndexEntry* new_entry);
+
+ private:
+  // Encodes "runs" (oldest first) as a v2 entry into *buf.  The runs may
+  // point into *buf.
+  static void Build(const std::vector<MiniRunIndexEntry>& runs,
+                    std::string* buf);
+};
+
+// Lets the NVM leaf index log append deltas instead of full entries.
+class LeafIndexEntryMerger : public LeafIndexValueMerger {
+ public:
+  bool IsDelta(const Slice& value) const override {
+    return LeafIndexEntryBuilder::IsAppendDelta(value);
+  }
+
+  void Merge(const Slice& base, const std::vector<Slice>& deltas,
+             std::string* result) const override {
+    LeafIndexEntry new_entry;
+    LeafIndexEntryBuilder::ApplyAppendDeltas(LeafIndexEntry(base), deltas,
+                                             result, &new_entry);
+  }
+};
+
+// An immutable, sorted copy of the leaf max keys.  Point lookups search
+// it for the leaf of a key instead of seeking the leaf index.  The keys
+// are stored back to back in one buffer.
+class LeafBoundaries {
+ public:
+  // "generation" identifies the leaf index state the keys were read from.
+  explicit LeafBoundaries(uint64_t generation) : generation_(generation) {
+    offsets_.push_back(0);
+  }
+
+  // REQUIRES: "key" is after every key added so far.
+  void Append(const Slice& key) {
+    data_.append(key.data(), key.size());
+    offsets_.push_back(data_.size());
+  }
+
+  uint64_t generation() const { return generation_; }
+  size_t size() const { return offsets_.size() - 1; }
+  Slice key(size_t i) const {
+    return Slice(data_.data() + offsets_[i], offsets_[i + 1] - offsets_[i]);
+  }
+
+  // Returns the index of the first leaf whose max key is >= "user_key",
+  // or size() if every leaf is before it.
+  size_t FindLeaf(const Comparator* user_cmp, const Slice& user_key) const;
+
+ private:
+  const uint64_t generation_;
+  std::string data_;
+  std::vector<size_t> offsets_;  // key i is data_[offsets_[i], offsets_[i+1])
 };
 
 /*
@@ -115,7 +212,8 @@ class LeafIndexEntryBuilder {
  *  1. Write Hotness: measurement of update frequency of a leaf
  *  2. Group Id: which group this leaf belongs to. This is updated after
  *      each run of clustering algorithm on the leaves based on Write Hotness
- * measure. Possible groups: Hot, Warm, Cold, Read-only.
+ * measure. Group 0 is the hottest; leaves that are only read end up in the
+ * last group.
  *  3. Read Hotness: measurement of read frequency of a leaf.
  *
  * The stats serve two purposes:
@@ -124,6 +222,8 @@ class LeafIndexEntryBuilder {
  *  2. To group minruns with similar hotness together during merge to increase
  * future GC efficiency.
  */
+class Segmenter;
+
 class LeafStatStore {
  public:
   static constexpr int read_interval_in_micros = 5000000;
@@ -141,122 +241,74 @@ class LeafStatStore {
     int num_runs;
   };
 
-  void NewLeaf(const std::string& key) {
-    MutexLock g(&lock);
-    m[key] = {-1, 0, 0, (long long)Env::Default()->NowMicros() / 1000000, 0, 0};
-  }
+  LeafStatStore();
 
-  void NewLeaf(const std::string& key, int num_runs) {
-    MutexLock g(&lock);
-    m[key] = {-1, 0,       0, (long long)Env::Default()->NowMicros() / 1000000,
-              0,  num_runs};
-  }
+  void NewLeaf(const std::string& key) { NewLeaf(key, 0); }
 
-  void IncrementLeafReads(const std::string& leaf_key) {
-    MutexLock g(&lock);
-    auto it = m.find(leaf_key);
-    if (it == m.end()) {
-      /* g.Release();
-      NewLeaf(leaf_key);
-      IncrementLeafReads(leaf_key); */
-      return;
-    }
-    LeafStat& stat = it->second;
-    ++stat.reads_in_last_interval;
-  }
+  void NewLeaf(const std::string& key, int num_runs);
 
-  double GetWriteHotness(const std::string& leaf_key) {
-    MutexLock g(&lock);
-    auto it = m.find(leaf_key);
-    if (it == m.end()) return -1;
-    return it->second.write_hotness;
-  }
+  // Called on every leaf-layer lookup.  Takes no lock and does not
+  // allocate: the read is counted in a per-thread table and folded into the
+  // leaf's LeafStat by the next UpdateReadHotness().
+  void IncrementLeafReads(const Slice& leaf_key);
 
-  double GetReadHotness(const std::string& leaf_key) {
-    MutexLock g(&lock);
-    auto it = m.find(leaf_key);
-    if (it == m.end()) return -1;
-    return it->second.read_hotness;
-  }
+  double GetWriteHotness(const std::string& leaf_key);
 
-  void DeleteLeaf(const std::string& leaf_key) {
-    MutexLock g(&lock);
-    m.erase(leaf_key);
-  }
+  double GetReadHotness(const std::string& leaf_key);
 
-  void UpdateLeafNumRuns(const std::string& leaf_key, int num_runs) {
-    MutexLock g(&lock);
-    auto it = m.find(leaf_key);
-    if (it == m.end()) {
-      return;
-    }
-    LeafStat& stat = it->second;
-    stat.num_runs = num_runs;
-  }
+  // Returns -1 if the leaf is unknown or has not been grouped yet.
+  int GetGroupId(const std::string& leaf_key);
 
-  void UpdateWriteHotness(const std::string& leaf_key, int writes) {
-    MutexLock g(&lock);
-    auto it = m.find(leaf_key);
-    if (it == m.end()) {
-      g.Release();
-      NewLeaf(leaf_key);
-      UpdateWriteHotness(leaf_key, writes);
-      return;
-    }
-
-    LeafStat& stat = it->second;
-    long long cur_time_in_s = Env::Default()->NowMicros() / 1000000;
-    // We weight the writes by the inverse of the amount of time elapsed since
-    // last update. Therefore, the longer the elapsed time is, the less the
-    // writes contribute to the hotness. This reflects not only the amount of
-    // writes but also the frequency of writes.
-    double weighted_writes =
-        (double)writes /
-        std::max(1LL, cur_time_in_s - stat.last_write_time_in_s);
-    stat.write_hotness = ExpSmoothUpdate(stat.write_hotness, weighted_writes,
-                                         write_hotness_exp_smooth_factor);
-    stat.last_write_time_in_s = cur_time_in_s;
-  }
+  // Clusters the leaves into at most "num_groups" groups by write hotness,
+  // discounted by the time since each leaf was last written, and numbers
+  // the groups hottest first.  Skewed hotness is clustered on a log scale.
+  void GroupLeaves(Segmenter* segmenter, int num_groups);
+
+  void DeleteLeaf(const std::string& leaf_key);
+
+  void UpdateLeafNumRuns(const std::string& leaf_key, int num_runs);
+
+  void UpdateWriteHotness(const std::string& leaf_key, int writes);
 
   void SplitLeaf(const std::string& leaf_key,
-                 std::vector<std::string>& splitted_keys) {
-    // leaf_key is splitted into (first_half_key, leaf_key)
-    MutexLock g(&lock);
-    if (m.find(leaf_key) == m.end()) return;
-    LeafStat original_leaf_stat = m[leaf_key];
-    m.erase(leaf_key);
-    for (auto& subkey : splitted_keys) {
-      LeafStat& new_leaf_stat = m[subkey] = {
-          -1, 0, 0, (long long)Env::Default()->NowMicros() / 1000000, 0, 1};
-      new_leaf_stat.write_hotness =
-          original_leaf_stat.write_hotness / splitted_keys.size();
-      new_leaf_stat.read_hotness =
-          original_leaf_stat.read_hotness / splitted_keys.size();
-      new_leaf_stat.reads_in_last_interval =
-          original_leaf_stat.reads_in_last_interval / splitted_keys.size();
-      new_leaf_stat.group_id = original_leaf_stat.group_id;
-      new_leaf_stat.last_write_time_in_s =
-          original_leaf_stat.last_write_time_in_s;
-    }
-  }
+                 std::vector<std::string>& splitted_keys);
 
-  void UpdateReadHotness() {
-    MutexLock g(&lock);
-    for (auto& kv : m) {
-      UpdateReadHotnessForOneLeaf(kv.second);
-    }
-  }
+  // The leaves in "leaf_keys" are merged into the last of them, which
+  // inherits their combined hotness.
+  void MergeLeaves(const std::vector<std::string>& leaf_keys);
+
+  void UpdateReadHotness();
 
   void ForEachLeaf(
-      std::function<void(const std::string&, const LeafStat&)> processor) {
-    MutexLock g(&lock);
-    // printf( "Leaf nums : %ld \n",  m.size() );
-    for (auto& kv : m) {
-      processor(kv.first, kv.second);
-    }
-  }
+      std::function<void(const std::string&, const LeafStat&)> processor);
+
+  // Returns an estimate of the bytes of DRAM held by the leaf stats.
+  size_t ApproximateMemoryUsage();
 
  private:
+  // Leaves are identified by a dense id; ids of deleted leaves are reused.
+  struct Leaf {
+    std::string key;
+    uint64_t key_hash;
+    LeafStat stat;
+  };
+
+  // Per-thread open-addressed table of read counts keyed by KeyHash().
+  // Entries are claimed with a CAS, so threads sharing a slot stay correct.
+  struct ReadCounter {
+    std::atomic<uint64_t> key_hash;  // 0 if unused
+    std::atomic<uint32_t> reads;
+  };
+  static const int kNumReadSlots = 64;
+  static const int kReadCountersPerSlot = 1024;  // power of two
+  static const int kMaxReadCounterProbes = 16;
+
+  static uint64_t KeyHash(const Slice& key);
+
+  struct KeyHasher {
+    size_t operator()(const Slice& key) const { return KeyHash(key); }
+  };
+
   double ExpSmoothUpdate(double old, double new_sample, double factor) {
     return old * (1 - factor) + new_sample * factor;
   }
@@ -274,18 +326,50 @@ class LeafStatStore {
     stat.reads_in_last_interval = 0;
   }
 
+  // REQUIRES: lock is held
+  LeafStat* FindLeaf(const std::string& key);
+  LeafStat* AddLeaf(const std::string& key);
+  void RemoveLeaf(const std::string& key);
+  void AddReads(uint64_t key_hash, uint32_t reads);
+  void FoldReadCounters(int slot);
+
   port::Mutex lock;
-  std::unordered_map<std::string, LeafStat> m;
+  // Leaf id by key.  The keys point into leaves_, so each leaf key is
+  // stored once; a deque never moves a Leaf once added.
+  std::unordered_map<Slice, uint32_t, KeyHasher> ids_;
+  std::unordered_map<uint64_t, uint32_t> ids_by_hash_;  // KeyHash -> leaf id
+  std::deque<Leaf> leaves_;                             // indexed by leaf id
+  std::vector<uint32_t> free_ids_;
+  std::unique_ptr<ReadCounter[]> read_counters_;
 };
 
 class LeafStore {
  public:
   static Status Open(SegmentManager* seg_manager, DB* leaf_index,
                      const Options& options, const Comparator* user_cmp,
-                     LeafStore** store);
+                     Statistics* statistics, LeafStore** store);
 
+  // If found_seq is non-null it is set to the sequence number of the entry
+  // that decided the lookup, or 0 if the key is absent from the leaves.
+  // While "boundaries" are non-null and still current, the leaf is found
+  // in them and its entry read with a point lookup instead of seeking a
+  // leaf index iterator.
   Status Get(const ReadOptions& options, const LookupKey& key,
-             std::string* value, LeafStatStore& stat_store);
+             std::string* value, LeafStatStore& stat_store,
+             SequenceNumber* found_seq = nullptr,
+             const LeafBoundaries* boundaries = nullptr);
+
+  // Applies "batch" to the leaf index.  Writes that may add or remove
+  // leaves must go through here so that lookups stop using boundaries
+  // taken before them.
+  Status WriteLeafIndex(WriteBatch* batch);
+
+  // Re-reads the leaf boundaries from the leaf index.
+  Status RebuildLeafBoundaries();
+
+  // Returns the boundaries built by the last RebuildLeafBoundaries(), or
+  // null if there were none.  They may be stale; Get() checks.
+  std::shared_ptr<const LeafBoundaries> CurrentLeafBoundaries();
 
   Iterator* NewIterator(const ReadOptions& options);
 
@@ -304,16 +388,31 @@ class LeafStore {
   class LeafStoreIterator;
 
   LeafStore(SegmentManager* seg_manager, DB* leaf_index, const Options& options,
-            const Comparator* user_cmp)
+            const Comparator* user_cmp, Statistics* statistics)
       : seg_manager_(seg_manager),
         leaf_index_(leaf_index),
         options_(options),
-        user_cmp_(user_cmp) {}
+        user_cmp_(user_cmp),
+        statistics_(statistics),
+        boundaries_generation_(0) {}
+
+  // Returns true if "boundaries" are non-null and no leaf index write
+  // happened since they were built.
+  bool BoundariesCurrent(const LeafBoundaries* boundaries);
 
   SegmentManager* seg_manager_;
   DB* leaf_index_;
   const Options options_;
   const Comparator* user_cmp_ = nullptr;
+  Statistics* statistics_;
+
+  // Serializes WriteLeafIndex() with RebuildLeafBoundaries()
+  port::Mutex boundaries_mutex_;
+  // Bumped before every WriteLeafIndex(); boundaries of an older
+  // generation are not trusted
+  std::atomic<uint64_t> boundaries_generation_;
+  std::shared_ptr<const LeafBoundaries> boundaries_
+      GUARDED_BY(boundaries_mutex_);
 };
 
 }  // namespace silkstore
@@ -0,0 +1,668 @@
+#include "silkstore/mem_leaf_index.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+#include "db/filename.h"
+#include "db/log_reader.h"
+#include "db/log_writer.h"
+#include "db/write_batch_internal.h"
+#include "leveldb/comparator.h"
+#include "nvm/leafindex/leafindex.h"
+#include "util/logging.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+namespace silkstore {
+
+// Entries per node before it is split in two
+static const size_t kMaxNodeSize = 64;
+
+// The log is rewritten once it is this large and holds this many times
+// the bytes of the tree.
+static const uint64_t kMinLogRewriteSize = 4 << 20;
+static const uint64_t kLogRewriteRatio = 2;
+
+// A log rewrite packs entries into records of about this size
+static const size_t kRewriteRecordSize = 1 << 20;
+
+// Leaves hold keys and values.  Inner nodes hold children, and as key i
+// the largest key under children[i].  Nodes are never modified once they
+// are reachable from a published root.
+//
+// The keys are stored back to back in one buffer so that copying a node
+// on the write path costs a few allocations rather than one per key.
+struct MemLeafIndex::Node {
+  std::string key_data;
+  // Key i is key_data[offsets[i], offsets[i + 1])
+  std::vector<uint32_t> offsets;
+  std::vector<std::shared_ptr<const std::string>> values;
+  std::vector<NodePtr> children;
+
+  Node() : offsets(1, 0) {}
+
+  bool leaf() const { return children.empty(); }
+  size_t size() const { return offsets.size() - 1; }
+
+  Slice key(size_t i) const {
+    return Slice(key_data.data() + offsets[i], offsets[i + 1] - offsets[i]);
+  }
+  Slice last_key() const { return key(size() - 1); }
+
+  void InsertKey(size_t i, const Slice& k) {
+    key_data.insert(offsets[i], k.data(), k.size());
+    offsets.insert(offsets.begin() + i + 1, offsets[i]);
+    for (size_t j = i + 1; j < offsets.size(); j++) offsets[j] += k.size();
+  }
+
+  void EraseKey(size_t i) {
+    const uint32_t len = offsets[i + 1] - offsets[i];
+    key_data.erase(offsets[i], len);
+    offsets.erase(offsets.begin() + i + 1);
+    for (size_t j = i + 1; j < offsets.size(); j++) offsets[j] -= len;
+  }
+
+  // REQUIRES: "k" does not point into this node
+  void SetKey(size_t i, const Slice& k) {
+    EraseKey(i);
+    InsertKey(i, k);
+  }
+
+  // Moves keys [from, size()) to the empty node "upper"
+  void MoveKeysTo(size_t from, Node* upper) {
+    const uint32_t base = offsets[from];
+    upper->key_data.assign(key_data, base, std::string::npos);
+    for (size_t j = from + 1; j < offsets.size(); j++) {
+      upper->offsets.push_back(offsets[j] - base);
+    }
+    key_data.resize(base);
+    offsets.resize(from + 1);
+  }
+
+  // Returns the index of the first key that is >= "k", or size() if
+  // there is none.
+  size_t LowerBound(const Comparator* cmp, const Slice& k) const {
+    size_t left = 0, right = size();
+    while (left < right) {
+      size_t mid = left + (right - left) / 2;
+      if (cmp->Compare(key(mid), k) < 0) {
+        left = mid + 1;
+      } else {
+        right = mid;
+      }
+    }
+    return left;
+  }
+};
+
+class MemLeafIndex::SnapshotImpl : public Snapshot {
+ public:
+  explicit SnapshotImpl(NodePtr root) : root(std::move(root)) {}
+
+  const NodePtr root;
+};
+
+// Applies a write batch to a private copy of the tree.  Nodes are copied
+// on the way down the first time the batch touches them and modified in
+// place afterwards.  Deletions only drop nodes that became empty, since
+// leaves are removed too rarely for rebalancing to pay off.
+class MemLeafIndex::Updater : public WriteBatch::Handler {
+ public:
+  Updater(const Comparator* cmp, const LeafIndexValueMerger* merger,
+          NodePtr root)
+      : cmp_(cmp), merger_(merger), root_(std::move(root)), live_delta_(0) {}
+
+  NodePtr root() const { return root_; }
+  int64_t live_delta() const { return live_delta_; }
+
+  void Put(const Slice& key, const Slice& value) override {
+    std::shared_ptr<const std::string> v;
+    if (merger_ != nullptr && merger_->IsDelta(value)) {
+      std::string merged;
+      merger_->Merge(Find(key), std::vector<Slice>(1, value), &merged);
+      v = std::make_shared<const std::string>(std::move(merged));
+    } else {
+      v = std::make_shared<const std::string>(value.data(), value.size());
+    }
+    live_delta_ += key.size() + v->size();
+    if (root_ == nullptr) {
+      std::shared_ptr<Node> leaf = NewNode();
+      leaf->InsertKey(0, key);
+      leaf->values.push_back(std::move(v));
+      root_ = std::move(leaf);
+      return;
+    }
+    NodePtr split;
+    NodePtr node = Insert(root_, key, std::move(v), &split);
+    if (split == nullptr) {
+      root_ = std::move(node);
+    } else {
+      std::shared_ptr<Node> root = NewNode();
+      root->InsertKey(0, node->last_key());
+      root->InsertKey(1, split->last_key());
+      root->children.push_back(std::move(node));
+      root->children.push_back(std::move(split));
+      root_ = std::move(root);
+    }
+  }
+
+  void Delete(const Slice& key) override {
+    if (root_ == nullptr) return;
+    bool erased = false;
+    root_ = Erase(root_, key, &erased);
+    // A root with a single child is just a longer path to its leaves
+    while (root_ != nullptr && !root_->leaf() && root_->size() == 1) {
+      root_ = root_->children[0];
+    }
+  }
+
+ private:
+  std::shared_ptr<Node> NewNode() {
+    std::shared_ptr<Node> node(new Node);
+    owned_.insert(node.get());
+    return node;
+  }
+
+  // Returns a node with the contents of "node" that the batch may
+  // modify: "node" itself if the batch created it, else a copy.
+  std::shared_ptr<Node> Writable(const NodePtr& node) {
+    if (owned_.count(node.get()) != 0) {
+      return std::const_pointer_cast<Node>(node);
+    }
+    std::shared_ptr<Node> copy(new Node(*node));
+    owned_.insert(copy.get());
+    return copy;
+  }
+
+  // Returns the value of "key", or an empty slice if it has none
+  Slice Find(const Slice& key) const {
+    const Node* node = root_.get();
+    while (node != nullptr) {
+      size_t i = node->LowerBound(cmp_, key);
+      if (i == node->size()) break;
+      if (node->leaf()) {
+        if (cmp_->Compare(node->key(i), key) == 0) return *node->values[i];
+        break;
+      }
+      node = node->children[i].get();
+    }
+    return Slice();
+  }
+
+  // Returns "node" with "key" set to "value".  If the result overflows,
+  // its upper half is moved to *split.
+  NodePtr Insert(const NodePtr& node, const Slice& key,
+                 std::shared_ptr<const std::string> value, NodePtr* split) {
+    std::shared_ptr<Node> copy = Writable(node);
+    size_t i = copy->LowerBound(cmp_, key);
+    if (copy->leaf()) {
+      if (i < copy->size() && cmp_->Compare(copy->key(i), key) == 0) {
+        live_delta_ -= copy->key(i).size() + copy->values[i]->size();
+        copy->values[i] = std::move(value);
+      } else {
+        copy->InsertKey(i, key);
+        copy->values.insert(copy->values.begin() + i, std::move(value));
+      }
+    } else {
+      // Keys past the largest one extend the last child
+      if (i == copy->size()) --i;
+      NodePtr child_split;
+      NodePtr child =
+          Insert(copy->children[i], key, std::move(value), &child_split);
+      copy->SetKey(i, child->last_key());
+      copy->children[i] = std::move(child);
+      if (child_split != nullptr) {
+        copy->InsertKey(i + 1, child_split->last_key());
+        copy->children.insert(copy->children.begin() + i + 1,
+                              std::move(child_split));
+      }
+    }
+    if (copy->size() > kMaxNodeSize) {
+      const size_t half = copy->size() / 2;
+      std::shared_ptr<Node> upper = NewNode();
+      copy->MoveKeysTo(half, upper.get());
+      if (copy->leaf()) {
+        upper->values.assign(copy->values.begin() + half,
+                             copy->values.end());
+        copy->values.resize(half);
+      } else {
+        upper->children.assign(copy->children.begin() + half,
+                               copy->children.end());
+        copy->children.resize(half);
+      }
+      *split = std::move(upper);
+    }
+    return copy;
+  }
+
+  // Returns "node" without "key", or null if nothing is left.  Sets
+  // *erased if the key was present.
+  NodePtr Erase(const NodePtr& node, const Slice& key, bool* erased) {
+    size_t i = node->LowerBound(cmp_, key);
+    if (i == node->size()) return node;
+    std::shared_ptr<Node> copy;
+    if (node->leaf()) {
+      if (cmp_->Compare(node->key(i), key) != 0) return node;
+      *erased = true;
+      live_delta_ -= node->key(i).size() + node->values[i]->size();
+      copy = Writable(node);
+      copy->EraseKey(i);
+      copy->values.erase(copy->values.begin() + i);
+    } else {
+      NodePtr child = Erase(node->children[i], key, erased);
+      if (!*erased) return node;
+      copy = Writable(node);
+      if (child == nullptr) {
+        copy->EraseKey(i);
+        copy->children.erase(copy->children.begin() + i);
+      } else {
+        copy->SetKey(i, child->last_key());
+        copy->children[i] = std::move(child);
+      }
+    }
+    if (copy->size() == 0) return nullptr;
+    return copy;
+  }
+
+  const Comparator* const cmp_;
+  const LeafIndexValueMerger* const merger_;
+  NodePtr root_;
+  int64_t live_delta_;
+  // Nodes created by this batch, which no reader can see yet
+  std::unordered_set<const Node*> owned_;
+};
+
+// Walks the tree through the path of nodes from the root to the current
+// entry.  Holding the root keeps every node on the path alive.
+class MemLeafIndex::Iter : public Iterator {
+ public:
+  Iter(const Comparator* cmp, NodePtr root)
+      : cmp_(cmp), root_(std::move(root)) {}
+
+  bool Valid() const override { return !path_.empty(); }
+
+  void SeekToFirst() override {
+    path_.clear();
+    if (root_ != nullptr) Descend(root_.get(), true);
+  }
+
+  void SeekToLast() override {
+    path_.clear();
+    if (root_ != nullptr) Descend(root_.get(), false);
+  }
+
+  void Seek(const Slice& target) override {
+    path_.clear();
+    const Node* node = root_.get();
+    while (node != nullptr) {
+      size_t i = node->LowerBound(cmp_, target);
+      if (i == node->size()) {
+        // Inner keys bound their subtrees, so this only happens at the
+        // root: every key is before the target
+        path_.clear();
+        return;
+      }
+      path_.push_back(Position(node, i));
+      node = node->leaf() ? nullptr : node->children[i].get();
+    }
+  }
+
+  void Next() override {
+    assert(Valid());
+    while (!path_.empty() &&
+           ++path_.back().second == path_.back().first->size()) {
+      path_.pop_back();
+    }
+    if (!path_.empty() && !path_.back().first->leaf()) {
+      const Position& p = path_.back();
+      Descend(p.first->children[p.second].get(), true);
+    }
+  }
+
+  void Prev() override {
+    assert(Valid());
+    while (!path_.empty() && path_.back().second == 0) {
+      path_.pop_back();
+    }
+    if (path_.empty()) return;
+    --path_.back().second;
+    if (!path_.back().first->leaf()) {
+      const Position& p = path_.back();
+      Descend(p.first->children[p.second].get(), false);
+    }
+  }
+
+  Slice key() const override {
+    assert(Valid());
+    const Position& p = path_.back();
+    return p.first->key(p.second);
+  }
+
+  Slice value() const override {
+    assert(Valid());
+    const Position& p = path_.back();
+    return *p.first->values[p.second];
+  }
+
+  Status status() const override { return Status::OK(); }
+
+ private:
+  typedef std::pair<const Node*, size_t> Position;
+
+  // Extends the path from "node" down to its first or last entry
+  void Descend(const Node* node, bool first) {
+    while (true) {
+      size_t i = first ? 0 : node->size() - 1;
+      path_.push_back(Position(node, i));
+      if (node->leaf()) return;
+      node = node->children[i].get();
+    }
+  }
+
+  const Comparator* const cmp_;
+  const NodePtr root_;
+  std::vector<Position> path_;
+};
+
+MemLeafIndex::MemLeafIndex(const Options& options, const std::string& dirname,
+                           const LeafIndexValueMerger* merger)
+    : env_(options.env),
+      cmp_(options.comparator),
+      dirname_(dirname),
+      merger_(merger),
+      db_lock_(nullptr),
+      logfile_(nullptr),
+      log_(nullptr),
+      log_number_(0),
+      log_bytes_(0),
+      live_bytes_(0),
+      log_rewrites_(0) {}
+
+MemLeafIndex::~MemLeafIndex() {
+  delete log_;
+  delete logfile_;
+  if (db_lock_ != nullptr) {
+    env_->UnlockFile(db_lock_);
+  }
+}
+
+Status MemLeafIndex::Open(const Options& options, const std::string& dirname,
+                          const LeafIndexValueMerger* merger, DB** dbptr) {
+  *dbptr = nullptr;
+  MemLeafIndex* index = new MemLeafIndex(options, dirname, merger);
+  Status s;
+  {
+    MutexLock l(&index->mutex_);
+    s = index->Recover();
+  }
+  if (s.ok()) {
+    *dbptr = index;
+  } else {
+    delete index;
+  }
+  return s;
+}
+
+Status MemLeafIndex::Recover() {
+  mutex_.AssertHeld();
+  env_->CreateDir(dirname_);  // Ignore error from CreateDir
+  Status s = env_->LockFile(LockFileName(dirname_), &db_lock_);
+  if (!s.ok()) return s;
+
+  std::vector<std::string> filenames;
+  s = env_->GetChildren(dirname_, &filenames);
+  if (!s.ok()) return s;
+  std::vector<uint64_t> logs;
+  uint64_t number;
+  FileType type;
+  for (size_t i = 0; i < filenames.size(); i++) {
+    if (ParseFileName(filenames[i], &number, &type)) {
+      if (type == kLogFile) {
+        logs.push_back(number);
+      } else if (type == kTempFile) {
+        // A log rewrite that did not finish
+        env_->DeleteFile(dirname_ + "/" + filenames[i]);
+      }
+    }
+  }
+
+  // Logs are renamed into place once complete, so the newest one holds
+  // the whole index and the others are left over from its rewrite
+  NodePtr root;
+  if (!logs.empty()) {
+    log_number_ = *std::max_element(logs.begin(), logs.end());
+    SequentialFile* file;
+    s = env_->NewSequentialFile(LogFileName(dirname_, log_number_), &file);
+    if (!s.ok()) return s;
+    struct LogReporter : public log::Reader::Reporter {
+      Status* status;
+      void Corruption(size_t bytes, const Status& s) override {
+        if (status->ok()) *status = s;
+      }
+    };
+    Status read_status;
+    LogReporter reporter;
+    reporter.status = &read_status;
+    log::Reader reader(file, &reporter, true /*checksum*/,
+                       0 /*initial_offset*/);
+    Slice record;
+    std::string scratch;
+    WriteBatch batch;
+    while (reader.ReadRecord(&record, &scratch) && read_status.ok()) {
+      if (record.size() < 12) {
+        read_status = Status::Corruption("leaf index log record too small");
+        break;
+      }
+      WriteBatchInternal::SetContents(&batch, record);
+      read_status = Apply(batch, &root);
+    }
+    delete file;
+    if (!read_status.ok()) return read_status;
+  }
+  {
+    MutexLock l(&root_mutex_);
+    root_ = root;
+  }
+  s = RewriteLog(root);
+  if (!s.ok()) return s;
+  for (size_t i = 0; i < logs.size(); i++) {
+    if (logs[i] != log_number_) {
+      env_->DeleteFile(LogFileName(dirname_, logs[i]));
+    }
+  }
+  return s;
+}
+
+Status MemLeafIndex::Apply(const WriteBatch& batch, NodePtr* root) {
+  mutex_.AssertHeld();
+  Updater updater(cmp_, merger_, *root);
+  Status s = batch.Iterate(&updater);
+  if (s.ok()) {
+    *root = updater.root();
+    live_bytes_ += updater.live_delta();
+  }
+  return s;
+}
+
+Status MemLeafIndex::RewriteLog(const NodePtr& root) {
+  mutex_.AssertHeld();
+  const uint64_t number = log_number_ + 1;
+  const std::string tmp = TempFileName(dirname_, number);
+  WritableFile* file;
+  Status s = env_->NewWritableFile(tmp, &file);
+  if (!s.ok()) return s;
+  log::Writer* writer = new log::Writer(file);
+  uint64_t bytes = 0;
+  WriteBatch batch;
+  Iter it(cmp_, root);
+  for (it.SeekToFirst(); s.ok() && it.Valid(); it.Next()) {
+    batch.Put(it.key(), it.value());
+    if (batch.ApproximateSize() >= kRewriteRecordSize) {
+      s = writer->AddRecord(WriteBatchInternal::Contents(&batch));
+      bytes += batch.ApproximateSize();
+      batch.Clear();
+    }
+  }
+  if (s.ok() && WriteBatchInternal::Count(&batch) > 0) {
+    s = writer->AddRecord(WriteBatchInternal::Contents(&batch));
+    bytes += batch.ApproximateSize();
+  }
+  if (s.ok()) s = file->Sync();
+  // Commit point: the newest log replaces the older ones on recovery
+  if (s.ok()) s = env_->RenameFile(tmp, LogFileName(dirname_, number));
+  if (!s.ok()) {
+    delete writer;
+    delete file;
+    env_->DeleteFile(tmp);
+    return s;
+  }
+  if (log_ != nullptr) {
+    delete log_;
+    delete logfile_;
+    env_->DeleteFile(LogFileName(dirname_, log_number_));
+  }
+  logfile_ = file;
+  log_ = writer;
+  log_number_ = number;
+  log_bytes_ = bytes;
+  ++log_rewrites_;
+  return s;
+}
+
+MemLeafIndex::NodePtr MemLeafIndex::CurrentRoot() {
+  MutexLock l(&root_mutex_);
+  return root_;
+}
+
+MemLeafIndex::NodePtr MemLeafIndex::SnapshotRoot(const ReadOptions& options) {
+  if (options.snapshot != nullptr) {
+    return static_cast<const SnapshotImpl*>(options.snapshot)->root;
+  }
+  return CurrentRoot();
+}
+
+Status MemLeafIndex::Put(const WriteOptions& options, const Slice& key,
+                         const Slice& value) {
+  WriteBatch batch;
+  batch.Put(key, value);
+  return Write(options, &batch);
+}
+
+Status MemLeafIndex::Delete(const WriteOptions& options, const Slice& key) {
+  WriteBatch batch;
+  batch.Delete(key);
+  return Write(options, &batch);
+}
+
+Status MemLeafIndex::Write(const WriteOptions& options, WriteBatch* updates) {
+  MutexLock l(&mutex_);
+  Slice record = WriteBatchInternal::Contents(updates);
+  Status s = log_->AddRecord(record);
+  if (s.ok() && options.sync) s = logfile_->Sync();
+  if (!s.ok()) return s;
+  log_bytes_ += record.size();
+
+  NodePtr root = CurrentRoot();
+  s = Apply(*updates, &root);
+  if (!s.ok()) return s;
+  {
+    MutexLock rl(&root_mutex_);
+    root_ = root;
+  }
+  if (log_bytes_ >= kMinLogRewriteSize &&
+      log_bytes_ > kLogRewriteRatio * live_bytes_) {
+    // The batch is already durable; a failed rewrite only leaves the
+    // current log in place
+    RewriteLog(root);
+  }
+  return s;
+}
+
+Status MemLeafIndex::Get(const ReadOptions& options, const Slice& key,
+                         std::string* value) {
+  NodePtr root = SnapshotRoot(options);
+  const Node* node = root.get();
+  while (node != nullptr) {
+    size_t i = node->LowerBound(cmp_, key);
+    if (i == node->size()) break;
+    if (node->leaf()) {
+      if (cmp_->Compare(node->key(i), key) != 0) break;
+      value->assign(*node->values[i]);
+      return Status::OK();
+    }
+    node = node->children[i].get();
+  }
+  return Status::NotFound(Slice());
+}
+
+Iterator* MemLeafIndex::NewIterator(const ReadOptions& options) {
+  return new Iter(cmp_, SnapshotRoot(options));
+}
+
+const Snapshot* MemLeafIndex::GetSnapshot() {
+  return new SnapshotImpl(CurrentRoot());
+}
+
+void MemLeafIndex::ReleaseSnapshot(const Snapshot* snapshot) {
+  delete static_cast<const SnapshotImpl*>(snapshot);
+}
+
+bool MemLeafIndex::GetProperty(const Slice& property, std::string* value) {
+  char buf[200];
+  if (property == Slice("silkstore.leaf_index_memory")) {
+    // Walk the tree; values are shared between versions, so this counts
+    // only what the current root keeps alive
+    uint64_t dram = 0, key_bytes = 0, stored_key_bytes = 0;
+    std::vector<const Node*> stack;
+    NodePtr root = CurrentRoot();
+    if (root != nullptr) stack.push_back(root.get());
+    while (!stack.empty()) {
+      const Node* node = stack.back();
+      stack.pop_back();
+      dram += sizeof(Node) + node->key_data.capacity() +
+              node->offsets.capacity() * sizeof(uint32_t) +
+              node->values.capacity() * sizeof(node->values[0]) +
+              node->children.capacity() * sizeof(NodePtr);
+      stored_key_bytes += node->key_data.size();
+      if (node->leaf()) key_bytes += node->key_data.size();
+      for (const auto& v : node->values) {
+        dram += sizeof(std::string) + v->capacity();
+      }
+      for (const NodePtr& child : node->children) {
+        stack.push_back(child.get());
+      }
+    }
+    snprintf(buf, sizeof(buf),
+             "leaf index dram bytes %llu\n"
+             "leaf index key bytes %llu (%llu stored)\n",
+             (unsigned long long)dram, (unsigned long long)key_bytes,
+             (unsigned long long)stored_key_bytes);
+    value->append(buf);
+    return true;
+  } else if (property == Slice("leveldb.stats")) {
+    MutexLock l(&mutex_);
+    snprintf(buf, sizeof(buf),
+             "\n live bytes %llu\n log bytes %llu log rewrites %llu\n",
+             (unsigned long long)live_bytes_, (unsigned long long)log_bytes_,
+             (unsigned long long)log_rewrites_);
+    value->append(buf);
+    return true;
+  }
+  return false;
+}
+
+void MemLeafIndex::GetApproximateSizes(const Range* range, int n,
+                                       uint64_t* sizes) {
+  for (int i = 0; i < n; i++) {
+    sizes[i] = 0;
+  }
+}
+
+void MemLeafIndex::CompactRange(const Slice* begin, const Slice* end) {
+  MutexLock l(&mutex_);
+  RewriteLog(CurrentRoot());
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
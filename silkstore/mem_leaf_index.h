@@ -0,0 +1,115 @@
+#ifndef STORAGE_LEVELDB_SILKSTORE_MEM_LEAF_INDEX_H_
+#define STORAGE_LEVELDB_SILKSTORE_MEM_LEAF_INDEX_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/options.h"
+#include "leveldb/write_batch.h"
+#include "port/port.h"
+#include "port/thread_annotations.h"
+
+namespace leveldb {
+
+class LeafIndexValueMerger;
+
+namespace log {
+class Writer;
+}
+
+namespace silkstore {
+
+// A MemLeafIndex keeps the leaf index in a copy-on-write B+-tree in DRAM,
+// for machines without NVM.  A write copies the nodes on its path and
+// publishes a new root, so readers, iterators and snapshots hold on to
+// the root they started from and never block.
+//
+// Every write batch is appended to a log in the index directory before
+// it is applied.  Opening the index replays the log, and the log is
+// rewritten from the tree once it is mostly superseded entries.
+class MemLeafIndex : public DB {
+ public:
+  // Opens the index whose log lives in directory "dirname".
+  // If "merger" is not null, values it reports as deltas are merged into
+  // the key's current value when written.  It must outlive the index.
+  static Status Open(const Options& options, const std::string& dirname,
+                     const LeafIndexValueMerger* merger, DB** dbptr);
+
+  MemLeafIndex(const MemLeafIndex&) = delete;
+  MemLeafIndex& operator=(const MemLeafIndex&) = delete;
+
+  ~MemLeafIndex() override;
+
+  Status Put(const WriteOptions& options, const Slice& key,
+             const Slice& value) override;
+  Status Delete(const WriteOptions& options, const Slice& key) override;
+  Status Write(const WriteOptions& options, WriteBatch* updates) override;
+  Status Get(const ReadOptions& options, const Slice& key,
+             std::string* value) override;
+  Iterator* NewIterator(const ReadOptions& options) override;
+  const Snapshot* GetSnapshot() override;
+  void ReleaseSnapshot(const Snapshot* snapshot) override;
+
+  // Understands "silkstore.leaf_index_memory" and "leveldb.stats".
+  bool GetProperty(const Slice& property, std::string* value) override;
+
+  // The index occupies no file system space besides its log, so every
+  // size is reported as 0.
+  void GetApproximateSizes(const Range* range, int n,
+                           uint64_t* sizes) override;
+
+  // Ignores the range and rewrites the log from the tree.
+  void CompactRange(const Slice* begin, const Slice* end) override;
+
+ private:
+  struct Node;
+  class Iter;
+  class SnapshotImpl;
+  class Updater;
+  typedef std::shared_ptr<const Node> NodePtr;
+
+  MemLeafIndex(const Options& options, const std::string& dirname,
+               const LeafIndexValueMerger* merger);
+
+  // Replays the newest log and starts a fresh one
+  Status Recover() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Applies "batch" to the tree rooted at *root, storing the new root
+  // in *root and adjusting live_bytes_.
+  Status Apply(const WriteBatch& batch, NodePtr* root)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Writes the entries under "root" to a new log and switches to it
+  Status RewriteLog(const NodePtr& root) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  NodePtr CurrentRoot();
+  NodePtr SnapshotRoot(const ReadOptions& options);
+
+  Env* const env_;
+  const Comparator* const cmp_;
+  const std::string dirname_;
+  const LeafIndexValueMerger* const merger_;
+  FileLock* db_lock_;
+
+  // Serializes writers and log rewrites; readers never take it
+  port::Mutex mutex_;
+  WritableFile* logfile_ GUARDED_BY(mutex_);
+  log::Writer* log_ GUARDED_BY(mutex_);
+  uint64_t log_number_ GUARDED_BY(mutex_);
+  uint64_t log_bytes_ GUARDED_BY(mutex_);
+  // Bytes of the keys and values in the tree
+  uint64_t live_bytes_ GUARDED_BY(mutex_);
+  uint64_t log_rewrites_ GUARDED_BY(mutex_);
+
+  // Protects the root_ pointer so readers can copy it safely
+  port::Mutex root_mutex_;
+  NodePtr root_ GUARDED_BY(root_mutex_);
+};
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_SILKSTORE_MEM_LEAF_INDEX_H_
@@ -15,6 +15,7 @@
 #include "util/crc32c.h"
 
 #include "silkstore/minirun.h"
+#include "silkstore/perf_context.h"
 #include "silkstore/segment.h"
 
 namespace leveldb {
@@ -49,8 +50,14 @@ Iterator* MiniRun::NewIteratorForOneBlock(
 
   BlockContents contents;
 
-  Status s = ReadBlock(this->file, read_options, handle, &contents);
+  Status s;
+  {
+    SILKSTORE_PERF_TIMER_GUARD(block_read_nanos);
+    s = ReadBlock(this->file, read_options, handle, &contents);
+  }
   if (s.ok()) {
+    SILKSTORE_PERF_COUNTER_ADD(block_read_count, 1);
+    SILKSTORE_PERF_COUNTER_ADD(block_read_bytes, contents.data.size());
     block = new Block(contents);
   }
 
@@ -108,8 +115,13 @@ Iterator* MiniRun::BlockReader(void* arg, const ReadOptions& options,
     //                block = new Block(contents);
     //            }
     //        }
-    s = ReadBlock(run->file, options, handle, &contents);
+    {
+      SILKSTORE_PERF_TIMER_GUARD(block_read_nanos);
+      s = ReadBlock(run->file, options, handle, &contents);
+    }
     if (s.ok()) {
+      SILKSTORE_PERF_COUNTER_ADD(block_read_count, 1);
+      SILKSTORE_PERF_COUNTER_ADD(block_read_bytes, contents.data.size());
       block = new Block(contents);
     }
   }
@@ -16,9 +16,12 @@
 #include "table/block_builder.h"
 #include "table/format.h"
 
+#include "silkstore/background_scheduler.h"
+
 namespace leveldb {
 namespace silkstore {
 
+class RateLimiter;
 class SegmentBuilder;
 
 /*
@@ -78,6 +81,10 @@ class MiniRunBuilder {
   // Reset the builder as if it were just constructed.
   void Reset(uint64_t file_offset);
 
+  // Charge every block written from now on to "limiter" as I/O of class
+  // "pri".  A null limiter writes at full speed.
+  void SetRateLimiter(RateLimiter* limiter, BackgroundPriority pri);
+
   // Advanced operation: flush any buffered key/value pairs to file.
   // Can be used to ensure that two adjacent entries never live in
   // the same data block.  Most clients should not need to use this method.
@@ -16,6 +16,7 @@
 #include "util/crc32c.h"
 
 #include "silkstore/minirun.h"
+#include "silkstore/rate_limiter.h"
 #include "silkstore/segment.h"
 
 namespace leveldb {
@@ -38,6 +39,8 @@ struct MiniRunBuilder::Rep {
   std::string last_key;
   int64_t num_entries;
   FilterBlockBuilder* filter_block_builder;
+  RateLimiter* rate_limiter;
+  BackgroundPriority io_priority;
 
   // We do not emit the index entry for a block until we have seen the
   // first key for the next data block.  This allows us to use shorter
@@ -69,8 +72,11 @@ struct MiniRunBuilder::Rep {
         filter_block_builder((opt.filter_policy == nullptr)
                                  ? nullptr
                                  : new FilterBlockBuilder(opt.filter_policy)),
+        rate_limiter(nullptr),
+        io_priority(kFlushPriority),
         pending_index_entry(false) {
-    index_block_options.block_restart_interval = 1;
+    index_block_options.block_restart_interval =
+        opt.index_block_restart_interval;
   }
 };
 
@@ -180,6 +186,10 @@ void MiniRunBuilder::WriteRawBlock(const Slice& block_contents,
   Rep* r = rep_;
   handle->set_offset(r->offset);
   handle->set_size(block_contents.size());
+  if (r->rate_limiter != nullptr) {
+    r->rate_limiter->Request(block_contents.size() + kBlockTrailerSize,
+                             r->io_priority);
+  }
   r->status = r->file->Append(block_contents);
   if (r->status.ok()) {
     char trailer[kBlockTrailerSize];
@@ -292,6 +302,12 @@ void MiniRunBuilder::Reset(uint64_t file_offset) {
   }
 }
 
+void MiniRunBuilder::SetRateLimiter(RateLimiter* limiter,
+                                    BackgroundPriority pri) {
+  rep_->rate_limiter = limiter;
+  rep_->io_priority = pri;
+}
+
 uint64_t MiniRunBuilder::NumEntries() const { return rep_->num_entries; }
 
 uint64_t MiniRunBuilder::FileSize() const { return rep_->offset; }
@@ -18,6 +18,7 @@
 #include "silkstore/util.h"
 
 #include <string>
+#include <thread>
 
 namespace leveldb {
 namespace silkstore {
@@ -746,6 +747,174 @@ TEST(MinirunTest, LeafIndexEntryTest) {
   }
 }
 
+TEST(MinirunTest, LeafIndexEntryV1Compatibility) {
+  // Encode a leaf in the original back-linked format by hand
+  static const int kNumRuns = 10;
+  std::vector<string> run_bufs(kNumRuns);
+  string v1;
+  size_t data_size = 0;
+  for (int i = 0; i < kNumRuns; ++i) {
+    auto e = MiniRunIndexEntry::Build(i, i + 1, Slice(std::to_string(i)),
+                                      Slice("f" + std::to_string(i)), 100 + i,
+                                      &run_bufs[i]);
+    v1.append(e.GetRawData().data(), e.GetRawData().size());
+    PutFixed32(&v1, e.GetRawData().size());
+    data_size += 100 + i;
+  }
+  PutFixed32(&v1, kNumRuns);
+
+  LeafIndexEntry old_entry(v1);
+  ASSERT_EQ(old_entry.GetNumMiniRuns(), kNumRuns);
+  ASSERT_EQ(old_entry.GetLeafDataSize(), data_size);
+  for (int i = 0; i < kNumRuns; ++i) {
+    MiniRunIndexEntry e = old_entry.GetMiniRunIndexEntry(i);
+    ASSERT_EQ(e.GetSegmentNumber(), i);
+    ASSERT_EQ(e.GetRunNumberWithinSegment(), i + 1);
+  }
+
+  // Any rewrite produces a v2 entry with the same runs
+  string buf;
+  LeafIndexEntry new_entry;
+  ASSERT_OK(LeafIndexEntryBuilder::RemoveMiniRunRange(old_entry, 0, 0, &buf,
+                                                      &new_entry));
+  ASSERT_NE(new_entry.GetRawData().ToString(), Slice(v1).ToString());
+  ASSERT_EQ(new_entry.GetNumMiniRuns(), kNumRuns - 1);
+  ASSERT_EQ(new_entry.GetLeafDataSize(), data_size - 100);
+  for (int i = 0; i < kNumRuns - 1; ++i) {
+    MiniRunIndexEntry e = new_entry.GetMiniRunIndexEntry(i);
+    ASSERT_EQ(e.GetSegmentNumber(), i + 1);
+    ASSERT_EQ(e.GetRunDataSize(), 100 + i + 1);
+    ASSERT_EQ(e.GetBlockIndexData().ToString(), std::to_string(i + 1));
+    ASSERT_EQ(e.GetFilterData().ToString(), "f" + std::to_string(i + 1));
+  }
+  int next = kNumRuns - 2;
+  new_entry.ForEachMiniRunIndexEntry(
+      [&next](const MiniRunIndexEntry& e, uint32_t run_no) -> bool {
+        ASSERT_EQ(run_no, next);
+        ASSERT_EQ(e.GetSegmentNumber(), next + 1);
+        --next;
+        return false;
+      },
+      LeafIndexEntry::TraversalOrder::backward);
+  ASSERT_EQ(next, -1);
+
+  // Removing every run leaves an empty entry
+  string empty_buf;
+  LeafIndexEntry empty_entry;
+  ASSERT_OK(LeafIndexEntryBuilder::RemoveMiniRunRange(
+      new_entry, 0, kNumRuns - 2, &empty_buf, &empty_entry));
+  ASSERT_TRUE(empty_entry.Empty());
+  ASSERT_EQ(empty_entry.GetLeafDataSize(), 0);
+}
+
+TEST(MinirunTest, LeafStatStoreTest) {
+  const double factor = LeafStatStore::read_hotness_exp_smooth_factor;
+  LeafStatStore stat_store;
+  stat_store.NewLeaf("leaf1");
+  stat_store.NewLeaf("leaf2");
+  const int kThreads = 8;
+  const int kReadsPerThread = 10000;
+  std::vector<std::thread> readers;
+  for (int t = 0; t < kThreads; ++t) {
+    readers.emplace_back([&stat_store]() {
+      std::string missing = "missing";
+      for (int i = 0; i < kReadsPerThread; ++i) {
+        stat_store.IncrementLeafReads(Slice("leaf1"));
+        stat_store.IncrementLeafReads(Slice(missing));
+      }
+    });
+  }
+  for (auto& reader : readers) reader.join();
+  stat_store.UpdateReadHotness();
+  ASSERT_EQ(kThreads * kReadsPerThread * factor,
+            stat_store.GetReadHotness("leaf1"));
+  ASSERT_EQ(0, stat_store.GetReadHotness("leaf2"));
+  ASSERT_EQ(-1, stat_store.GetReadHotness("missing"));
+
+  // A single thread touching more leaves than its counter table holds
+  const int kLeaves = 5000;
+  for (int i = 0; i < kLeaves; ++i) {
+    stat_store.NewLeaf("many" + std::to_string(i));
+  }
+  for (int i = 0; i < kLeaves; ++i) {
+    stat_store.IncrementLeafReads(Slice("many" + std::to_string(i)));
+  }
+  stat_store.UpdateReadHotness();
+  for (int i = 0; i < kLeaves; ++i) {
+    ASSERT_EQ(factor, stat_store.GetReadHotness("many" + std::to_string(i)));
+  }
+
+  // Splitting divides the hotness between the new leaves
+  std::vector<std::string> splitted_keys = {"leaf0", "leaf1"};
+  double hotness = stat_store.GetReadHotness("leaf1");
+  stat_store.SplitLeaf("leaf1", splitted_keys);
+  ASSERT_EQ(hotness / 2, stat_store.GetReadHotness("leaf0"));
+  ASSERT_EQ(hotness / 2, stat_store.GetReadHotness("leaf1"));
+  stat_store.DeleteLeaf("leaf0");
+  ASSERT_EQ(-1, stat_store.GetReadHotness("leaf0"));
+  int num_leaves = 0;
+  stat_store.ForEachLeaf(
+      [&num_leaves](const std::string&, const LeafStatStore::LeafStat&) {
+        ++num_leaves;
+      });
+  ASSERT_EQ(kLeaves + 2, num_leaves);
+}
+
+TEST(MinirunTest, LeafStatGroupTest) {
+  LeafStatStore stat_store;
+  KMeansSegmenter segmenter;
+  for (int i = 0; i < 100; ++i) {
+    stat_store.NewLeaf("leaf" + std::to_string(i));
+  }
+  ASSERT_EQ(-1, stat_store.GetGroupId("leaf0"));
+  // All leaves equally cold form a single group
+  stat_store.GroupLeaves(&segmenter, 4);
+  ASSERT_EQ(0, stat_store.GetGroupId("leaf0"));
+  ASSERT_EQ(0, stat_store.GetGroupId("leaf99"));
+
+  // A few leaves take most of the writes
+  for (int i = 0; i < 100; ++i) {
+    stat_store.UpdateWriteHotness("leaf" + std::to_string(i),
+                                  i < 10 ? 10000 : 1);
+  }
+  stat_store.GroupLeaves(&segmenter, 2);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(i < 10 ? 0 : 1,
+              stat_store.GetGroupId("leaf" + std::to_string(i)));
+  }
+
+  // Split leaves keep the group; a merged leaf takes the hottest one
+  std::vector<std::string> splitted_keys = {"leaf00", "leaf0"};
+  stat_store.SplitLeaf("leaf0", splitted_keys);
+  ASSERT_EQ(0, stat_store.GetGroupId("leaf00"));
+  stat_store.MergeLeaves({"leaf1", "leaf50"});
+  ASSERT_EQ(0, stat_store.GetGroupId("leaf50"));
+  ASSERT_EQ(-1, stat_store.GetGroupId("missing"));
+}
+
+TEST(MinirunTest, LeafBoundariesTest) {
+  const Comparator* cmp = BytewiseComparator();
+  LeafBoundaries empty(7);
+  ASSERT_EQ(7, empty.generation());
+  ASSERT_EQ(0, empty.size());
+  ASSERT_EQ(0, empty.FindLeaf(cmp, "a"));
+
+  LeafBoundaries boundaries(1);
+  std::vector<std::string> keys = {"", "b", "bb", "d", "key_000100"};
+  for (const std::string& k : keys) boundaries.Append(k);
+  ASSERT_EQ(keys.size(), boundaries.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ASSERT_EQ(keys[i], boundaries.key(i).ToString());
+    // A leaf's max key belongs to that leaf
+    ASSERT_EQ(i, boundaries.FindLeaf(cmp, keys[i]));
+  }
+  ASSERT_EQ(1, boundaries.FindLeaf(cmp, "a"));
+  ASSERT_EQ(2, boundaries.FindLeaf(cmp, "ba"));
+  ASSERT_EQ(3, boundaries.FindLeaf(cmp, "c"));
+  ASSERT_EQ(4, boundaries.FindLeaf(cmp, "key"));
+  ASSERT_EQ(5, boundaries.FindLeaf(cmp, "z"));
+}
+
 }  // namespace silkstore
 }  // namespace leveldb
 
@@ -0,0 +1,50 @@
+#include "silkstore/perf_context.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace leveldb {
+namespace silkstore {
+
+static thread_local PerfLevel perf_level = kPerfEnableCount;
+static thread_local PerfContext perf_context;
+
+void SetPerfLevel(PerfLevel level) { perf_level = level; }
+
+PerfLevel GetPerfLevel() { return perf_level; }
+
+PerfContext* GetPerfContext() { return &perf_context; }
+
+void PerfContext::Reset() { memset(this, 0, sizeof(*this)); }
+
+std::string PerfContext::ToString() const {
+  char buf[1000];
+  snprintf(buf, sizeof(buf),
+           "get_count = %llu, iter_seek_count = %llu, iter_next_count = %llu, "
+           "iter_prev_count = %llu, memtable_get_count = %llu, "
+           "memtable_get_nanos = %llu, "
+           "leaf_index_seek_count = %llu, leaf_index_seek_nanos = %llu, "
+           "runs_searched_count = %llu, filter_check_count = %llu, "
+           "filter_useful_count = %llu, filter_check_nanos = %llu, "
+           "block_read_count = %llu, block_read_bytes = %llu, "
+           "block_read_nanos = %llu, block_decode_nanos = %llu",
+           (unsigned long long)get_count, (unsigned long long)iter_seek_count,
+           (unsigned long long)iter_next_count,
+           (unsigned long long)iter_prev_count,
+           (unsigned long long)memtable_get_count,
+           (unsigned long long)memtable_get_nanos,
+           (unsigned long long)leaf_index_seek_count,
+           (unsigned long long)leaf_index_seek_nanos,
+           (unsigned long long)runs_searched_count,
+           (unsigned long long)filter_check_count,
+           (unsigned long long)filter_useful_count,
+           (unsigned long long)filter_check_nanos,
+           (unsigned long long)block_read_count,
+           (unsigned long long)block_read_bytes,
+           (unsigned long long)block_read_nanos,
+           (unsigned long long)block_decode_nanos);
+  return buf;
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
@@ -0,0 +1,105 @@
+#ifndef STORAGE_LEVELDB_SILKSTORE_PERF_CONTEXT_H_
+#define STORAGE_LEVELDB_SILKSTORE_PERF_CONTEXT_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+
+namespace leveldb {
+namespace silkstore {
+
+// How much a thread records into its PerfContext.
+enum PerfLevel {
+  kPerfDisable = 0,
+  // Counters only
+  kPerfEnableCount = 1,
+  // Counters plus wall-clock nanoseconds for each stage
+  kPerfEnableTime = 2,
+};
+
+// Applies to the calling thread only.  Default: kPerfEnableCount.
+void SetPerfLevel(PerfLevel level);
+PerfLevel GetPerfLevel();
+
+// Per-thread breakdown of where Get() and iterator operations spend their
+// work.  Values accumulate until Reset(); callers typically Reset() before
+// an operation and read the fields afterwards.
+struct PerfContext {
+  void Reset();
+  std::string ToString() const;
+
+  uint64_t get_count;
+  uint64_t iter_seek_count;
+  uint64_t iter_next_count;
+  uint64_t iter_prev_count;
+
+  uint64_t memtable_get_count;
+  uint64_t memtable_get_nanos;
+
+  uint64_t leaf_index_seek_count;
+  uint64_t leaf_index_seek_nanos;
+
+  uint64_t runs_searched_count;
+
+  uint64_t filter_check_count;
+  uint64_t filter_useful_count;
+  uint64_t filter_check_nanos;
+
+  uint64_t block_read_count;
+  uint64_t block_read_bytes;
+  uint64_t block_read_nanos;
+
+  // Time spent seeking inside miniruns, excluding block reads
+  uint64_t block_decode_nanos;
+};
+
+// Returns the calling thread's PerfContext.
+PerfContext* GetPerfContext();
+
+// Adds "value" to a counter if counting is enabled for this thread.
+#define SILKSTORE_PERF_COUNTER_ADD(metric, value)                  \
+  do {                                                             \
+    if (::leveldb::silkstore::GetPerfLevel() >=                    \
+        ::leveldb::silkstore::kPerfEnableCount) {                  \
+      ::leveldb::silkstore::GetPerfContext()->metric += (value);   \
+    }                                                              \
+  } while (0)
+
+// Adds the lifetime of the timer to *metric when timing is enabled.
+class PerfTimer {
+ public:
+  explicit PerfTimer(uint64_t* metric)
+      : metric_(GetPerfLevel() >= kPerfEnableTime ? metric : nullptr) {
+    if (metric_ != nullptr) start_ = std::chrono::steady_clock::now();
+  }
+
+  ~PerfTimer() { Stop(); }
+
+  // Elapsed nanoseconds since construction, or 0 when timing is off.
+  uint64_t Elapsed() const {
+    if (metric_ == nullptr) return 0;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+  void Stop() {
+    if (metric_ != nullptr) {
+      *metric_ += Elapsed();
+      metric_ = nullptr;
+    }
+  }
+
+ private:
+  uint64_t* metric_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#define SILKSTORE_PERF_TIMER_GUARD(metric) \
+  ::leveldb::silkstore::PerfTimer perf_timer_##metric( \
+      &::leveldb::silkstore::GetPerfContext()->metric)
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_SILKSTORE_PERF_CONTEXT_H_
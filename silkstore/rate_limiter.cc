@@ -0,0 +1,126 @@
+#include "silkstore/rate_limiter.h"
+
+#include <algorithm>
+
+namespace leveldb {
+namespace silkstore {
+
+// Share of the rate each priority class refills its bucket with
+static const double kShares[kNumBackgroundPriorities] = {0.4, 0.3, 0.2, 0.1};
+
+RateLimiter::RateLimiter(uint64_t bytes_per_sec)
+    : bytes_per_sec_(bytes_per_sec), last_refill_(Clock::now()), spare_(0) {
+  for (int pri = 0; pri < kNumBackgroundPriorities; ++pri) {
+    available_[pri] = Capacity(pri);
+    total_bytes_[pri] = 0;
+    throttled_micros_[pri] = 0;
+  }
+}
+
+double RateLimiter::Capacity(int pri) const {
+  return bytes_per_sec_ * kShares[pri] * kRefillPeriodMicros / 1e6;
+}
+
+void RateLimiter::Refill(Clock::time_point now) {
+  const double elapsed_secs =
+      std::chrono::duration<double>(now - last_refill_).count();
+  last_refill_ = now;
+  if (elapsed_secs <= 0) return;
+  for (int pri = 0; pri < kNumBackgroundPriorities; ++pri) {
+    available_[pri] += elapsed_secs * bytes_per_sec_ * kShares[pri];
+    const double capacity = Capacity(pri);
+    if (available_[pri] > capacity) {
+      spare_ += available_[pri] - capacity;
+      available_[pri] = capacity;
+    }
+  }
+  spare_ = std::min(spare_, bytes_per_sec_ * kRefillPeriodMicros / 1e6);
+}
+
+void RateLimiter::Request(size_t bytes, BackgroundPriority pri) {
+  std::unique_lock<std::mutex> l(mutex_);
+  total_bytes_[pri] += bytes;
+  double remaining = bytes;
+  while (bytes_per_sec_ != 0) {
+    Refill(Clock::now());
+    double take = std::min(remaining, available_[pri]);
+    available_[pri] -= take;
+    remaining -= take;
+    take = std::min(remaining, spare_);
+    spare_ -= take;
+    remaining -= take;
+    if (remaining <= 0) break;
+
+    // Sleep until the class's own bucket covers the rest, at most one
+    // refill period so a rate change or freed spare tokens are noticed
+    const double rate = bytes_per_sec_ * kShares[pri];
+    const double wait_micros =
+        std::min(std::min(remaining, Capacity(pri)) / rate * 1e6,
+                 static_cast<double>(kRefillPeriodMicros));
+    const Clock::time_point start = Clock::now();
+    rate_changed_cv_.wait_for(
+        l, std::chrono::microseconds(
+               std::max<uint64_t>(1, static_cast<uint64_t>(wait_micros))));
+    throttled_micros_[pri] +=
+        std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                              start)
+            .count();
+  }
+}
+
+void RateLimiter::SetBytesPerSecond(uint64_t bytes_per_sec) {
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    // Tokens earned so far are earned at the old rate
+    Refill(Clock::now());
+    bytes_per_sec_ = bytes_per_sec;
+    for (int pri = 0; pri < kNumBackgroundPriorities; ++pri) {
+      available_[pri] = std::min(available_[pri], Capacity(pri));
+    }
+    spare_ = std::min(spare_, bytes_per_sec_ * kRefillPeriodMicros / 1e6);
+  }
+  rate_changed_cv_.notify_all();
+}
+
+uint64_t RateLimiter::GetBytesPerSecond() {
+  std::lock_guard<std::mutex> l(mutex_);
+  return bytes_per_sec_;
+}
+
+uint64_t RateLimiter::Tune(double observed_p99_micros, double target_micros,
+                           uint64_t max_bytes_per_sec) {
+  uint64_t rate = GetBytesPerSecond();
+  if (max_bytes_per_sec == 0 || target_micros <= 0) return rate;
+  const uint64_t step = std::max<uint64_t>(1, max_bytes_per_sec / 16);
+  if (observed_p99_micros > target_micros) {
+    rate = std::max(step, rate / 4 * 3);
+  } else if (observed_p99_micros < target_micros * 0.8) {
+    rate = std::min(max_bytes_per_sec, rate + step);
+  }
+  SetBytesPerSecond(rate);
+  return rate;
+}
+
+uint64_t RateLimiter::TotalBytes(BackgroundPriority pri) {
+  std::lock_guard<std::mutex> l(mutex_);
+  return total_bytes_[pri];
+}
+
+uint64_t RateLimiter::TotalThrottledMicros(BackgroundPriority pri) {
+  std::lock_guard<std::mutex> l(mutex_);
+  return throttled_micros_[pri];
+}
+
+std::string RateLimiter::ToString() {
+  std::lock_guard<std::mutex> l(mutex_);
+  std::string result = "rate " + std::to_string(bytes_per_sec_) + "\n";
+  for (int pri = 0; pri < kNumBackgroundPriorities; ++pri) {
+    result.append(BackgroundPriorityName(static_cast<BackgroundPriority>(pri)));
+    result.append(" " + std::to_string(total_bytes_[pri]));
+    result.append(" " + std::to_string(throttled_micros_[pri]) + "\n");
+  }
+  return result;
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
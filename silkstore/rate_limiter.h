@@ -0,0 +1,74 @@
+#ifndef STORAGE_LEVELDB_SILKSTORE_RATE_LIMITER_H_
+#define STORAGE_LEVELDB_SILKSTORE_RATE_LIMITER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "silkstore/background_scheduler.h"
+
+namespace leveldb {
+namespace silkstore {
+
+// Token bucket shared by all background reads and writes of a SilkStore.
+//
+// Every priority class refills its own bucket with a fixed share of the
+// rate, so GC cannot eat the budget a flush needs.  Tokens a full bucket
+// cannot hold go to a spare bucket any class may draw from, so the whole
+// rate is usable when only one class is busy.
+class RateLimiter {
+ public:
+  // "bytes_per_sec" of 0 disables limiting.
+  explicit RateLimiter(uint64_t bytes_per_sec);
+
+  RateLimiter(const RateLimiter&) = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  // Blocks until "bytes" of I/O of class "pri" may proceed.
+  void Request(size_t bytes, BackgroundPriority pri);
+
+  // Changes the rate; 0 disables limiting and releases every waiter.
+  void SetBytesPerSecond(uint64_t bytes_per_sec);
+  uint64_t GetBytesPerSecond();
+
+  // Steers the rate toward keeping the foreground p99 latency at
+  // "target_micros", given the p99 observed since the previous call:
+  // the rate is cut by a quarter while the target is missed and grows
+  // back by 1/16 of "max_bytes_per_sec" once latency is well below it.
+  // Returns the new rate.
+  uint64_t Tune(double observed_p99_micros, double target_micros,
+                uint64_t max_bytes_per_sec);
+
+  // Bytes let through and microseconds spent waiting for class "pri"
+  uint64_t TotalBytes(BackgroundPriority pri);
+  uint64_t TotalThrottledMicros(BackgroundPriority pri);
+
+  // Current rate plus one "<class> <bytes> <throttled micros>" line per
+  // priority class.
+  std::string ToString();
+
+  // Length of time a full bucket lasts at its refill rate
+  static const uint64_t kRefillPeriodMicros = 100000;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  void Refill(Clock::time_point now);
+  double Capacity(int pri) const;
+
+  std::mutex mutex_;
+  std::condition_variable rate_changed_cv_;
+  uint64_t bytes_per_sec_;
+  Clock::time_point last_refill_;
+  double available_[kNumBackgroundPriorities];
+  double spare_;
+  uint64_t total_bytes_[kNumBackgroundPriorities];
+  uint64_t throttled_micros_[kNumBackgroundPriorities];
+};
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_SILKSTORE_RATE_LIMITER_H_
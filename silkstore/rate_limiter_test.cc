@@ -0,0 +1,84 @@
+#include "silkstore/rate_limiter.h"
+
+#include <thread>
+#include <vector>
+
+#include "leveldb/env.h"
+#include "silkstore/statistics.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+namespace silkstore {
+
+class RateLimiterTest {};
+
+TEST(RateLimiterTest, Unlimited) {
+  RateLimiter limiter(0);
+  const uint64_t start = Env::Default()->NowMicros();
+  limiter.Request(1 << 30, kGCPriority);
+  ASSERT_LT(Env::Default()->NowMicros() - start, 100000);
+  ASSERT_EQ(1 << 30, limiter.TotalBytes(kGCPriority));
+  ASSERT_EQ(0, limiter.TotalThrottledMicros(kGCPriority));
+}
+
+TEST(RateLimiterTest, Throttles) {
+  // A lone class gets the whole rate through the spare bucket, so 300KB
+  // at 1MB/s takes a little under 0.3 seconds
+  RateLimiter limiter(1 << 20);
+  const uint64_t start = Env::Default()->NowMicros();
+  for (int i = 0; i < 300; i++) limiter.Request(1 << 10, kGCPriority);
+  const uint64_t elapsed = Env::Default()->NowMicros() - start;
+  ASSERT_GE(elapsed, 150000);
+  ASSERT_LT(elapsed, 2000000);
+  ASSERT_EQ(300 << 10, limiter.TotalBytes(kGCPriority));
+  ASSERT_GT(limiter.TotalThrottledMicros(kGCPriority), 0);
+  ASSERT_EQ(0, limiter.TotalThrottledMicros(kFlushPriority));
+}
+
+TEST(RateLimiterTest, RequestLargerThanBucket) {
+  RateLimiter limiter(10 << 20);
+  const uint64_t start = Env::Default()->NowMicros();
+  limiter.Request(3 << 20, kFlushPriority);
+  ASSERT_GE(Env::Default()->NowMicros() - start, 150000);
+}
+
+TEST(RateLimiterTest, DisableReleasesWaiters) {
+  RateLimiter limiter(1024);
+  std::thread waiter([&limiter]() { limiter.Request(1 << 30, kGCPriority); });
+  Env::Default()->SleepForMicroseconds(50000);
+  limiter.SetBytesPerSecond(0);
+  waiter.join();
+  ASSERT_EQ(0, limiter.GetBytesPerSecond());
+}
+
+TEST(RateLimiterTest, Tune) {
+  const uint64_t max = 16 << 20;
+  RateLimiter limiter(max);
+  // Missing the target lowers the rate, but not below 1/16 of the max
+  ASSERT_EQ(12 << 20, limiter.Tune(2000, 1000, max));
+  for (int i = 0; i < 20; i++) limiter.Tune(2000, 1000, max);
+  ASSERT_EQ(1 << 20, limiter.GetBytesPerSecond());
+  // Close to the target holds it
+  ASSERT_EQ(1 << 20, limiter.Tune(900, 1000, max));
+  // Well below grows it back up to the max
+  ASSERT_EQ(2 << 20, limiter.Tune(100, 1000, max));
+  for (int i = 0; i < 20; i++) limiter.Tune(100, 1000, max);
+  ASSERT_EQ(max, limiter.GetBytesPerSecond());
+}
+
+TEST(RateLimiterTest, PercentileSince) {
+  Statistics stats;
+  std::vector<uint64_t> since;
+  for (int i = 0; i < 100; i++) stats.RecordInHistogram(kGetMicros, 10000);
+  ASSERT_GT(stats.PercentileSince(kGetMicros, 99, &since), 5000);
+  // Only the values recorded after the previous call count
+  for (int i = 0; i < 100; i++) stats.RecordInHistogram(kGetMicros, 10);
+  ASSERT_LT(stats.PercentileSince(kGetMicros, 99, &since), 20);
+  ASSERT_EQ(0, stats.PercentileSince(kGetMicros, 99, &since));
+  ASSERT_GT(stats.Percentile(kGetMicros, 99), 5000);
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+int main(int argc, char** argv) { return leveldb::test::RunAllTests(); }
@@ -4,12 +4,22 @@
 
 #include "silkstore/segment.h"
 
+#include <algorithm>
+#include <cassert>
+#include <atomic>
 #include <cmath>
+#include <cstdio>
+#include <limits>
+#include <map>
 #include <queue>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 
+#include "db/filename.h"
+#include "db/log_reader.h"
+#include "db/log_writer.h"
 #include "leveldb/comparator.h"
 #include "leveldb/env.h"
 #include "leveldb/filter_policy.h"
@@ -21,38 +31,135 @@
 #include "util/crc32c.h"
 #include "util/mutexlock.h"
 
+#include "silkstore/epoch.h"
+#include "silkstore/gc_policy.h"
 #include "silkstore/minirun.h"
 
 namespace leveldb {
 namespace silkstore {
 
+// Holes are punched for whole file system blocks only
+static const uint64_t kPunchHoleAlignment = 4096;
+
 static std::string MakeSegmentFileName(uint32_t segment_id) {
   return "seg." + std::to_string(segment_id);
 }
 
-struct Segment::Rep {
+struct SegmentRunState {
   /*
-   * Stores the ids of the minirun that have been invalidated.
-   * During GC, runs indicated by this set are skipped querying leaf index
+   * One flag per minirun telling whether it has been invalidated.
+   * During GC, runs flagged here are skipped querying leaf index
    * and directly considered as garbage.
    */
-  std::string invalidated_runs;
+  std::vector<bool> invalidated_runs;
+  // Invalidated runs whose blocks were freed by PunchMiniRun()
+  std::vector<bool> punched_runs;
+  std::atomic<uint64_t> punched_bytes;
+  // Segment objects sharing the state.  An evicted object pinned by a
+  // reader lives on next to the one reopened after it.
+  std::atomic<int> num_segments;
+
+  explicit SegmentRunState(size_t num_runs)
+      : invalidated_runs(num_runs, false),
+        punched_runs(num_runs, false),
+        punched_bytes(0),
+        num_segments(0) {}
+};
+
+struct Segment::Rep {
+  std::shared_ptr<SegmentRunState> state;
   std::vector<MiniRunHandle> run_handles;
   uint32_t id;
   RandomAccessFile* file;
   uint64_t file_size;
   Options options;
   std::atomic<int> ref_cnt;
+  std::atomic<uint64_t> last_access;
+  // Deleted along with the segment once set, see SetObsolete()
+  std::string obsolete_filepath;
+
+  Rep() : ref_cnt(0), last_access(0) {}
 
-  Rep() : ref_cnt(0) {}
+  ~Rep() {
+    if (state != nullptr) state->num_segments--;
+    delete file;
+  }
+
+  uint64_t RunSize(size_t run_no) const {
+    return run_no + 1 == run_handles.size()
+               ? file_size - run_handles[run_no].run_start_pos
+               : run_handles[run_no + 1].run_start_pos -
+                     run_handles[run_no].run_start_pos;
+  }
 };
 
-Status Segment::InvalidateMiniRun(const int& run_no) {
+Status Segment::InvalidateMiniRun(const int& run_no,
+                                  uint64_t* invalidated_bytes) {
   Rep* r = rep_;
-  PutVarint32(&r->invalidated_runs, run_no);
+  *invalidated_bytes = 0;
+  if (run_no < 0 || run_no >= r->run_handles.size())
+    return Status::InvalidArgument("run_no is not in valid range");
+  if (!r->state->invalidated_runs[run_no]) {
+    r->state->invalidated_runs[run_no] = true;
+    *invalidated_bytes = r->RunSize(run_no);
+  }
   return Status::OK();
 }
 
+Status Segment::PunchMiniRun(int run_no, const std::string& filepath,
+                             uint64_t* punched_bytes) {
+  Rep* r = rep_;
+  *punched_bytes = 0;
+  if (run_no < 0 || run_no >= r->run_handles.size())
+    return Status::InvalidArgument("run_no is not in valid range");
+  SegmentRunState* state = r->state.get();
+  if (!state->invalidated_runs[run_no] || state->punched_runs[run_no])
+    return Status::OK();
+  // The run ends with the trailer of its last block; RunSize() of the last
+  // run would take in the segment footer
+  const MiniRunHandle& handle = r->run_handles[run_no];
+  const uint64_t run_end = handle.last_block_handle.offset() +
+                           handle.last_block_handle.size() + kBlockTrailerSize;
+  const uint64_t begin =
+      (handle.run_start_pos + kPunchHoleAlignment - 1) / kPunchHoleAlignment *
+      kPunchHoleAlignment;
+  const uint64_t end = run_end / kPunchHoleAlignment * kPunchHoleAlignment;
+  state->punched_runs[run_no] = true;
+  if (handle.last_block_handle.offset() < handle.run_start_pos || end <= begin)
+    return Status::OK();
+  Status s = Env::Default()->PunchHole(filepath, begin, end - begin);
+  if (!s.ok()) {
+    state->punched_runs[run_no] = false;
+    return s;
+  }
+  *punched_bytes = end - begin;
+  state->punched_bytes.fetch_add(end - begin);
+  return s;
+}
+
+uint64_t Segment::PunchedBytes() const {
+  return rep_->state->punched_bytes.load();
+}
+
+std::shared_ptr<SegmentRunState> Segment::GetRunState() const {
+  return rep_->state;
+}
+
+void Segment::SetRunState(std::shared_ptr<SegmentRunState> state) {
+  state->num_segments++;
+  if (rep_->state != nullptr) rep_->state->num_segments--;
+  rep_->state = std::move(state);
+}
+
+uint64_t Segment::LastAccess() const { return rep_->last_access.load(); }
+
+void Segment::SetLastAccess(uint64_t tick) {
+  // Skips the store, and the cache line bouncing, for repeated hits
+  if (rep_->last_access.load(std::memory_order_relaxed) != tick) {
+    rep_->last_access.store(tick, std::memory_order_relaxed);
+  }
+}
+
 uint32_t Segment::SegmentId() const {
   Rep* r = rep_;
   return r->id;
@@ -76,7 +183,8 @@ Status Segment::Open(const Options& options, uint32_t segment_id,
   r->file_size = file_size;
   r->id = segment_id;
   r->options = options;
-  *segment = new Segment(r);
+  *segment = nullptr;
+  std::unique_ptr<Segment> seg(new Segment(r));
 
   size_t footer_offset = file_size - sizeof(uint64_t);
   char footer_buf[sizeof(uint64_t)];
@@ -107,15 +215,13 @@ Status Segment::Open(const Options& options, uint32_t segment_id,
     r->run_handles.emplace_back(
         MiniRunHandle{run_starting_pos, last_block_handle});
   }
+  seg->SetRunState(std::make_shared<SegmentRunState>(r->run_handles.size()));
+  *segment = seg.release();
   return Status::OK();
 }
 
-RandomAccessFile* Segment::SetNewSegmentFile(RandomAccessFile* file) {
-  Rep* r = rep_;
-  assert(NumRef() == 0);
-  auto old_file = r->file;
-  r->file = file;
-  return old_file;
+void Segment::SetObsolete(const std::string& filepath) {
+  rep_->obsolete_filepath = filepath;
 }
 
 Status Segment::OpenMiniRun(int run_no, Block& index_block, MiniRun** run) {
@@ -123,10 +229,7 @@ Status Segment::OpenMiniRun(int run_no, Block& index_block, MiniRun** run) {
   if (run_no < 0 || run_no >= r->run_handles.size())
     return Status::InvalidArgument("run_no is not in valid range");
   uint64_t run_offset = r->run_handles[run_no].run_start_pos;
-  uint64_t run_size =
-      run_no + 1 == r->run_handles.size()
-          ? r->file_size - run_offset
-          : r->run_handles[run_no + 1].run_start_pos - run_offset;
+  uint64_t run_size = r->RunSize(run_no);
 
   *run = new MiniRun(&r->options, r->file, run_offset, run_size, index_block);
   return Status::OK();
@@ -139,7 +242,13 @@ void Segment::Ref() {
 
 void Segment::UnRef() {
   Rep* r = rep_;
-  r->ref_cnt.fetch_add(-1);
+  if (r->ref_cnt.fetch_sub(1) == 1) {
+    const std::string obsolete_filepath = r->obsolete_filepath;
+    delete this;  // Closes the file first
+    if (!obsolete_filepath.empty()) {
+      Env::Default()->DeleteFile(obsolete_filepath);
+    }
+  }
 }
 
 int Segment::NumRef() {
@@ -149,37 +258,85 @@ int Segment::NumRef() {
 
 void Segment::ForEachRun(
     std::function<bool(int, MiniRunHandle, size_t, bool)> processor) {
-  std::unordered_set<int> invalidated_runs;
   Rep* r = rep_;
-  const char* start = r->invalidated_runs.data();
-  const char* end = start + r->invalidated_runs.size();
-  while (start < end) {
-    uint32_t run_no;
-    uint32_t run_size;
-    start = GetVarint32Ptr(start, end, &run_no);
-    invalidated_runs.insert(run_no);
-  }
-
   for (size_t run_no = 0; run_no < r->run_handles.size(); ++run_no) {
-    bool valid = invalidated_runs.find(run_no) == invalidated_runs.end();
-    size_t run_size = run_no == r->run_handles.size() - 1
-                          ? r->file_size - r->run_handles[run_no].run_start_pos
-                          : r->run_handles[run_no + 1].run_start_pos -
-                                r->run_handles[run_no].run_start_pos;
+    bool valid = !r->state->invalidated_runs[run_no];
+    size_t run_size = r->RunSize(run_no);
     bool early_exit =
         processor(run_no, r->run_handles[run_no], run_size, valid);
     if (early_exit) break;
   }
 }
 
+typedef std::unordered_map<uint32_t, Segment*> SegmentTable;
+
 struct SegmentManager::Rep {
   std::mutex mutex;
-  std::unordered_map<uint32_t, Segment*> segments;
+  // Open segments, each holding a reference of the manager.  The table is
+  // copied and republished under mutex and read without it, see
+  // OpenSegment().  Retired tables are freed through epoch.
+  std::atomic<const SegmentTable*> segments;
+  EpochManager epoch;
   std::unordered_map<uint32_t, std::string> segment_filepaths;
+  std::unordered_map<uint32_t, int> segment_groups;
   uint32_t seg_id_max = 0;
   Options options;
   std::string dbname;
   std::function<void()> gc_func;
+  std::unique_ptr<GCPolicy> gc_policy;
+  // Space accounting of finished segments, kept current without opening
+  // them so GC victims are picked cheaply
+  std::unique_ptr<SegmentUsageTracker> usage;
+
+  // Runs invalidated since the last PersistInvalidRuns(), as
+  // (seg_id, run_no, run_size) varint triples
+  std::string pending_invalid_runs;
+  // Invalid runs read from the invalid runs file, for the segments not
+  // opened since
+  std::unordered_map<uint32_t, std::vector<uint32_t>> recovered_invalid_runs;
+  // Serializes appends to the invalid runs file
+  std::mutex invalid_runs_mutex;
+  WritableFile* invalid_runs_file = nullptr;
+  log::Writer* invalid_runs_log = nullptr;
+  // Persisted invalid runs not punched yet, by segment, see
+  // Options::punch_invalid_runs.  Each run comes with the read view epoch
+  // it was persisted at, in increasing order.  Guarded by
+  // invalid_runs_mutex.
+  std::map<uint32_t, std::vector<std::pair<uint64_t, uint32_t>>>
+      runs_to_punch;
+  // Cleared when the file system turns out unable to punch holes
+  bool punch_holes = false;
+  // Number of read views held by the epoch they were acquired at, see
+  // AcquireReadView().  Guarded by views_mutex.
+  std::mutex views_mutex;
+  uint64_t view_epoch = 1;
+  std::map<uint64_t, int> read_views;
+  // Run state of every segment opened since it was written or the DB
+  // was opened, so closing a cached segment loses nothing
+  std::unordered_map<uint32_t, std::shared_ptr<SegmentRunState>> run_states;
+
+  // Segments kept open at most, see EvictSegments()
+  size_t cache_capacity = 0;
+  // Advanced on every miss; hits stamp the segment with it, so segments
+  // opened in the same stretch of hits count as equally recent
+  std::atomic<uint64_t> access_clock;
+  std::atomic<uint64_t> cache_hits;
+  std::atomic<uint64_t> cache_misses;
+  std::atomic<uint64_t> cache_evictions;
+
+  Rep()
+      : segments(new SegmentTable),
+        access_clock(0),
+        cache_hits(0),
+        cache_misses(0),
+        cache_evictions(0) {}
+
+  // Replaces the segment table.
+  // REQUIRES: mutex is held.
+  void PublishSegments(const SegmentTable* table) {
+    const SegmentTable* old = segments.exchange(table);
+    epoch.Retire([old]() { delete old; });
+  }
 };
 
 static bool GetSegmentFileInfo(const std::string& filename, uint32_t& seg_id) {
@@ -213,49 +370,40 @@ void SegmentManager::ForEachSegment(
   }
 }
 
-std::vector<Segment*> SegmentManager::GetMostInvalidatedSegments(int K) {
-  struct QueueNode {
+std::vector<Segment*> SegmentManager::PickSegmentsToCollect(int K) {
+  Rep* r = rep_;
+  std::vector<uint32_t> victims;
+  {
+    std::lock_guard<std::mutex> g(r->mutex);
+    victims = r->usage->PickVictims(K);
+  }
+  std::vector<Segment*> res;
+  for (auto seg_id : victims) {
     Segment* seg;
-    double invalidated_data_ratio;
-
-    bool operator<(const QueueNode& rhs) const {
-      return invalidated_data_ratio > rhs.invalidated_data_ratio;
-    }
-  };
-  std::priority_queue<QueueNode> q;
-
-  ForEachSegment([&, this](Segment* seg) {
-    uint64_t invalidated_data_size = 0;
-    seg->ForEachRun(
-        [&invalidated_data_size](int, MiniRunHandle, size_t size, bool valid) {
-          if (valid == false) {
-            invalidated_data_size += size;
-          }
-          return false;
-        });
-    double invalidated_data_ratio =
-        invalidated_data_size / (seg->SegmentSize());
-    if (abs(invalidated_data_ratio - 0) < 1e-7) return false;
-    if (q.size() < K) {
-      q.push({seg, invalidated_data_ratio});
-    } else {
-      if (q.empty() == false &&
-          q.top().invalidated_data_ratio < invalidated_data_ratio) {
-        q.pop();
-        q.push({seg, invalidated_data_ratio});
-      }
+    Status s = OpenSegment(seg_id, &seg);
+    if (s.ok()) {
+      res.push_back(seg);
     }
-    return false;
-  });
-
-  std::vector<Segment*> res;
-  while (!q.empty()) {
-    res.push_back(q.top().seg);
-    q.pop();
   }
   return res;
 }
 
+std::string SegmentManager::UsageString() {
+  Rep* r = rep_;
+  std::lock_guard<std::mutex> g(r->mutex);
+  const SegmentUsageTracker& usage = *r->usage;
+  char buf[200];
+  snprintf(buf, sizeof(buf),
+           "gc policy: %s\n"
+           "%lu segments, %.1f MB, %.1f%% invalid\n",
+           r->gc_policy->Name(), usage.NumSegments(),
+           usage.TotalBytes() / 1048576.0,
+           usage.TotalBytes() == 0
+               ? 0.0
+               : 100.0 * usage.InvalidBytes() / usage.TotalBytes());
+  return buf;
+}
+
 Status SegmentManager::NewSegmentBuilder(
     uint32_t* seg_id, std::unique_ptr<SegmentBuilder>& seg_builder_ptr,
     bool gc_on_segment_shortage) {
@@ -295,7 +443,14 @@ Status SegmentManager::InvalidateSegmentRun(uint32_t seg_id, uint32_t run_no) {
   if (!s.ok()) return s;
   Rep* r = rep_;
   std::lock_guard<std::mutex> g(r->mutex);
-  s = seg->InvalidateMiniRun(run_no);
+  uint64_t invalidated_bytes;
+  s = seg->InvalidateMiniRun(run_no, &invalidated_bytes);
+  if (s.ok() && invalidated_bytes != 0) {
+    r->usage->AddInvalidBytes(seg_id, invalidated_bytes);
+    PutVarint32(&r->pending_invalid_runs, seg_id);
+    PutVarint32(&r->pending_invalid_runs, run_no);
+    PutVarint64(&r->pending_invalid_runs, invalidated_bytes);
+  }
   DropSegment(seg);
   return s;
 }
@@ -312,31 +467,39 @@ Status SegmentManager::RenameSegment(uint32_t seg_id,
   r->segment_filepaths[seg_id] = target_filepath;
   Status s = Env::Default()->RenameFile(filepath, target_filepath);
   if (!s.ok()) return s;
-  auto segment_it = r->segments.find(seg_id);
-  if (segment_it == r->segments.end()) return s;
-  Segment* segment = segment_it->second;
-  // Wait for all the old readers to drop reference to the current segment
-  // New readers will be blocked by r->mutex
-  while (segment->NumRef()) Env::Default()->SleepForMicroseconds(10);
-
-  RandomAccessFile* rfile;
-  s = Env::Default()->NewRandomAccessFile(target_filepath, &rfile);
-  if (!s.ok()) {
-    return s;
+  uint64_t filesize;
+  if (Env::Default()->GetFileSize(target_filepath, &filesize).ok()) {
+    r->usage->AddSegment(seg_id, filesize);
   }
-  RandomAccessFile* old_file = segment->SetNewSegmentFile(rfile);
-  // FIXME: fix this leak
-  // delete old_file;
+  // A segment opened before it was finished has no run handles; the next
+  // OpenSegment() reads them from the renamed file.  Readers of the old
+  // object keep their file handle, which the rename does not affect.
+  r->run_states.erase(seg_id);
+  CloseSegment(seg_id, "");
+  return Status::OK();
+}
+
+Status SegmentManager::GetSegmentFilePath(uint32_t seg_id,
+                                          std::string* filepath) {
+  Rep* r = rep_;
+  std::lock_guard<std::mutex> g(r->mutex);
+  auto filepath_it = r->segment_filepaths.find(seg_id);
+  if (filepath_it == r->segment_filepaths.end())
+    return Status::NotFound("segment[" + std::to_string(seg_id) +
+                            "] is not found");
+  *filepath = filepath_it->second;
   return Status::OK();
 }
 
 size_t SegmentManager::ApproximateSize() {
   Rep* r = rep_;
   std::lock_guard<std::mutex> g(r->mutex);
-  size_t size = 0;
+  // Finished segments are accounted for, only the ones being written grow
+  size_t size = r->usage->TotalBytes();
   Env* default_env = Env::Default();
   for (auto kv : r->segment_filepaths) {
     auto filepath = kv.second;
+    if (filepath.find("tmpseg.") == std::string::npos) continue;
     uint64_t filesize;
     Status s = default_env->GetFileSize(filepath, &filesize);
     if (s.ok()) {
@@ -352,77 +515,202 @@ size_t SegmentManager::ApproximateSize() {
 }
 
 Status SegmentManager::RemoveSegment(uint32_t seg_id) {
-  Status s;
   Rep* r = rep_;
-  r->mutex.lock();
+  std::lock_guard<std::mutex> g(r->mutex);
   auto filepath_it = r->segment_filepaths.find(seg_id);
   if (filepath_it == r->segment_filepaths.end()) {
-    r->mutex.unlock();
     return Status::NotFound("segment[" + std::to_string(seg_id) +
                             "] is not found");
   }
-
-  auto it = r->segments.find(seg_id);
-  if (it != r->segments.end()) {
-    std::string filepath = filepath_it->second;
-    Segment* seg = it->second;
-    r->segments.erase(seg_id);
-    r->segment_filepaths.erase(seg_id);
-    Env* default_env = Env::Default();
-    r->mutex.unlock();
-    // Wait for all read references to this segment to drop
-    while (seg->NumRef()) default_env->SleepForMicroseconds(10);
-    s = default_env->DeleteFile(filepath);
-    if (!s.ok()) return s;
-    r->mutex.lock();
-    delete seg;
+  const std::string filepath = filepath_it->second;
+  r->segment_filepaths.erase(filepath_it);
+  r->segment_groups.erase(seg_id);
+  r->usage->RemoveSegment(seg_id);
+  r->recovered_invalid_runs.erase(seg_id);
+  r->run_states.erase(seg_id);
+  const SegmentTable* segments = r->segments.load();
+  if (segments->find(seg_id) == segments->end()) {
+    // Never opened, so nobody reads it
+    return Env::Default()->DeleteFile(filepath);
   }
-  r->mutex.unlock();
-  return s;
+  CloseSegment(seg_id, filepath);
+  return Status::OK();
+}
+
+void SegmentManager::CloseSegment(uint32_t seg_id,
+                                  const std::string& obsolete_filepath) {
+  Rep* r = rep_;
+  const SegmentTable* segments = r->segments.load();
+  auto it = segments->find(seg_id);
+  if (it == segments->end()) return;
+  Segment* seg = it->second;
+  if (!obsolete_filepath.empty()) seg->SetObsolete(obsolete_filepath);
+  SegmentTable* table = new SegmentTable(*segments);
+  table->erase(seg_id);
+  r->PublishSegments(table);
+  // Readers that found the segment in the old table may still be taking
+  // references to it
+  r->epoch.Retire([seg]() { seg->UnRef(); });
 }
 
 void SegmentManager::DropSegment(Segment* seg_ptr) { seg_ptr->UnRef(); }
 
+void SegmentManager::InheritDataAge(uint32_t seg_id, uint32_t src_seg_id) {
+  Rep* r = rep_;
+  std::lock_guard<std::mutex> g(r->mutex);
+  r->usage->InheritAge(seg_id, src_seg_id);
+}
+
+void SegmentManager::SetSegmentGroup(uint32_t seg_id, int group) {
+  Rep* r = rep_;
+  std::lock_guard<std::mutex> g(r->mutex);
+  r->segment_groups[seg_id] = group;
+}
+
+int SegmentManager::GetSegmentGroup(uint32_t seg_id) {
+  Rep* r = rep_;
+  std::lock_guard<std::mutex> g(r->mutex);
+  auto it = r->segment_groups.find(seg_id);
+  return it == r->segment_groups.end() ? -1 : it->second;
+}
+
 Status SegmentManager::OpenSegment(uint32_t seg_id, Segment** seg_ptr) {
   Rep* r = rep_;
-  r->mutex.lock();
+  {
+    EpochManager::Guard guard(&r->epoch);
+    const SegmentTable* segments = r->segments.load();
+    auto it = segments->find(seg_id);
+    if (it != segments->end()) {
+      *seg_ptr = it->second;
+      (*seg_ptr)->Ref();
+      (*seg_ptr)->SetLastAccess(
+          r->access_clock.load(std::memory_order_relaxed));
+      r->cache_hits.fetch_add(1, std::memory_order_relaxed);
+      return Status::OK();
+    }
+  }
+
+  // First open of the segment, or reopen after eviction
+  r->cache_misses.fetch_add(1, std::memory_order_relaxed);
+  std::string filepath;
+  Status s = GetSegmentFilePath(seg_id, &filepath);
+  if (!s.ok()) return s;
+  Env* default_env = Env::Default();
+  RandomAccessFile* rfile;
+  s = default_env->NewRandomAccessFile(filepath, &rfile);
+  if (!s.ok()) {
+    return s;
+  }
+  uint64_t filesize;
+  s = default_env->GetFileSize(filepath, &filesize);
+  if (!s.ok()) {
+    delete rfile;
+    return s;
+  }
+  Segment* seg;
+  s = Segment::Open(r->options, seg_id, rfile, filesize, &seg);
+  if (!s.ok()) {
+    return s;
+  }
+
+  std::lock_guard<std::mutex> g(r->mutex);
+  const SegmentTable* segments = r->segments.load();
+  auto it = segments->find(seg_id);
   auto filepath_it = r->segment_filepaths.find(seg_id);
-  if (filepath_it == r->segment_filepaths.end()) {
-    r->mutex.unlock();
+  if (it != segments->end()) {
+    // Opened by another thread meanwhile
+    delete seg;
+    seg = it->second;
+  } else if (filepath_it == r->segment_filepaths.end() ||
+             filepath_it->second != filepath) {
+    delete seg;
     return Status::NotFound("segment[" + std::to_string(seg_id) +
-                            "] is not found");
+                            "] was removed or renamed while opening");
+  } else {
+    std::shared_ptr<SegmentRunState>& state = r->run_states[seg_id];
+    if (state != nullptr &&
+        state->invalidated_runs.size() ==
+            seg->GetRunState()->invalidated_runs.size()) {
+      // Closed by EvictSegments() before
+      seg->SetRunState(state);
+    } else {
+      state = seg->GetRunState();
+      auto recovered = r->recovered_invalid_runs.find(seg_id);
+      if (recovered != r->recovered_invalid_runs.end()) {
+        // Already accounted for in r->usage
+        uint64_t invalidated_bytes;
+        for (uint32_t run_no : recovered->second) {
+          seg->InvalidateMiniRun(run_no, &invalidated_bytes);
+        }
+        r->recovered_invalid_runs.erase(recovered);
+      }
+    }
+    seg->SetLastAccess(r->access_clock.fetch_add(1) + 1);
+    seg->Ref();  // The manager's
+    SegmentTable* table = new SegmentTable(*segments);
+    (*table)[seg_id] = seg;
+    r->PublishSegments(table);
   }
+  seg->Ref();
+  *seg_ptr = seg;
+  // Pinned first, so the segment is not evicted right away
+  if (r->segments.load()->size() > r->cache_capacity) EvictSegments();
+  return Status::OK();
+}
 
-  auto it = r->segments.find(seg_id);
-  if (it == r->segments.end()) {
-    std::string filepath = filepath_it->second;
-    r->mutex.unlock();
-    Env* default_env = Env::Default();
-    RandomAccessFile* rfile;
-    Status s = default_env->NewRandomAccessFile(filepath, &rfile);
-    if (!s.ok()) {
-      return s;
+void SegmentManager::EvictSegments() {
+  Rep* r = rep_;
+  const SegmentTable* segments = r->segments.load();
+  // Evict in batches so the table is not copied on every miss
+  const size_t target = r->cache_capacity - r->cache_capacity / 8;
+  std::vector<std::pair<uint64_t, Segment*>> idle;
+  for (auto& kv : *segments) {
+    // Only the manager's reference is left
+    if (kv.second->NumRef() == 1) {
+      idle.emplace_back(kv.second->LastAccess(), kv.second);
     }
+  }
+  if (segments->size() <= target) return;
+  const size_t n = std::min(idle.size(), segments->size() - target);
+  if (n == 0) return;
+  std::partial_sort(idle.begin(), idle.begin() + n, idle.end(),
+                    [](const std::pair<uint64_t, Segment*>& a,
+                       const std::pair<uint64_t, Segment*>& b) {
+                      return a.first < b.first;
+                    });
+  SegmentTable* table = new SegmentTable(*segments);
+  for (size_t i = 0; i < n; i++) {
+    table->erase(idle[i].second->SegmentId());
+  }
+  r->PublishSegments(table);
+  r->cache_evictions.fetch_add(n, std::memory_order_relaxed);
+  // Readers may have taken a reference since the check above; like in
+  // CloseSegment() they keep the segment alive until they drop it
+  for (size_t i = 0; i < n; i++) {
+    Segment* seg = idle[i].second;
+    r->epoch.Retire([seg]() { seg->UnRef(); });
+  }
+}
 
-    uint64_t filesize;
-    s = default_env->GetFileSize(filepath, &filesize);
-    if (!s.ok()) {
-      return s;
-    }
-    r->mutex.lock();
-    s = Segment::Open(r->options, seg_id, rfile, filesize, seg_ptr);
-    if (!s.ok()) {
-      r->mutex.unlock();
-      return s;
-    }
-    r->segments[seg_id] = *seg_ptr;
-    r->segment_filepaths[seg_id] = filepath;
-  } else {
-    *seg_ptr = it->second;
+std::string SegmentManager::CacheString() {
+  Rep* r = rep_;
+  size_t open;
+  {
+    EpochManager::Guard guard(&r->epoch);
+    open = r->segments.load()->size();
   }
-  (*seg_ptr)->Ref();
-  r->mutex.unlock();
-  return Status::OK();
+  const uint64_t hits = r->cache_hits.load();
+  const uint64_t misses = r->cache_misses.load();
+  const uint64_t total = hits + misses;
+  char buf[200];
+  snprintf(buf, sizeof(buf),
+           "segment cache: %zu/%zu open, %llu hits, %llu misses, "
+           "%.1f%% hit rate, %llu evictions\n",
+           open, r->cache_capacity, (unsigned long long)hits,
+           (unsigned long long)misses,
+           total == 0 ? 0.0 : 100.0 * hits / total,
+           (unsigned long long)r->cache_evictions.load());
+  return buf;
 }
 
 Status SegmentManager::OpenManager(const Options& options,
@@ -443,28 +731,248 @@ Status SegmentManager::OpenManager(const Options& options,
   r->options = options;
   r->dbname = dbname;
   r->gc_func = gc_func;
+  r->gc_policy.reset(NewGCPolicy(options.gc_policy));
+  r->usage.reset(new SegmentUsageTracker(r->gc_policy.get()));
+  r->punch_holes = options.punch_invalid_runs;
+  // Like the table cache of leveldb, leave some files for the rest
+  r->cache_capacity = std::max(options.max_open_files - 10, 1);
   std::vector<std::string> subfiles;
   Status s = default_env->GetChildren(dbname, &subfiles);
   if (!s.ok()) {
     return s;
   }
 
-  std::vector<std::string> seg_files;
-  std::vector<uint32_t> seg_ids;
   for (auto filename : subfiles) {
     uint32_t seg_id = -1;
     if (GetSegmentFileInfo(filename, seg_id)) {
       std::string filepath = dbname + "/" + filename;
-      seg_files.push_back(filepath);
-      seg_ids.push_back(seg_id);
       r->segment_filepaths[seg_id] = filepath;
       r->seg_id_max = std::max(r->seg_id_max, seg_id);
     }
   }
 
-  *manager_ptr = new SegmentManager(r);
+  SegmentManager* manager = new SegmentManager(r);
+  s = manager->RecoverInvalidRuns();
+  if (!s.ok()) {
+    delete manager;
+    return s;
+  }
+  *manager_ptr = manager;
   return Status::OK();
 }
 
+SegmentManager::~SegmentManager() {
+  Rep* r = rep_;
+  PersistInvalidRuns();
+  delete r->invalid_runs_log;
+  delete r->invalid_runs_file;
+  // No readers are left to hold back retired segments and tables
+  r->epoch.Reclaim();
+  const SegmentTable* segments = r->segments.load();
+  for (auto& kv : *segments) {
+    kv.second->UnRef();
+  }
+  delete segments;
+  delete r;
+}
+
+Status SegmentManager::RecoverInvalidRuns() {
+  Rep* r = rep_;
+  Env* env = Env::Default();
+  const std::string filename = InvalidRunsFileName(r->dbname);
+
+  // Invalid run sizes by run number, by segment
+  std::unordered_map<uint32_t, std::map<uint32_t, uint64_t>> invalid_runs;
+  SequentialFile* file;
+  Status s = env->NewSequentialFile(filename, &file);
+  if (s.ok()) {
+    struct LogReporter : public log::Reader::Reporter {
+      Status* status;
+      void Corruption(size_t bytes, const Status& s) override {
+        if (status->ok()) *status = s;
+      }
+    };
+    Status read_status;
+    LogReporter reporter;
+    reporter.status = &read_status;
+    log::Reader reader(file, &reporter, true /*checksum*/,
+                       0 /*initial_offset*/);
+    Slice record;
+    std::string scratch;
+    while (reader.ReadRecord(&record, &scratch) && read_status.ok()) {
+      uint32_t seg_id, run_no;
+      uint64_t run_size;
+      while (GetVarint32(&record, &seg_id) && GetVarint32(&record, &run_no) &&
+             GetVarint64(&record, &run_size)) {
+        // Segments removed since may have left records behind
+        if (r->segment_filepaths.count(seg_id)) {
+          invalid_runs[seg_id][run_no] = run_size;
+        }
+      }
+    }
+    delete file;
+    // Losing records only makes runs look valid, which GC double checks
+    // against the leaf index anyway
+    if (!read_status.ok()) {
+      Log(r->options.info_log, "Dropping corrupted invalid runs: %s\n",
+          read_status.ToString().c_str());
+    }
+  }
+
+  // Rewrite the file with the records of the live segments only, so it
+  // does not grow forever and ids of removed segments may be reused
+  std::string contents;
+  for (auto& kv : r->segment_filepaths) {
+    const uint32_t seg_id = kv.first;
+    uint64_t filesize;
+    if (!env->GetFileSize(kv.second, &filesize).ok()) continue;
+    uint64_t invalid_bytes = 0;
+    auto it = invalid_runs.find(seg_id);
+    if (it != invalid_runs.end()) {
+      std::vector<uint32_t>& recovered = r->recovered_invalid_runs[seg_id];
+      for (auto& run : it->second) {
+        recovered.push_back(run.first);
+        // Punched already unless the process died in between, either way
+        // the space is accounted for once punched again
+        if (r->punch_holes) {
+          r->runs_to_punch[seg_id].emplace_back(0, run.first);
+        }
+        invalid_bytes += run.second;
+        PutVarint32(&contents, seg_id);
+        PutVarint32(&contents, run.first);
+        PutVarint64(&contents, run.second);
+      }
+    }
+    r->usage->AddSegment(seg_id, filesize, invalid_bytes);
+  }
+
+  const std::string tmp = filename + ".tmp";
+  WritableFile* wfile;
+  s = env->NewWritableFile(tmp, &wfile);
+  if (!s.ok()) return s;
+  log::Writer* writer = new log::Writer(wfile);
+  if (!contents.empty()) s = writer->AddRecord(contents);
+  if (s.ok()) s = wfile->Sync();
+  if (s.ok()) s = env->RenameFile(tmp, filename);
+  if (!s.ok()) {
+    delete writer;
+    delete wfile;
+    env->DeleteFile(tmp);
+    return s;
+  }
+  r->invalid_runs_file = wfile;
+  r->invalid_runs_log = writer;
+  return s;
+}
+
+Status SegmentManager::PersistInvalidRuns() {
+  Rep* r = rep_;
+  std::lock_guard<std::mutex> l(r->invalid_runs_mutex);
+  std::string batch;
+  {
+    std::lock_guard<std::mutex> g(r->mutex);
+    batch.swap(r->pending_invalid_runs);
+  }
+  if (r->invalid_runs_log == nullptr) return Status::OK();
+  Status s;
+  if (!batch.empty()) {
+    s = r->invalid_runs_log->AddRecord(batch);
+    if (s.ok()) s = r->invalid_runs_file->Sync();
+  }
+  if (s.ok() && r->punch_holes) {
+    // The leaf index dropped these runs before this call; views acquired
+    // from now on cannot reach them
+    uint64_t epoch;
+    {
+      std::lock_guard<std::mutex> g(r->views_mutex);
+      epoch = ++r->view_epoch;
+    }
+    Slice input(batch);
+    uint32_t seg_id, run_no;
+    uint64_t run_size;
+    while (GetVarint32(&input, &seg_id) && GetVarint32(&input, &run_no) &&
+           GetVarint64(&input, &run_size)) {
+      r->runs_to_punch[seg_id].emplace_back(epoch, run_no);
+    }
+    PunchInvalidRuns();
+  }
+  return s;
+}
+
+uint64_t SegmentManager::AcquireReadView() {
+  Rep* r = rep_;
+  if (!r->options.punch_invalid_runs) return 0;
+  std::lock_guard<std::mutex> g(r->views_mutex);
+  ++r->read_views[r->view_epoch];
+  return r->view_epoch;
+}
+
+void SegmentManager::ReleaseReadView(uint64_t view) {
+  Rep* r = rep_;
+  if (view == 0) return;
+  std::lock_guard<std::mutex> g(r->views_mutex);
+  auto it = r->read_views.find(view);
+  assert(it != r->read_views.end());
+  if (--it->second == 0) r->read_views.erase(it);
+}
+
+void SegmentManager::PunchInvalidRuns() {
+  Rep* r = rep_;
+  // Runs persisted after the oldest view was acquired may still be read
+  // through it, whether or not their segment is open yet
+  uint64_t oldest_view = std::numeric_limits<uint64_t>::max();
+  {
+    std::lock_guard<std::mutex> g(r->views_mutex);
+    if (!r->read_views.empty()) oldest_view = r->read_views.begin()->first;
+  }
+  for (auto it = r->runs_to_punch.begin(); it != r->runs_to_punch.end();) {
+    const uint32_t seg_id = it->first;
+    std::vector<std::pair<uint64_t, uint32_t>>& runs = it->second;
+    size_t num_ready = 0;
+    while (num_ready < runs.size() && runs[num_ready].first <= oldest_view) {
+      ++num_ready;
+    }
+    if (num_ready == 0) {  // Try again on a later call
+      ++it;
+      continue;
+    }
+    Segment* seg;
+    std::string filepath;
+    Status s = OpenSegment(seg_id, &seg);
+    if (!s.ok()) {  // Collected since
+      it = r->runs_to_punch.erase(it);
+      continue;
+    }
+    s = GetSegmentFilePath(seg_id, &filepath);
+    uint64_t punched = 0;
+    for (size_t i = 0; i < num_ready && s.ok(); ++i) {
+      uint64_t run_punched;
+      s = seg->PunchMiniRun(runs[i].second, filepath, &run_punched);
+      punched += run_punched;
+    }
+    DropSegment(seg);
+    if (punched != 0) {
+      std::lock_guard<std::mutex> g(r->mutex);
+      r->usage->ReclaimInvalidBytes(seg_id, punched);
+    }
+    if (!s.ok()) {
+      // Leaves the runs to GC
+      Log(r->options.info_log, "Punching invalid runs failed: %s\n",
+          s.ToString().c_str());
+      if (s.IsNotSupportedError()) {
+        r->punch_holes = false;
+        r->runs_to_punch.clear();
+        return;
+      }
+    }
+    runs.erase(runs.begin(), runs.begin() + num_ready);
+    if (runs.empty()) {
+      it = r->runs_to_punch.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
 }  // namespace silkstore
 }  // namespace leveldb
\ No newline at end of file
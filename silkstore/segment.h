@@ -17,6 +17,7 @@ namespace leveldb {
 namespace silkstore {
 
 class SegmentManager;
+struct SegmentRunState;
 
 static std::string MakeSegmentFileName(uint32_t segment_id);
 
@@ -55,6 +56,16 @@ class SegmentBuilder {
   // REQUIRES: Finish(), Abandon() have not been called.
   Status FinishMiniRun(uint32_t* run_no);
 
+  // Append the run described by "src_handle" of segment "src_seg_id" as a
+  // finished run, copying its bytes verbatim without decoding them.  Block
+  // handles in a run's index block are relative to the run start, so the
+  // index and filter blocks of the source run remain valid for the copy.
+  // Unlike FinishMiniRun(), the finished run index block, filter block and
+  // data size are not available afterwards.
+  // REQUIRES: no run is being built.
+  Status AddRawMiniRun(uint32_t src_seg_id, const MiniRunHandle& src_handle,
+                       uint32_t* run_no);
+
   // Return the index block for the previously finished run.
   // REQUIRES: FinishMiniRun() has been called and StartMiniRun() has not.
   Slice GetFinishedRunIndexBlock();
@@ -77,6 +88,9 @@ class SegmentBuilder {
 
   bool RunStarted() const;
 
+  // Throttle the writes of this segment, see MiniRunBuilder::SetRateLimiter.
+  void SetRateLimiter(RateLimiter* limiter, BackgroundPriority pri);
+
   uint32_t GetFinishedRunDataSize();
 
  private:
@@ -103,6 +117,7 @@ class SegmentBuilder {
  */
 class Segment {
  public:
+  // Takes ownership of "file", also on failure.
   static Status Open(const Options& options, uint32_t segment_id,
                      RandomAccessFile* file, uint64_t file_size,
                      Segment** segment);
@@ -111,6 +126,8 @@ class Segment {
 
   Segment(const Segment&) = delete;
 
+  // The segment is deleted when the last reference is dropped.  The
+  // SegmentManager holds one for as long as the segment is open.
   void Ref();
 
   void UnRef();
@@ -119,13 +136,39 @@ class Segment {
 
   void operator=(const Segment&) = delete;
 
-  RandomAccessFile* SetNewSegmentFile(RandomAccessFile* file);
+  // Delete "filepath", the file of the segment, along with the segment.
+  void SetObsolete(const std::string& filepath);
 
   Status OpenMiniRun(int run_no, Block& index_block, MiniRun** run);
 
   // Mark the minirun indicated by the segment.run_handle[run_no] as invalid.
   // Later GCs can simply skip this run without querying index for validness.
-  Status InvalidateMiniRun(const int& run_no);
+  // Stores the size of the run in *invalidated_bytes, or 0 if it was
+  // invalidated already.
+  Status InvalidateMiniRun(const int& run_no, uint64_t* invalidated_bytes);
+
+  // Free the disk space of the invalidated run "run_no" by punching a hole
+  // into "filepath", the file of this segment, over the whole file system
+  // blocks the run covers.  Stores the number of bytes freed in
+  // *punched_bytes, 0 if the run was punched before or covers no whole
+  // block.  Punched runs read back as zeros, so the run must not be
+  // referenced by the leaf index nor read by anyone anymore.
+  Status PunchMiniRun(int run_no, const std::string& filepath,
+                      uint64_t* punched_bytes);
+
+  // Bytes freed by PunchMiniRun() since the segment was first opened.
+  uint64_t PunchedBytes() const;
+
+  // Invalidated and punched runs.  The SegmentManager keeps them across
+  // reopens of a segment it evicted, and shares them between the objects
+  // of one segment.
+  std::shared_ptr<SegmentRunState> GetRunState() const;
+  void SetRunState(std::shared_ptr<SegmentRunState> state);
+
+  // Tick of the segment cache when the segment was last opened, see
+  // SegmentManager::OpenSegment().
+  uint64_t LastAccess() const;
+  void SetLastAccess(uint64_t tick);
 
   // Iterate over all run numbers using a user-defined handler.
   // Arguments include a run number, handle to the run, size of the run, and a
@@ -161,19 +204,37 @@ class SegmentManager {
                             SegmentManager** manager_ptr,
                             std::function<void()> gc_func);
 
-  // Get the top K most invalidated segments
-  std::vector<Segment*> GetMostInvalidatedSegments(int K);
+  // Persists the runs invalidated so far.
+  // REQUIRES: no segments are in use.
+  ~SegmentManager();
+
+  // Get the K segments most worth collecting according to
+  // Options::gc_policy, roughly best first, see SegmentUsageTracker.
+  // Segments without invalid data are never returned.  The segments are
+  // pinned, so the cache cannot close them; the caller must DropSegment()
+  // each of them, also after RemoveSegment().
+  std::vector<Segment*> PickSegmentsToCollect(int K);
+
+  // GC policy plus the number, total size and invalid share of the
+  // finished segments.
+  std::string UsageString();
+
+  // Size, capacity and hit rate of the cache of open segments.
+  std::string CacheString();
 
   // Open or create a segment object
   // OpenSegment should always be paired with DropSegment
+  // Does not block while the segment stays cached.  At most
+  // Options::max_open_files - 10 segments are cached; the least recently
+  // opened ones nobody holds are closed beyond that.
   Status OpenSegment(uint32_t seg_id, Segment** seg_ptr);
 
   void DropSegment(Segment* seg_ptr);
 
   // Remove segment objects and underlying segment files if associated.
   // This function should be called for phyiscal cleanup after GC.
-  // This function waits for old readers to the segment to exit before
-  // physically deleting resources.
+  // Readers still holding the segment keep it and its file alive; the
+  // last one to drop it deletes both.
   Status RemoveSegment(uint32_t seg_id);
 
   Status NewSegmentBuilder(uint32_t* seg_id,
@@ -184,8 +245,42 @@ class SegmentManager {
 
   Status InvalidateSegmentRun(uint32_t seg_id, uint32_t run_no);
 
+  // Appends the runs invalidated since the previous call to the invalid
+  // runs file, so GC can skip them and segment utilization is known
+  // after a restart.  Must only be called once the leaf index no longer
+  // references those runs durably; otherwise a crash could leave the
+  // index pointing at runs GC considers garbage.
+  //
+  // With Options::punch_invalid_runs, also frees the space of those runs
+  // once the read views acquired before are released, see
+  // Segment::PunchMiniRun() and AcquireReadView().
+  Status PersistInvalidRuns();
+
+  // Readers that look runs up in the leaf index and read them later hold
+  // a read view from before the lookup until they are done.  Runs
+  // invalidated after a view was acquired are not punched before it is
+  // released, so such readers never see the holes.  Returns the view to
+  // pass to ReleaseReadView(); free without Options::punch_invalid_runs.
+  uint64_t AcquireReadView();
+  void ReleaseReadView(uint64_t view);
+
   Status RenameSegment(uint32_t seg_id, const std::string target_filepath);
 
+  Status GetSegmentFilePath(uint32_t seg_id, std::string* filepath);
+
+  // Records that a run of segment "src_seg_id" was copied into segment
+  // "seg_id", which is being built, so GC judges "seg_id" by the age of
+  // the data it holds.  Kept in memory only.
+  void InheritDataAge(uint32_t seg_id, uint32_t src_seg_id);
+
+  // Remember which placement group a segment was written for, see
+  // Options::num_segment_groups.  Groups are kept in memory only, so
+  // segments written before the DB was opened have none.
+  void SetSegmentGroup(uint32_t seg_id, int group);
+
+  // Returns -1 if the segment has no group.
+  int GetSegmentGroup(uint32_t seg_id);
+
   void ForEachSegment(std::function<void(Segment* seg)> processor);
 
  private:
@@ -193,6 +288,24 @@ class SegmentManager {
   Rep* rep_;
 
   SegmentManager(Rep* r) : rep_(r) {}
+
+  // Closes least recently opened segments not in use until the cache is
+  // below its capacity.
+  // REQUIRES: rep_->mutex is held.
+  void EvictSegments();
+
+  // Loads the invalid runs file into the usage tracker and rewrites it
+  // with the records of existing segments only.
+  Status RecoverInvalidRuns();
+
+  // Punches the queued invalid runs no read view may still reach.
+  // REQUIRES: rep_->invalid_runs_mutex is held.
+  void PunchInvalidRuns();
+
+  // Unpublishes open segment "seg_id", if any, dropping the manager's
+  // reference once readers that may have found it are done.
+  // REQUIRES: rep_->mutex is held.
+  void CloseSegment(uint32_t seg_id, const std::string& obsolete_filepath);
 };
 
 }  // namespace silkstore
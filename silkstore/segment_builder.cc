@@ -15,6 +15,7 @@
 #include "util/crc32c.h"
 
 #include "silkstore/minirun.h"
+#include "silkstore/rate_limiter.h"
 #include "silkstore/segment.h"
 
 namespace leveldb {
@@ -33,6 +34,8 @@ struct SegmentBuilder::Rep {
   std::string target_segment_filepath;
   uint32_t seg_id;
   SegmentManager* segment_mgr;
+  RateLimiter* rate_limiter;
+  BackgroundPriority io_priority;
 
   Rep(const Options& opt, const std::string& src_segment_filepath,
       const std::string& target_segment_filepath, WritableFile* f,
@@ -46,7 +49,9 @@ struct SegmentBuilder::Rep {
         src_segment_filepath(src_segment_filepath),
         target_segment_filepath(target_segment_filepath),
         seg_id(seg_id),
-        segment_mgr(segment_mgr) {}
+        segment_mgr(segment_mgr),
+        rate_limiter(nullptr),
+        io_priority(kFlushPriority) {}
 
   ~Rep() { delete file; }
 };
@@ -74,6 +79,13 @@ Status SegmentBuilder::StartMiniRun() {
   return Status::OK();
 }
 
+void SegmentBuilder::SetRateLimiter(RateLimiter* limiter,
+                                    BackgroundPriority pri) {
+  rep_->rate_limiter = limiter;
+  rep_->io_priority = pri;
+  rep_->run_builder->SetRateLimiter(limiter, pri);
+}
+
 bool SegmentBuilder::RunStarted() const {
   Rep* r = rep_;
   return r->run_started;
@@ -110,6 +122,57 @@ Status SegmentBuilder::FinishMiniRun(uint32_t* run_no) {
   return Status::OK();
 }
 
+Status SegmentBuilder::AddRawMiniRun(uint32_t src_seg_id,
+                                     const MiniRunHandle& src_handle,
+                                     uint32_t* run_no) {
+  Rep* r = rep_;
+  assert(r->run_started == false);
+  if (!ok()) return status();
+  // A run ends with the trailer of its last block; the run size derived from
+  // the next run's start would count the footer of the last run too
+  const BlockHandle& src_last = src_handle.last_block_handle;
+  if (src_last.offset() < src_handle.run_start_pos)
+    return Status::Corruption("minirun without blocks");
+  const uint64_t run_size = src_last.offset() + src_last.size() +
+                            kBlockTrailerSize - src_handle.run_start_pos;
+
+  std::string src_filepath;
+  r->status = r->segment_mgr->GetSegmentFilePath(src_seg_id, &src_filepath);
+  if (!ok()) return status();
+  if (r->rate_limiter != nullptr) {
+    r->rate_limiter->Request(run_size, r->io_priority);
+  }
+  r->status = r->file->AppendFileRange(src_filepath, src_handle.run_start_pos,
+                                       run_size);
+  if (r->status.IsNotSupportedError()) {
+    // Copy through user space, still without decoding the blocks
+    RandomAccessFile* src_file;
+    r->status = r->options.env->NewRandomAccessFile(src_filepath, &src_file);
+    if (!ok()) return status();
+    std::string scratch(run_size, '\0');
+    Slice contents;
+    r->status = src_file->Read(src_handle.run_start_pos, run_size, &contents,
+                               &scratch[0]);
+    if (ok() && contents.size() != run_size)
+      r->status = Status::Corruption("truncated minirun", src_filepath);
+    if (ok()) r->status = r->file->Append(contents);
+    delete src_file;
+  }
+  if (!ok()) return status();
+
+  BlockHandle last_block_handle;
+  last_block_handle.set_offset(src_last.offset() - src_handle.run_start_pos +
+                               r->prev_file_size);
+  last_block_handle.set_size(src_last.size());
+  *run_no = r->run_handles.size();
+  r->run_handles.push_back(MiniRunHandle{r->prev_file_size, last_block_handle});
+  r->prev_file_size += run_size;
+  // Keeps FileSize() and the start of the next run in step
+  r->run_builder->Reset(r->prev_file_size);
+  r->segment_mgr->InheritDataAge(r->seg_id, src_seg_id);
+  return Status::OK();
+}
+
 void SegmentBuilder::Add(const Slice& key, const Slice& value) {
   Rep* r = rep_;
   assert(r->run_started);
@@ -5,25 +5,24 @@
 #include <functional>
 #include <memory>
 #include <queue>
-#include <thread>
 
 #include "db/filename.h"
 #include "db/log_reader.h"
 #include "db/memtable.h"
 #include "db/write_batch_internal.h"
+#include "leveldb/cache.h"
 #include "leveldb/write_batch.h"
 #include "table/merger.h"
+#include "util/coding.h"
 #include "util/mutexlock.h"
 
 #include "util/histogram.h"
 #include "silkstore/silkstore_impl.h"
+#include "silkstore/leaf_index_backend.h"
+#include "silkstore/perf_context.h"
 #include "silkstore/silkstore_iter.h"
 #include "silkstore/util.h"
 
-int runs_searched = 0;
-int runs_hit_counts = 0;
-int runs_miss_counts = 0;
-int bloom_filter_counts = 0;
 namespace leveldb {
 
 Status DB::OpenSilkStore(const Options& options, const std::string& name,
@@ -47,6 +46,41 @@ namespace silkstore {
 
 const std::string kCURRENTFilename = "CURRENT";
 
+// The memtables and leaf store a read has to consult, pinned as a unit.
+// SilkStore holds one reference to the current SuperVersion and readers
+// hold the others.  The memtable references are dropped under
+// SilkStore::mutex_ once the last reference goes away.
+struct SuperVersion {
+  NvmemTable* const mem;
+  NvmemTable* const imm;
+  LeafStore* const leaf_store;
+  // Leaf boundaries for point lookups; may be null or stale
+  const std::shared_ptr<const LeafBoundaries> leaf_boundaries;
+  const uint64_t version_number;
+  std::atomic<int> refs;
+
+  SuperVersion(NvmemTable* mem, NvmemTable* imm, LeafStore* leaf_store,
+               std::shared_ptr<const LeafBoundaries> leaf_boundaries,
+               uint64_t version_number)
+      : mem(mem),
+        imm(imm),
+        leaf_store(leaf_store),
+        leaf_boundaries(std::move(leaf_boundaries)),
+        version_number(version_number),
+        refs(1) {}
+
+  void Ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+
+  // Returns true iff the last reference was dropped.
+  bool Unref() { return refs.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+
+  // REQUIRES: SilkStore::mutex_ is held and Unref() returned true
+  void Cleanup() {
+    mem->Unref();
+    if (imm != nullptr) imm->Unref();
+  }
+};
+
 // Fix user-supplied options to be reasonable
 template <class T, class V>
 static void ClipToRange(T* ptr, V minvalue, V maxvalue) {
@@ -65,6 +99,7 @@ static Options SanitizeOptions(const std::string& dbname,
   ClipToRange(&result.write_buffer_size, 64 << 10, 1 << 30);
   ClipToRange(&result.max_file_size, 1 << 20, 1 << 30);
   ClipToRange(&result.block_size, 1 << 10, 4 << 20);
+  ClipToRange(&result.num_segment_groups, 1, 16);
   if (result.info_log == nullptr) {
     // Open a log file in the same directory as the db
     src.env->CreateDir(dbname);  // In case it does not exist
@@ -97,37 +132,56 @@ SilkStore::SilkStore(const Options& raw_options, const std::string& dbname)
       logfile_number_(0),
       log_(nullptr),
       max_sequence_(0),
+      visible_sequence_(0),
+      super_version_(nullptr),
+      super_version_number_(0),
       memtable_capacity_(options_.write_buffer_size),
       seed_(0),
       tmp_batch_(new WriteBatch),
       background_compaction_scheduled_(false),
+      background_gc_scheduled_(false),
+      scheduler_(new BackgroundScheduler(options_.background_threads)),
+      rate_limiter_(options_.background_io_bytes_per_sec),
       leaf_optimization_func_([]() {}),
-      background_leaf_op_finished_signal_(&leaf_op_mutex_),
-      background_leaf_optimization_scheduled_(false),
-      manual_compaction_(nullptr) {
+      manual_compaction_(nullptr),
+      row_cache_id_(options_.row_cache != nullptr ? options_.row_cache->NewId()
+                                                  : 0) {
   nvm_manager_ =
       new NvmManager(raw_options.nvmemtable_file, raw_options.nvmemtable_size);
   has_imm_.Release_Store(nullptr);
+  stats_.gc_group_stats.resize(options_.num_segment_groups + 1);
+  for (int i = 0; i < kNumSuperVersionSlots; ++i) {
+    super_version_slots_[i].sv.store(nullptr, std::memory_order_relaxed);
+  }
 }
 
 SilkStore::~SilkStore() {
   // Wait for background work to finish
   mutex_.Lock();
   shutting_down_.Release_Store(this);  // Any non-null value is ok
-  while (background_compaction_scheduled_) {
+  while (background_compaction_scheduled_ || background_gc_scheduled_) {
     background_work_finished_signal_.Wait();
   }
+  ReleaseCachedSuperVersions();
+  if (super_version_ != nullptr && super_version_->Unref()) {
+    super_version_->Cleanup();
+    delete super_version_;
+  }
+  super_version_ = nullptr;
   mutex_.Unlock();
 
-  leaf_op_mutex_.Lock();
-  while (background_leaf_optimization_scheduled_) {
-    background_leaf_op_finished_signal_.Wait();
-  }
-  leaf_op_mutex_.Unlock();
+  // Waits for a running leaf optimization and drops the scheduled one
+  delete scheduler_;
+  scheduler_ = nullptr;
+
+  delete segment_manager_;
+  segment_manager_ = nullptr;
 
   // Delete leaf index
   delete leaf_index_;
   leaf_index_ = nullptr;
+  delete leaf_index_options_.filter_policy;
+  delete leaf_index_options_.block_cache;
 
   if (db_lock_ != nullptr) {
     env_->UnlockFile(db_lock_);
@@ -150,8 +204,9 @@ SilkStore::~SilkStore() {
 
 Status SilkStore::OpenIndex(const Options& index_options) {
   assert(leaf_index_ == nullptr);
-  Status s =
-      NvmLeafIndex::OpenNvmLeafIndex(index_options, dbname_, &leaf_index_);
+  Status s = OpenLeafIndex(index_options, dbname_, &leaf_index_merger_,
+                           &leaf_index_);
+  if (!s.ok()) return s;
 
   auto it = leaf_index_->NewIterator(ReadOptions{});
   DeferCode c([it]() { delete it; });
@@ -267,7 +322,8 @@ Status SilkStore::RecoverNvmemtable(uint64_t log_number,
   mem_ =
       new NvmemTable(internal_comparator_, nullptr,
                      nvm_manager_->reallocate(records[len - 1], records[len]));
-  SequenceNumber last_seq;
+  // An empty memtable leaves last_seq untouched
+  SequenceNumber last_seq = 0;
   mem_->Recovery(last_seq);
   mem_->Ref();
 
@@ -294,17 +350,25 @@ Status SilkStore::RecoverNvmemtable(uint64_t log_number,
 Status SilkStore::Recover() {
   MutexLock g(&mutex_);
   this->leaf_index_options_.create_if_missing = true;
-  this->leaf_index_options_.filter_policy = NewBloomFilterPolicy(10);
-  this->leaf_index_options_.block_cache = NewLRUCache(8 << 26);
-  this->leaf_index_options_.compression = kNoCompression;
+  this->leaf_index_options_.env = options_.env;
+  this->leaf_index_options_.leaf_index_type = options_.leaf_index_type;
+  this->leaf_index_options_.nvmleafindex_file = options_.nvmleafindex_file;
+  this->leaf_index_options_.nvmleafindex_size = options_.nvmleafindex_size;
+  if (options_.leaf_index_type == kLevelDBLeafIndex) {
+    // Only a LevelDB leaf index reads through blocks and filters
+    this->leaf_index_options_.filter_policy = NewBloomFilterPolicy(10);
+    this->leaf_index_options_.block_cache = NewLRUCache(8 << 26);
+    this->leaf_index_options_.compression = kNoCompression;
+  }
   Status s = OpenIndex(this->leaf_index_options_);
   if (!s.ok()) return s;
   // Open segment manager
   s = SegmentManager::OpenManager(this->options_, dbname_, &segment_manager_,
-                                  std::bind(&SilkStore::GarbageCollect, this));
+                                  [this]() { GarbageCollect(1); });
   if (!s.ok()) return s;
   s = LeafStore::Open(segment_manager_, leaf_index_, options_,
-                      internal_comparator_.user_comparator(), &leaf_store_);
+                      internal_comparator_.user_comparator(), &statistics_,
+                      &leaf_store_);
   if (!s.ok()) return s;
   std::string current_content;
   s = ReadFileToString(env_, CurrentFilename(dbname_), &current_content);
@@ -355,29 +419,53 @@ Status SilkStore::Recover() {
     s = RecoverNvmemtable(log_start_seq_num, &max_sequence_);
   }
   if (!s.ok()) return s;
+  s = leaf_store_->RebuildLeafBoundaries();
+  if (!s.ok()) return s;
+  visible_sequence_.store(max_sequence_, std::memory_order_release);
+  InstallSuperVersion();
 
   leaf_optimization_func_ = [this]() {
     this->OptimizeLeaf();
-    background_leaf_optimization_scheduled_ = false;
-    background_leaf_op_finished_signal_.SignalAll();
-    leaf_op_mutex_.Unlock();
-    if (shutting_down_.Acquire_Load()) {
-      // No more background work when shutting down.
-    } else {
-      leaf_op_mutex_.Lock();
-      background_leaf_optimization_scheduled_ = true;
-      env_->ScheduleDelayedTask(leaf_optimization_func_,
-                                LeafStatStore::read_interval_in_micros);
+    // No more background work when shutting down.
+    if (!shutting_down_.Acquire_Load()) {
+      scheduler_->ScheduleDelayed(kReadOptPriority, leaf_optimization_func_,
+                                  LeafStatStore::read_interval_in_micros);
     }
   };
-
-  leaf_op_mutex_.Lock();
-  background_leaf_optimization_scheduled_ = true;
-  env_->ScheduleDelayedTask(leaf_optimization_func_,
-                            LeafStatStore::read_interval_in_micros);
+  scheduler_->ScheduleDelayed(kReadOptPriority, leaf_optimization_func_,
+                              LeafStatStore::read_interval_in_micros);
+
+  if (options_.background_io_bytes_per_sec > 0 &&
+      options_.background_io_target_p99_micros > 0) {
+    // Tuning is cheap and matters most when the pool is busy, so it does
+    // not queue behind splits and GC.
+    rate_tuning_func_ = [this]() {
+      this->TuneBackgroundIORate();
+      if (!shutting_down_.Acquire_Load()) {
+        scheduler_->ScheduleDelayed(kFlushPriority, rate_tuning_func_,
+                                    kRateTuningIntervalMicros);
+      }
+    };
+    scheduler_->ScheduleDelayed(kFlushPriority, rate_tuning_func_,
+                                kRateTuningIntervalMicros);
+  }
   return s;
 }
 
+void SilkStore::TuneBackgroundIORate() {
+  const double p99 =
+      statistics_.PercentileSince(kGetMicros, 99, &tuning_get_micros_);
+  const uint64_t old_rate = rate_limiter_.GetBytesPerSecond();
+  const uint64_t rate =
+      rate_limiter_.Tune(p99, options_.background_io_target_p99_micros,
+                         options_.background_io_bytes_per_sec);
+  if (rate != old_rate) {
+    Log(options_.info_log,
+        "Background I/O rate %llu -> %llu bytes/s, Get p99 %.1f micros\n",
+        (unsigned long long)old_rate, (unsigned long long)rate, p99);
+  }
+}
+
 Status SilkStore::TEST_CompactMemTable() {
   // nullptr batch means just wait for earlier writes to be done
   Status s = Write(WriteOptions(), nullptr);
@@ -394,6 +482,15 @@ Status SilkStore::TEST_CompactMemTable() {
   return s;
 }
 
+void SilkStore::TEST_WaitForGC() {
+  MutexLock l(&mutex_);
+  while (background_gc_scheduled_) {
+    background_work_finished_signal_.Wait();
+  }
+}
+
+Status SilkStore::TEST_OptimizeLeaf() { return OptimizeLeaf(); }
+
 // Convenience methods
 Status SilkStore::Put(const WriteOptions& o, const Slice& key,
                       const Slice& val) {
@@ -406,55 +503,139 @@ Status SilkStore::Delete(const WriteOptions& options, const Slice& key) {
 
 namespace {
 
+// Marks a per-thread SuperVersion slot whose reference is being used.
+char super_version_in_use;
+SuperVersion* const kSuperVersionInUse =
+    reinterpret_cast<SuperVersion*>(&super_version_in_use);
+
 struct IterState {
   port::Mutex* const mu;
-  NvmemTable* const mem GUARDED_BY(mu);
-  NvmemTable* const imm GUARDED_BY(mu);
-  IterState(port::Mutex* mutex, NvmemTable* mem, NvmemTable* imm)
-      : mu(mutex), mem(mem), imm(imm) {}
+  SuperVersion* const sv;
+  IterState(port::Mutex* mutex, SuperVersion* sv) : mu(mutex), sv(sv) {}
 };
 
 static void SilkStoreNewIteratorCleanup(void* arg1, void* arg2) {
   IterState* state = reinterpret_cast<IterState*>(arg1);
-  state->mu->Lock();
-  state->mem->Unref();
-  if (state->imm != nullptr) state->imm->Unref();
-  state->mu->Unlock();
+  if (state->sv->Unref()) {
+    state->mu->Lock();
+    state->sv->Cleanup();
+    state->mu->Unlock();
+    delete state->sv;
+  }
   delete state;
 }
 }  // anonymous namespace
 
-const Snapshot* SilkStore::GetSnapshot() {
-  MutexLock l(&mutex_);
-  return leaf_index_->GetSnapshot();
+void SilkStore::InstallSuperVersion() {
+  mutex_.AssertHeld();
+  SuperVersion* old = super_version_;
+  mem_->Ref();
+  if (imm_ != nullptr) imm_->Ref();
+  super_version_ = new SuperVersion(
+      mem_, imm_, leaf_store_, leaf_store_->CurrentLeafBoundaries(),
+      old == nullptr ? 1 : old->version_number + 1);
+  super_version_number_.store(super_version_->version_number,
+                              std::memory_order_release);
+  // Idle reader threads must not keep retired memtables alive
+  ReleaseCachedSuperVersions();
+  if (old != nullptr && old->Unref()) {
+    old->Cleanup();
+    delete old;
+  }
+}
+
+void SilkStore::ReleaseCachedSuperVersions() {
+  mutex_.AssertHeld();
+  for (int i = 0; i < kNumSuperVersionSlots; ++i) {
+    // A slot in use is cleared as well; its owner notices on release
+    // and drops the reference itself.
+    SuperVersion* cached = super_version_slots_[i].sv.exchange(
+        nullptr, std::memory_order_acq_rel);
+    if (cached != nullptr && cached != kSuperVersionInUse &&
+        cached->Unref()) {
+      cached->Cleanup();
+      delete cached;
+    }
+  }
+}
+
+SuperVersion* SilkStore::AcquireSuperVersion(int* slot) {
+  *slot = ThreadSlot(kNumSuperVersionSlots);
+  SuperVersion* sv = super_version_slots_[*slot].sv.exchange(
+      kSuperVersionInUse, std::memory_order_acquire);
+  if (sv == kSuperVersionInUse) {
+    // Another thread sharing this slot is reading right now
+    *slot = -1;
+    MutexLock l(&mutex_);
+    sv = super_version_;
+    sv->Ref();
+    return sv;
+  }
+  if (sv == nullptr || sv->version_number !=
+                           super_version_number_.load(
+                               std::memory_order_acquire)) {
+    MutexLock l(&mutex_);
+    if (sv != nullptr && sv->Unref()) {
+      sv->Cleanup();
+      delete sv;
+    }
+    sv = super_version_;
+    sv->Ref();
+  }
+  return sv;
+}
+
+void SilkStore::ReleaseSuperVersion(SuperVersion* sv, int slot) {
+  if (slot >= 0) {
+    SuperVersion* expected = kSuperVersionInUse;
+    if (super_version_slots_[slot].sv.compare_exchange_strong(
+            expected, sv, std::memory_order_release)) {
+      return;
+    }
+    // InstallSuperVersion() cleared the slot while sv was in use
+  }
+  UnrefSuperVersion(sv);
 }
 
+void SilkStore::UnrefSuperVersion(SuperVersion* sv) {
+  if (sv->Unref()) {
+    MutexLock l(&mutex_);
+    sv->Cleanup();
+    delete sv;
+  }
+}
+
+// User-level snapshots are not supported yet: leaf index snapshots are in
+// the index's own sequence space and must not be mistaken for SilkStore
+// sequence numbers by Get() and NewIterator().
+const Snapshot* SilkStore::GetSnapshot() { return nullptr; }
+
 void SilkStore::ReleaseSnapshot(const Snapshot* snapshot) {
-  MutexLock l(&mutex_);
-  return leaf_index_->ReleaseSnapshot(snapshot);
+  assert(snapshot == nullptr);
 }
 
 Iterator* SilkStore::NewIterator(const ReadOptions& ropts) {
-  MutexLock l(&mutex_);
   SequenceNumber seqno =
       ropts.snapshot
           ? dynamic_cast<const SnapshotImpl*>(ropts.snapshot)->sequence_number()
-          : max_sequence_;
+          : visible_sequence_.load(std::memory_order_acquire);
+  int slot;
+  SuperVersion* sv = AcquireSuperVersion(&slot);
+  sv->Ref();  // Owned by the iterator
+  ReleaseSuperVersion(sv, slot);
   // Collect together all needed child iterators
   std::vector<Iterator*> list;
-  list.push_back(mem_->NewIterator());
-  mem_->Ref();
-  if (imm_ != nullptr) {
-    list.push_back(imm_->NewIterator());
-    imm_->Ref();
+  list.push_back(sv->mem->NewIterator(ropts));
+  if (sv->imm != nullptr) {
+    list.push_back(sv->imm->NewIterator(ropts));
   }
-  list.push_back(leaf_store_->NewIterator(ropts));
+  list.push_back(sv->leaf_store->NewIterator(ropts));
   Iterator* internal_iter =
       NewMergingIterator(&internal_comparator_, &list[0], list.size());
-  IterState* cleanup = new IterState(&mutex_, mem_, imm_);
+  IterState* cleanup = new IterState(&mutex_, sv);
   internal_iter->RegisterCleanup(SilkStoreNewIteratorCleanup, cleanup, nullptr);
   return leveldb::silkstore::NewDBIterator(
-      internal_comparator_.user_comparator(), internal_iter, seqno);
+      internal_comparator_.user_comparator(), internal_iter, seqno, ropts);
 }
 
 // REQUIRES: mutex_ is held
@@ -535,6 +716,7 @@ Status SilkStore::MakeRoomForWrite(bool force) {
         assert(false);
       }
       mem_->Ref();
+      InstallSuperVersion();
       force = false;  // Do not force another compaction if have room
       MaybeScheduleCompaction();
     }
@@ -556,11 +738,47 @@ void SilkStore::BackgroundCall() {
   // Previous compaction may have produced too many files in a level,
   // so reschedule another compaction if needed.
   MaybeScheduleCompaction();
+  // The flush added segments
+  MaybeScheduleGC();
   background_work_finished_signal_.SignalAll();
 }
 
-void SilkStore::BGWork(void* db) {
-  reinterpret_cast<SilkStore*>(db)->BackgroundCall();
+bool SilkStore::SegmentsAbove(double ratio) {
+  return options_.maximum_segments_storage_size &&
+         segment_manager_->ApproximateSize() >=
+             ratio * options_.maximum_segments_storage_size;
+}
+
+void SilkStore::MaybeScheduleGC() {
+  mutex_.AssertHeld();
+  if (background_gc_scheduled_) {
+    // Already scheduled
+  } else if (shutting_down_.Acquire_Load()) {
+    // DB is being deleted; no more GC
+  } else if (!bg_error_.ok()) {
+    // Already got an error; no more changes
+  } else if (!SegmentsAbove(options_.segments_storage_size_gc_threshold)) {
+    // No work to be done
+  } else {
+    background_gc_scheduled_ = true;
+    scheduler_->Schedule(kGCPriority, [this]() { BackgroundGC(); });
+  }
+}
+
+void SilkStore::BackgroundGC() {
+  int collected = 0;
+  if (!shutting_down_.Acquire_Load()) {
+    const uint64_t start = env_->NowMicros();
+    collected = GarbageCollect(1);
+    stats_.AddTimeGC(env_->NowMicros() - start);
+  }
+  MutexLock l(&mutex_);
+  assert(background_gc_scheduled_);
+  background_gc_scheduled_ = false;
+  // Without collectable segments another round would spin; the next
+  // flush tries again
+  if (collected > 0) MaybeScheduleGC();
+  background_work_finished_signal_.SignalAll();
 }
 
 void SilkStore::MaybeScheduleCompaction() {
@@ -575,7 +793,7 @@ void SilkStore::MaybeScheduleCompaction() {
     // No work to be done
   } else {
     background_compaction_scheduled_ = true;
-    env_->Schedule(&SilkStore::BGWork, this);
+    scheduler_->Schedule(kFlushPriority, [this]() { BackgroundCall(); });
   }
 }
 
@@ -618,6 +836,9 @@ Status SilkStore::Write(const WriteOptions& options, WriteBatch* my_batch) {
       mutex_.Unlock();
       status = WriteBatchInternal::InsertInto(updates, mem_);
       mem_->AddCounter(nums);
+      // Publish before invalidating, see FillRowCache()
+      visible_sequence_.store(last_sequence, std::memory_order_release);
+      InvalidateRowCache(updates);
       mutex_.Lock();
     }
     if (updates == tmp_batch_) tmp_batch_->Clear();
@@ -643,13 +864,42 @@ Status SilkStore::Write(const WriteOptions& options, WriteBatch* my_batch) {
 
 bool SilkStore::GetProperty(const Slice& property, std::string* value) {
   if (property.ToString() == "silkstore.runs_searched") {
-    *value = std::to_string(runs_searched) + "\n";
+    *value = std::to_string(statistics_.GetTickerCount(kRunsSearched)) + "\n";
     value->append("runs_hit_counts: ");
-    value->append(std::to_string(runs_hit_counts) + "\n");
+    value->append(std::to_string(statistics_.GetTickerCount(kRunsHit)) + "\n");
     value->append("runs_miss_counts: ");
-    value->append(std::to_string(runs_miss_counts) + "\n");
+    value->append(std::to_string(statistics_.GetTickerCount(kRunsMiss)) +
+                  "\n");
     value->append("bloom_filter_counts: ");
-    value->append(std::to_string(bloom_filter_counts) + "\n");
+    value->append(std::to_string(statistics_.GetTickerCount(kFilterUseful)) +
+                  "\n");
+    return true;
+  } else if (property.ToString() == "silkstore.statistics") {
+    *value = statistics_.ToString();
+    return true;
+  } else if (property.ToString() == "silkstore.background_queue_depth") {
+    *value = scheduler_->QueueDepthString();
+    return true;
+  } else if (property.ToString() == "silkstore.gc_group_stats") {
+    char buf[200];
+    value->clear();
+    for (size_t g = 0; g < stats_.gc_group_stats.size(); ++g) {
+      const MergeStats::GroupGCStats& gs = stats_.gc_group_stats[g];
+      // The last slot holds the segments without a group
+      const std::string group = g + 1 == stats_.gc_group_stats.size()
+                                    ? "none"
+                                    : std::to_string(g);
+      snprintf(buf, sizeof(buf),
+               "group %s: %lu segments, %.1f MB collected, %.1f MB copied "
+               "(%.1f%%)\n",
+               group.c_str(), gs.segments, gs.bytes / 1048576.0,
+               gs.bytes_copied / 1048576.0,
+               gs.bytes ? 100.0 * gs.bytes_copied / gs.bytes : 0.0);
+      value->append(buf);
+    }
+    return true;
+  } else if (property.ToString() == "silkstore.background_io") {
+    *value = rate_limiter_.ToString();
     return true;
   } else if (property.ToString() == "silkstore.num_leaves") {
     auto it = leaf_index_->NewIterator(ReadOptions{});
@@ -713,7 +963,11 @@ bool SilkStore::GetProperty(const Slice& property, std::string* value) {
     return true;
   } else if (property.ToString() == "silkstore.gcstat") {
     *value =
-        "\ntime spent in gc: " + std::to_string(stats_.time_spent_gc) + "us\n";
+        "\ntime spent in gc: " + std::to_string(stats_.time_spent_gc) + "us\n" +
+        segment_manager_->UsageString();
+    return true;
+  } else if (property.ToString() == "silkstore.segment_cache") {
+    *value = segment_manager_->CacheString();
     return true;
   } else if (property.ToString() == "silkstore.segment_util") {
     *value = this->SegmentsSpaceUtilityHistogram();
@@ -738,6 +992,12 @@ bool SilkStore::GetProperty(const Slice& property, std::string* value) {
     leaf_index_->GetProperty("leveldb.stats", &leaf_index_stats);
     value->append(leaf_index_stats);
     return true;
+  } else if (property.ToString() == "silkstore.leaf_index_memory") {
+    value->clear();
+    leaf_index_->GetProperty(property, value);
+    value->append("leaf stats bytes " +
+                  std::to_string(stat_store_.ApproximateMemoryUsage()) + "\n");
+    return true;
   } else if (property.ToString() == "silkstore.write_volume") {
     *value = std::to_string(stats_.bytes_written);
     return true;
@@ -748,41 +1008,147 @@ bool SilkStore::GetProperty(const Slice& property, std::string* value) {
 Status SilkStore::Get(const ReadOptions& options, const Slice& key,
                       std::string* value) {
   Status s;
-  MutexLock l(&mutex_);
   SequenceNumber snapshot;
   if (options.snapshot != nullptr) {
     snapshot =
         static_cast<const SnapshotImpl*>(options.snapshot)->sequence_number();
   } else {
-    snapshot = max_sequence_;
-  }
-  NvmemTable* mem = mem_;
-  NvmemTable* imm = imm_;
-  mem->Ref();
-  if (imm != nullptr) imm->Ref();
-  // Unlock while reading from files and memtables
+    snapshot = visible_sequence_.load(std::memory_order_acquire);
+  }
+  // mutex_ is only taken when the thread's cached view is stale
+  int slot;
+  SuperVersion* sv = AcquireSuperVersion(&slot);
+  uint64_t start_micros = env_->NowMicros();
+  SILKSTORE_PERF_COUNTER_ADD(get_count, 1);
+  statistics_.RecordTick(kGetCalls);
+  // First look in the memtable, then in the immutable memtable (if any).
+  LookupKey lkey(key, snapshot);
+  bool mem_hit;
   {
-    mutex_.Unlock();
-    // First look in the memtable, then in the immutable memtable (if any).
-    LookupKey lkey(key, snapshot);
-    if (mem->Get(lkey, value, &s)) {
-      // Done
-    } else if (imm != nullptr && imm->Get(lkey, value, &s)) {
-      // Done
-    } else {
-      s = leaf_store_->Get(options, lkey, value, stat_store_);
+    SILKSTORE_PERF_TIMER_GUARD(memtable_get_nanos);
+    SILKSTORE_PERF_COUNTER_ADD(memtable_get_count, 1);
+    mem_hit = sv->mem->Get(lkey, value, &s) ||
+              (sv->imm != nullptr && sv->imm->Get(lkey, value, &s));
+  }
+  if (mem_hit) {
+    statistics_.RecordTick(kGetHitMemtable);
+  } else if (LookupRowCache(key, snapshot, value, &s)) {
+    statistics_.RecordTick(kRowCacheHit);
+  } else {
+    SequenceNumber found_seq;
+    // The boundaries describe the latest leaves, not those of a snapshot
+    s = sv->leaf_store->Get(
+        options, lkey, value, stat_store_, &found_seq,
+        options.snapshot == nullptr ? sv->leaf_boundaries.get() : nullptr);
+    if (s.ok()) statistics_.RecordTick(kGetHitLeafStore);
+    // Only results at the latest sequence are worth sharing
+    if (options.snapshot == nullptr) {
+      FillRowCache(key, snapshot, found_seq, s, *value);
     }
-    mutex_.Lock();
   }
+  if (s.IsNotFound()) statistics_.RecordTick(kGetNotFound);
+  statistics_.RecordInHistogram(kGetMicros, env_->NowMicros() - start_micros);
 
   //    if (have_stat_update && current->UpdateStats(stats)) {
   //        MaybeScheduleCompaction();
   //    }
-  mem->Unref();
-  if (imm != nullptr) imm->Unref();
+  ReleaseSuperVersion(sv, slot);
   return s;
 }
 
+// A row cache entry holds the newest version of a user key in the leaf
+// layer: the fixed64 (sequence << 8 | type) of that version followed by
+// its value.  Sequence 0 records that the key is absent.  Since every
+// write to the key erases the entry, a cached version is also the newest
+// one overall and answers any read whose snapshot is at or above it.
+static void RowCacheKey(uint64_t id, const Slice& key, std::string* dst) {
+  dst->clear();
+  PutFixed64(dst, id);
+  dst->append(key.data(), key.size());
+}
+
+static void DeleteRowCacheEntry(const Slice& key, void* value) {
+  delete reinterpret_cast<std::string*>(value);
+}
+
+bool SilkStore::LookupRowCache(const Slice& key, SequenceNumber snapshot,
+                               std::string* value, Status* s) {
+  Cache* cache = options_.row_cache;
+  if (cache == nullptr) return false;
+  std::string cache_key;
+  RowCacheKey(row_cache_id_, key, &cache_key);
+  Cache::Handle* handle = cache->Lookup(cache_key);
+  if (handle == nullptr) {
+    statistics_.RecordTick(kRowCacheMiss);
+    return false;
+  }
+  const std::string* entry =
+      reinterpret_cast<const std::string*>(cache->Value(handle));
+  uint64_t tag = DecodeFixed64(entry->data());
+  bool valid = (tag >> 8) <= snapshot;
+  if (valid) {
+    if (static_cast<ValueType>(tag & 0xff) == kTypeValue) {
+      value->assign(entry->data() + 8, entry->size() - 8);
+      *s = Status::OK();
+    } else {
+      *s = Status::NotFound(Slice());
+    }
+  } else {
+    statistics_.RecordTick(kRowCacheMiss);
+  }
+  cache->Release(handle);
+  return valid;
+}
+
+void SilkStore::FillRowCache(const Slice& key, SequenceNumber snapshot,
+                             SequenceNumber found_seq, const Status& s,
+                             const std::string& value) {
+  Cache* cache = options_.row_cache;
+  if (cache == nullptr || !(s.ok() || s.IsNotFound())) return;
+  if (visible_sequence_.load(std::memory_order_acquire) != snapshot) return;
+  std::string* entry = new std::string;
+  ValueType type = s.ok() ? kTypeValue : kTypeDeletion;
+  PutFixed64(entry, (found_seq << 8) | type);
+  if (s.ok()) entry->append(value);
+  std::string cache_key;
+  RowCacheKey(row_cache_id_, key, &cache_key);
+  cache->Release(cache->Insert(cache_key, entry,
+                               cache_key.size() + entry->size(),
+                               &DeleteRowCacheEntry));
+  // A writer publishes its sequence before erasing the keys it wrote.  If
+  // the sequence is unchanged here, any racing writer erases after our
+  // insert; otherwise the entry may predate a write and is dropped.
+  if (visible_sequence_.load(std::memory_order_acquire) != snapshot) {
+    cache->Erase(cache_key);
+  }
+}
+
+namespace {
+class RowCacheInvalidator : public WriteBatch::Handler {
+ public:
+  RowCacheInvalidator(Cache* cache, uint64_t id) : cache_(cache), id_(id) {}
+
+  void Put(const Slice& key, const Slice& value) override { Erase(key); }
+  void Delete(const Slice& key) override { Erase(key); }
+
+ private:
+  void Erase(const Slice& key) {
+    RowCacheKey(id_, key, &buf_);
+    cache_->Erase(buf_);
+  }
+
+  Cache* const cache_;
+  const uint64_t id_;
+  std::string buf_;
+};
+}  // namespace
+
+void SilkStore::InvalidateRowCache(WriteBatch* updates) {
+  if (options_.row_cache == nullptr) return;
+  RowCacheInvalidator invalidator(options_.row_cache, row_cache_id_);
+  updates->Iterate(&invalidator);
+}
+
 // REQUIRES: Writer list must be non-empty
 // REQUIRES: First writer must have a non-null batch
 WriteBatch* SilkStore::BuildBatchGroup(Writer** last_writer) {
@@ -834,12 +1200,17 @@ WriteBatch* SilkStore::BuildBatchGroup(Writer** last_writer) {
 
 class GroupedSegmentAppender {
  public:
+  // Segment writes are charged to "rate_limiter" as I/O of class
+  // "io_priority".
   GroupedSegmentAppender(int num_groups, SegmentManager* segment_manager,
-                         const Options& options,
+                         const Options& options, RateLimiter* rate_limiter,
+                         BackgroundPriority io_priority,
                          bool gc_on_segment_shortage = true)
       : builders(num_groups),
         segment_manager(segment_manager),
         options(options),
+        rate_limiter(rate_limiter),
+        io_priority(io_priority),
         gc_on_segment_shortage(gc_on_segment_shortage) {}
 
   // Make sure the segment that is being built by a group has enough space.
@@ -873,6 +1244,8 @@ class GroupedSegmentAppender {
       return s;
     }
     switched_segment = true;
+    new_builder->SetRateLimiter(rate_limiter, io_priority);
+    segment_manager->SetSegmentGroup(seg_id, group_id);
     *builder_ptr = builders[group_id] = new_builder.release();
     return Status::OK();
   }
@@ -891,6 +1264,8 @@ class GroupedSegmentAppender {
   std::vector<SegmentBuilder*> builders;
   SegmentManager* segment_manager;
   Options options;
+  RateLimiter* rate_limiter;
+  BackgroundPriority io_priority;
   bool gc_on_segment_shortage;
 };
 
@@ -984,47 +1359,53 @@ LeafIndexEntry SilkStore::CompactLeaf(SegmentBuilder* seg_builder,
   return new_leaf_index_entry;
 }
 
-Status SilkStore::CopyMinirunRun(Slice leaf_max_key,
-                                 LeafIndexEntry& leaf_index_entry,
-                                 uint32_t run_idx_in_index_entry,
-                                 SegmentBuilder* target_seg_builder,
-                                 WriteBatch& leaf_index_wb) {
-  Status s;
+// Returns the position of run "run_no" of segment "seg_id" among the runs
+// of "leaf_index_entry", or GetNumMiniRuns() if the leaf does not use it.
+static uint32_t FindRunInLeaf(const LeafIndexEntry& leaf_index_entry,
+                              uint32_t seg_id, uint32_t run_no) {
+  uint32_t run_idx_in_index_entry = leaf_index_entry.GetNumMiniRuns();
+  leaf_index_entry.ForEachMiniRunIndexEntry(
+      [&run_idx_in_index_entry, run_no, seg_id](
+          const MiniRunIndexEntry& minirun_index_entry, uint32_t idx) {
+        if (minirun_index_entry.GetSegmentNumber() == seg_id &&
+            minirun_index_entry.GetRunNumberWithinSegment() == run_no) {
+          run_idx_in_index_entry = idx;
+          return true;
+        }
+        return false;
+      },
+      LeafIndexEntry::TraversalOrder::forward);
+  return run_idx_in_index_entry;
+}
+
+Status SilkStore::RelocateMinirunRun(const LeafIndexEntry& leaf_index_entry,
+                                     uint32_t run_idx_in_index_entry,
+                                     const RelocatedRun& run,
+                                     std::string* new_index_entry) {
   assert(run_idx_in_index_entry < leaf_index_entry.GetNumMiniRuns());
-  std::unique_ptr<Iterator> source_it(leaf_store_->NewIteratorForLeaf(
-      {}, leaf_index_entry, s, run_idx_in_index_entry, run_idx_in_index_entry));
-  if (!s.ok()) return s;
-  assert(target_seg_builder->RunStarted() == false);
-  source_it->SeekToFirst();
-  s = target_seg_builder->StartMiniRun();
-  if (!s.ok()) return s;
-  while (source_it->Valid()) {
-    target_seg_builder->Add(source_it->key(), source_it->value());
-    source_it->Next();
-  }
-  uint32_t run_no;
-  s = target_seg_builder->FinishMiniRun(&run_no);
-  if (!s.ok()) return s;
+  // The copy keeps the index and filter blocks of the original, only where
+  // the run lives changes
+  MiniRunIndexEntry old_minirun_index_entry =
+      leaf_index_entry.GetMiniRunIndexEntry(run_idx_in_index_entry);
   std::string buf;
-  buf.clear();
   MiniRunIndexEntry new_minirun_index_entry = MiniRunIndexEntry::Build(
-      target_seg_builder->SegmentId(), run_no,
-      target_seg_builder->GetFinishedRunIndexBlock(),
-      target_seg_builder->GetFinishedRunFilterBlock(),
-      target_seg_builder->GetFinishedRunDataSize(), &buf);
+      run.new_seg_id, run.new_run_no,
+      old_minirun_index_entry.GetBlockIndexData(),
+      old_minirun_index_entry.GetFilterData(),
+      old_minirun_index_entry.GetRunDataSize(), &buf);
   LeafIndexEntry new_leaf_index_entry;
   std::string buf2;
-  s = LeafIndexEntryBuilder::ReplaceMiniRunRange(
+  Status s = LeafIndexEntryBuilder::ReplaceMiniRunRange(
       leaf_index_entry, run_idx_in_index_entry, run_idx_in_index_entry,
       new_minirun_index_entry, &buf2, &new_leaf_index_entry);
   if (!s.ok()) return s;
-  leaf_index_wb.Put(leaf_max_key, new_leaf_index_entry.GetRawData());
+  *new_index_entry = new_leaf_index_entry.GetRawData().ToString();
   return s;
 }
 
 Status SilkStore::GarbageCollectSegment(Segment* seg,
                                         GroupedSegmentAppender& appender,
-                                        WriteBatch& leaf_index_wb) {
+                                        std::vector<RelocatedRun>* relocated) {
   Status s;
   size_t copied = 0;
   size_t segment_size = seg->SegmentSize();
@@ -1052,6 +1433,8 @@ Status SilkStore::GarbageCollectSegment(Segment* seg,
         run->NewIteratorForOneBlock({}, last_block_handle));
 
     // Read the last block aligned by options_.block_size
+    rate_limiter_.Request(
+        std::max(options_.block_size, last_block_handle.size()), kGCPriority);
     stats_.AddGCStats(std::max(options_.block_size, last_block_handle.size()),
                       0);
     stats_.Add(std::max(options_.block_size, last_block_handle.size()), 0);
@@ -1069,40 +1452,29 @@ Status SilkStore::GarbageCollectSegment(Segment* seg,
       leaf_it->Seek(user_key);
       if (!leaf_it->Valid()) return false;
 
-      Slice leaf_key = leaf_it->key();
+      const std::string leaf_key = leaf_it->key().ToString();
       LeafIndexEntry leaf_index_entry = leaf_it->value();
-
-      uint32_t run_idx_in_index_entry = leaf_index_entry.GetNumMiniRuns();
       uint32_t seg_id = seg->SegmentId();
-      leaf_index_entry.ForEachMiniRunIndexEntry(
-          [&run_idx_in_index_entry, run_no, seg_id](
-              const MiniRunIndexEntry& minirun_index_entry, uint32_t idx) {
-            if (minirun_index_entry.GetSegmentNumber() == seg_id &&
-                minirun_index_entry.GetRunNumberWithinSegment() ==
-                    run_no) {  // Found that the index entry stored in
-                               // leaf_index_ is still pointing to this run in
-                               // this segment
-              run_idx_in_index_entry = idx;
-              return true;
-            }
-            return false;
-          },
-          LeafIndexEntry::TraversalOrder::forward);
-
-      if (run_idx_in_index_entry ==
+      if (FindRunInLeaf(leaf_index_entry, seg_id, run_no) ==
           leaf_index_entry.GetNumMiniRuns())  // Stale minirun, skip it
         return false;
 
       SegmentBuilder* seg_builder;
       bool switched_segment = false;
-      s = appender.MakeRoomForGroupAndGetBuilder(0, &seg_builder,
-                                                 switched_segment);
+      s = appender.MakeRoomForGroupAndGetBuilder(
+          LeafGroup(leaf_key), &seg_builder, switched_segment);
       if (!s.ok())  // error, early exit
         return true;
-      // Copy the entire minirun to the other segment file and update leaf_index
-      // accordingly
-      s = CopyMinirunRun(leaf_key, leaf_index_entry, run_idx_in_index_entry,
-                         seg_builder, leaf_index_wb);
+      // Copy the entire minirun to the other segment file; the leaf index
+      // is pointed at the copy when the round commits
+      rate_limiter_.Request(run_size, kGCPriority);
+      RelocatedRun relocation;
+      relocation.user_key = user_key.ToString();
+      relocation.old_seg_id = seg_id;
+      relocation.old_run_no = run_no;
+      relocation.new_seg_id = seg_builder->SegmentId();
+      s = seg_builder->AddRawMiniRun(seg_id, run_handle,
+                                     &relocation.new_run_no);
       if (!s.ok())  // error, early exit
         return true;
       // Read from the old leaf
@@ -1112,13 +1484,65 @@ Status SilkStore::GarbageCollectSegment(Segment* seg,
       stats_.AddGCStats(leaf_index_entry.GetLeafDataSize(),
                         leaf_index_entry.GetLeafDataSize());
       copied += run_size;
+      relocated->push_back(std::move(relocation));
     }
     return false;
   });
-  // if (copied)
-  // fprintf(stderr, "Copied %f%% the data from segment %d of size %lu\n",
-  // (copied+0.0)/segment_size * 100, seg->SegmentId(), segment_size);
-  return Status::OK();
+  stats_.AddGCGroupStats(segment_manager_->GetSegmentGroup(seg->SegmentId()),
+                         segment_size, copied);
+  return s;
+}
+
+Status SilkStore::CommitRelocatedRuns(
+    const std::vector<RelocatedRun>& relocated) {
+  GCMutex.AssertHeld();
+  Status s;
+  // Maps the max key of every leaf with relocated runs to its new entry.
+  // A leaf with several relocated runs builds on the entry its earlier
+  // relocations produced, not the stale one.
+  std::map<std::string, std::string> relocated_leaves;
+  std::unique_ptr<Iterator> leaf_it(leaf_index_->NewIterator({}));
+  for (const RelocatedRun& run : relocated) {
+    leaf_it->Seek(run.user_key);
+    std::string leaf_key;
+    LeafIndexEntry leaf_index_entry;
+    uint32_t run_idx_in_index_entry = 0;
+    bool live = false;
+    if (leaf_it->Valid()) {
+      leaf_key = leaf_it->key().ToString();
+      auto it = relocated_leaves.find(leaf_key);
+      leaf_index_entry =
+          it == relocated_leaves.end() ? leaf_it->value() : Slice(it->second);
+      run_idx_in_index_entry =
+          FindRunInLeaf(leaf_index_entry, run.old_seg_id, run.old_run_no);
+      live = run_idx_in_index_entry < leaf_index_entry.GetNumMiniRuns();
+    }
+    if (!live) {
+      // The leaf layer rewrote the run while it was being copied
+      s = segment_manager_->InvalidateSegmentRun(run.new_seg_id,
+                                                 run.new_run_no);
+      if (!s.ok()) return s;
+      continue;
+    }
+    std::string new_index_entry;
+    s = RelocateMinirunRun(leaf_index_entry, run_idx_in_index_entry, run,
+                           &new_index_entry);
+    if (!s.ok()) return s;
+    relocated_leaves[leaf_key] = std::move(new_index_entry);
+  }
+  s = leaf_it->status();
+  if (!s.ok()) return s;
+
+  WriteBatch leaf_index_wb;
+  for (auto& kv : relocated_leaves) {
+    leaf_index_wb.Put(kv.first, kv.second);
+  }
+  // GC only rewrites entries of existing leaves, so it bypasses
+  // LeafStore::WriteLeafIndex() and leaves the leaf boundaries valid
+  if (leaf_index_wb.ApproximateSize()) {
+    s = leaf_index_->Write({}, &leaf_index_wb);
+  }
+  return s;
 }
 
 std::string SilkStore::SegmentsSpaceUtilityHistogram() {
@@ -1128,9 +1552,13 @@ std::string SilkStore::SegmentsSpaceUtilityHistogram() {
   hist.Clear();
   size_t total_segment_size = 0;
   size_t total_valid_size = 0;
+  size_t total_punched_size = 0;
   segment_manager_->ForEachSegment([&, this](Segment* seg) {
     size_t seg_size = seg->SegmentSize();
+    // Holes punched into invalid runs take no space
+    size_t punched_size = seg->PunchedBytes();
     total_segment_size += seg_size;
+    total_punched_size += punched_size;
     size_t valid_size = 0;
     bool error = false;
     seg->ForEachRun([&, this](int run_no, MiniRunHandle run_handle,
@@ -1175,25 +1603,9 @@ std::string SilkStore::SegmentsSpaceUtilityHistogram() {
 
         LeafIndexEntry leaf_index_entry = leaf_it->value();
 
-        uint32_t run_idx_in_index_entry = leaf_index_entry.GetNumMiniRuns();
-        uint32_t seg_id = seg->SegmentId();
-        leaf_index_entry.ForEachMiniRunIndexEntry(
-            [&run_idx_in_index_entry, run_no, seg_id](
-                const MiniRunIndexEntry& minirun_index_entry, uint32_t idx) {
-              if (minirun_index_entry.GetSegmentNumber() == seg_id &&
-                  minirun_index_entry.GetRunNumberWithinSegment() ==
-                      run_no) {  // Found that the index entry stored in
-                                 // leaf_index_ is still pointing to this run in
-                                 // this segment
-                run_idx_in_index_entry = idx;
-                return true;
-              }
-              return false;
-            },
-            LeafIndexEntry::TraversalOrder::forward);
-
-        if (run_idx_in_index_entry ==
-            leaf_index_entry.GetNumMiniRuns())  // Stale minirun, skip it
+        // Stale minirun, skip it
+        if (FindRunInLeaf(leaf_index_entry, seg->SegmentId(), run_no) ==
+            leaf_index_entry.GetNumMiniRuns())
           return false;
 
         valid_size += run_size;
@@ -1201,41 +1613,63 @@ std::string SilkStore::SegmentsSpaceUtilityHistogram() {
       return false;
     });
     if (error == false) {
-      assert(valid_size <= seg_size);
-      double util = (valid_size + 0.0) / seg_size;
+      assert(valid_size <= seg_size - punched_size);
+      double util = (valid_size + 0.0) / (seg_size - punched_size);
       hist.Add(util * 100);
       total_valid_size += valid_size;
     }
   });
   return hist.ToString() +
          "\ntotal_valid_size: " + std::to_string(total_valid_size) +
-         "\ntotal_segment_size : " + std::to_string(total_segment_size) + "\n";
+         "\ntotal_segment_size : " + std::to_string(total_segment_size) +
+         "\ntotal_punched_size : " + std::to_string(total_punched_size) + "\n";
 }
 
-int SilkStore::GarbageCollect() {
-  MutexLock g(&GCMutex);
+int SilkStore::GarbageCollect(int max_segments) {
+  MutexLock round(&gc_round_mutex_);
   Log(options_.info_log, "Garbage Collect(gc).");
-  WriteBatch leaf_index_wb;
-  // Simple policy: choose the segment with maximum number of invalidated runs
-  constexpr int kGCSegmentCandidateNum = 5;
   std::vector<Segment*> candidates =
-      segment_manager_->GetMostInvalidatedSegments(kGCSegmentCandidateNum);
+      segment_manager_->PickSegmentsToCollect(max_segments);
   if (candidates.empty()) return 0;
-  // Disable nested garbage collection
-  bool gc_on_segment_shortage = false;
-  GroupedSegmentAppender appender(1, segment_manager_, options_,
-                                  gc_on_segment_shortage);
-  for (auto seg : candidates) {
-    GarbageCollectSegment(seg, appender, leaf_index_wb);
+  // The victims stay pinned until the round is over, removed or not
+  DeferCode c([this, &candidates]() {
+    for (auto seg : candidates) segment_manager_->DropSegment(seg);
+  });
+  std::vector<RelocatedRun> relocated;
+  Status s;
+  {
+    // Disable nested garbage collection
+    bool gc_on_segment_shortage = false;
+    GroupedSegmentAppender appender(options_.num_segment_groups,
+                                    segment_manager_, options_, &rate_limiter_,
+                                    kGCPriority, gc_on_segment_shortage);
+    for (auto seg : candidates) {
+      s = GarbageCollectSegment(seg, appender, &relocated);
+      if (!s.ok()) break;
+    }
+    // The appender finishes the new segments before the leaf index
+    // points at them
+  }
+  if (!s.ok()) {
+    // Some live runs of the victims were not copied; keep the victims and
+    // leave the copies made so far unreferenced for a later round
+    Log(options_.info_log, "gc relocation failed: %s\n",
+        s.ToString().c_str());
+    return 0;
   }
 
-  if (leaf_index_wb.ApproximateSize()) {
-    leaf_index_->Write({}, &leaf_index_wb);
+  MutexLock g(&GCMutex);
+  s = CommitRelocatedRuns(relocated);
+  if (!s.ok()) {
+    // The victims still hold the only indexed copy of their live runs
+    Log(options_.info_log, "gc leaf index write failed: %s\n",
+        s.ToString().c_str());
+    return 0;
   }
+  segment_manager_->PersistInvalidRuns();
   for (auto seg : candidates) {
     segment_manager_->RemoveSegment(seg->SegmentId());
   }
-  printf("gc collect %lu\n", candidates.size());
   Log(options_.info_log, "gc collect %lu\n", candidates.size());
 
   return candidates.size();
@@ -1261,10 +1695,23 @@ Status SilkStore::InvalidateLeafRuns(const LeafIndexEntry& leaf_index_entry,
   return s;
 }
 
+uint32_t SilkStore::LeafGroup(const std::string& leaf_key) {
+  if (options_.num_segment_groups <= 1) return 0;
+  // Leaves not grouped yet are new and go with the hottest ones
+  int group = stat_store_.GetGroupId(leaf_key);
+  if (group < 0) return 0;
+  return std::min(group, options_.num_segment_groups - 1);
+}
+
 Status SilkStore::OptimizeLeaf() {
   Log(options_.info_log, "Updating read hotness for all leaves.");
   stat_store_.UpdateReadHotness();
 
+  if (options_.num_segment_groups > 1) {
+    KMeansSegmenter segmenter;
+    stat_store_.GroupLeaves(&segmenter, options_.num_segment_groups);
+  }
+
   if (options_.enable_leaf_read_opt == false) return Status::OK();
   Log(options_.info_log,
       "Scanning for leaves that are suitable for optimization.");
@@ -1318,6 +1765,7 @@ Status SilkStore::OptimizeLeaf() {
     if (!s.ok()) {
       return s;
     }
+    seg_builder->SetRateLimiter(&rate_limiter_, kReadOptPriority);
   } else {
     return s;
   }
@@ -1338,6 +1786,7 @@ Status SilkStore::OptimizeLeaf() {
       if (!s.ok()) {
         return s;
       }
+      seg_builder->SetRateLimiter(&rate_limiter_, kReadOptPriority);
       s = leaf_index_->Write(WriteOptions{}, &leaf_index_wb);
       if (!s.ok()) {
         return s;
@@ -1356,6 +1805,7 @@ Status SilkStore::OptimizeLeaf() {
     // miniruns[%d, %d]\n", item.leaf_max_key->c_str(), item.read_hotness, 0,
     // index_entry.GetNumMiniRuns() - 1);
     assert(seg_builder->RunStarted() == false);
+    rate_limiter_.Request(index_entry.GetLeafDataSize(), kReadOptPriority);
     LeafIndexEntry new_index_entry =
         CompactLeaf(seg_builder.get(), seg_id, index_entry, s, &buf, 0,
                     index_entry.GetNumMiniRuns() - 1, leaf_index_snapshot);
@@ -1377,12 +1827,16 @@ Status SilkStore::OptimizeLeaf() {
     // fprintf(stderr, "Leaf Optimization compacted %d runs\n", compacted_runs);
   }
   if (seg_builder.get()) {
-    return seg_builder->Finish();
+    s = seg_builder->Finish();
+    if (!s.ok()) return s;
   }
+  // Optimized leaves keep their max keys, so the leaf boundaries stay
+  // valid
   if (leaf_index_wb.ApproximateSize()) {
-    return leaf_index_->Write(WriteOptions{}, &leaf_index_wb);
+    s = leaf_index_->Write(WriteOptions{}, &leaf_index_wb);
+    if (!s.ok()) return s;
   }
-  return s;
+  return segment_manager_->PersistInvalidRuns();
 }
 
 constexpr size_t kLeafIndexWriteBufferMaxSize = 4 * 1024 * 1024;
@@ -1407,7 +1861,8 @@ void SilkStore::PrepareLeafsNeedSplit(bool force) {
     stats_.Add(iit->key().size() + iit->value().size(), 0);
     iit->Next();
   }
-  split_subtask_states_.resize(split_leaf_num_threads_);
+  split_subtask_states_.resize(std::max<size_t>(
+      1, std::min<size_t>(scheduler_->NumThreads(), leafs_need_split.size())));
   //    for (auto & kv:leafs_need_split) {
   //        std::string k = kv.max_key_, v = kv.value_;
   //        Log(options_.info_log, "k: %s  v: %s\n", k.c_str(), v.c_str());
@@ -1421,7 +1876,9 @@ void SilkStore::ProcessOneLeaf(
   WriteBatch& leaf_index_wb = state.leaf_index_wb_;
   SequenceNumber seq_num = max_sequence_;
 
-  auto SplitLeaf = [&grouped_segment_appender, &leaf_index_wb, this](
+  // The new leaves stay in the group of the leaf they split from
+  const uint32_t group = LeafGroup(leaf.max_key_);
+  auto SplitLeaf = [&grouped_segment_appender, &leaf_index_wb, group, this](
                        const LeafIndexEntry& leaf_index_entry,
                        SequenceNumber seq_num,
                        std::vector<std::string>& max_keys,
@@ -1439,10 +1896,10 @@ void SilkStore::ProcessOneLeaf(
 
     SegmentBuilder* seg_builder = nullptr;
     auto AssignSegmentBuilder = [&seg_builder, &grouped_segment_appender,
-                                 &leaf_index_wb, this]() {
+                                 &leaf_index_wb, group, this]() {
       bool switched_segment = false;
       Status s = grouped_segment_appender.MakeRoomForGroupAndGetBuilder(
-          0, &seg_builder, switched_segment);
+          group, &seg_builder, switched_segment);
       if (!s.ok()) return s;
 
       if (switched_segment &&
@@ -1450,7 +1907,7 @@ void SilkStore::ProcessOneLeaf(
         // If all previous segments are built successfully and
         // the leaf_index write buffer exceeds the threshold,
         // write it down to leaf_index_ to keep the memory footprint small.
-        s = leaf_index_->Write({}, &leaf_index_wb);
+        s = leaf_store_->WriteLeafIndex(&leaf_index_wb);
         if (!s.ok()) return s;
         leaf_index_wb.Clear();
       }
@@ -1513,8 +1970,8 @@ void SilkStore::ProcessOneLeaf(
 
   SegmentBuilder* seg_builder = nullptr;
   bool switched_segment = false;
-  s = grouped_segment_appender.MakeRoomForGroupAndGetBuilder(0, &seg_builder,
-                                                             switched_segment);
+  s = grouped_segment_appender.MakeRoomForGroupAndGetBuilder(
+      group, &seg_builder, switched_segment);
   if (!s.ok()) return;
 
   if (switched_segment &&
@@ -1522,7 +1979,7 @@ void SilkStore::ProcessOneLeaf(
     // If all previous segments are built successfully and
     // the leaf_index write buffer exceeds the threshold,
     // write it down to leaf_index_ to keep the memory footprint small.
-    s = leaf_index_->Write({}, &leaf_index_wb);
+    s = leaf_store_->WriteLeafIndex(&leaf_index_wb);
     if (!s.ok()) return;
     leaf_index_wb.Clear();
   }
@@ -1536,6 +1993,7 @@ void SilkStore::ProcessOneLeaf(
   std::vector<std::string> max_keys;
   std::vector<std::string> max_key_index_entry_bufs;
   // Log(options_.info_log, "Start split k: %s\n", leaf.max_key_.c_str());
+  rate_limiter_.Request(leaf_index_entry.GetLeafDataSize(), kSplitPriority);
   s = SplitLeaf(leaf_index_entry, seq_num, max_keys, max_key_index_entry_bufs);
   assert(max_keys.size() == max_key_index_entry_bufs.size());
   if (!s.ok()) return;
@@ -1566,37 +2024,29 @@ void SilkStore::ProcessOneLeaf(
 }
 
 void SilkStore::ProcessSplitLeafSubTasks(int tid) {
-  GroupedSegmentAppender grouped_segment_appender(1, segment_manager_,
-                                                  options_);
-
-  for (size_t i = 0; i < leafs_need_split.size(); ++i) {
-    if (tid == (i % split_leaf_num_threads_)) {
-      ProcessOneLeaf(leafs_need_split[i], split_subtask_states_[tid],
-                     grouped_segment_appender);
-      // failed compaction
-      if (!split_subtask_states_[tid].s_.ok()) {
-        break;
-      }
+  GroupedSegmentAppender grouped_segment_appender(
+      options_.num_segment_groups, segment_manager_, options_, &rate_limiter_,
+      kSplitPriority);
+
+  // Leaves differ a lot in size, so each thread takes the next unclaimed
+  // leaf instead of a fixed share
+  size_t i;
+  while ((i = next_split_leaf_.fetch_add(1)) < leafs_need_split.size()) {
+    ProcessOneLeaf(leafs_need_split[i], split_subtask_states_[tid],
+                   grouped_segment_appender);
+    // failed compaction
+    if (!split_subtask_states_[tid].s_.ok()) {
+      break;
     }
   }
 }
 
 void SilkStore::RunSplitLeafTasks() {
-  std::vector<std::thread> thread_pool;
-  thread_pool.reserve(split_leaf_num_threads_ - 1);
-
-  for (size_t i = 1; i < split_leaf_num_threads_; ++i) {
-    thread_pool.emplace_back(&SilkStore::ProcessSplitLeafSubTasks, this, i);
-  }
-
-  // Always schedule the first task(whether or not there are also
-  // others) in the current thread to be efficient with resources
-  ProcessSplitLeafSubTasks(0);
-
-  // Wait for all other threads (if there are any) to finish execution
-  for (auto& thread : thread_pool) {
-    thread.join();
-  }
+  next_split_leaf_ = 0;
+  // The first task runs in the current thread (whether or not there are
+  // also others) to be efficient with resources
+  scheduler_->RunParallel(kSplitPriority, split_subtask_states_.size(),
+                          [this](int tid) { ProcessSplitLeafSubTasks(tid); });
 }
 
 Status SilkStore::FinishSplitLeafTasks() {
@@ -1618,7 +2068,7 @@ Status SilkStore::FinishSplitLeafTasks() {
     num_leaves += state.leaf_change_num_;
 
     if (state.leaf_index_wb_.ApproximateSize()) {
-      Status s = leaf_index_->Write({}, &(state.leaf_index_wb_));
+      Status s = leaf_store_->WriteLeafIndex(&(state.leaf_index_wb_));
       if (!s.ok()) {
         Log(options_.info_log, "leaf_index_->Write failed: %s\n",
             s.ToString().c_str());
@@ -1630,6 +2080,177 @@ Status SilkStore::FinishSplitLeafTasks() {
   return Status();
 }
 
+void SilkStore::MergeOneLeafGroup(
+    const std::vector<SingleLeaf>& leafs, SplitLeafTaskState& state,
+    GroupedSegmentAppender& grouped_segment_appender) {
+  WriteBatch& leaf_index_wb = state.leaf_index_wb_;
+  SequenceNumber seq_num = max_sequence_;
+  Status& s = state.s_;
+
+  // The merged leaf takes the hottest group of the leaves, as its stats do
+  uint32_t group = LeafGroup(leafs[0].max_key_);
+  for (const SingleLeaf& leaf : leafs) {
+    group = std::min(group, LeafGroup(leaf.max_key_));
+  }
+  SegmentBuilder* seg_builder = nullptr;
+  bool switched_segment = false;
+  s = grouped_segment_appender.MakeRoomForGroupAndGetBuilder(
+      group, &seg_builder, switched_segment);
+  if (!s.ok()) return;
+
+  if (switched_segment &&
+      leaf_index_wb.ApproximateSize() > kLeafIndexWriteBufferMaxSize) {
+    // If all previous segments are built successfully and
+    // the leaf_index write buffer exceeds the threshold,
+    // write it down to leaf_index_ to keep the memory footprint small.
+    s = leaf_store_->WriteLeafIndex(&leaf_index_wb);
+    if (!s.ok()) return;
+    leaf_index_wb.Clear();
+  }
+
+  // Leaves cover disjoint key ranges in increasing order, so copying the
+  // most recent non-deleted keys of one leaf after another keeps the new
+  // minirun sorted.
+  std::vector<std::string> leaf_keys;
+  for (const SingleLeaf& leaf : leafs) {
+    LeafIndexEntry leaf_index_entry(leaf.value_);
+    rate_limiter_.Request(leaf_index_entry.GetLeafDataSize(), kSplitPriority);
+    auto it = dynamic_cast<silkstore::DBIter*>(leaf_store_->NewDBIterForLeaf(
+        ReadOptions{}, leaf_index_entry, s, user_comparator(), seq_num));
+    DeferCode c([it]() { delete it; });
+    if (!s.ok()) return;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      if (seg_builder->RunStarted() == false) {
+        s = seg_builder->StartMiniRun();
+        if (!s.ok()) return;
+      }
+      seg_builder->Add(it->internal_key(), it->value());
+    }
+    s = it->status();
+    if (!s.ok()) return;
+    state.read_ += leaf_index_entry.GetLeafDataSize();
+    leaf_keys.push_back(leaf.max_key_);
+  }
+
+  // The merged leaf takes over the range of the whole group
+  const std::string& merged_max_key = leafs.back().max_key_;
+  for (size_t i = 0; i + 1 < leafs.size(); ++i) {
+    leaf_index_wb.Delete(leafs[i].max_key_);
+  }
+  if (seg_builder->RunStarted()) {
+    uint32_t run_no;
+    s = seg_builder->FinishMiniRun(&run_no);
+    if (!s.ok()) return;
+    std::string buf, merged_index_entry_buf;
+    MiniRunIndexEntry minirun_index_entry = MiniRunIndexEntry::Build(
+        seg_builder->SegmentId(), run_no,
+        seg_builder->GetFinishedRunIndexBlock(),
+        seg_builder->GetFinishedRunFilterBlock(),
+        seg_builder->GetFinishedRunDataSize(), &buf);
+    LeafIndexEntry merged_leaf_index_entry;
+    LeafIndexEntryBuilder::AppendMiniRunIndexEntry(
+        LeafIndexEntry{}, minirun_index_entry, &merged_index_entry_buf,
+        &merged_leaf_index_entry);
+    leaf_index_wb.Put(merged_max_key, merged_index_entry_buf);
+    state.written_ += seg_builder->GetFinishedRunDataSize();
+    state.leaf_change_num_ -= leafs.size() - 1;
+    stat_store_.MergeLeaves(leaf_keys);
+  } else {
+    // Nothing is left in the group; the next leaf covers its range
+    leaf_index_wb.Delete(merged_max_key);
+    state.leaf_change_num_ -= leafs.size();
+    for (const std::string& key : leaf_keys) stat_store_.DeleteLeaf(key);
+  }
+
+  // Invalidate the miniruns pointed by the old leaf index entries
+  for (const SingleLeaf& leaf : leafs) {
+    LeafIndexEntry leaf_index_entry(leaf.value_);
+    if (leaf_index_entry.GetNumMiniRuns() == 0) continue;
+    s = InvalidateLeafRuns(leaf_index_entry, 0,
+                           leaf_index_entry.GetNumMiniRuns() - 1);
+    if (!s.ok()) return;
+  }
+}
+
+Status SilkStore::MergeUnderfullLeaves() {
+  const size_t low_water_mark =
+      options_.leaf_merge_ratio * options_.leaf_datasize_thresh;
+  // With merging disabled only empty leaves are collected, to be dropped
+  const bool merging = low_water_mark > 0;
+
+  // OptimizeLeaf rewrites leaves it found in its own snapshot of the leaf
+  // index and must not bring back a leaf that was merged away.  Compaction
+  // holds GCMutex around its leaf layer work, this included.
+  GCMutex.AssertHeld();
+
+  // Group runs of adjacent underfull leaves.  A group is cut before the
+  // merged leaf would reach the size a split produces.  Compaction only
+  // visits leaves that receive keys, so empty leaves are dropped here even
+  // without a neighbor to merge with.
+  std::vector<std::vector<SingleLeaf>> leaf_groups;
+  auto AddGroup = [&leaf_groups](std::vector<SingleLeaf>& group) {
+    if (group.size() > 1 ||
+        (group.size() == 1 && LeafIndexEntry(group[0].value_).Empty())) {
+      leaf_groups.push_back(std::move(group));
+    }
+  };
+  {
+    ReadOptions ro;
+    ro.snapshot = leaf_index_->GetSnapshot();
+    // Release snapshot after the traversal is done
+    DeferCode c([&ro, this]() { leaf_index_->ReleaseSnapshot(ro.snapshot); });
+    std::unique_ptr<Iterator> iit(leaf_index_->NewIterator(ro));
+    std::vector<SingleLeaf> group;
+    size_t group_datasize = 0;
+    for (iit->SeekToFirst(); iit->Valid(); iit->Next()) {
+      LeafIndexEntry leaf_index_entry(iit->value());
+      size_t datasize = leaf_index_entry.GetLeafDataSize();
+      bool underfull =
+          merging ? datasize < low_water_mark : leaf_index_entry.Empty();
+      if (!underfull ||
+          group_datasize + datasize >= options_.leaf_datasize_thresh / 2) {
+        AddGroup(group);
+        group.clear();
+        group_datasize = 0;
+      }
+      if (underfull) {
+        group.emplace_back(iit->key().ToString(), iit->value().ToString());
+        group_datasize += datasize;
+      }
+      // Record the data read from leaf_index as well
+      stats_.Add(iit->key().size() + iit->value().size(), 0);
+    }
+    AddGroup(group);
+  }
+  if (leaf_groups.empty()) return Status::OK();
+
+  SplitLeafTaskState state;
+  {
+    // Segments are finished before the leaf index points at them
+    GroupedSegmentAppender grouped_segment_appender(
+        options_.num_segment_groups, segment_manager_, options_,
+        &rate_limiter_, kSplitPriority);
+    for (const auto& group : leaf_groups) {
+      MergeOneLeafGroup(group, state, grouped_segment_appender);
+      if (!state.s_.ok()) break;
+    }
+  }
+  if (!state.s_.ok()) {
+    Log(options_.info_log, "MergeUnderfullLeaves failed: %s\n",
+        state.s_.ToString().c_str());
+    return state.s_;
+  }
+  stats_.Add(state.read_, state.written_);
+  num_leaves += state.leaf_change_num_;
+  Log(options_.info_log,
+      "Merged %lu groups of underfull leaves, %d leaves removed\n",
+      leaf_groups.size(), -state.leaf_change_num_);
+  if (state.leaf_index_wb_.ApproximateSize()) {
+    return leaf_store_->WriteLeafIndex(&state.leaf_index_wb_);
+  }
+  return Status::OK();
+}
+
 Status SilkStore::MakeRoomInLeafLayer(bool force) {
   Log(options_.info_log, "MakeRoomInLeafLayer Start\n");
   mutex_.Unlock();
@@ -1639,6 +2260,7 @@ restart : {
   PrepareLeafsNeedSplit(force);
   RunSplitLeafTasks();
   Status s = FinishSplitLeafTasks();
+  if (s.ok()) s = MergeUnderfullLeaves();
   Log(options_.info_log, "MakeRoomInLeafLayer End\n");
   return s;
 };
@@ -1647,30 +2269,35 @@ restart : {
 static int num_compactions = 0;
 
 void SilkStore::GenSubcompactionBoundaries() {
-  ReadOptions ro;
-  ro.snapshot = leaf_index_->GetSnapshot();
-  // Release snapshot after the traversal is done
-  DeferCode c([&ro, this]() { leaf_index_->ReleaseSnapshot(ro.snapshot); });
+  const size_t num_entries = imm_->NumEntries();
+  const size_t num_tasks = std::max<size_t>(
+      1, std::min<size_t>(scheduler_->NumThreads(),
+                          num_entries / kMinSubcompactionEntries));
+  if (num_tasks == 1) return;
 
+  ReadOptions ro;
+  ro.snapshot = compact_leaf_index_snapshot_;
   std::unique_ptr<Iterator> iit(leaf_index_->NewIterator(ro));
-  iit->SeekToFirst();
-
-  std::string key_buf, value_buf;
-
-  while (iit->Valid()) {
-    // itt return the value for the current entry.  The underlying storage for
-    // the returned slice is valid only until the next modification of
-    // the iterator.
-    key_buf.clear();
-    key_buf.append(iit->key().data(), iit->key().size());
-    boundries_.emplace_back(key_buf);
-
-    value_buf.clear();
-    value_buf.append(iit->value().data(), iit->value().size());
-    leaf_values_.push_back(value_buf);
+  std::unique_ptr<Iterator> mit(imm_->NewIterator());
+  const size_t entries_per_task = num_entries / num_tasks;
+  size_t entries = 0;
+  for (mit->SeekToFirst(); mit->Valid() && boundries_.size() + 1 < num_tasks;
+       mit->Next()) {
+    if (++entries < entries_per_task * (boundries_.size() + 1)) continue;
+    Slice user_key = ExtractUserKey(mit->key());
+    if (!boundries_.empty() &&
+        user_comparator()->Compare(user_key, boundries_.back()) <= 0) {
+      // Still in the leaf that ended the previous subcompaction
+      continue;
+    }
+    iit->Seek(user_key);
+    if (!iit->Valid()) {
+      // The remaining keys go to new leaves past the last one
+      break;
+    }
+    boundries_.push_back(iit->key().ToString());
     // Record the data read from leaf_index as well
-    stats_.Add(iit->key().size() + iit->value().size(), 0);
-    iit->Next();
+    stats_.Add(iit->key().size(), 0);
   }
 }
 
@@ -1680,499 +2307,126 @@ void SilkStore::PrepareCompactionTasks() {
   sub_compact_tasks_.reserve(size + 1);
   for (size_t i = 0; i <= size; ++i) {
     // nullptr means unbounded
-    std::string* start = (i == 0) ? nullptr : &boundries_[i - 1];
-    std::string* end = (i == size) ? nullptr : &boundries_[i];
-    // nullptr means the leaf is not exist
-    std::string* value = (i == size) ? nullptr : &leaf_values_[i];
-    sub_compact_tasks_.emplace_back(start, end, value);
+    const std::string* start = (i == 0) ? nullptr : &boundries_[i - 1];
+    const std::string* end = (i == size) ? nullptr : &boundries_[i];
+    sub_compact_tasks_.emplace_back(start, end);
   }
-  compact_subtask_states_.resize(compact_num_threads_);
+  compact_subtask_states_.resize(std::min<size_t>(scheduler_->NumThreads(),
+                                                  sub_compact_tasks_.size()));
 }
 
 void SilkStore::ProcessKeyValueCompaction(
     SubCompaction& sub_compact, CompactSubTaskState& state,
     GroupedSegmentAppender& grouped_segment_appender) {
-  std::string* start = sub_compact.start_;
-  std::string* end = sub_compact.end_;
-  std::string* leaf_value = sub_compact.value_;
+  const std::string* start = sub_compact.start_;
+  const std::string* end = sub_compact.end_;
+  const Comparator* ucmp = user_comparator();
   Status& s = state.s_;
-
   WriteBatch& leaf_index_wb = state.leaf_index_wb_;
 
+  ReadOptions ro;
+  ro.snapshot = compact_leaf_index_snapshot_;
+  std::unique_ptr<Iterator> iit(leaf_index_->NewIterator(ro));
   std::unique_ptr<Iterator> mit(imm_->NewIterator());
-
-  SegmentBuilder* seg_builder = nullptr;
-  bool switched_segment = false;
-  s = grouped_segment_appender.MakeRoomForGroupAndGetBuilder(0, &seg_builder,
-                                                             switched_segment);
-  if (!s.ok()) return;
-
-  if (switched_segment &&
-      leaf_index_wb.ApproximateSize() > kLeafIndexWriteBufferMaxSize) {
-    // If all previous segments are built successfully and
-    // the leaf_index write buffer exceeds the threshold,
-    // write it down to leaf_index_ to keep the memory footprint small.
-    s = leaf_index_->Write({}, &leaf_index_wb);
-    if (!s.ok()) return;
-    leaf_index_wb.Clear();
-  }
-
-  uint32_t seg_id = seg_builder->SegmentId();
-
-  assert(seg_builder->RunStarted() == false);
-
   if (start == nullptr) {
     mit->SeekToFirst();
   } else {
-    Slice start_slice(*start);
-
-    SequenceNumber snapshot = max_sequence_;
-    LookupKey lkey(start_slice, snapshot);
-
-    // seek to the first key larger than *start
-    mit->Seek(lkey.memtable_key());
-    // mit->SeekToFirst();
-    while (mit->Valid() && s.ok()) {
-      Slice imm_internal_key = mit->key();
-      ParsedInternalKey parsed_internal_key;
-      if (!ParseInternalKey(imm_internal_key, &parsed_internal_key)) {
-        s = Status::InvalidArgument(
-            "error parsing key from immutable table during compaction");
-        return;
-      }
-      if (this->user_comparator()->Compare(parsed_internal_key.user_key,
-                                           start_slice) > 0) {
-        break;
-      }
+    LookupKey lkey(*start, max_sequence_);
+    mit->Seek(lkey.internal_key());
+    if (mit->Valid() &&
+        ucmp->Compare(ExtractUserKey(mit->key()), *start) == 0) {
+      // The memtable holds one entry per user key
       mit->Next();
     }
   }
 
-  if (end != nullptr) {
-    Slice leaf_max_key(*end);
-    Slice leaf_value_slice(*leaf_value);
-    LeafIndexEntry leaf_index_entry(leaf_value_slice);
-
-    // normal process
-    int minirun_key_cnt = 0;
-    // Build up a minirun of key value payloads
-    while (mit->Valid() && s.ok()) {
-      Slice imm_internal_key = mit->key();
-      ParsedInternalKey parsed_internal_key;
-      if (!ParseInternalKey(imm_internal_key, &parsed_internal_key)) {
-        s = Status::InvalidArgument(
-            "error parsing key from immutable table during compaction");
-        return;
-      }
-      if (this->user_comparator()->Compare(parsed_internal_key.user_key,
-                                           leaf_max_key) > 0) {
-        break;
-      }
-      if (seg_builder->RunStarted() == false) {
-        s = seg_builder->StartMiniRun();
-        if (!s.ok()) {
-          return;
-        }
-        assert(seg_builder->RunStarted());
-      }
-      seg_builder->Add(mit->key(), mit->value());
-
-      // Reading data from memtable costs no read io.
-      // Record the write to segment.
-      state.written_ += (mit->key().size() + mit->value().size());
-      ++minirun_key_cnt;
-
-      mit->Next();
-    }
-
-    stat_store_.UpdateWriteHotness(leaf_max_key.ToString(), minirun_key_cnt);
-
-    std::string buf, buf2;
-    uint32_t run_no;
-
-    if (seg_builder->RunStarted()) {
-      s = seg_builder->FinishMiniRun(&run_no);
-      if (!s.ok()) {
-        return;
-      }
-      // Generate an index entry for the new minirun
-      buf.clear();
-      MiniRunIndexEntry new_minirun_index_entry = MiniRunIndexEntry::Build(
-          seg_id, run_no, seg_builder->GetFinishedRunIndexBlock(),
-          seg_builder->GetFinishedRunFilterBlock(),
-          seg_builder->GetFinishedRunDataSize(), &buf);
-      // Update the leaf index entry
-      LeafIndexEntry new_leaf_index_entry;
-      LeafIndexEntryBuilder::AppendMiniRunIndexEntry(
-          leaf_index_entry, new_minirun_index_entry, &buf2,
-          &new_leaf_index_entry);
-
-      assert(leaf_index_entry.GetNumMiniRuns() + 1 ==
-             new_leaf_index_entry.GetNumMiniRuns());
-      // Write out the updated entry to leaf index
-      leaf_index_wb.Put(leaf_max_key, new_leaf_index_entry.GetRawData());
-      stat_store_.UpdateLeafNumRuns(leaf_max_key.ToString(),
-                                    new_leaf_index_entry.GetNumMiniRuns());
-    } else {
-      // Memtable has no keys intersected with this leaf
-      if (leaf_index_entry.Empty()) {
-        // If the leaf became empty due to self-compaction or split, remove it
-        // from the leaf index
-        leaf_index_wb.Delete(leaf_max_key);
-        --(state.leaf_change_num_);
-        stat_store_.DeleteLeaf(leaf_max_key.ToString());
-        // fprintf(stderr, "Deleted index entry for empty leaf of key %s\n",
-        // leaf_max_key.ToString().c_str());
-      }
-    }
-
-  } else {
-    // create new leaf and process
-    // Memtable has keys that are greater than all the keys in leaf_index_.
-    // In this case, partition the rest of memtable contents into leaves each no
-    // more than options_.leaf_datasize_thresh bytes in size.
-    while (s.ok() && mit->Valid()) {
-      std::string buf, buf2;
-
-      SegmentBuilder* seg_builder = nullptr;
-      bool switched_segment = false;
-      s = grouped_segment_appender.MakeRoomForGroupAndGetBuilder(
-          0, &seg_builder, switched_segment);
-      if (!s.ok()) {
-        return;
-      }
-
-      if (switched_segment &&
-          leaf_index_wb.ApproximateSize() > kLeafIndexWriteBufferMaxSize) {
-        // If all previous segments are built successfully and
-        // the leaf_index write buffer exceeds the threshold,
-        // write it down to leaf_index_ to keep the memory footprint small.
-        s = leaf_index_->Write({}, &leaf_index_wb);
-        if (!s.ok()) return;
-        leaf_index_wb.Clear();
-      }
-
-      uint32_t seg_id = seg_builder->SegmentId();
-
-      assert(seg_builder->RunStarted() == false);
-
-      s = seg_builder->StartMiniRun();
-      if (!s.ok()) {
-        fprintf(stderr, "%s", s.ToString().c_str());
-        return;
-      }
-
-      size_t bytes = 0;
-      int minirun_key_cnt = 0;
-
-      Slice leaf_max_key;
-
-      while (mit->Valid()) {
-        Slice imm_internal_key = mit->key();
-        ParsedInternalKey parsed_internal_key;
-        if (!ParseInternalKey(mit->key(), &parsed_internal_key)) {
-          s = Status::InvalidArgument(
-              "error parsing key from immutable table during compaction");
-          fprintf(stderr, "%s", s.ToString().c_str());
-          return;
-        }
-
-        // A leaf holds at least one key-value pair and at most
-        // options_.leaf_datasize_thresh bytes of data.
-        if (minirun_key_cnt > 0 &&
-            bytes + imm_internal_key.size() + mit->value().size() >=
-                options_.leaf_datasize_thresh * 0.05) {
-          break;
-        }
-
-        bytes += imm_internal_key.size() + mit->value().size();
-
-        leaf_max_key = parsed_internal_key.user_key;
-        seg_builder->Add(imm_internal_key, mit->value());
-        // Reading data from memtable costs no read io.
-        // Record the write to segment.
-        state.written_ += (mit->key().size() + mit->value().size());
-        ++minirun_key_cnt;
-        mit->Next();
-      }
-
-      uint32_t run_no;
-      seg_builder->FinishMiniRun(&run_no);
-      assert(seg_builder->GetFinishedRunDataSize());
-      // Generate an index entry for the new minirun
-      MiniRunIndexEntry minirun_index_entry = MiniRunIndexEntry::Build(
-          seg_id, run_no, seg_builder->GetFinishedRunIndexBlock(),
-          seg_builder->GetFinishedRunFilterBlock(),
-          seg_builder->GetFinishedRunDataSize(), &buf);
-      LeafIndexEntry new_leaf_index_entry;
-      LeafIndexEntryBuilder::AppendMiniRunIndexEntry(
-          LeafIndexEntry{}, minirun_index_entry, &buf2, &new_leaf_index_entry);
-      leaf_index_wb.Put(leaf_max_key, new_leaf_index_entry.GetRawData());
-      ++(state.leaf_change_num_);
-      stat_store_.NewLeaf(leaf_max_key.ToString());
-      stat_store_.UpdateWriteHotness(leaf_max_key.ToString(), minirun_key_cnt);
-    }
-  }
-}
-
-void SilkStore::ProcessCompactionSubTasks(int tid) {
-  GroupedSegmentAppender grouped_segment_appender(1, segment_manager_,
-                                                  options_);
-
-  for (size_t i = 0; i < sub_compact_tasks_.size(); ++i) {
-    if (tid == (i % compact_num_threads_)) {
-      ProcessKeyValueCompaction(sub_compact_tasks_[i],
-                                compact_subtask_states_[tid],
-                                grouped_segment_appender);
-      // failed compaction
-      if (!compact_subtask_states_[tid].s_.ok()) {
-        break;
-      }
-    }
-  }
-}
-
-void SilkStore::RunCompactionTasks() {
-  // Launch a thread for each of subcompactions 1...num_threads-1
-  std::vector<std::thread> thread_pool;
-  thread_pool.reserve(compact_num_threads_ - 1);
-
-  for (size_t i = 1; i < compact_num_threads_; ++i) {
-    thread_pool.emplace_back(&SilkStore::ProcessCompactionSubTasks, this, i);
-  }
-
-  // Always schedule the first subcompaction (whether or not there are also
-  // others) in the current thread to be efficient with resources
-  ProcessCompactionSubTasks(0);
-
-  // Wait for all other threads (if there are any) to finish execution
-  for (auto& thread : thread_pool) {
-    thread.join();
-  }
-}
-
-Status SilkStore::FinishCompactionTasks() {
-  DeferCode c([this]() {
-    sub_compact_tasks_.clear();
-    compact_subtask_states_.clear();
-    boundries_.clear();
-    leaf_values_.clear();
-  });
-
-  for (auto& state : compact_subtask_states_) {
-    if (!state.s_.ok()) {
-      return state.s_;
-    }
-    // Record the read and write
-    stats_.Add(state.read_, state.written_);
-    // Record the change of leaf num
-    num_leaves += state.leaf_change_num_;
-
-    if (state.leaf_index_wb_.ApproximateSize()) {
-      Status s = leaf_index_->Write({}, &(state.leaf_index_wb_));
-      if (!s.ok()) return s;
-      state.leaf_index_wb_.Clear();
-    }
-  }
-  return Status();
-}
-
-/*
-// Discard: we should not use this version
-Status SilkStore::DoCompactionWork(WriteBatch &leaf_index_wb) {
-    mutex_.Unlock();
-    DeferCode c([this]() {
-        mutex_.Lock();
-    });
-
-    PrepareCompactionTasks();
-    RunCompactionTasks();
-    Status s = FinishCompactionTasks();
-
-    if (s.ok()) {
-        ++num_compactions;
-    }
-
-    return s;
-}
-
-*/
-Status SilkStore::DoCompactionWork(WriteBatch& leaf_index_wb) {
-  Log(options_.info_log, "DoCompactionWork start\n");
-  mutex_.Unlock();
-  ReadOptions ro;
-  ro.snapshot = leaf_index_->GetSnapshot();
-
-  // Release snapshot after the traversal is done
-  DeferCode c([&ro, this]() {
-    leaf_index_->ReleaseSnapshot(ro.snapshot);
-    mutex_.Lock();
-  });
-
-  std::unique_ptr<Iterator> iit(leaf_index_->NewIterator(ro));
-  int self_compaction = 0;
-  int num_leaves_snap = (num_leaves == 0 ? 1 : num_leaves);
-  int num_splits = 0;
-  iit->SeekToFirst();
-  std::unique_ptr<Iterator> mit(imm_->NewIterator());
-  mit->SeekToFirst();
   std::string buf, buf2;
   uint32_t run_no;
-  Status s;
-
-  GroupedSegmentAppender grouped_segment_appender(1, segment_manager_,
-                                                  options_);
-
-  Slice next_leaf_max_key;
-  Slice next_leaf_index_value;
-  Slice leaf_max_key;
-  while (iit->Valid() && mit->Valid() && s.ok()) {
-    if (next_leaf_max_key.empty()) {
-      next_leaf_max_key = iit->key();
-      next_leaf_index_value = iit->value();
+  bool leaf_positioned = false;
+  while (mit->Valid() && s.ok()) {
+    Slice user_key = ExtractUserKey(mit->key());
+    if (end != nullptr && ucmp->Compare(user_key, *end) > 0) return;
+
+    // Find the leaf of the next memtable key.  Leaves in between have no
+    // keys in the memtable and are skipped by a seek, unless the key
+    // belongs to the very next leaf.
+    if (leaf_positioned) iit->Next();
+    if (!leaf_positioned ||
+        (iit->Valid() && ucmp->Compare(user_key, iit->key()) > 0)) {
+      iit->Seek(user_key);
+      leaf_positioned = true;
     }
-
-    Slice leaf_max_key = next_leaf_max_key;
-    LeafIndexEntry leaf_index_entry(next_leaf_index_value);
-
+    if (!iit->Valid()) {
+      // The key is past the last leaf
+      break;
+    }
+    Slice leaf_max_key = iit->key();
+    LeafIndexEntry leaf_index_entry(iit->value());
     // Record the data read from leaf_index as well
-    stats_.Add(iit->key().size() + iit->value().size(), 0);
+    state.read_ += iit->key().size() + iit->value().size();
 
     SegmentBuilder* seg_builder = nullptr;
     bool switched_segment = false;
     s = grouped_segment_appender.MakeRoomForGroupAndGetBuilder(
-        0, &seg_builder, switched_segment);
-    if (!s.ok()) return s;
-
-    if (switched_segment &&
-        leaf_index_wb.ApproximateSize() > kLeafIndexWriteBufferMaxSize) {
-      // If all previous segments are built successfully and
-      // the leaf_index write buffer exceeds the threshold,
-      // write it down to leaf_index_ to keep the memory footprint small.
-      s = leaf_index_->Write({}, &leaf_index_wb);
-      if (!s.ok()) return s;
-      leaf_index_wb.Clear();
-    }
-
-    uint32_t seg_id = seg_builder->SegmentId();
-
+        LeafGroup(leaf_max_key.ToString()), &seg_builder, switched_segment);
+    if (!s.ok()) return;
     assert(seg_builder->RunStarted() == false);
+    s = seg_builder->StartMiniRun();
+    if (!s.ok()) return;
 
-    int minirun_key_cnt = 0;
     // Build up a minirun of key value payloads
-    while (mit->Valid() /*  && minirun_key_cnt < 1024*10 */) {
-      Slice imm_internal_key = mit->key();
-      ParsedInternalKey parsed_internal_key;
-      if (!ParseInternalKey(imm_internal_key, &parsed_internal_key)) {
-        s = Status::InvalidArgument(
-            "error parsing key from immutable table during compaction");
-        return s;
-      }
-      if (this->user_comparator()->Compare(parsed_internal_key.user_key,
-                                           leaf_max_key) > 0) {
-        break;
-      }
-      if (seg_builder->RunStarted() == false) {
-        s = seg_builder->StartMiniRun();
-        if (!s.ok()) {
-          return s;
-        }
-        assert(seg_builder->RunStarted());
-      }
+    int minirun_key_cnt = 0;
+    while (mit->Valid() &&
+           ucmp->Compare(ExtractUserKey(mit->key()), leaf_max_key) <= 0) {
       seg_builder->Add(mit->key(), mit->value());
-
       // Reading data from memtable costs no read io.
       // Record the write to segment.
-      stats_.Add(0, mit->key().size() + mit->value().size());
+      state.written_ += mit->key().size() + mit->value().size();
       ++minirun_key_cnt;
-
       mit->Next();
     }
-
+    assert(minirun_key_cnt > 0);
     stat_store_.UpdateWriteHotness(leaf_max_key.ToString(), minirun_key_cnt);
 
-    if (seg_builder->RunStarted()) {
-      s = seg_builder->FinishMiniRun(&run_no);
-      if (!s.ok()) {
-        return s;
-      }
-      // Generate an index entry for the new minirun
-      buf.clear();
-      MiniRunIndexEntry new_minirun_index_entry = MiniRunIndexEntry::Build(
-          seg_id, run_no, seg_builder->GetFinishedRunIndexBlock(),
-          seg_builder->GetFinishedRunFilterBlock(),
-          seg_builder->GetFinishedRunDataSize(), &buf);
-
-      // Update the leaf index entry
-      LeafIndexEntry new_leaf_index_entry;
-      LeafIndexEntryBuilder::AppendMiniRunIndexEntry(
-          leaf_index_entry, new_minirun_index_entry, &buf2,
-          &new_leaf_index_entry);
-
-      assert(leaf_index_entry.GetNumMiniRuns() + 1 ==
-             new_leaf_index_entry.GetNumMiniRuns());
-      // Write out the updated entry to leaf index
-      leaf_index_wb.Put(leaf_max_key, new_leaf_index_entry.GetRawData());
-      stat_store_.UpdateLeafNumRuns(leaf_max_key.ToString(),
-                                    new_leaf_index_entry.GetNumMiniRuns());
-    } else {
-      // Memtable has no keys intersected with this leaf
-      if (leaf_index_entry.Empty()) {
-        // If the leaf became empty due to self-compaction or split,
-        // remove it from the leaf index
-        leaf_index_wb.Delete(leaf_max_key);
-        --num_leaves;
-        stat_store_.DeleteLeaf(leaf_max_key.ToString());
-        // fprintf(stderr, "Deleted index entry for empty leaf of key %s\n",
-        // leaf_max_key.ToString().c_str());
-      }
-    }
-
-    iit->Next();
-    if (iit->Valid()) {
-      next_leaf_max_key = iit->key();
-      next_leaf_index_value = iit->value();
-    }
+    s = seg_builder->FinishMiniRun(&run_no);
+    if (!s.ok()) return;
+    // Generate an index entry for the new minirun
+    buf.clear();
+    MiniRunIndexEntry new_minirun_index_entry = MiniRunIndexEntry::Build(
+        seg_builder->SegmentId(), run_no,
+        seg_builder->GetFinishedRunIndexBlock(),
+        seg_builder->GetFinishedRunFilterBlock(),
+        seg_builder->GetFinishedRunDataSize(), &buf);
+    // Only the new run is written to the leaf index; the index merges
+    // it into the leaf's entry and consolidates the chain periodically.
+    leaf_index_wb.Put(leaf_max_key,
+                      LeafIndexEntryBuilder::EncodeAppendDelta(
+                          new_minirun_index_entry, &buf2));
+    stat_store_.UpdateLeafNumRuns(leaf_max_key.ToString(),
+                                  leaf_index_entry.GetNumMiniRuns() + 1);
+    ++state.leaves_written_;
   }
+
   // Memtable has keys that are greater than all the keys in leaf_index_.
   // In this case, partition the rest of memtable contents into leaves each no
   // more than options_.leaf_datasize_thresh bytes in size.
   while (s.ok() && mit->Valid()) {
-    std::string buf, buf2;
+    assert(end == nullptr);
+    // New leaves start out in the hottest group
     SegmentBuilder* seg_builder = nullptr;
     bool switched_segment = false;
     s = grouped_segment_appender.MakeRoomForGroupAndGetBuilder(
         0, &seg_builder, switched_segment);
-    if (!s.ok()) return s;
-    if (switched_segment &&
-        leaf_index_wb.ApproximateSize() > kLeafIndexWriteBufferMaxSize) {
-      // If all previous segments are built successfully and
-      // the leaf_index write buffer exceeds the threshold,
-      // write it down to leaf_index_ to keep the memory footprint small.
-      s = leaf_index_->Write({}, &leaf_index_wb);
-      if (!s.ok()) return s;
-      leaf_index_wb.Clear();
-    }
-
-    uint32_t seg_id = seg_builder->SegmentId();
-
+    if (!s.ok()) return;
     assert(seg_builder->RunStarted() == false);
     s = seg_builder->StartMiniRun();
-    if (!s.ok()) {
-      fprintf(stderr, "%s", s.ToString().c_str());
-      return s;
-    }
+    if (!s.ok()) return;
+
     size_t bytes = 0;
     int minirun_key_cnt = 0;
+    Slice leaf_max_key;
     while (mit->Valid()) {
       Slice imm_internal_key = mit->key();
-      ParsedInternalKey parsed_internal_key;
-      if (!ParseInternalKey(mit->key(), &parsed_internal_key)) {
-        s = Status::InvalidArgument(
-            "error parsing key from immutable table during compaction");
-        fprintf(stderr, "%s", s.ToString().c_str());
-        return s;
-      }
       // A leaf holds at least one key-value pair and at most
       // options_.leaf_datasize_thresh bytes of data.
       if (minirun_key_cnt > 0 &&
@@ -2181,47 +2435,116 @@ Status SilkStore::DoCompactionWork(WriteBatch& leaf_index_wb) {
         break;
       }
       bytes += imm_internal_key.size() + mit->value().size();
-      leaf_max_key = parsed_internal_key.user_key;
-
+      leaf_max_key = ExtractUserKey(imm_internal_key);
       seg_builder->Add(imm_internal_key, mit->value());
       // Reading data from memtable costs no read io.
       // Record the write to segment.
-      stats_.Add(0, mit->key().size() + mit->value().size());
+      state.written_ += imm_internal_key.size() + mit->value().size();
       ++minirun_key_cnt;
-
       mit->Next();
     }
-    uint32_t run_no;
-    seg_builder->FinishMiniRun(&run_no);
+
+    s = seg_builder->FinishMiniRun(&run_no);
+    if (!s.ok()) return;
     assert(seg_builder->GetFinishedRunDataSize());
     // Generate an index entry for the new minirun
+    buf.clear();
+    buf2.clear();
     MiniRunIndexEntry minirun_index_entry = MiniRunIndexEntry::Build(
-        seg_id, run_no, seg_builder->GetFinishedRunIndexBlock(),
+        seg_builder->SegmentId(), run_no,
+        seg_builder->GetFinishedRunIndexBlock(),
         seg_builder->GetFinishedRunFilterBlock(),
         seg_builder->GetFinishedRunDataSize(), &buf);
     LeafIndexEntry new_leaf_index_entry;
     LeafIndexEntryBuilder::AppendMiniRunIndexEntry(
         LeafIndexEntry{}, minirun_index_entry, &buf2, &new_leaf_index_entry);
     leaf_index_wb.Put(leaf_max_key, new_leaf_index_entry.GetRawData());
-    ++num_leaves;
+    ++(state.leaf_change_num_);
+    ++state.leaves_written_;
     stat_store_.NewLeaf(leaf_max_key.ToString());
     stat_store_.UpdateWriteHotness(leaf_max_key.ToString(), minirun_key_cnt);
   }
-  //    fprintf(stderr, "Background compaction finished, last segment %d\n",
-  //    seg_id); fprintf(stderr, "avg runsize %d, self compactions %d,
-  //    num_splits %d, num_leaves %d, memtable size %lu, segments size %lu\n",
-  //    imm_->ApproximateMemoryUsage() / num_leaves_snap, self_compaction,
-  //    num_splits, num_leaves_snap, imm_->ApproximateMemoryUsage(),
-  //    segment_manager_->ApproximateSize());
-  ++num_compactions;
-  //        Log(options_.info_log, "Background compaction finished, last segment
-  //        %d\n", seg_id);
+}
+
+void SilkStore::ProcessCompactionSubTasks(int tid) {
+  GroupedSegmentAppender grouped_segment_appender(
+      options_.num_segment_groups, segment_manager_, options_, &rate_limiter_,
+      kFlushPriority);
+
+  size_t i;
+  while ((i = next_compact_task_.fetch_add(1)) < sub_compact_tasks_.size()) {
+    ProcessKeyValueCompaction(sub_compact_tasks_[i],
+                              compact_subtask_states_[tid],
+                              grouped_segment_appender);
+    // failed compaction
+    if (!compact_subtask_states_[tid].s_.ok()) {
+      break;
+    }
+  }
+  // The appender finishes its last segment here, before any leaf index
+  // entry pointing into it is committed.
+}
+
+void SilkStore::RunCompactionTasks() {
+  next_compact_task_ = 0;
+  // The first subcompaction runs in the current thread (whether or not
+  // there are also others) to be efficient with resources
+  scheduler_->RunParallel(
+      kFlushPriority, compact_subtask_states_.size(),
+      [this](int tid) { ProcessCompactionSubTasks(tid); });
+}
+
+Status SilkStore::FinishCompactionTasks(WriteBatch* leaf_index_wb) {
+  DeferCode c([this]() {
+    sub_compact_tasks_.clear();
+    compact_subtask_states_.clear();
+    boundries_.clear();
+  });
+
+  size_t leaves_written = 0;
+  for (auto& state : compact_subtask_states_) {
+    if (!state.s_.ok()) {
+      return state.s_;
+    }
+  }
+  for (auto& state : compact_subtask_states_) {
+    // Record the read and write
+    stats_.Add(state.read_, state.written_);
+    // Record the change of leaf num
+    num_leaves += state.leaf_change_num_;
+    leaves_written += state.leaves_written_;
+    WriteBatchInternal::Append(leaf_index_wb, &state.leaf_index_wb_);
+  }
   Log(options_.info_log,
-      "avg runsize %ld, self compactions %d, num_splits %d, num_leaves %d, "
-      "memtable size %lu, segments size %lu\n",
-      imm_->ApproximateMemoryUsage() / num_leaves_snap, self_compaction,
-      num_splits, num_leaves_snap, imm_->ApproximateMemoryUsage(),
-      segment_manager_->ApproximateSize());
+      "%lu subcompactions wrote %lu of %lu leaves, memtable size %lu, "
+      "segments size %lu\n",
+      sub_compact_tasks_.size(), leaves_written, num_leaves,
+      imm_->ApproximateMemoryUsage(), segment_manager_->ApproximateSize());
+  return Status();
+}
+
+// Flushes the immutable memtable into the leaf layer.  The memtable is cut
+// into key ranges on leaf boundaries and the ranges are flushed in
+// parallel; every leaf index update lands in "leaf_index_wb", which the
+// caller commits in one write.
+Status SilkStore::DoCompactionWork(WriteBatch& leaf_index_wb) {
+  Log(options_.info_log, "DoCompactionWork start\n");
+  mutex_.Unlock();
+  compact_leaf_index_snapshot_ = leaf_index_->GetSnapshot();
+
+  // Release snapshot after the traversal is done
+  DeferCode c([this]() {
+    leaf_index_->ReleaseSnapshot(compact_leaf_index_snapshot_);
+    compact_leaf_index_snapshot_ = nullptr;
+    mutex_.Lock();
+  });
+
+  PrepareCompactionTasks();
+  RunCompactionTasks();
+  Status s = FinishCompactionTasks(&leaf_index_wb);
+  if (s.ok()) {
+    ++num_compactions;
+  }
   return s;
 }
 
@@ -2236,33 +2559,22 @@ void SilkStore::BackgroundCompaction() {
   Status s;
   bool full_compacted = false;
 
-  // Log(options_.info_log,"check gc %lu %lu\n",
-  // segment_manager_->ApproximateSize(),
-  // options_.maximum_segments_storage_size); todo GC can cause deadlock: gc is
-  // ongoing and optimization_leaf is waiting for gc_mutex, and at that time
-  // memtable is full.
-  while (options_.maximum_segments_storage_size &&
-         segment_manager_->ApproximateSize() >=
-             options_.segments_storage_size_gc_threshold *
-                 options_.maximum_segments_storage_size &&
-         s.ok()) {
-    // Log(options_.info_log, "start gc %lu %lu\n",
-    // segment_manager_->ApproximateSize(),
-    // options_.maximum_segments_storage_size);
+  // Background GC fell behind and segments hit the limit; flushing more
+  // would exceed it, so collect in the foreground first
+  constexpr int kGCSegmentCandidateNum = 5;
+  while (SegmentsAbove(1.0) && s.ok()) {
     auto t_start_gc = env_->NowMicros();
-    if (this->GarbageCollect() == 0) {
+    if (GarbageCollect(kGCSegmentCandidateNum) == 0) {
       // Do a full compaction to release space
       Log(options_.info_log, "full compaction\n");
+      MutexLock gc_lock(&GCMutex);
       mutex_.Lock();
       s = MakeRoomInLeafLayer(true);
       mutex_.Unlock();
       full_compacted = true;
 
       // todo 自适应调整gc阈值
-      if (options_.maximum_segments_storage_size &&
-          segment_manager_->ApproximateSize() >=
-              options_.segments_storage_size_gc_threshold *
-                  options_.maximum_segments_storage_size) {
+      if (SegmentsAbove(options_.segments_storage_size_gc_threshold)) {
         size_t cur_stoage_size = segment_manager_->ApproximateSize();
         options_.maximum_segments_storage_size =
             cur_stoage_size +
@@ -2270,9 +2582,13 @@ void SilkStore::BackgroundCompaction() {
                 (1 - options_.segments_storage_size_gc_threshold + 0.2);
       }
     }
-    // Log(options_.info_log, "end gc\n");
     stats_.AddTimeGC(env_->NowMicros() - t_start_gc);
   }
+
+  // GC runs in its own background rounds between flushes, see
+  // BackgroundGC().  Compaction rewrites leaf index entries too, so it
+  // excludes the commits of those rounds, though not their copying.
+  MutexLock gc_lock(&GCMutex);
   mutex_.Lock();
 
   if (!s.ok()) {
@@ -2298,8 +2614,13 @@ void SilkStore::BackgroundCompaction() {
   } else {
     mutex_.Unlock();
     if (leaf_index_wb.ApproximateSize()) {
-      s = leaf_index_->Write({}, &leaf_index_wb);
+      s = leaf_store_->WriteLeafIndex(&leaf_index_wb);
     }
+    // Leaves were split, created and removed; lookups pick the new
+    // boundaries up with the SuperVersion installed below
+    if (s.ok()) s = leaf_store_->RebuildLeafBoundaries();
+    // The runs the new leaf index entries replaced are garbage for good
+    if (s.ok()) s = segment_manager_->PersistInvalidRuns();
     mutex_.Lock();
     if (!s.ok()) {
       bg_error_ = s;
@@ -2314,6 +2635,7 @@ void SilkStore::BackgroundCompaction() {
     imm_->Unref();
     imm_ = nullptr;
     has_imm_.Release_Store(nullptr);
+    InstallSuperVersion();
   }
 }
 
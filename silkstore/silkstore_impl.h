@@ -13,21 +13,27 @@
 #include "db/log_writer.h"
 #include "db/snapshot.h"
 #include "db/write_batch_internal.h"
+#include <atomic>
 #include <deque>
+#include <map>
 #include <set>
 #include "leveldb/db.h"
 #include "leveldb/env.h"
 #include "port/port.h"
 #include "port/thread_annotations.h"
+#include "background_scheduler.h"
 #include "leaf_store.h"
+#include "rate_limiter.h"
 #include "nvm/nvmemtable.h"
 #include "nvm/nvmleafindex.h"
 #include "nvm/nvmmanager.h"
 #include "segment.h"
+#include "statistics.h"
 namespace leveldb {
 namespace silkstore {
 
 class GroupedSegmentAppender;
+struct SuperVersion;
 
 class SilkStore : public DB {
  public:
@@ -66,6 +72,12 @@ class SilkStore : public DB {
   // Force current memtable contents to be compacted.
   Status TEST_CompactMemTable();
 
+  // Wait until background GC has no more rounds to run.
+  void TEST_WaitForGC();
+
+  // Run one round of leaf optimization now.
+  Status TEST_OptimizeLeaf();
+
   // Return an internal iterator over the current state of the database.
   // The keys of this iterator are internal keys (see format.h).
   // The returned iterator should be deleted when no longer needed.
@@ -84,14 +96,39 @@ class SilkStore : public DB {
 
   void BackgroundCompaction();
 
-  Status CopyMinirunRun(Slice leaf_max_key, LeafIndexEntry& index_entry,
-                        uint32_t run_idx_in_index_entry,
-                        SegmentBuilder* seg_builder, WriteBatch& leaf_index_wb);
+  // A live run GC has copied out of a victim segment.  The leaf index
+  // keeps pointing at the original until the round commits.
+  struct RelocatedRun {
+    std::string user_key;  // A key of the run, to find its leaf by
+    uint32_t old_seg_id;
+    uint32_t old_run_no;
+    uint32_t new_seg_id;
+    uint32_t new_run_no;
+  };
+
+  // Points run "run_idx_in_index_entry" of "index_entry" at the copy
+  // "run" describes and stores the resulting entry in *new_index_entry.
+  Status RelocateMinirunRun(const LeafIndexEntry& index_entry,
+                            uint32_t run_idx_in_index_entry,
+                            const RelocatedRun& run,
+                            std::string* new_index_entry);
 
+  // Copies the runs of "seg" the leaf index points at to "appender" byte
+  // for byte and appends them to *relocated.  Does not need GCMutex.
   Status GarbageCollectSegment(Segment* seg, GroupedSegmentAppender& appender,
-                               WriteBatch& leaf_index_wb);
+                               std::vector<RelocatedRun>* relocated);
 
-  int GarbageCollect();
+  // Points the leaf index at the copies in "relocated" whose originals it
+  // still references, in one write, and invalidates the other copies.
+  // REQUIRES: GCMutex is held
+  Status CommitRelocatedRuns(const std::vector<RelocatedRun>& relocated);
+
+  // Collects up to "max_segments" segments picked by Options::gc_policy.
+  // Their live runs are copied without GCMutex, which is only taken to
+  // commit the copies, so flushes do not wait behind throttled GC I/O.
+  // Returns the number of segments removed.
+  // REQUIRES: GCMutex is not held
+  int GarbageCollect(int max_segments);
 
   std::string SegmentsSpaceUtilityHistogram();
 
@@ -117,12 +154,22 @@ class SilkStore : public DB {
 
   // Leaf index
   DB* leaf_index_;
+  // Merges minirun append deltas written to leaf_index_
+  LeafIndexEntryMerger leaf_index_merger_;
 
   // Lock over the persistent DB state.  Non-null iff successfully acquired.
   FileLock* db_lock_;
 
+  // Serializes the work that rewrites leaf index entries from its own
+  // view of them: flushes into the leaf layer, the commits of GC rounds,
+  // leaf optimization and merging.  Acquired before mutex_, never while
+  // holding it.
   port::Mutex GCMutex;
 
+  // Serializes GC rounds, so that no two pick the same victims.  Acquired
+  // before GCMutex.
+  port::Mutex gc_round_mutex_;
+
   // port::Mutex LeafMutex;
 
   // State below is protected by mutex_
@@ -139,11 +186,28 @@ class SilkStore : public DB {
   log::Writer* log_;
   uint32_t seed_ GUARDED_BY(mutex_);  // For sampling.
   SequenceNumber max_sequence_ GUARDED_BY(mutex_);
+  // Copy of max_sequence_ readable without mutex_
+  std::atomic<SequenceNumber> visible_sequence_;
+
+  // Read view (mem_, imm_, leaf_store_) handed to Get and NewIterator.
+  // A new one is installed whenever mem_ or imm_ changes.
+  SuperVersion* super_version_ GUARDED_BY(mutex_);
+  std::atomic<uint64_t> super_version_number_;
+
+  // Per-thread cached references to a SuperVersion.  Each reader thread is
+  // assigned one slot, so the common case of an up-to-date cached view
+  // costs two atomic exchanges and no mutex_.
+  static const int kNumSuperVersionSlots = 64;
+  struct SuperVersionSlot {
+    std::atomic<SuperVersion*> sv;
+    char padding[64 - sizeof(std::atomic<SuperVersion*>)];
+  };
+  SuperVersionSlot super_version_slots_[kNumSuperVersionSlots];
   size_t memtable_capacity_ GUARDED_BY(mutex_);
   ;
   size_t allowed_num_leaves = 0;
   size_t num_leaves = 0;
-  SegmentManager* segment_manager_;
+  SegmentManager* segment_manager_ = nullptr;
   // Queue of writers.
   std::deque<Writer*> writers_ GUARDED_BY(mutex_);
   WriteBatch* tmp_batch_ GUARDED_BY(mutex_);
@@ -157,12 +221,23 @@ class SilkStore : public DB {
   // Has a background compaction been scheduled or is running?
   bool background_compaction_scheduled_ GUARDED_BY(mutex_);
 
-  // =====================================================================
-  port::Mutex leaf_op_mutex_;
-  bool background_leaf_optimization_scheduled_ GUARDED_BY(leaf_op_mutex_);
-  port::CondVar background_leaf_op_finished_signal_ GUARDED_BY(leaf_op_mutex_);
-  // =====================================================================
+  // Has a background GC round been scheduled or is running?
+  bool background_gc_scheduled_ GUARDED_BY(mutex_);
+
+  // Runs all background work
+  BackgroundScheduler* scheduler_;
 
+  // Throttles the segment reads and writes of background work
+  RateLimiter rate_limiter_;
+
+  // Retunes rate_limiter_ and schedules itself again, see
+  // Options::background_io_target_p99_micros
+  std::function<void()> rate_tuning_func_;
+  static const uint64_t kRateTuningIntervalMicros = 1000000;
+  // kGetMicros buckets at the previous tuning
+  std::vector<uint64_t> tuning_get_micros_;
+
+  // Optimizes hot leaves and schedules itself again
   std::function<void()> leaf_optimization_func_;
   // Information for a manual compaction
   struct ManualCompaction {
@@ -205,6 +280,22 @@ class SilkStore : public DB {
   Status MakeRoomForWrite(bool force /* compact even if there is room? */)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
+  // Publish the current mem_/imm_ as a new SuperVersion and drop the
+  // references cached by reader threads.
+  void InstallSuperVersion() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Pin the current SuperVersion without taking mutex_ in the common case.
+  // *slot is set to the per-thread slot the reference was taken from, or
+  // -1 if the slot was busy.  Must be paired with ReleaseSuperVersion().
+  SuperVersion* AcquireSuperVersion(int* slot);
+  void ReleaseSuperVersion(SuperVersion* sv, int slot);
+
+  // Drop one reference, freeing the view if it was the last one.
+  void UnrefSuperVersion(SuperVersion* sv);
+
+  // Drop every reference cached in super_version_slots_.
+  void ReleaseCachedSuperVersions() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
   // Recover the descriptor from persistent storage.  May do a significant
   // amount of work to recover recently logged updates.  Any changes to
   // be made to the descriptor are added to *edit.
@@ -222,13 +313,28 @@ class SilkStore : public DB {
 
   void MaybeScheduleCompaction();
 
+  // Whether segments take up at least "ratio" of
+  // Options::maximum_segments_storage_size.
+  bool SegmentsAbove(double ratio);
+
+  // Schedules a GC round if segments passed the GC threshold.
+  void MaybeScheduleGC() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Collects one segment and schedules the next round, so GC proceeds
+  // incrementally behind flushes and splits queued meanwhile.
+  void BackgroundGC();
+
   Status DoCompactionWork(WriteBatch& leaf_index_wb);
 
   Status OptimizeLeaf();
 
-  Status MakeRoomInLeafLayer(bool force = false);
+  // Segment group the miniruns of a leaf are placed in
+  uint32_t LeafGroup(const std::string& leaf_key);
 
-  static void BGWork(void* db);
+  // Moves the background I/O rate toward the foreground latency target
+  void TuneBackgroundIORate();
+
+  Status MakeRoomInLeafLayer(bool force = false);
 
   void BackgroundCall();
 
@@ -279,6 +385,24 @@ class SilkStore : public DB {
       gc_miniruns_total += miniruns_total;
     }
 
+    // GC work by the placement group of the collected segments.  The last
+    // slot counts segments without a group.
+    struct GroupGCStats {
+      size_t segments = 0;
+      size_t bytes = 0;
+      size_t bytes_copied = 0;
+    };
+    std::vector<GroupGCStats> gc_group_stats;
+
+    void AddGCGroupStats(int group, size_t segment_size, size_t copied) {
+      if (group < 0 || group + 1 >= (int)gc_group_stats.size()) {
+        group = gc_group_stats.size() - 1;
+      }
+      ++gc_group_stats[group].segments;
+      gc_group_stats[group].bytes += segment_size;
+      gc_group_stats[group].bytes_copied += copied;
+    }
+
     size_t time_spent_compaction = 0;
     size_t time_spent_gc = 0;
 
@@ -287,26 +411,53 @@ class SilkStore : public DB {
     void AddTimeGC(size_t t) { time_spent_gc += t; }
   } stats_;
 
+  // Read path tickers and histograms, see "silkstore.statistics"
+  Statistics statistics_;
+
+  // Prefix that keeps this DB's entries apart in a shared row cache
+  uint64_t row_cache_id_;
+
+  // Looks "key" up in options_.row_cache.  Returns true and sets *s (and
+  // *value on success) iff a cached leaf layer result is valid at
+  // "snapshot".
+  bool LookupRowCache(const Slice& key, SequenceNumber snapshot,
+                      std::string* value, Status* s);
+
+  // Caches a leaf layer result obtained at "snapshot", unless a write may
+  // have raced with the lookup.
+  void FillRowCache(const Slice& key, SequenceNumber snapshot,
+                    SequenceNumber found_seq, const Status& s,
+                    const std::string& value);
+
+  // Drops the row cache entries of every key written by "updates".
+  void InvalidateRowCache(WriteBatch* updates);
+
   // parallel compaction
-  // Maintains state for each sub-compaction
+  // Each sub-compaction flushes the keys of the immutable memtable in
+  // (*start_, *end_] into the leaf layer.  Both bounds are leaf max keys,
+  // so no leaf is written by two sub-compactions.
   struct SubCompaction {
-    std::string *start_, *end_;
-    std::string* value_;
+    const std::string *start_, *end_;  // nullptr means unbounded
 
-    SubCompaction() : start_(nullptr), end_(nullptr), value_(nullptr) {}
-    SubCompaction(std::string* start, std::string* end, std::string* value)
-        : start_(start), end_(end), value_(value) {}
+    SubCompaction() : start_(nullptr), end_(nullptr) {}
+    SubCompaction(const std::string* start, const std::string* end)
+        : start_(start), end_(end) {}
   };
 
   struct CompactSubTaskState {
     size_t read_ = 0;
     size_t written_ = 0;
     int32_t leaf_change_num_ = 0;
+    size_t leaves_written_ = 0;
     Status s_;
     WriteBatch leaf_index_wb_;
   };
 
-  size_t compact_num_threads_ = 2;
+  // Index of the next subcompaction to be claimed by a thread
+  std::atomic<size_t> next_compact_task_{0};
+
+  // Sub-compactions below this many memtable entries are not worth a thread
+  static const size_t kMinSubcompactionEntries = 4096;
 
   // Stores the boundaries for each subcompaction
   // subcompaction states are stored in order of increasing key-range
@@ -314,22 +465,26 @@ class SilkStore : public DB {
 
   std::vector<CompactSubTaskState> compact_subtask_states_;
 
-  // the max key of each leaf_index_entry
+  // the leaf max keys that separate subcompactions
   std::vector<std::string> boundries_;
-  // the value of each leaf_index_entry
-  std::vector<std::string> leaf_values_;
 
-  // It adds the max key and value of each leaf_index_entry
-  // Then it is uesd to divides immutable to sum groups.
+  // The leaf index as of the start of the compaction, shared by all
+  // subcompactions
+  const Snapshot* compact_leaf_index_snapshot_ = nullptr;
+
+  // Cuts the immutable memtable into subcompactions holding about the
+  // same number of entries, moving each cut up to the max key of the leaf
+  // it falls into.
   void GenSubcompactionBoundaries();
 
   // prepare subtasks for multiple threads
   void PrepareCompactionTasks();
 
-  // Launch threads for each subcompaction and wait for them to finish.
+  // Run the subcompactions on all background threads and wait for them
+  // to finish.
   void RunCompactionTasks();
 
-  // Assign tasks to threads
+  // Claim subcompactions until none are left
   void ProcessCompactionSubTasks(int tid);
 
   // Iterate through immutable and compact the kv-pairs.
@@ -337,7 +492,9 @@ class SilkStore : public DB {
       SubCompaction& sub_compact, CompactSubTaskState& state,
       GroupedSegmentAppender& grouped_segment_appender);
 
-  Status FinishCompactionTasks();
+  // Collects the leaf index updates of all subcompactions into
+  // *leaf_index_wb, to be committed at once.
+  Status FinishCompactionTasks(WriteBatch* leaf_index_wb);
 
   // parallel make room for leaf layer
   // mainly responsible for split leaf
@@ -358,17 +515,18 @@ class SilkStore : public DB {
     WriteBatch leaf_index_wb_;
   };
 
-  size_t split_leaf_num_threads_ = 4;
+  // Index of the next leaf in leafs_need_split to be claimed by a thread
+  std::atomic<size_t> next_split_leaf_{0};
 
   // the leafs need split
   std::vector<SingleLeaf> leafs_need_split;
   std::vector<SplitLeafTaskState> split_subtask_states_;
   // prepare the leafs need split
   void PrepareLeafsNeedSplit(bool force);
-  // launch threads for each subcompaction and wait for them to finish.
+  // Split the leaves on all background threads and wait for them to finish.
   void RunSplitLeafTasks();
 
-  // Assign tasks to threads
+  // Claim leaves until none are left
   void ProcessSplitLeafSubTasks(int tid);
 
   // do split leaf work
@@ -376,6 +534,15 @@ class SilkStore : public DB {
                       GroupedSegmentAppender& grouped_segment_appender);
   // finish all tasks and aggregate
   Status FinishSplitLeafTasks();
+
+  // merge adjacent leaves holding less than
+  // leaf_merge_ratio * leaf_datasize_thresh bytes each and drop empty ones
+  Status MergeUnderfullLeaves();
+
+  // write the live keys of "leafs" to one minirun under the last max key
+  void MergeOneLeafGroup(const std::vector<SingleLeaf>& leafs,
+                         SplitLeafTaskState& state,
+                         GroupedSegmentAppender& grouped_segment_appender);
 };
 
 Status DestroyDB(const std::string& dbname, const Options& options);
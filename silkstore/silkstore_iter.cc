@@ -14,7 +14,14 @@ namespace silkstore {
 
 Iterator* NewDBIterator(const Comparator* user_key_comparator,
                         Iterator* internal_iter, SequenceNumber sequence) {
-  return new DBIter(user_key_comparator, internal_iter, sequence);
+  return new DBIter(user_key_comparator, internal_iter, sequence,
+                    ReadOptions());
+}
+
+Iterator* NewDBIterator(const Comparator* user_key_comparator,
+                        Iterator* internal_iter, SequenceNumber sequence,
+                        const ReadOptions& options) {
+  return new DBIter(user_key_comparator, internal_iter, sequence, options);
 }
 
 }  // namespace silkstore
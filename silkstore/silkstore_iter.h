@@ -7,10 +7,66 @@
 
 #include "db/dbformat.h"
 #include <stdint.h>
+#include <string>
+#include "leveldb/comparator.h"
 #include "leveldb/db.h"
+#include "silkstore/perf_context.h"
 
 namespace leveldb {
 namespace silkstore {
+
+// Exclusive upper limit on user keys for forward iteration, derived from
+// ReadOptions::iterate_upper_bound and ReadOptions::iterate_prefix_length.
+// The prefix part is recomputed on every Seek().
+class IterateBound {
+ public:
+  IterateBound(const Comparator* ucmp, const ReadOptions& options)
+      : ucmp_(ucmp),
+        upper_bound_(options.iterate_upper_bound),
+        prefix_length_(options.iterate_prefix_length),
+        has_prefix_bound_(false) {}
+
+  // Forget any prefix bound (SeekToFirst/SeekToLast).
+  void Reset() { has_prefix_bound_ = false; }
+
+  // Recompute the prefix bound for a Seek() to user key "target".
+  void Reset(const Slice& target) {
+    has_prefix_bound_ = false;
+    if (prefix_length_ == 0 || target.size() < prefix_length_) return;
+    prefix_bound_.assign(target.data(), prefix_length_);
+    // Smallest key greater than every key with this prefix
+    while (!prefix_bound_.empty()) {
+      unsigned char c = static_cast<unsigned char>(prefix_bound_.back());
+      if (c != 0xff) {
+        prefix_bound_.back() = static_cast<char>(c + 1);
+        has_prefix_bound_ = true;
+        return;
+      }
+      prefix_bound_.pop_back();
+    }
+  }
+
+  bool Active() const {
+    return upper_bound_ != nullptr || has_prefix_bound_;
+  }
+
+  // Returns true iff "user_key" is at or past the bound.
+  bool Exceeds(const Slice& user_key) const {
+    if (upper_bound_ != nullptr &&
+        ucmp_->Compare(user_key, *upper_bound_) >= 0) {
+      return true;
+    }
+    return has_prefix_bound_ && user_key.compare(prefix_bound_) >= 0;
+  }
+
+ private:
+  const Comparator* ucmp_;
+  const Slice* upper_bound_;
+  size_t prefix_length_;
+  bool has_prefix_bound_;
+  std::string prefix_bound_;
+};
+
 // Memtables and sstables that make the DB representation contain
 // (userkey,seq,type) => uservalue entries.  DBIter
 // combines multiple entries for the same userkey found in the DB
@@ -25,10 +81,12 @@ class DBIter : public Iterator {
   //     just before all entries whose user key == this->key().
   enum Direction { kForward, kReverse };
 
-  DBIter(const Comparator* cmp, Iterator* iter, SequenceNumber s)
+  DBIter(const Comparator* cmp, Iterator* iter, SequenceNumber s,
+         const ReadOptions& options)
       : user_comparator_(cmp),
         iter_(iter),
         sequence_(s),
+        bound_(cmp, options),
         direction_(kForward),
         valid_(false) {}
 
@@ -61,6 +119,7 @@ class DBIter : public Iterator {
 
   virtual void Next() {
     assert(valid_);
+    SILKSTORE_PERF_COUNTER_ADD(iter_next_count, 1);
 
     if (direction_ == kReverse) {  // Switch directions?
       direction_ = kForward;
@@ -88,6 +147,7 @@ class DBIter : public Iterator {
 
   virtual void Prev() {
     assert(valid_);
+    SILKSTORE_PERF_COUNTER_ADD(iter_prev_count, 1);
 
     if (direction_ == kForward) {  // Switch directions?
       // iter_ is pointing at the current entry.  Scan backwards until
@@ -114,7 +174,9 @@ class DBIter : public Iterator {
   }
 
   virtual void Seek(const Slice& target) {
+    SILKSTORE_PERF_COUNTER_ADD(iter_seek_count, 1);
     direction_ = kForward;
+    bound_.Reset(target);
     ClearSavedValue();
     saved_key_.clear();
     AppendInternalKey(&saved_key_,
@@ -128,7 +190,9 @@ class DBIter : public Iterator {
   }
 
   virtual void SeekToFirst() {
+    SILKSTORE_PERF_COUNTER_ADD(iter_seek_count, 1);
     direction_ = kForward;
+    bound_.Reset();
     ClearSavedValue();
     iter_->SeekToFirst();
     if (iter_->Valid()) {
@@ -139,7 +203,9 @@ class DBIter : public Iterator {
   }
 
   virtual void SeekToLast() {
+    SILKSTORE_PERF_COUNTER_ADD(iter_seek_count, 1);
     direction_ = kReverse;
+    bound_.Reset();
     ClearSavedValue();
     iter_->SeekToLast();
     FindPrevUserEntry();
@@ -152,7 +218,15 @@ class DBIter : public Iterator {
     assert(direction_ == kForward);
     do {
       ParsedInternalKey ikey;
-      if (ParseKey(&ikey) && ikey.sequence <= sequence_) {
+      if (!ParseKey(&ikey)) {
+        iter_->Next();
+        continue;
+      }
+      if (bound_.Active() && bound_.Exceeds(ikey.user_key)) {
+        // Every remaining entry lies past the iteration bound
+        break;
+      }
+      if (ikey.sequence <= sequence_) {
         switch (ikey.type) {
           case kTypeDeletion:
             // Arrange to skip all upcoming entries for this key since
@@ -247,6 +321,7 @@ class DBIter : public Iterator {
   const Comparator* const user_comparator_;
   Iterator* const iter_;
   SequenceNumber const sequence_;
+  IterateBound bound_;
 
   Status status_;
   std::string saved_key_;    // == current key when direction_==kReverse
@@ -266,6 +341,11 @@ class DBIter : public Iterator {
 Iterator* NewDBIterator(const Comparator* user_key_comparator,
                         Iterator* internal_iter, SequenceNumber sequence);
 
+// Same as above, but honors the iteration bounds in "options".
+Iterator* NewDBIterator(const Comparator* user_key_comparator,
+                        Iterator* internal_iter, SequenceNumber sequence,
+                        const ReadOptions& options);
+
 }  // namespace silkstore
 }  // namespace leveldb
 
@@ -22,8 +22,11 @@
 #include "util/mutexlock.h"
 #include "util/testharness.h"
 #include "util/testutil.h"
+#include "silkstore/perf_context.h"
 #include "silkstore/silkstore_impl.h"
 
+#include <atomic>
+#include <thread>
 #include <unordered_map>
 namespace leveldb {
 
@@ -239,7 +242,15 @@ class DBTest {
   const FilterPolicy* filter_policy_;
 
   // Sequence of option configurations to try
-  enum OptionConfig { kDefault, kReuse, kFilter, kUncompressed, kEnd };
+  enum OptionConfig {
+    kDefault,
+    kReuse,
+    kFilter,
+    kUncompressed,
+    kLevelDBIndex,
+    kMemIndex,
+    kEnd
+  };
   int option_config_;
 
  public:
@@ -291,6 +302,12 @@ class DBTest {
       case kUncompressed:
         options.compression = kNoCompression;
         break;
+      case kLevelDBIndex:
+        options.leaf_index_type = kLevelDBLeafIndex;
+        break;
+      case kMemIndex:
+        options.leaf_index_type = kMemLeafIndex;
+        break;
       default:
         break;
     }
@@ -353,6 +370,16 @@ class DBTest {
     return result;
   }
 
+  // Value of ticker "name" in the "silkstore.statistics" dump
+  uint64_t TickerCount(const std::string& name) {
+    std::string stats;
+    if (!db_->GetProperty("silkstore.statistics", &stats)) return 0;
+    std::string prefix = name + " COUNT : ";
+    size_t pos = stats.find(prefix);
+    if (pos == std::string::npos) return 0;
+    return strtoull(stats.c_str() + pos + prefix.size(), nullptr, 10);
+  }
+
   // Return a string that contains all key,value pairs in order,
   // formatted like "(k1->v1)(k2->v2)".
   std::string Contents() {
@@ -1155,6 +1182,718 @@ TEST(DBTest, IteratorPinsRef) {
   delete iter;
 }
 
+TEST(DBTest, ConcurrentReadsAcrossMemtableSwitch) {
+  const int N = 1000;
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), Key(i)));
+  }
+
+  // Readers keep probing while the writer swaps memtables underneath
+  std::atomic<bool> done(false);
+  std::atomic<int> errors(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&, t]() {
+      Random rnd(301 + t);
+      while (!done.load()) {
+        int k = rnd.Uniform(N);
+        std::string value;
+        if (!db_->Get(ReadOptions(), Key(k), &value).ok() || value != Key(k)) {
+          errors.fetch_add(1);
+        }
+        Iterator* iter = db_->NewIterator(ReadOptions());
+        iter->Seek(Key(k));
+        if (!iter->Valid() || iter->key() != Key(k)) errors.fetch_add(1);
+        delete iter;
+      }
+    });
+  }
+  for (int round = 0; round < 5; round++) {
+    for (int i = 0; i < 100; i++) {
+      ASSERT_OK(Put("extra" + Key(round * 100 + i), std::string(100, 'x')));
+    }
+    ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  }
+  done.store(true);
+  for (auto& reader : readers) reader.join();
+  ASSERT_EQ(0, errors.load());
+}
+
+TEST(DBTest, IterateUpperBound) {
+  const int N = 2000;
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), Key(i) + std::string(1000, 'v')));
+  }
+  ASSERT_OK(Put("zzz", "last"));
+  // Scan both the leaf layer and the memtable
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_OK(Put(Key(150) + "a", "mem"));
+
+  std::string limit = Key(200);
+  Slice upper_bound(limit);
+  ReadOptions ropts;
+  ropts.iterate_upper_bound = &upper_bound;
+  Iterator* iter = db_->NewIterator(ropts);
+  int count = 0;
+  for (iter->Seek(Key(100)); iter->Valid(); iter->Next()) {
+    ASSERT_LT(iter->key().compare(upper_bound), 0);
+    ++count;
+  }
+  ASSERT_OK(iter->status());
+  ASSERT_EQ(101, count);
+
+  // The bound may be moved between seeks
+  limit = Key(N - 1);
+  upper_bound = Slice(limit);
+  count = 0;
+  for (iter->Seek(Key(N - 10)); iter->Valid(); iter->Next()) {
+    ++count;
+  }
+  ASSERT_OK(iter->status());
+  ASSERT_EQ(9, count);
+
+  // Seeking at or past the bound yields nothing
+  iter->Seek(Key(N - 1));
+  ASSERT_EQ("(invalid)", IterStatus(iter));
+  ASSERT_OK(iter->status());
+  delete iter;
+
+  // Prefix mode: "key0001" covers key000100 .. key000199
+  ReadOptions prefix_ropts;
+  prefix_ropts.iterate_prefix_length = 7;
+  iter = db_->NewIterator(prefix_ropts);
+  count = 0;
+  for (iter->Seek(Key(100)); iter->Valid(); iter->Next()) {
+    ASSERT_TRUE(iter->key().starts_with("key0001"));
+    ++count;
+  }
+  ASSERT_OK(iter->status());
+  ASSERT_EQ(101, count);
+  delete iter;
+}
+
+TEST(DBTest, MergeUnderfullLeaves) {
+  Options options = CurrentOptions();
+  options.leaf_datasize_thresh = 64 << 10;
+  options.leaf_max_num_miniruns = 2;
+  Reopen(&options);
+
+  const int N = 400;
+  const std::string value(1000, 'v');
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), value));
+  }
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  std::string leaves;
+  ASSERT_TRUE(db_->GetProperty("silkstore.num_leaves", &leaves));
+  ASSERT_GT(std::stoi(leaves), 4);
+
+  // Shrink every leaf to a few keys; the leaves are rewritten once they
+  // reach leaf_max_num_miniruns, and the small results are merged
+  for (int i = 0; i < N; i++) {
+    if (i % 20 != 0) ASSERT_OK(Delete(Key(i)));
+  }
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_OK(Put(Key(1), "v"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_TRUE(db_->GetProperty("silkstore.num_leaves", &leaves));
+  ASSERT_EQ(1, std::stoi(leaves));
+
+  for (int i = 2; i < N; i++) {
+    ASSERT_EQ(i % 20 == 0 ? value : "NOT_FOUND", Get(Key(i)));
+  }
+  ASSERT_EQ(value, Get(Key(0)));
+  ASSERT_EQ("v", Get(Key(1)));
+  Reopen(&options);
+  for (int i = 0; i < N; i += 20) {
+    ASSERT_EQ(value, Get(Key(i)));
+  }
+  ASSERT_EQ("v", Get(Key(1)));
+  ASSERT_EQ("NOT_FOUND", Get(Key(2)));
+}
+
+TEST(DBTest, DropEmptyLeavesWithoutMerging) {
+  Options options = CurrentOptions();
+  options.leaf_datasize_thresh = 64 << 10;
+  options.leaf_merge_ratio = 0;
+  options.enable_leaf_read_opt = true;
+  Reopen(&options);
+
+  const int N = 400;
+  const std::string value(1000, 'v');
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), value));
+  }
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  std::string leaves;
+  ASSERT_TRUE(db_->GetProperty("silkstore.num_leaves", &leaves));
+  const int num_leaves = std::stoi(leaves);
+  ASSERT_GT(num_leaves, 4);
+
+  // Delete the keys of the first half of the leaves and read them, so
+  // that leaf optimization compacts those leaves down to nothing
+  for (int i = 0; i < N / 2; i++) {
+    ASSERT_OK(Delete(Key(i)));
+  }
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  for (int i = 0; i < N / 2; i++) {
+    ASSERT_EQ("NOT_FOUND", Get(Key(i)));
+  }
+  ASSERT_OK(dbfull()->TEST_OptimizeLeaf());
+
+  // No leaf is merged, but the next flush drops the empty ones
+  ASSERT_OK(Put(Key(N - 1), "v"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_TRUE(db_->GetProperty("silkstore.num_leaves", &leaves));
+  ASSERT_LT(std::stoi(leaves), num_leaves);
+  ASSERT_GE(std::stoi(leaves), num_leaves / 2 - 1);
+
+  for (int i = 0; i < N - 1; i++) {
+    ASSERT_EQ(i < N / 2 ? "NOT_FOUND" : value, Get(Key(i)));
+  }
+  ASSERT_EQ("v", Get(Key(N - 1)));
+  Reopen(&options);
+  ASSERT_EQ("NOT_FOUND", Get(Key(0)));
+  ASSERT_EQ(value, Get(Key(N / 2)));
+}
+
+TEST(DBTest, PartitionedFlush) {
+  Options options = CurrentOptions();
+  options.leaf_datasize_thresh = 16 << 10;
+  Reopen(&options);
+
+  // Even keys build the leaves, then odd keys and overwrites land in
+  // most of them, enough for several subcompactions
+  const int N = 20000;
+  for (int i = 0; i < N; i += 2) {
+    ASSERT_OK(Put(Key(i), Key(i) + "v1"));
+  }
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  for (int i = 0; i < N + 2000; i++) {
+    if (i % 2 == 1 || i % 3 == 0) ASSERT_OK(Put(Key(i), Key(i) + "v2"));
+  }
+  ASSERT_OK(Delete(Key(4)));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  // Only a few leaves receive keys this time
+  ASSERT_OK(Put(Key(10), "v3"));
+  ASSERT_OK(Put(Key(N / 2), "v3"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+
+  for (int i = 0; i < N + 2000; i++) {
+    std::string expected;
+    if (i == 4) {
+      expected = "NOT_FOUND";
+    } else if (i == 10 || i == N / 2) {
+      expected = "v3";
+    } else if (i % 2 == 1 || i % 3 == 0) {
+      expected = Key(i) + "v2";
+    } else if (i < N) {
+      expected = Key(i) + "v1";
+    } else {
+      expected = "NOT_FOUND";
+    }
+    ASSERT_EQ(expected, Get(Key(i)));
+  }
+}
+
+TEST(DBTest, BackgroundIOLimit) {
+  Options options = CurrentOptions();
+  options.leaf_datasize_thresh = 16 << 10;
+  options.background_io_bytes_per_sec = 1 << 20;
+  Reopen(&options);
+
+  const int N = 2000;
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), std::string(100, 'v')));
+  }
+  const uint64_t start = env_->NowMicros();
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  // Over 200KB of segments at 1MB/s, less what the buckets start with
+  ASSERT_GE(env_->NowMicros() - start, 50000);
+
+  std::string io;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.background_io", &io));
+  ASSERT_TRUE(io.find("rate 1048576\n") != std::string::npos) << io;
+  ASSERT_TRUE(io.find("\nflush 0 ") == std::string::npos) << io;
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(std::string(100, 'v'), Get(Key(i)));
+  }
+}
+
+TEST(DBTest, SegmentGroups) {
+  Options options = CurrentOptions();
+  options.num_segment_groups = 4;
+  options.leaf_datasize_thresh = 32 << 10;
+  options.segment_file_size_thresh = 64 << 10;
+  options.maximum_segments_storage_size = 512 << 10;
+  Reopen(&options);
+
+  // A few keys are overwritten in every round, so GC has segments to
+  // collect
+  const int N = 4000;
+  Random rnd(301);
+  std::vector<std::string> values(N);
+  for (int round = 0; round < 8; round++) {
+    for (int i = 0; i < N; i++) {
+      if (round == 0 || i % 10 == 0) {
+        values[i] = RandomString(&rnd, 100);
+        ASSERT_OK(Put(Key(i), values[i]));
+      }
+    }
+    ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  }
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+
+  std::string stats;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.gc_group_stats", &stats));
+  // Nothing is grouped before the first regrouping, so it all went to
+  // the hottest group
+  ASSERT_TRUE(stats.find("group 0: 0 segments") == std::string::npos)
+      << stats;
+  ASSERT_TRUE(stats.find("group 3: ") != std::string::npos) << stats;
+  ASSERT_TRUE(stats.find("group none: ") != std::string::npos) << stats;
+  ASSERT_TRUE(stats.find("group 4: ") == std::string::npos) << stats;
+}
+
+TEST(DBTest, GCPolicy) {
+  for (GCPolicyType policy : {kGreedyGCPolicy, kCostBenefitGCPolicy}) {
+    Options options = CurrentOptions();
+    options.gc_policy = policy;
+    options.leaf_datasize_thresh = 32 << 10;
+    options.segment_file_size_thresh = 64 << 10;
+    options.maximum_segments_storage_size = 512 << 10;
+    DestroyAndReopen(&options);
+
+    const int N = 4000;
+    Random rnd(301);
+    std::vector<std::string> values(N);
+    for (int round = 0; round < 8; round++) {
+      for (int i = 0; i < N; i++) {
+        if (round == 0 || i % 10 == 0) {
+          values[i] = RandomString(&rnd, 100);
+          ASSERT_OK(Put(Key(i), values[i]));
+        }
+      }
+      ASSERT_OK(dbfull()->TEST_CompactMemTable());
+    }
+    for (int i = 0; i < N; i++) {
+      ASSERT_EQ(values[i], Get(Key(i)));
+    }
+
+    std::string stats;
+    ASSERT_TRUE(dbfull()->GetProperty("silkstore.gcstat", &stats));
+    const char* name = policy == kGreedyGCPolicy ? "gc policy: greedy"
+                                                 : "gc policy: cost_benefit";
+    ASSERT_TRUE(stats.find(name) != std::string::npos) << stats;
+    ASSERT_TRUE(dbfull()->GetProperty("silkstore.gc_group_stats", &stats));
+    ASSERT_TRUE(stats.find("group 0: 0 segments") == std::string::npos)
+        << stats;
+  }
+}
+
+TEST(DBTest, BackgroundGC) {
+  Options options = CurrentOptions();
+  // Leaves are rewritten often, leaving invalid runs behind
+  options.leaf_max_num_miniruns = 2;
+  options.leaf_datasize_thresh = 32 << 10;
+  options.segment_file_size_thresh = 64 << 10;
+  // About twice the live data
+  options.maximum_segments_storage_size = 1 << 20;
+  Reopen(&options);
+
+  const int N = 4000;
+  Random rnd(301);
+  std::vector<std::string> values(N);
+  for (int round = 0; round < 8; round++) {
+    for (int i = 0; i < N; i++) {
+      if (round == 0 || i % 10 == 0) {
+        values[i] = RandomString(&rnd, 100);
+        ASSERT_OK(Put(Key(i), values[i]));
+      }
+    }
+    ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  }
+  dbfull()->TEST_WaitForGC();
+
+  std::string util;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.segment_util", &util));
+  const size_t pos = util.find("total_segment_size : ");
+  ASSERT_TRUE(pos != std::string::npos) << util;
+  const size_t total = std::stoul(util.substr(pos + 21));
+  ASSERT_LT(total, options.maximum_segments_storage_size);
+  std::string gcstat;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.gcstat", &gcstat));
+  ASSERT_TRUE(gcstat.find("time spent in gc: 0us") == std::string::npos)
+      << gcstat;
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+  // GC copies runs verbatim and only rewrites where they live; the patched
+  // run handles must hold up after a restart too
+  Reopen(&options);
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+}
+
+TEST(DBTest, ReadsDuringGC) {
+  Options options = CurrentOptions();
+  options.leaf_max_num_miniruns = 2;
+  options.leaf_datasize_thresh = 32 << 10;
+  options.segment_file_size_thresh = 64 << 10;
+  options.maximum_segments_storage_size = 1 << 20;
+  Reopen(&options);
+
+  const int N = 4000;
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), Key(i)));
+  }
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+
+  // Readers of the keys written once race GC moving their runs and
+  // removing the segments they came from
+  std::atomic<bool> done(false);
+  std::atomic<int> errors(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 2; t++) {
+    readers.emplace_back([&, t]() {
+      Random rnd(301 + t);
+      while (!done.load()) {
+        int k = rnd.Uniform(N / 2) * 2 + 1;
+        std::string value;
+        if (!db_->Get(ReadOptions(), Key(k), &value).ok() || value != Key(k)) {
+          errors.fetch_add(1);
+        }
+      }
+    });
+  }
+  Random rnd(301);
+  for (int round = 0; round < 8; round++) {
+    for (int i = 0; i < N; i += 2) {
+      ASSERT_OK(Put(Key(i), RandomString(&rnd, 100)));
+    }
+    ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  }
+  dbfull()->TEST_WaitForGC();
+  done.store(true);
+  for (auto& reader : readers) reader.join();
+  ASSERT_EQ(0, errors.load());
+  std::string gcstat;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.gcstat", &gcstat));
+  ASSERT_TRUE(gcstat.find("time spent in gc: 0us") == std::string::npos)
+      << gcstat;
+}
+
+TEST(DBTest, InvalidRunsSurviveReopen) {
+  Options options = CurrentOptions();
+  // Leaves are rewritten often, leaving invalid runs behind
+  options.leaf_max_num_miniruns = 2;
+  options.leaf_datasize_thresh = 32 << 10;
+  options.segment_file_size_thresh = 64 << 10;
+  Reopen(&options);
+
+  const int N = 4000;
+  Random rnd(301);
+  std::vector<std::string> values(N);
+  for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < N; i++) {
+      values[i] = RandomString(&rnd, 100);
+      ASSERT_OK(Put(Key(i), values[i]));
+    }
+    ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  }
+  std::string before;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.gcstat", &before));
+  before = before.substr(before.find("gc policy"));
+  ASSERT_TRUE(before.find(" 0.0% invalid") == std::string::npos) << before;
+
+  Reopen(&options);
+  std::string after;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.gcstat", &after));
+  after = after.substr(after.find("gc policy"));
+  ASSERT_EQ(before, after);
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+}
+
+TEST(DBTest, PunchInvalidRuns) {
+  const std::string probe = dbname_ + "/punch_probe";
+  ASSERT_OK(WriteStringToFile(env_, std::string(3 * 4096, 'x'), probe));
+  const Status probe_status = env_->PunchHole(probe, 4096, 4096);
+  env_->DeleteFile(probe);
+  if (probe_status.IsNotSupportedError()) {
+    fprintf(stderr, "Punching holes not supported, skipping\n");
+    return;
+  }
+  ASSERT_OK(probe_status);
+
+  Options options = CurrentOptions();
+  options.punch_invalid_runs = true;
+  // Leaves are rewritten often, leaving invalid runs behind
+  options.leaf_max_num_miniruns = 2;
+  options.leaf_datasize_thresh = 32 << 10;
+  options.segment_file_size_thresh = 64 << 10;
+  Reopen(&options);
+
+  const int N = 1000;
+  Random rnd(301);
+  std::vector<std::string> values(N);
+  for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < N; i++) {
+      values[i] = RandomString(&rnd, 1000);
+      ASSERT_OK(Put(Key(i), values[i]));
+    }
+    ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  }
+
+  std::string util;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.segment_util", &util));
+  const size_t pos = util.find("total_punched_size : ");
+  ASSERT_TRUE(pos != std::string::npos) << util;
+  ASSERT_GT(std::stoul(util.substr(pos + 21)), 0) << util;
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+  Reopen(&options);
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+}
+
+TEST(DBTest, PunchInvalidRunsUnderIterator) {
+  const std::string probe = dbname_ + "/punch_probe";
+  ASSERT_OK(WriteStringToFile(env_, std::string(3 * 4096, 'x'), probe));
+  const Status probe_status = env_->PunchHole(probe, 4096, 4096);
+  env_->DeleteFile(probe);
+  if (probe_status.IsNotSupportedError()) {
+    fprintf(stderr, "Punching holes not supported, skipping\n");
+    return;
+  }
+  ASSERT_OK(probe_status);
+
+  Options options = CurrentOptions();
+  options.punch_invalid_runs = true;
+  options.leaf_max_num_miniruns = 2;
+  options.leaf_datasize_thresh = 32 << 10;
+  options.segment_file_size_thresh = 64 << 10;
+  // Iterators of this leaf index keep reading the leaves as of their
+  // creation, so they reach runs rewritten since
+  options.leaf_index_type = kMemLeafIndex;
+  Reopen(&options);
+
+  const int N = 1000;
+  Random rnd(301);
+  std::vector<std::string> values(N);
+  auto WriteRound = [&]() {
+    for (int i = 0; i < N; i++) {
+      values[i] = RandomString(&rnd, 1000);
+      ASSERT_OK(Put(Key(i), values[i]));
+    }
+    ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  };
+  auto PunchedSize = [&]() {
+    std::string util;
+    ASSERT_TRUE(dbfull()->GetProperty("silkstore.segment_util", &util));
+    const size_t pos = util.find("total_punched_size : ");
+    ASSERT_TRUE(pos != std::string::npos) << util;
+    return std::stoul(util.substr(pos + 21));
+  };
+  WriteRound();
+  WriteRound();
+
+  // The iterator has not opened any leaf yet when the next rounds
+  // rewrite them all and invalidate the runs it is going to read
+  Iterator* iter = db_->NewIterator(ReadOptions());
+  const std::vector<std::string> expected = values;
+  const size_t punched = PunchedSize();
+  WriteRound();
+  WriteRound();
+  ASSERT_EQ(punched, PunchedSize());
+
+  int n = 0;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    ASSERT_EQ(Key(n), iter->key().ToString());
+    ASSERT_EQ(expected[n], iter->value().ToString());
+    n++;
+  }
+  ASSERT_OK(iter->status());
+  ASSERT_EQ(N, n);
+  delete iter;
+
+  // Without the iterator the runs are punched with the next ones
+  WriteRound();
+  ASSERT_GT(PunchedSize(), punched);
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+}
+
+TEST(DBTest, SegmentCacheBounded) {
+  Options options = CurrentOptions();
+  // The smallest cache, 64 segments, over about a hundred segments
+  options.max_open_files = 0;
+  options.segment_file_size_thresh = 16 << 10;
+  Reopen(&options);
+
+  const int N = 6000;
+  Random rnd(301);
+  std::vector<std::string> values(N);
+  for (int i = 0; i < N; i++) {
+    values[i] = RandomString(&rnd, 1000);
+    ASSERT_OK(Put(Key(i), values[i]));
+    if (i % 100 == 99) ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  }
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < N; i++) {
+      ASSERT_EQ(values[i], Get(Key(i)));
+    }
+  }
+
+  std::string cache;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.segment_cache", &cache));
+  size_t open, capacity;
+  unsigned long long evictions;
+  const size_t pos = cache.find(": ");
+  ASSERT_EQ(2, sscanf(cache.c_str() + pos + 2, "%zu/%zu", &open, &capacity))
+      << cache;
+  ASSERT_EQ(64, capacity);
+  ASSERT_LE(open, capacity) << cache;
+  ASSERT_EQ(1, sscanf(cache.c_str() + cache.find("rate, ") + 6, "%llu",
+                      &evictions))
+      << cache;
+  ASSERT_GT(evictions, 0) << cache;
+}
+
+TEST(DBTest, GCWithSegmentCacheFull) {
+  Options options = CurrentOptions();
+  // GC victims compete for the 64 cache slots with flushes and reads
+  options.max_open_files = 0;
+  options.leaf_max_num_miniruns = 2;
+  options.leaf_datasize_thresh = 32 << 10;
+  options.segment_file_size_thresh = 16 << 10;
+  options.maximum_segments_storage_size = 2 << 20;
+  Reopen(&options);
+
+  const int N = 4000;
+  Random rnd(301);
+  std::vector<std::string> values(N);
+  for (int round = 0; round < 8; round++) {
+    for (int i = 0; i < N; i++) {
+      if (round == 0 || i % 10 == 0) {
+        values[i] = RandomString(&rnd, 100);
+        ASSERT_OK(Put(Key(i), values[i]));
+      }
+    }
+    ASSERT_OK(dbfull()->TEST_CompactMemTable());
+    for (int i = 0; i < N; i += 7) {
+      ASSERT_EQ(values[i], Get(Key(i)));
+    }
+  }
+  dbfull()->TEST_WaitForGC();
+
+  std::string gcstat;
+  ASSERT_TRUE(dbfull()->GetProperty("silkstore.gcstat", &gcstat));
+  ASSERT_TRUE(gcstat.find("time spent in gc: 0us") == std::string::npos)
+      << gcstat;
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+}
+
+TEST(DBTest, RowCache) {
+  Options options = CurrentOptions();
+  options.row_cache = NewLRUCache(1 << 20);
+  Reopen(&options);
+
+  ASSERT_OK(Put("a", "v1"));
+  ASSERT_OK(Put("b", "v1"));
+  ASSERT_OK(Put("c", "v1"));
+  ASSERT_OK(Delete("c"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+
+  // The first lookup fills the cache, the second one is served by it
+  ASSERT_EQ("v1", Get("a"));
+  ASSERT_EQ("v1", Get("a"));
+  ASSERT_EQ(1, TickerCount("silkstore.row.cache.hit"));
+  // Deleted and absent keys are cached as well
+  ASSERT_EQ("NOT_FOUND", Get("c"));
+  ASSERT_EQ("NOT_FOUND", Get("c"));
+  ASSERT_EQ("NOT_FOUND", Get("missing"));
+  ASSERT_EQ("NOT_FOUND", Get("missing"));
+  ASSERT_EQ(3, TickerCount("silkstore.row.cache.hit"));
+
+  // Writes invalidate, including once they reach the leaf layer
+  ASSERT_OK(Put("a", "v2"));
+  ASSERT_OK(Put("c", "v2"));
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_EQ("v2", Get("a"));
+  ASSERT_EQ("v2", Get("a"));
+  ASSERT_EQ("v2", Get("c"));
+  ASSERT_EQ("v1", Get("b"));
+
+  Close();
+  delete options.row_cache;
+}
+
+TEST(DBTest, ReadStatisticsAndPerfContext) {
+  const int N = 200;
+  for (int i = 0; i < N; i++) {
+    ASSERT_OK(Put(Key(i), Key(i)));
+  }
+  ASSERT_OK(dbfull()->TEST_CompactMemTable());
+  ASSERT_OK(Put("mem", "v"));
+
+  silkstore::SetPerfLevel(silkstore::kPerfEnableTime);
+  silkstore::PerfContext* perf = silkstore::GetPerfContext();
+
+  // A memtable hit never touches the leaf index
+  perf->Reset();
+  ASSERT_EQ("v", Get("mem"));
+  ASSERT_EQ(1, perf->get_count);
+  ASSERT_EQ(1, perf->memtable_get_count);
+  ASSERT_EQ(0, perf->leaf_index_seek_count);
+
+  // A leaf hit probes at least one minirun and reads at least one block
+  perf->Reset();
+  ASSERT_EQ(Key(7), Get(Key(7)));
+  ASSERT_EQ(1, perf->leaf_index_seek_count);
+  ASSERT_GE(perf->runs_searched_count, 1);
+  ASSERT_GE(perf->block_read_count, 1);
+  ASSERT_GT(perf->block_read_bytes, 0);
+
+  // Steps forwards and backwards are counted apart
+  perf->Reset();
+  {
+    std::unique_ptr<Iterator> iter(db_->NewIterator(ReadOptions()));
+    iter->Seek(Key(7));
+    iter->Next();
+  }
+  ASSERT_EQ(1, perf->iter_seek_count);
+  ASSERT_EQ(1, perf->iter_next_count);
+  ASSERT_EQ(0, perf->iter_prev_count);
+
+  // Disabled contexts stay untouched
+  silkstore::SetPerfLevel(silkstore::kPerfDisable);
+  perf->Reset();
+  ASSERT_EQ(Key(8), Get(Key(8)));
+  ASSERT_EQ(0, perf->get_count);
+  ASSERT_EQ(0, perf->runs_searched_count);
+  silkstore::SetPerfLevel(silkstore::kPerfEnableCount);
+
+  std::string stats;
+  ASSERT_TRUE(db_->GetProperty("silkstore.statistics", &stats));
+  ASSERT_TRUE(stats.find("silkstore.get.calls COUNT : 3\n") !=
+              std::string::npos);
+  ASSERT_TRUE(stats.find("silkstore.get.hit.memtable COUNT : 1\n") !=
+              std::string::npos);
+  ASSERT_TRUE(stats.find("silkstore.get.hit.leafstore COUNT : 2\n") !=
+              std::string::npos);
+  ASSERT_TRUE(stats.find("silkstore.runs.probed.per.get") != std::string::npos);
+}
+
 // TEST(DBTest, Snapshot) {
 //    do {
 //        Put("foo", "v1");
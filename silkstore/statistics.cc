@@ -0,0 +1,190 @@
+#include "silkstore/statistics.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <limits>
+
+#include "silkstore/util.h"
+
+namespace leveldb {
+namespace silkstore {
+
+static const char* const kTickerNames[kTickerCount] = {
+    "silkstore.get.calls",
+    "silkstore.get.hit.memtable",
+    "silkstore.get.hit.leafstore",
+    "silkstore.get.notfound",
+    "silkstore.runs.searched",
+    "silkstore.runs.hit",
+    "silkstore.runs.miss",
+    "silkstore.filter.useful",
+    "silkstore.filter.false.positive",
+    "silkstore.row.cache.hit",
+    "silkstore.row.cache.miss",
+};
+
+static const char* const kHistogramNames[kHistogramCount] = {
+    "silkstore.get.micros",
+    "silkstore.runs.probed.per.get",
+};
+
+Statistics::Statistics() { Reset(); }
+
+const char* Statistics::TickerName(Ticker ticker) {
+  return kTickerNames[ticker];
+}
+
+const char* Statistics::HistogramName(HistogramType type) {
+  return kHistogramNames[type];
+}
+
+int Statistics::BucketFor(uint64_t value) {
+  int b = 0;
+  while (value != 0 && b < kNumBuckets - 1) {
+    value >>= 1;
+    ++b;
+  }
+  return b;
+}
+
+void Statistics::RecordTick(Ticker ticker, uint64_t count) {
+  Shard& shard = shards_[ThreadSlot(kNumShards)];
+  shard.tickers[ticker].fetch_add(count, std::memory_order_relaxed);
+}
+
+void Statistics::RecordInHistogram(HistogramType type, uint64_t value) {
+  Histogram& h = shards_[ThreadSlot(kNumShards)].histograms[type];
+  h.buckets[BucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+  h.count.fetch_add(1, std::memory_order_relaxed);
+  h.sum.fetch_add(value, std::memory_order_relaxed);
+  // Several threads can share a shard, so min/max need a CAS loop
+  uint64_t cur = h.min.load(std::memory_order_relaxed);
+  while (value < cur &&
+         !h.min.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+  }
+  cur = h.max.load(std::memory_order_relaxed);
+  while (value > cur &&
+         !h.max.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t Statistics::GetTickerCount(Ticker ticker) const {
+  uint64_t sum = 0;
+  for (int i = 0; i < kNumShards; ++i) {
+    sum += shards_[i].tickers[ticker].load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+Statistics::HistogramSnapshot Statistics::GetHistogram(
+    HistogramType type) const {
+  HistogramSnapshot snap{0, 0, std::numeric_limits<uint64_t>::max(), 0};
+  for (int i = 0; i < kNumShards; ++i) {
+    const Histogram& h = shards_[i].histograms[type];
+    snap.count += h.count.load(std::memory_order_relaxed);
+    snap.sum += h.sum.load(std::memory_order_relaxed);
+    snap.min = std::min(snap.min, h.min.load(std::memory_order_relaxed));
+    snap.max = std::max(snap.max, h.max.load(std::memory_order_relaxed));
+  }
+  if (snap.count == 0) snap.min = 0;
+  return snap;
+}
+
+void Statistics::MergeBuckets(HistogramType type, uint64_t* buckets) const {
+  for (int b = 0; b < kNumBuckets; ++b) buckets[b] = 0;
+  for (int i = 0; i < kNumShards; ++i) {
+    const Histogram& h = shards_[i].histograms[type];
+    for (int b = 0; b < kNumBuckets; ++b) {
+      buckets[b] += h.buckets[b].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+double Statistics::Percentile(HistogramType type, double p) const {
+  uint64_t buckets[kNumBuckets];
+  MergeBuckets(type, buckets);
+  return BucketPercentile(buckets, p, GetHistogram(type));
+}
+
+double Statistics::PercentileSince(HistogramType type, double p,
+                                   std::vector<uint64_t>* since) const {
+  uint64_t buckets[kNumBuckets];
+  MergeBuckets(type, buckets);
+  since->resize(kNumBuckets, 0);
+  uint64_t window[kNumBuckets];
+  for (int b = 0; b < kNumBuckets; ++b) {
+    // A Reset() in between restarts the window
+    window[b] = buckets[b] >= (*since)[b] ? buckets[b] - (*since)[b]
+                                          : buckets[b];
+    (*since)[b] = buckets[b];
+  }
+  return BucketPercentile(window, p, GetHistogram(type));
+}
+
+double Statistics::BucketPercentile(const uint64_t* buckets, double p,
+                                    const HistogramSnapshot& snap) {
+  uint64_t total = 0;
+  for (int b = 0; b < kNumBuckets; ++b) total += buckets[b];
+  if (total == 0) return 0;
+  double threshold = total * (p / 100.0);
+  uint64_t cumulative = 0;
+  for (int b = 0; b < kNumBuckets; ++b) {
+    if (buckets[b] == 0) continue;
+    if (cumulative + buckets[b] >= threshold) {
+      // Interpolate linearly within [2^(b-1), 2^b)
+      double left = b == 0 ? 0 : double(uint64_t(1) << (b - 1));
+      double right = b == 0 ? 0 : left * 2;
+      double pos = (threshold - cumulative) / buckets[b];
+      double r = left + (right - left) * pos;
+      r = std::max(r, double(snap.min));
+      return std::min(r, double(snap.max));
+    }
+    cumulative += buckets[b];
+  }
+  return snap.max;
+}
+
+void Statistics::Reset() {
+  for (int i = 0; i < kNumShards; ++i) {
+    Shard& shard = shards_[i];
+    for (int t = 0; t < kTickerCount; ++t) {
+      shard.tickers[t].store(0, std::memory_order_relaxed);
+    }
+    for (int k = 0; k < kHistogramCount; ++k) {
+      Histogram& h = shard.histograms[k];
+      for (int b = 0; b < kNumBuckets; ++b) {
+        h.buckets[b].store(0, std::memory_order_relaxed);
+      }
+      h.count.store(0, std::memory_order_relaxed);
+      h.sum.store(0, std::memory_order_relaxed);
+      h.min.store(std::numeric_limits<uint64_t>::max(),
+                  std::memory_order_relaxed);
+      h.max.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+std::string Statistics::ToString() const {
+  std::string r;
+  char buf[200];
+  for (int t = 0; t < kTickerCount; ++t) {
+    snprintf(buf, sizeof(buf), "%s COUNT : %llu\n", kTickerNames[t],
+             (unsigned long long)GetTickerCount(static_cast<Ticker>(t)));
+    r.append(buf);
+  }
+  for (int k = 0; k < kHistogramCount; ++k) {
+    HistogramType type = static_cast<HistogramType>(k);
+    HistogramSnapshot snap = GetHistogram(type);
+    snprintf(buf, sizeof(buf),
+             "%s P50 : %.2f P95 : %.2f P99 : %.2f MAX : %llu COUNT : %llu "
+             "AVG : %.2f\n",
+             kHistogramNames[k], Percentile(type, 50), Percentile(type, 95),
+             Percentile(type, 99), (unsigned long long)snap.max,
+             (unsigned long long)snap.count, snap.Average());
+    r.append(buf);
+  }
+  return r;
+}
+
+}  // namespace silkstore
+}  // namespace leveldb
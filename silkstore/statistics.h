@@ -0,0 +1,109 @@
+#ifndef STORAGE_LEVELDB_SILKSTORE_STATISTICS_H_
+#define STORAGE_LEVELDB_SILKSTORE_STATISTICS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace leveldb {
+namespace silkstore {
+
+// Monotonic event counters kept by Statistics.
+enum Ticker : uint32_t {
+  kGetCalls = 0,
+  kGetHitMemtable,
+  kGetHitLeafStore,
+  kGetNotFound,
+  kRunsSearched,
+  kRunsHit,
+  kRunsMiss,
+  // Runs skipped because the filter ruled the key out
+  kFilterUseful,
+  // Runs the filter let through that did not contain the key
+  kFilterFalsePositive,
+  kRowCacheHit,
+  kRowCacheMiss,
+  kTickerCount
+};
+
+// Value distributions kept by Statistics.
+enum HistogramType : uint32_t {
+  kGetMicros = 0,
+  kRunsProbedPerGet,
+  kHistogramCount
+};
+
+// Process-wide counters and histograms for a SilkStore instance.
+// Updates are relaxed atomic adds on a per-thread shard, so they are cheap
+// enough to stay on in production; readers sum all shards.
+class Statistics {
+ public:
+  Statistics();
+  Statistics(const Statistics&) = delete;
+  Statistics& operator=(const Statistics&) = delete;
+
+  void RecordTick(Ticker ticker, uint64_t count = 1);
+  void RecordInHistogram(HistogramType type, uint64_t value);
+
+  uint64_t GetTickerCount(Ticker ticker) const;
+
+  struct HistogramSnapshot {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    double Average() const { return count == 0 ? 0 : double(sum) / count; }
+  };
+  HistogramSnapshot GetHistogram(HistogramType type) const;
+
+  // Approximate p-th percentile (0 < p <= 100) of histogram "type".
+  double Percentile(HistogramType type, double p) const;
+
+  // Same, over the values recorded since the previous call with the same
+  // "*since", which is updated.  Start with an empty vector.
+  double PercentileSince(HistogramType type, double p,
+                         std::vector<uint64_t>* since) const;
+
+  // Clear every ticker and histogram.  Not atomic with respect to
+  // concurrent updates.
+  void Reset();
+
+  // Human readable dump of every ticker and histogram.
+  std::string ToString() const;
+
+  static const char* TickerName(Ticker ticker);
+  static const char* HistogramName(HistogramType type);
+
+ private:
+  // Bucket i holds values in [2^(i-1), 2^i), bucket 0 holds 0.
+  static const int kNumBuckets = 64;
+  static const int kNumShards = 16;
+
+  struct Histogram {
+    std::atomic<uint64_t> buckets[kNumBuckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> min;
+    std::atomic<uint64_t> max;
+  };
+
+  struct Shard {
+    std::atomic<uint64_t> tickers[kTickerCount];
+    Histogram histograms[kHistogramCount];
+    char padding[64];
+  };
+
+  static int BucketFor(uint64_t value);
+  // Percentile of "buckets", clamped to the range seen in "snap"
+  static double BucketPercentile(const uint64_t* buckets, double p,
+                                 const HistogramSnapshot& snap);
+  void MergeBuckets(HistogramType type, uint64_t* buckets) const;
+
+  Shard shards_[kNumShards];
+};
+
+}  // namespace silkstore
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_SILKSTORE_STATISTICS_H_
@@ -2,7 +2,10 @@
 // Created by zxjcarrot on 2019-11-07.
 //
 
-#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 
 #include "silkstore/util.h"
 
@@ -10,60 +13,52 @@ namespace leveldb {
 
 namespace silkstore {
 
+int ThreadSlot(int num_slots) {
+  static std::atomic<uint32_t> next_thread(0);
+  thread_local uint32_t thread_number = next_thread.fetch_add(1);
+  return thread_number % num_slots;
+}
+
 std::vector<int>
 KMeansSegmenter::classify(const std::vector<double> &data_points, int k) {
-  k = std::min(k, (int)data_points.size());
-  std::vector<double> centroids;
-  for (int i = 0; i < k; ++i) {
-    double centroid = data_points[rand() % data_points.size()];
-    double duplicate = false;
-    for (int j = 0; j < centroids.size(); ++j) {
-      if (abs(centroid - centroids[j]) < 1e-6) {
-        duplicate = true;
-      }
-    }
-    if (duplicate == true) {
-      --i;
-    } else {
-      centroids.push_back(centroid);
-    }
+  std::vector<int> groups(data_points.size(), 0);
+  // Seed the centroids with evenly spaced distinct values.  In one
+  // dimension they then stay sorted, so group ids follow the centroids.
+  std::vector<double> distinct(data_points);
+  std::sort(distinct.begin(), distinct.end());
+  distinct.erase(std::unique(distinct.begin(), distinct.end()),
+                 distinct.end());
+  k = std::min(k, (int)distinct.size());
+  if (k <= 1) return groups;
+  std::vector<double> centroids(k);
+  for (int j = 0; j < k; ++j) {
+    centroids[j] = distinct[(distinct.size() - 1) * j / (k - 1)];
   }
-  std::vector<int> groups(data_points.size(), -1);
-  int steps = 0;
-  while (steps < 100) {
-    std::vector<std::vector<double>> group_elements(k);
-    for (int i = 0; i < data_points.size(); ++i) {
-      double min_dis = std::numeric_limits<double>::max();
-      int min_group = -1;
-      for (int j = 0; j < k; ++j) {
-        double dis = abs(data_points[i] - centroids[j]);
-        if (min_dis > dis || min_group == -1) {
-          min_dis = dis;
-          min_group = j;
+
+  for (int steps = 0; steps < 100; ++steps) {
+    std::vector<double> sums(k, 0);
+    std::vector<size_t> counts(k, 0);
+    for (size_t i = 0; i < data_points.size(); ++i) {
+      int nearest = 0;
+      for (int j = 1; j < k; ++j) {
+        if (std::fabs(data_points[i] - centroids[j]) <
+            std::fabs(data_points[i] - centroids[nearest])) {
+          nearest = j;
         }
       }
-      group_elements[min_group].push_back(data_points[i]);
-      groups[i] = min_group;
+      groups[i] = nearest;
+      sums[nearest] += data_points[i];
+      ++counts[nearest];
     }
 
-    std::vector<double> new_centroids;
-    for (int i = 0; i < k; ++i) {
-      double S = 0;
-      for (auto x : group_elements[i])
-        S += x;
-      new_centroids.push_back(S / group_elements[i].size());
-    }
-    double centroids_changed = false;
-    for (int i = 0; i < k; ++i) {
-      if (abs(centroids[i] - new_centroids[i]) > 1e-5) {
-        centroids_changed = true;
-        break;
-      }
+    bool centroids_changed = false;
+    for (int j = 0; j < k; ++j) {
+      if (counts[j] == 0) continue;  // keep the centroid of an empty group
+      double centroid = sums[j] / counts[j];
+      if (std::fabs(centroid - centroids[j]) > 1e-5) centroids_changed = true;
+      centroids[j] = centroid;
     }
-    if (centroids_changed == false)
-      break;
-    centroids = new_centroids;
-    ++steps;
+    if (centroids_changed == false) break;
   }
   return groups;
 }
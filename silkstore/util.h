@@ -20,6 +20,11 @@ class DeferCode {
   std::function<void()> code;
 };
 
+// Returns a small index in [0, num_slots) fixed for the calling thread.
+// Threads are numbered round-robin, so up to num_slots threads each get a
+// distinct slot.  Used to spread per-thread state over cache lines.
+int ThreadSlot(int num_slots);
+
 // Perform a KMeans clustering on one-dimensional data_points
 // Produces a vector of group ids. The ith element in the returned vector
 // indicates the group id of data_points[i] after clustering.
@@ -33,6 +38,8 @@ class Segmenter {
   virtual ~Segmenter() {}
 };
 
+// Groups are numbered in increasing order of their centroids.  Fewer than
+// "k" groups are formed when there are fewer distinct data points.
 class KMeansSegmenter : public Segmenter {
  public:
   std::vector<int> classify(const std::vector<double>& data_points,
@@ -25,6 +25,23 @@ TEST(SegmenterTest, classify) {
     fprintf(stderr, "%d ", ans[i]);
   }
   fprintf(stderr, "\n");
+  for (int i = 0; i < ans.size(); ++i) {
+    ASSERT_EQ(0, ans[i]);
+  }
+}
+
+TEST(SegmenterTest, KMeansSeparatesClusters) {
+  leveldb::silkstore::KMeansSegmenter segmenter;
+  std::vector<double> data_points{67, 1, 11, 2, 71, 10, 1, 13, 3};
+  std::vector<int> groups = segmenter.classify(data_points, 3);
+  // Groups are numbered by increasing centroid
+  std::vector<int> expected{2, 0, 1, 0, 2, 1, 0, 1, 0};
+  ASSERT_TRUE(groups == expected);
+  // Fewer distinct values than groups
+  groups = segmenter.classify({5, 7, 5}, 4);
+  expected = {0, 1, 0};
+  ASSERT_TRUE(groups == expected);
+  ASSERT_TRUE(segmenter.classify({}, 2).empty());
 }
 
 }  // namespace leveldb
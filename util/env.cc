@@ -12,12 +12,22 @@ Status Env::NewAppendableFile(const std::string& fname, WritableFile** result) {
   return Status::NotSupported("NewAppendableFile", fname);
 }
 
+Status Env::PunchHole(const std::string& fname, uint64_t offset,
+                      uint64_t len) {
+  return Status::NotSupported("PunchHole", fname);
+}
+
 SequentialFile::~SequentialFile() {}
 
 RandomAccessFile::~RandomAccessFile() {}
 
 WritableFile::~WritableFile() {}
 
+Status WritableFile::AppendFileRange(const std::string& src_fname,
+                                     uint64_t offset, uint64_t n) {
+  return Status::NotSupported("AppendFileRange", src_fname);
+}
+
 Logger::~Logger() {}
 
 FileLock::~FileLock() {}
@@ -315,6 +315,68 @@ class PosixWritableFile final : public WritableFile {
     return SyncFd(fd_, filename_);
   }
 
+  Status AppendFileRange(const std::string& src_filename, uint64_t offset,
+                         uint64_t n) override {
+#if HAVE_COPY_FILE_RANGE
+    Status status = FlushBuffer();
+    if (!status.ok()) {
+      return status;
+    }
+
+    int src_fd = ::open(src_filename.c_str(), O_RDONLY);
+    if (src_fd < 0) {
+      return PosixError(src_filename, errno);
+    }
+
+    // copy_file_range() refuses O_APPEND destinations, so those are written
+    // through a second descriptor at an explicit offset, the end of file.
+    int dst_fd = fd_;
+    loff_t dst_offset = 0;
+    loff_t* dst_offset_ptr = nullptr;
+    if (::fcntl(fd_, F_GETFL) & O_APPEND) {
+      dst_offset = ::lseek(fd_, 0, SEEK_END);
+      dst_fd = ::open(filename_.c_str(), O_WRONLY);
+      if (dst_offset < 0 || dst_fd < 0) {
+        status = PosixError(filename_, errno);
+        if (dst_fd >= 0) ::close(dst_fd);
+        ::close(src_fd);
+        return status;
+      }
+      dst_offset_ptr = &dst_offset;
+    }
+
+    loff_t src_offset = offset;
+    uint64_t copied = 0;
+    while (copied < n) {
+      ssize_t copy_result = ::copy_file_range(src_fd, &src_offset, dst_fd,
+                                              dst_offset_ptr, n - copied, 0);
+      if (copy_result < 0) {
+        if (errno == EINTR) {
+          continue;  // Retry
+        }
+        // Nothing written yet, the caller can still copy by hand
+        if (copied == 0 && (errno == EXDEV || errno == ENOSYS ||
+                            errno == EINVAL || errno == EOPNOTSUPP)) {
+          status = Status::NotSupported("AppendFileRange", src_filename);
+        } else {
+          status = PosixError(filename_, errno);
+        }
+        break;
+      }
+      if (copy_result == 0) {
+        status = Status::IOError(src_filename, "unexpected end of file");
+        break;
+      }
+      copied += copy_result;
+    }
+    if (dst_fd != fd_) ::close(dst_fd);
+    ::close(src_fd);
+    return status;
+#else
+    return Status::NotSupported("AppendFileRange", src_filename);
+#endif  // HAVE_COPY_FILE_RANGE
+  }
+
  private:
   Status FlushBuffer() {
     Status status = WriteUnbuffered(buf_, pos_);
@@ -615,6 +677,26 @@ class PosixEnv : public Env {
     return Status::OK();
   }
 
+  Status PunchHole(const std::string& filename, uint64_t offset,
+                   uint64_t len) override {
+#if HAVE_FALLOCATE_PUNCH_HOLE
+    int fd = ::open(filename.c_str(), O_WRONLY);
+    if (fd < 0) {
+      return PosixError(filename, errno);
+    }
+    Status status;
+    if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                    len) != 0) {
+      status = errno == EOPNOTSUPP ? Status::NotSupported("PunchHole", filename)
+                                   : PosixError(filename, errno);
+    }
+    ::close(fd);
+    return status;
+#else
+    return Status::NotSupported("PunchHole", filename);
+#endif  // HAVE_FALLOCATE_PUNCH_HOLE
+  }
+
   Status LockFile(const std::string& filename, FileLock** lock) override {
     *lock = nullptr;
 
@@ -215,6 +215,59 @@ TEST(EnvTest, ReopenAppendableFile) {
   env_->DeleteFile(test_file_name);
 }
 
+TEST(EnvTest, AppendFileRange) {
+  std::string test_dir;
+  ASSERT_OK(env_->GetTestDirectory(&test_dir));
+  std::string src_file_name = test_dir + "/append_file_range_src.txt";
+  std::string test_file_name = test_dir + "/append_file_range.txt";
+  env_->DeleteFile(test_file_name);
+  ASSERT_OK(WriteStringToFile(env_, "0123456789", src_file_name));
+
+  WritableFile* appendable_file;
+  ASSERT_OK(env_->NewAppendableFile(test_file_name, &appendable_file));
+  // Buffered data must land before the copied range, later data after it
+  ASSERT_OK(appendable_file->Append("ab"));
+  Status status = appendable_file->AppendFileRange(src_file_name, 3, 4);
+  if (status.IsNotSupportedError()) {
+    fprintf(stderr, "AppendFileRange not supported, skipping\n");
+    ASSERT_OK(appendable_file->Append("3456"));
+  } else {
+    ASSERT_OK(status);
+  }
+  ASSERT_OK(appendable_file->Append("cd"));
+  ASSERT_OK(appendable_file->Close());
+  delete appendable_file;
+
+  std::string data;
+  ASSERT_OK(ReadFileToString(env_, test_file_name, &data));
+  ASSERT_EQ(std::string("ab3456cd"), data);
+  env_->DeleteFile(test_file_name);
+  env_->DeleteFile(src_file_name);
+}
+
+TEST(EnvTest, PunchHole) {
+  std::string test_dir;
+  ASSERT_OK(env_->GetTestDirectory(&test_dir));
+  std::string test_file_name = test_dir + "/punch_hole.txt";
+  ASSERT_OK(WriteStringToFile(env_, std::string(3 * 4096, 'x'), test_file_name));
+
+  Status status = env_->PunchHole(test_file_name, 4096, 4096);
+  if (status.IsNotSupportedError()) {
+    fprintf(stderr, "PunchHole not supported, skipping\n");
+    env_->DeleteFile(test_file_name);
+    return;
+  }
+  ASSERT_OK(status);
+
+  std::string data;
+  ASSERT_OK(ReadFileToString(env_, test_file_name, &data));
+  ASSERT_EQ(3 * 4096, data.size());
+  ASSERT_EQ(std::string(4096, 'x'), data.substr(0, 4096));
+  ASSERT_EQ(std::string(4096, '\0'), data.substr(4096, 4096));
+  ASSERT_EQ(std::string(4096, 'x'), data.substr(2 * 4096));
+  env_->DeleteFile(test_file_name);
+}
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) { return leveldb::test::RunAllTests(); }
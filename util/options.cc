@@ -27,12 +27,19 @@ Options::Options()
       segment_file_size_thresh(kSegmentFileSizeThreshold),
       leaf_datasize_thresh(kLeafDataSizeThreshold),
       leaf_max_num_miniruns(kLeafMaxRunNum),
+      leaf_merge_ratio(0.125),
+      num_segment_groups(1),
+      background_threads(4),
+      background_io_bytes_per_sec(0),
+      background_io_target_p99_micros(0),
       storage_block_size(kStorageBlocKSize),
       memtbl_to_L0_ratio(100),
       max_open_files(1000),
       block_cache(nullptr),
+      row_cache(nullptr),
       block_size(4096),
       block_restart_interval(16),
+      index_block_restart_interval(16),
       max_file_size(2 << 20),
       compression(kSnappyCompression),
       reuse_logs(false),
@@ -44,7 +51,10 @@ Options::Options()
       enable_leaf_read_opt(false),
       maximum_segments_storage_size(0),
       segments_storage_size_gc_threshold(0.9),
+      gc_policy(kCostBenefitGCPolicy),
+      punch_invalid_runs(false),
       use_memtable_dynamic_filter(false),
-      memtable_dynamic_filter_fp_rate(0.1) {}
+      memtable_dynamic_filter_fp_rate(0.1),
+      leaf_index_type(kNvmLeafIndex) {}
 
 }  // namespace leveldb